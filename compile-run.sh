@@ -1,5 +1,5 @@
 # Compile main:
-clang++ -o jovian-vm `llvm-config-14 --cxxflags --ldflags --system-libs --libs core` main.cpp -fexceptions
+clang++ -o jovian-vm `llvm-config-14 --cxxflags --ldflags --system-libs --libs core x86` main.cpp -fexceptions
 
 # Run main:
 ./jovian-vm -f test.eva
@@ -10,13 +10,31 @@ lli-14 ./out.ll
 # Optimize the output:
 opt-14 ./out.ll -O3 -S -o ./out-opt.ll
 
-# Compile ./out.ll with GC:
+# Note: generators and async functions are lowered by the coroutine
+# passes of opt, execute the optimized IR instead:
 #
-# Note: to install GC_malloc:
+#   lli-14 ./out-opt.ll
+
+# Compile ./out.ll with the runtime:
+#
+# Note: programs compiled with --memory=gc, or using (region ...)
+# blocks, string operations (==, str-concat, str-find, ...), maps,
+# tasks (spawn, join, parallel-for, ...) or file I/O (read-file,
+# write, ...), need the
+# runtime (src/runtime) and cannot be executed with lli:
 #
-#   brew install libgc
+#   ./jovian-vm --memory=gc -f test.eva
+#
+clang++ -O3 ./out.ll src/runtime/*.c -o ./out
+
+# Profile-guided optimization: build with counters, run on a
+# representative input (writes ./jovian.profile), then rebuild
+# with the counts:
 #
-clang++ -O3 -I/usr/local/include/gc/ ./out.ll /usr/local/lib/libgc.a -o ./out
+#   ./jovian-vm --profile-generate -f test.eva
+#   clang++ -O3 ./out.ll src/runtime/*.c -o ./out && ./out
+#   ./jovian-vm --profile-use=jovian.profile -f test.eva
+#   clang++ -O3 ./out.ll src/runtime/*.c -o ./out
 
 # Run the compiled program:
 ./out
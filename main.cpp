@@ -12,19 +12,65 @@ void printHelp() {
   std::cout << "\nUsage: finder-vm [options]\n\n"
             << "Options:\n"
             << "    -e, --expression  Expression to parse\n"
-            << "    -f, --file        File to parse\n\n";
+            << "    -f, --file        File to parse\n"
+            << "    --memory=<mode>   Memory management: malloc (default), gc, arc\n"
+            << "    --heap-profile    Report heap allocations per site at exit\n"
+            << "    --fast-math       Fast-math floating point operations\n"
+            << "    --memo-entries=<n> Default cache size of def-memo functions\n"
+            << "    --profile-generate[=<file>] Count branches, written to <file> (jovian.profile) at exit\n"
+            << "    --profile-use=<file> Optimize with the counts of a --profile-generate run\n\n";
 }
 
 int main(int argc, char const *argv[]) {
-  if (argc != 3) {
-    printHelp();
-    return 0;
-  }
-
   /**
    * Expression mode.
    */
-  std::string mode = argv[1];
+  std::string mode;
+
+  /**
+   * Expression or file name.
+   */
+  std::string input;
+
+  /**
+   * Compiler options.
+   */
+  CompilerOptions options;
+
+  for (auto i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+
+    if ((arg == "-e" || arg == "-f") && i + 1 < argc) {
+      mode = arg;
+      input = argv[++i];
+    } else if (arg == "--memory=malloc") {
+      options.memory = MemoryMode::Malloc;
+    } else if (arg == "--memory=gc") {
+      options.memory = MemoryMode::GC;
+    } else if (arg == "--memory=arc") {
+      options.memory = MemoryMode::ARC;
+    } else if (arg == "--heap-profile") {
+      options.heapProfile = true;
+    } else if (arg == "--fast-math") {
+      options.fastMath = true;
+    } else if (arg.rfind("--memo-entries=", 0) == 0) {
+      options.memoEntries = std::stoull(arg.substr(std::string("--memo-entries=").size()));
+    } else if (arg == "--profile-generate") {
+      options.profileGenerate = "jovian.profile";
+    } else if (arg.rfind("--profile-generate=", 0) == 0) {
+      options.profileGenerate = arg.substr(std::string("--profile-generate=").size());
+    } else if (arg.rfind("--profile-use=", 0) == 0) {
+      options.profileUse = arg.substr(std::string("--profile-use=").size());
+    } else {
+      printHelp();
+      return 0;
+    }
+  }
+
+  if (mode.empty()) {
+    printHelp();
+    return 0;
+  }
 
   /**
    * Program to execute.
@@ -35,7 +81,7 @@ int main(int argc, char const *argv[]) {
    * Simple expression.
    */
   if (mode == "-e") {
-    program = argv[2];
+    program = input;
   }
 
   /**
@@ -43,7 +89,7 @@ int main(int argc, char const *argv[]) {
    */
   else if (mode == "-f") {
     // Read the file:
-    std::ifstream programFile(argv[2]);
+    std::ifstream programFile(input);
     std::stringstream buffer;
     buffer << programFile.rdbuf() << "\n";
 
@@ -54,7 +100,7 @@ int main(int argc, char const *argv[]) {
   /**
    * Compiler instance.
    */
-  JovianVM vm;
+  JovianVM vm(options);
 
   /**
    * Generate LLVM IR.
@@ -36,6 +36,33 @@ class Environment : public std::enable_shared_from_this<Environment> {
     return resolve(name)->record_[name];
   }
 
+  /**
+   * Whether a variable is defined in this environment
+   * or in one of its parents.
+   */
+  bool isDefined(const std::string& name) {
+    for (auto env = shared_from_this(); env != nullptr; env = env->parent_) {
+      if (env->record_.count(name) != 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Whether a variable is defined in the given environment
+   * or in one of its nested environments.
+   */
+  bool isDefinedWithin(const std::string& name,
+                       std::shared_ptr<Environment> scope) {
+    for (auto env = resolve(name); env != nullptr; env = env->parent_) {
+      if (env == scope) {
+        return true;
+      }
+    }
+    return false;
+  }
+
  private:
   /**
    * Returns specific environment in which a variable is defined, or
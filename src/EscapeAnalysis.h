@@ -0,0 +1,871 @@
+#ifndef EscapeAnalysis_h
+#define EscapeAnalysis_h
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "./parser/JovianParser.h"
+
+/**
+ * Escape analysis over the Eva AST.
+ *
+ * An instance bound by (var x (new C ...)) escapes if `x` is stored to
+ * a field or another variable, returned, or passed to a call which may
+ * capture it. Instances which never escape can live in the stack frame
+ * of the function which creates them.
+ */
+class EscapeAnalysis
+{
+public:
+    /**
+     * Indexes classes and functions of the whole program.
+     */
+    EscapeAnalysis(const Exp &program) { index(program); }
+
+    /**
+     * Indexes a class or function compiled outside of the program
+     * tree, such as a generic instance.
+     */
+    void addDeclaration(const Exp &exp) { index(exp); }
+
+    /**
+     * Returns (new ...) expressions of the function body whose instances
+     * never escape it. `params` and `className` describe the function
+     * being compiled (empty for the main body).
+     */
+    std::set<const Exp *> findLocalInstances(const Exp &body,
+                                             const Exp *params = nullptr,
+                                             const std::string &className = "")
+    {
+        Scope scope;
+        collectParams(scope, params, className);
+        collectCandidates(body, scope);
+
+        std::set<const Exp *> result;
+
+        for (auto &candidate : scope.candidates)
+        {
+            auto &name = candidate.first;
+            auto newExp = candidate.second;
+
+            auto ctor = resolveMethod(newExp->list[1].string, "constructor");
+
+            if (ctor != nullptr && paramEscapes(*ctor, 0))
+            {
+                continue;
+            }
+
+            if (!escapesIn(body, name, scope))
+            {
+                result.insert(newExp);
+            }
+        }
+
+        return result;
+    }
+
+    /**
+     * Whether a call may keep an argument at one of the given
+     * positions (1 for the first argument) beyond the call, see
+     * paramsCaptured. receiverClass is the static class of the
+     * receiver of a method call.
+     */
+    bool callCaptures(const Exp &call, const std::set<size_t> &positions, const std::string &receiverClass = "")
+    {
+        Scope scope;
+        auto &head = call.list[0];
+
+        if (isTaggedList(head, "method") && head.list[1].type == ExpType::SYMBOL && !receiverClass.empty())
+        {
+            scope.classes[head.list[1].string] = {receiverClass, false};
+        }
+
+        std::set<size_t> params;
+        for (auto position : positions)
+        {
+            params.insert(position - 1);
+        }
+
+        return calleesCapture(resolveCallees(head, scope), params);
+    }
+
+    /**
+     * Whether the constructor of (new <class> <args>...) may keep an
+     * argument at one of the given positions in the expression (2 for
+     * the first argument) beyond the call. The new instance is allocated with its arguments, so
+     * storing them to it does not count.
+     */
+    bool constructorCaptures(const Exp &newExp, const std::set<size_t> &positions)
+    {
+        auto ctor = resolveMethod(newExp.list[1].string, "constructor");
+
+        if (ctor == nullptr)
+        {
+            return false;
+        }
+
+        std::set<size_t> params{0};
+        for (auto position : positions)
+        {
+            params.insert(position - 1);
+        }
+
+        return paramsCaptured(*ctor, params);
+    }
+
+private:
+    /**
+     * Class declaration: parent name and methods.
+     */
+    struct ClassDecl
+    {
+        std::string parent;
+        std::map<std::string, const Exp *> methods;
+    };
+
+    /**
+     * Per function analysis state.
+     */
+    struct Scope
+    {
+        /**
+         * Variables bound to a (new ...) expression.
+         */
+        std::multimap<std::string, const Exp *> candidates;
+
+        /**
+         * Statically known class of a variable. Exact classes come
+         * from (new ...), declared ones from typed parameters and
+         * may hold any subclass.
+         */
+        std::map<std::string, std::pair<std::string, bool>> classes;
+    };
+
+    /**
+     * Records top-level functions and class methods.
+     */
+    void index(const Exp &exp)
+    {
+        if (exp.type != ExpType::LIST || exp.list.empty())
+        {
+            return;
+        }
+
+        if (isTaggedList(exp, "class"))
+        {
+            auto &decl = classes_[exp.list[1].string];
+            decl.parent = exp.list[2].string;
+
+            for (auto &member : exp.list[3].list)
+            {
+                if (isTaggedList(member, "def"))
+                {
+                    decl.methods[member.list[1].string] = &member;
+                }
+            }
+            return;
+        }
+
+        if (isTaggedList(exp, "def"))
+        {
+            functions_[exp.list[1].string] = &exp;
+        }
+
+        for (auto &sub : exp.list)
+        {
+            index(sub);
+        }
+    }
+
+    void collectParams(Scope &scope, const Exp *params, const std::string &className)
+    {
+        if (params == nullptr)
+        {
+            return;
+        }
+
+        for (auto &param : params->list)
+        {
+            if (param.type == ExpType::LIST && classes_.count(param.list[1].string) != 0)
+            {
+                scope.classes[param.list[0].string] = {param.list[1].string, false};
+            }
+            else if (param.type == ExpType::SYMBOL && param.string == "self" && !className.empty())
+            {
+                scope.classes["self"] = {className, false};
+            }
+        }
+    }
+
+    /**
+     * Finds (var x (new ...)) bindings of the function body.
+     */
+    void collectCandidates(const Exp &exp, Scope &scope)
+    {
+        if (exp.type != ExpType::LIST || exp.list.empty() ||
+            isTaggedList(exp, "def") || isTaggedList(exp, "class"))
+        {
+            return;
+        }
+
+        if (isTaggedList(exp, "var") && isTaggedList(exp.list[2], "new"))
+        {
+            auto &decl = exp.list[1];
+            auto name = decl.type == ExpType::LIST ? decl.list[0].string : decl.string;
+            auto className = exp.list[2].list[1].string;
+
+            if (classes_.count(className) != 0)
+            {
+                scope.candidates.insert({name, &exp.list[2]});
+                scope.classes[name] = {className, true};
+            }
+        }
+
+        for (auto &sub : exp.list)
+        {
+            collectCandidates(sub, scope);
+        }
+    }
+
+    /**
+     * Whether a variable escapes in the expression.
+     */
+    bool escapesIn(const Exp &exp, const std::string &name, Scope &scope)
+    {
+        if (exp.type == ExpType::SYMBOL)
+        {
+            return exp.string == name;
+        }
+
+        if (exp.type != ExpType::LIST || exp.list.empty())
+        {
+            return false;
+        }
+
+        if (isTaggedList(exp, "def") || isTaggedList(exp, "class"))
+        {
+            return false;
+        }
+
+        // (var x <init>): the declared name is not a use.
+        if (isTaggedList(exp, "var"))
+        {
+            return escapesIn(exp.list[2], name, scope);
+        }
+
+        // (set (prop x f) <value>), (set x <value>)
+        if (isTaggedList(exp, "set"))
+        {
+            auto &target = exp.list[1];
+
+            if (target.type == ExpType::SYMBOL && target.string == name)
+            {
+                return true;
+            }
+
+            return (isTaggedList(target, "prop") && escapesInReceiver(target.list[1], name, scope)) ||
+                   escapesIn(exp.list[2], name, scope);
+        }
+
+        // (prop x f): reading a field does not leak the object.
+        if (isTaggedList(exp, "prop"))
+        {
+            return escapesInReceiver(exp.list[1], name, scope);
+        }
+
+        // printf reads its arguments only.
+        if (isTaggedList(exp, "printf"))
+        {
+            for (auto i = 1; i < exp.list.size(); i++)
+            {
+                if (escapesInReceiver(exp.list[i], name, scope))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // (spawn <exp>): the task may outlive the frame.
+        if (isTaggedList(exp, "spawn"))
+        {
+            return usesName(exp.list[1], name);
+        }
+
+        // Call: ((method x m) args...), (fn args...)
+        auto callees = resolveCallees(exp.list[0], scope);
+
+        if (isTaggedList(exp.list[0], "method"))
+        {
+            auto &receiver = exp.list[0].list[1];
+            if (!isTaggedList(receiver, "super") && escapesInReceiver(receiver, name, scope))
+            {
+                return true;
+            }
+        }
+        else if (exp.list[0].type == ExpType::LIST && escapesIn(exp.list[0], name, scope))
+        {
+            return true;
+        }
+
+        auto isCall = exp.list[0].type == ExpType::LIST || functions_.count(exp.list[0].string) != 0;
+
+        for (auto i = 1; i < exp.list.size(); i++)
+        {
+            auto &arg = exp.list[i];
+
+            if (isCall && arg.type == ExpType::SYMBOL && arg.string == name)
+            {
+                if (callees.empty())
+                {
+                    return true;
+                }
+
+                for (auto callee : callees)
+                {
+                    if (paramEscapes(*callee, i - 1))
+                    {
+                        return true;
+                    }
+                }
+                continue;
+            }
+
+            if (escapesIn(arg, name, scope))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Object in a receiver position (prop, method): using the
+     * variable itself is safe, other expressions are checked.
+     */
+    bool escapesInReceiver(const Exp &exp, const std::string &name, Scope &scope)
+    {
+        if (exp.type == ExpType::SYMBOL && exp.string == name)
+        {
+            return false;
+        }
+        return escapesIn(exp, name, scope);
+    }
+
+    /**
+     * Function definitions a call head may dispatch to. Empty if
+     * unknown, in which case arguments are assumed to be captured.
+     */
+    std::vector<const Exp *> resolveCallees(const Exp &head, Scope &scope)
+    {
+        if (head.type == ExpType::SYMBOL)
+        {
+            if (functions_.count(head.string) != 0)
+            {
+                return {functions_[head.string]};
+            }
+            return {};
+        }
+
+        if (!isTaggedList(head, "method"))
+        {
+            return {};
+        }
+
+        auto &receiver = head.list[1];
+        auto methodName = head.list[2].string;
+
+        // (method (super C) m): statically bound to the parent method.
+        if (isTaggedList(receiver, "super"))
+        {
+            auto parent = classes_[receiver.list[1].string].parent;
+            auto method = resolveMethod(parent, methodName);
+            return method != nullptr ? std::vector<const Exp *>{method} : std::vector<const Exp *>{};
+        }
+
+        if (receiver.type != ExpType::SYMBOL || scope.classes.count(receiver.string) == 0)
+        {
+            return {};
+        }
+
+        auto &classInfo = scope.classes[receiver.string];
+        std::vector<const Exp *> callees;
+
+        // Exact class is known for fresh instances, otherwise any
+        // subclass override may be called.
+        for (auto &decl : classes_)
+        {
+            if (decl.first == classInfo.first ||
+                (!classInfo.second && isSubclass(decl.first, classInfo.first)))
+            {
+                auto method = resolveMethod(decl.first, methodName);
+                if (method == nullptr)
+                {
+                    return {};
+                }
+                callees.push_back(method);
+            }
+        }
+
+        return callees;
+    }
+
+    /**
+     * Whether a function captures its parameter with the given index.
+     * Recursive cycles are conservatively treated as escaping.
+     */
+    bool paramEscapes(const Exp &fnExp, size_t idx)
+    {
+        auto key = std::make_pair(&fnExp, idx);
+
+        if (paramEscapes_.count(key) != 0)
+        {
+            return paramEscapes_[key];
+        }
+
+        auto &params = fnExp.list[2];
+
+        if (idx >= params.list.size())
+        {
+            return true;
+        }
+
+        paramEscapes_[key] = true;
+
+        auto &param = params.list[idx];
+        auto paramName = param.type == ExpType::LIST ? param.list[0].string : param.string;
+        auto &body = hasReturnType(fnExp) ? fnExp.list[5] : fnExp.list[3];
+
+        Scope scope;
+        collectParams(scope, &params, ownerClass(fnExp));
+        collectCandidates(body, scope);
+
+        return paramEscapes_[key] = escapesIn(body, paramName, scope);
+    }
+
+    bool calleesCapture(const std::vector<const Exp *> &callees, const std::set<size_t> &params)
+    {
+        if (callees.empty())
+        {
+            return true;
+        }
+
+        for (auto callee : callees)
+        {
+            if (paramsCaptured(*callee, params))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Whether a function may keep one of its parameters with the given
+     * indices beyond the call: store it to a field of another object or
+     * to a global, or pass it to a call which may. Unlike paramEscapes,
+     * copies to local variables are followed and returning it does not
+     * count: the caller checks the result. Fields of the parameters are
+     * treated as the parameters. Recursive cycles count as captured.
+     */
+    bool paramsCaptured(const Exp &fnExp, const std::set<size_t> &params)
+    {
+        auto key = std::make_pair(&fnExp, params);
+
+        if (paramsCaptured_.count(key) != 0)
+        {
+            return paramsCaptured_[key];
+        }
+
+        paramsCaptured_[key] = true;
+
+        auto &paramList = fnExp.list[2].list;
+        auto &body = hasReturnType(fnExp) ? fnExp.list[5] : fnExp.list[3];
+
+        CaptureScope scope;
+        collectParams(scope, &fnExp.list[2], ownerClass(fnExp));
+
+        for (auto i = 0; i < paramList.size(); i++)
+        {
+            auto &param = paramList[i];
+            auto paramName = param.type == ExpType::LIST ? param.list[0].string : param.string;
+
+            scope.locals.insert(paramName);
+
+            if (params.count(i) != 0)
+            {
+                scope.aliases.insert(paramName);
+            }
+        }
+
+        for (auto index : params)
+        {
+            if (index >= paramList.size())
+            {
+                return true;
+            }
+        }
+
+        collectLocals(body, scope);
+        collectCandidates(body, scope);
+
+        // Copies of the parameters, to a fixed point:
+        for (size_t count = 0; count != scope.aliases.size();)
+        {
+            count = scope.aliases.size();
+            collectAliases(body, scope);
+        }
+
+        return paramsCaptured_[key] = capturesIn(body, scope);
+    }
+
+    /**
+     * State of paramsCaptured: local variables of the function, and
+     * those which may hold a parameter.
+     */
+    struct CaptureScope : Scope
+    {
+        std::set<std::string> locals;
+        std::set<std::string> aliases;
+    };
+
+    void collectLocals(const Exp &exp, CaptureScope &scope)
+    {
+        if (exp.type != ExpType::LIST || isTaggedList(exp, "def") || isTaggedList(exp, "class"))
+        {
+            return;
+        }
+
+        if (isTaggedList(exp, "var"))
+        {
+            auto &decl = exp.list[1];
+            scope.locals.insert(decl.type == ExpType::LIST ? decl.list[0].string : decl.string);
+        }
+
+        for (auto &sub : exp.list)
+        {
+            collectLocals(sub, scope);
+        }
+    }
+
+    void collectAliases(const Exp &exp, CaptureScope &scope)
+    {
+        if (exp.type != ExpType::LIST || isTaggedList(exp, "def") || isTaggedList(exp, "class"))
+        {
+            return;
+        }
+
+        if (isTaggedList(exp, "var") && yieldsAlias(exp.list[2], scope))
+        {
+            auto &decl = exp.list[1];
+            scope.aliases.insert(decl.type == ExpType::LIST ? decl.list[0].string : decl.string);
+        }
+
+        if (isTaggedList(exp, "set") && exp.list[1].type == ExpType::SYMBOL &&
+            scope.locals.count(exp.list[1].string) != 0 && yieldsAlias(exp.list[2], scope))
+        {
+            scope.aliases.insert(exp.list[1].string);
+        }
+
+        for (auto &sub : exp.list)
+        {
+            collectAliases(sub, scope);
+        }
+    }
+
+    /**
+     * Whether the value of an expression may be a parameter (or an
+     * object it refers to).
+     */
+    bool yieldsAlias(const Exp &exp, CaptureScope &scope)
+    {
+        if (exp.type == ExpType::SYMBOL)
+        {
+            return scope.aliases.count(exp.string) != 0;
+        }
+
+        if (exp.type != ExpType::LIST || exp.list.empty())
+        {
+            return false;
+        }
+
+        if (isTaggedList(exp, "prop"))
+        {
+            return yieldsAlias(exp.list[1], scope);
+        }
+
+        if (isTaggedList(exp, "if"))
+        {
+            return yieldsAlias(exp.list[2], scope) || (exp.list.size() > 3 && yieldsAlias(exp.list[3], scope));
+        }
+
+        if (isTaggedList(exp, "begin"))
+        {
+            return exp.list.size() > 1 && yieldsAlias(exp.list.back(), scope);
+        }
+
+        if (isTaggedList(exp, "cond") || isTaggedList(exp, "switch"))
+        {
+            for (auto &clause : exp.list)
+            {
+                if (clause.type == ExpType::LIST && !clause.list.empty() && yieldsAlias(clause.list.back(), scope))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        if (isReadOnlyForm(exp))
+        {
+            return false;
+        }
+
+        // Calls may return their arguments:
+        for (auto i = 1; i < exp.list.size(); i++)
+        {
+            if (yieldsAlias(exp.list[i], scope))
+            {
+                return true;
+            }
+        }
+
+        return isTaggedList(exp.list[0], "method") && yieldsAlias(exp.list[0].list[1], scope);
+    }
+
+    /**
+     * Forms whose value is never one of their operands.
+     */
+    bool isReadOnlyForm(const Exp &exp)
+    {
+        static const std::set<std::string> forms{"+", "-", "*", "/", "==", "!=", "<", ">", "<=", ">=",
+                                                 "printf", "len", "while", "do-while", "for", "var", "set"};
+
+        return exp.list[0].type == ExpType::SYMBOL && forms.count(exp.list[0].string) != 0;
+    }
+
+    /**
+     * Whether a parameter is kept beyond the call in the expression.
+     */
+    bool capturesIn(const Exp &exp, CaptureScope &scope)
+    {
+        if (exp.type != ExpType::LIST || exp.list.empty() || isTaggedList(exp, "def") || isTaggedList(exp, "class"))
+        {
+            return false;
+        }
+
+        auto &head = exp.list[0];
+        auto tag = head.type == ExpType::SYMBOL ? head.string : "";
+
+        static const std::set<std::string> structural{"begin", "if", "while", "do-while", "for", "cond",
+                                                      "switch", "region", "var", "prop", "printf", "len",
+                                                      "aref", "method", "super",
+                                                      "+", "-", "*", "/", "==", "!=", "<", ">", "<=", ">="};
+
+        if (tag == "set")
+        {
+            auto &target = exp.list[1];
+
+            if (yieldsAlias(exp.list[2], scope))
+            {
+                // To a global, or a field of an object other than a parameter:
+                if (target.type == ExpType::SYMBOL ? scope.locals.count(target.string) == 0
+                                                    : !(isTaggedList(target, "prop") && yieldsAlias(target.list[1], scope)))
+                {
+                    return true;
+                }
+            }
+
+            return capturesIn(target, scope) || capturesIn(exp.list[2], scope);
+        }
+
+        // (spawn <exp>): the task may outlive the call.
+        if (tag == "spawn")
+        {
+            for (auto &alias : scope.aliases)
+            {
+                if (usesName(exp.list[1], alias))
+                {
+                    return true;
+                }
+            }
+        }
+
+        if (structural.count(tag) != 0 || tag == "spawn")
+        {
+            for (auto i = 1; i < exp.list.size(); i++)
+            {
+                if (capturesIn(exp.list[i], scope))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // (new <class> <args>...): the new instance holds the arguments,
+        // and may be one of the parameters itself, see yieldsAlias.
+        if (tag == "new")
+        {
+            std::set<size_t> params{0};
+
+            for (auto i = 2; i < exp.list.size(); i++)
+            {
+                if (capturesIn(exp.list[i], scope))
+                {
+                    return true;
+                }
+                if (yieldsAlias(exp.list[i], scope))
+                {
+                    params.insert(i - 1);
+                }
+            }
+
+            auto ctor = resolveMethod(exp.list[1].string, "constructor");
+            return params.size() > 1 && ctor != nullptr && paramsCaptured(*ctor, params);
+        }
+
+        // Calls and other forms: the positions of arguments which
+        // may be parameters.
+        std::set<size_t> params;
+
+        for (auto i = 1; i < exp.list.size(); i++)
+        {
+            if (capturesIn(exp.list[i], scope))
+            {
+                return true;
+            }
+            if (yieldsAlias(exp.list[i], scope))
+            {
+                params.insert(i - 1);
+            }
+        }
+
+        if (head.type == ExpType::LIST && capturesIn(head, scope))
+        {
+            return true;
+        }
+
+        if (params.empty())
+        {
+            return false;
+        }
+
+        auto isCall = head.type == ExpType::LIST || functions_.count(tag) != 0;
+
+        if (!isCall)
+        {
+            // Stored by a built-in form, e.g. (aset a i x), (push a x):
+            return true;
+        }
+
+        return calleesCapture(resolveCallees(head, scope), params);
+    }
+
+    /**
+     * Finds a method in the class or its ancestors.
+     */
+    const Exp *resolveMethod(const std::string &className, const std::string &methodName)
+    {
+        auto name = className;
+
+        while (classes_.count(name) != 0)
+        {
+            auto &decl = classes_[name];
+            if (decl.methods.count(methodName) != 0)
+            {
+                return decl.methods[methodName];
+            }
+            name = decl.parent;
+        }
+
+        return nullptr;
+    }
+
+    bool isSubclass(const std::string &className, const std::string &ancestor)
+    {
+        auto name = className;
+
+        while (classes_.count(name) != 0)
+        {
+            if (name == ancestor)
+            {
+                return true;
+            }
+            name = classes_[name].parent;
+        }
+
+        return false;
+    }
+
+    std::string ownerClass(const Exp &fnExp)
+    {
+        for (auto &decl : classes_)
+        {
+            for (auto &method : decl.second.methods)
+            {
+                if (method.second == &fnExp)
+                {
+                    return decl.first;
+                }
+            }
+        }
+        return "";
+    }
+
+    bool usesName(const Exp &exp, const std::string &name)
+    {
+        if (exp.type == ExpType::SYMBOL)
+        {
+            return exp.string == name;
+        }
+        if (exp.type == ExpType::LIST)
+        {
+            for (auto &sub : exp.list)
+            {
+                if (usesName(sub, name))
+                {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool isTaggedList(const Exp &exp, const std::string &tag)
+    {
+        return exp.type == ExpType::LIST && !exp.list.empty() &&
+               exp.list[0].type == ExpType::SYMBOL && exp.list[0].string == tag;
+    }
+
+    bool hasReturnType(const Exp &fnExp)
+    {
+        return fnExp.list[3].type == ExpType::SYMBOL && fnExp.list[3].string == "->";
+    }
+
+    /**
+     * Top-level functions.
+     */
+    std::map<std::string, const Exp *> functions_;
+
+    /**
+     * Class declarations.
+     */
+    std::map<std::string, ClassDecl> classes_;
+
+    /**
+     * Memoized parameter escape results.
+     */
+    std::map<std::pair<const Exp *, size_t>, bool> paramEscapes_;
+
+    /**
+     * Memoized parameter capture results.
+     */
+    std::map<std::pair<const Exp *, std::set<size_t>>, bool> paramsCaptured_;
+};
+
+#endif
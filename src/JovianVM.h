@@ -2,18 +2,32 @@
 #ifndef FinderVM_h
 #define FinderVM_h
 
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <list>
 #include <map>
 #include <regex>
+#include <set>
 #include <string>
 
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
 
 #include "./Environment.h"
+#include "./EscapeAnalysis.h"
 #include "./Logger.h"
+#include "./RetainReleaseElision.h"
 #include "./parser/JovianParser.h"
 
 using syntax::JovianParser;
@@ -29,6 +43,96 @@ struct ClassInfo
     llvm::StructType *parent;
     std::map<std::string, llvm::Type *> fieldsMap;
     std::map<std::string, llvm::Function *> methodsMap;
+    std::set<std::string> atomicFields;
+};
+
+/**
+ * Generic function or class: type parameters, the declaration and
+ * the environment it was declared in.
+ */
+struct GenericInfo
+{
+    std::vector<std::string> typeParams;
+    Exp exp{std::vector<Exp>{}};
+    Env env;
+};
+
+/**
+ * Value of a compile-time evaluation, see JovianVM::evalComptime: a
+ * constant, or the elements of an array.
+ */
+struct ComptimeValue
+{
+    llvm::Type *type;
+    llvm::Constant *constant;
+    std::shared_ptr<std::vector<llvm::Constant *>> elements;
+
+    /**
+     * Whether code generation would see a constant here (a literal or
+     * an operation on literals), see JovianVM::genBinaryValues.
+     */
+    bool literal;
+};
+
+/**
+ * Variables of a compile-time evaluation, innermost block last.
+ */
+using ComptimeScope = std::vector<std::map<std::string, ComptimeValue>>;
+
+/**
+ * Memory management of class instances.
+ */
+enum class MemoryMode
+{
+    /**
+     * Instances are allocated with malloc and never freed.
+     */
+    Malloc,
+
+    /**
+     * Precise generational garbage collector (runtime/gc.c).
+     */
+    GC,
+
+    /**
+     * Reference counting: instances are freed by their class
+     * destructor once the last reference is released.
+     */
+    ARC,
+};
+
+/**
+ * Compiler options.
+ */
+struct CompilerOptions
+{
+    MemoryMode memory = MemoryMode::Malloc;
+
+    /**
+     * Counts heap allocations per (new ...) site, and
+     * reports them at exit (runtime/heapprof.c).
+     */
+    bool heapProfile = false;
+
+    /**
+     * Emits floating point operations with fast-math flags
+     * (reassociation, no NaNs/infinities), which allows
+     * vectorizing reductions.
+     */
+    bool fastMath = false;
+
+    /**
+     * Default cache size of memoized functions, see (def-memo ...).
+     */
+    uint64_t memoEntries = 4096;
+
+    /**
+     * Profile-guided optimization: instruments branches and function
+     * entries with counters written to profileGenerate at exit
+     * (runtime/profile.c); profileUse reads them back when rebuilding.
+     */
+    std::string profileGenerate;
+    std::string profileUse;
 };
 
 /**
@@ -43,24 +147,92 @@ static const size_t VTABLE_INDEX = 0;
  */
 static const size_t RESERVED_FIELDS_COUNT = 1;
 
-// Generic binary operator:
-#define GEN_BINARY_OP(Op, varName)             \
-    do                                         \
-    {                                          \
-        auto op1 = gen(exp.list[1], env);      \
-        auto op2 = gen(exp.list[2], env);      \
-        return builder->Op(op1, op2, varName); \
-    } while (false)
+/**
+ * ARC mode: index of the reference count, which
+ * follows the vTable and is reserved as well.
+ */
+static const size_t REFCOUNT_INDEX = 1;
+
+/**
+ * ARC mode: index of the class destructor in the vTable.
+ */
+static const size_t DESTRUCTOR_INDEX = 0;
+
+/**
+ * Array header fields: { i64 length, i64 capacity, T* data }
+ */
+static const size_t ARRAY_LENGTH_INDEX = 0;
+static const size_t ARRAY_CAPACITY_INDEX = 1;
+static const size_t ARRAY_DATA_INDEX = 2;
+
+/**
+ * Bytes fields: { i8* data, i64 length, i32 flags }
+ */
+static const size_t BYTES_DATA_INDEX = 0;
+static const size_t BYTES_LENGTH_INDEX = 1;
+
+/**
+ * Heap profile: every N-th allocation of a site records
+ * its stack trace. Must be a power of two.
+ */
+static const uint64_t HEAP_PROFILE_SAMPLE_PERIOD = 4096;
+
+/**
+ * Profile use: functions entered at least 1/N times as often as
+ * the most entered one are hot, functions never entered are cold.
+ */
+static const uint64_t PROFILE_HOT_FRACTION = 100;
+
+/**
+ * Strings: flag of static (literal) string objects, and the
+ * maximum length of strings stored in the pointer.
+ */
+static const uint32_t STRING_STATIC = 1;
+static const size_t SMALL_STRING_MAX = 6;
+
+/**
+ * Map key kinds, see src/runtime/map.c.
+ */
+static const uint32_t MAP_KEY_INT = 0;
+static const uint32_t MAP_KEY_STRING = 1;
+
+/**
+ * Size of the per-thread output buffer of printf.
+ */
+static const uint64_t PRINT_BUFFER_SIZE = 1 << 14;
+
+/**
+ * Alignment of the value slot (promise) in coroutine frames.
+ */
+static const uint32_t GENERATOR_PROMISE_ALIGN = 8;
+
+/**
+ * Element kinds of (parallel-sort ...) and (prefix-sum ...) arrays,
+ * see src/runtime/parallel.c.
+ */
+static const int PARALLEL_KIND_I32 = 0;
+static const int PARALLEL_KIND_I64 = 1;
+static const int PARALLEL_KIND_F32 = 2;
+static const int PARALLEL_KIND_F64 = 3;
+
+/**
+ * Limits of compile-time evaluation: evaluation steps of a (comptime ...)
+ * form, of a pure call evaluated automatically, and the call depth.
+ */
+static const int64_t COMPTIME_MAX_STEPS = 50000000;
+static const int64_t COMPTIME_AUTO_STEPS = 10000;
+static const int COMPTIME_MAX_DEPTH = 2000;
 
 class JovianVM
 {
 public:
-    JovianVM() : parser(std::make_unique<JovianParser>())
+    JovianVM(const CompilerOptions &options = {})
+        : parser(std::make_unique<JovianParser>()), options(options)
     {
         moduleInit();
+        setupTargetTriple();
         setupExternalFunction();
         setupGlobalEnvironment();
-        setupTargetTriple();
     }
 
     /**
@@ -68,8 +240,8 @@ public:
      */
     void exec(const std::string &program)
     {
-        // 1. Parse the program
-        auto ast = parser->parse("(begin" + program + ")");
+        // 1. Parse the program, which may begin or end with a comment:
+        auto ast = parser->parse("(begin " + program + "\n)");
 
         // 2. Compile to LLVM IR:
         compile(ast);
@@ -86,15 +258,66 @@ public:
 private:
     void compile(const Exp &ast)
     {
+        escapeAnalysis = std::make_unique<EscapeAnalysis>(ast);
+
+        if (!options.profileUse.empty())
+        {
+            loadProfile(options.profileUse);
+        }
+
+        if (options.fastMath)
+        {
+            llvm::FastMathFlags fastMathFlags;
+            fastMathFlags.setFast();
+            builder->setFastMathFlags(fastMathFlags);
+        }
+
+        usesRegions = containsForm(ast, "region");
+
+        if (options.memory == MemoryMode::Malloc && usesRegions)
+        {
+            setupRegionFunctions();
+        }
+
         // create main function
-        fn = createFunction("main", llvm::FunctionType::get(builder->getInt32Ty(), false), GlobalEnv);
+        auto argvTy = builder->getInt8Ty()->getPointerTo()->getPointerTo();
+        fn = createFunction("main", llvm::FunctionType::get(builder->getInt32Ty(), {builder->getInt32Ty(), argvTy}, false),
+                            GlobalEnv);
 
-        createGlobalVar("VERSION", builder->getInt32(42));
+        localInstances = escapeAnalysis->findLocalInstances(ast);
+
+        fnBody = &ast;
 
         // compile main body
-        gen(ast, GlobalEnv);
+        releaseValue(gen(ast, GlobalEnv));
+        releaseSlots();
+
+        if (auto flushFn = module->getFunction("jovian_print_flush"))
+        {
+            builder->CreateCall(flushFn);
+        }
 
         builder->CreateRet(builder->getInt32(0));
+
+        if (options.heapProfile)
+        {
+            registerHeapSites();
+        }
+
+        if (!options.profileGenerate.empty())
+        {
+            registerProfileSites();
+        }
+
+        if (!options.profileUse.empty())
+        {
+            layoutProfiledFunctions();
+        }
+
+        if (options.memory == MemoryMode::ARC)
+        {
+            RetainReleaseElision(*module).run();
+        }
     }
 
     /**
@@ -107,14 +330,24 @@ private:
         {
         case ExpType::NUMBER:
         {
+            // Literals which don't fit a number are int64:
+            if (exp.number > INT32_MAX)
+            {
+                return builder->getInt64(exp.number);
+            }
             return builder->getInt32(exp.number);
         }
 
+        case ExpType::FLOAT:
+        {
+            return llvm::ConstantFP::get(builder->getDoubleTy(), exp.floatNumber);
+        }
+
         case ExpType::STRING:
         {
             auto re = std::regex("\\\\n");
             auto str = std::regex_replace(exp.string, re, "\n");
-            return builder->CreateGlobalStringPtr(str);
+            return getStringLiteral(str);
         }
 
         case ExpType::SYMBOL:
@@ -127,15 +360,34 @@ private:
             {
 
                 auto varName = exp.string;
+
+                // Explicit instance of a generic function: max<number>
+                if (!env->isDefined(varName) && isGenericName(varName))
+                {
+                    return instantiateGeneric(varName);
+                }
+
                 auto value = env->lookup(varName);
 
                 if (auto localVar = llvm::dyn_cast<llvm::AllocaInst>(value))
                 {
-                    return builder->CreateLoad(localVar->getAllocatedType(), localVar, varName.c_str());
+                    // Stack allocated instance: the slot is the object itself.
+                    if (localVar->getAllocatedType()->isStructTy())
+                    {
+                        return localVar;
+                    }
+
+                    return retainValue(
+                        builder->CreateLoad(localVar->getAllocatedType(), localVar, varName.c_str()));
                 }
 
                 else if (auto globalVar = llvm::dyn_cast<llvm::GlobalVariable>(value))
                 {
+                    if (globalVar->isConstant())
+                    {
+                        return globalVar->getInitializer();
+                    }
+
                     return builder->CreateLoad(globalVar->getInitializer()->getType(), globalVar, varName.c_str());
                 }
 
@@ -158,65 +410,24 @@ private:
                 auto op = tag.string;
 
                 // --------------------------------------------
-                // Binary math operations:
-
-                if (op == "+")
-                {
-                    GEN_BINARY_OP(CreateAdd, "tmpadd");
-                }
-
-                else if (op == "-")
-                {
-                    GEN_BINARY_OP(CreateSub, "tmpsub");
-                }
-
-                else if (op == "*")
-                {
-                    GEN_BINARY_OP(CreateMul, "tmpmul");
-                }
+                // Binary math operations: (+ a b)
+                //
+                // Operands are converted to the wider of their
+                // types: number (i32) < int64 < float32 < float64
 
-                else if (op == "/")
+                if (op == "+" || op == "-" || op == "*" || op == "/")
                 {
-                    GEN_BINARY_OP(CreateSDiv, "tmpdiv");
+                    return genBinaryOp(exp, env);
                 }
 
                 // --------------------------------------------
                 // Compare operations: (> 5 10)
+                //
+                // Signed for integers, ordered for floating point.
 
-                // UGT - unsigned, greater than
-                else if (op == ">")
-                {
-                    GEN_BINARY_OP(CreateICmpUGT, "tmpcmp");
-                }
-
-                // ULT - unsigned, less than
-                else if (op == "<")
-                {
-                    GEN_BINARY_OP(CreateICmpULT, "tmpcmp");
-                }
-
-                // EQ - equal
-                else if (op == "==")
-                {
-                    GEN_BINARY_OP(CreateICmpEQ, "tmpcmp");
-                }
-
-                // NE - not equal
-                else if (op == "!=")
-                {
-                    GEN_BINARY_OP(CreateICmpNE, "tmpcmp");
-                }
-
-                // UGE - greater or equal
-                else if (op == ">=")
-                {
-                    GEN_BINARY_OP(CreateICmpUGE, "tmpcmp");
-                }
-
-                // ULE - less or equal
-                else if (op == "<=")
+                else if (op == ">" || op == "<" || op == "==" || op == "!=" || op == ">=" || op == "<=")
                 {
-                    GEN_BINARY_OP(CreateICmpULE, "tmpcmp");
+                    return genBinaryOp(exp, env);
                 }
 
                 // --------------------------------------------
@@ -234,7 +445,7 @@ private:
                     auto elseBlock = createBB("else");
                     auto ifEndBlock = createBB("ifend");
 
-                    builder->CreateCondBr(cond, thenBlock, elseBlock);
+                    genProfiledCondBr("if", cond, thenBlock, elseBlock);
 
                     builder->SetInsertPoint(thenBlock);
                     auto thenRes = gen(exp.list[2], env);
@@ -251,6 +462,20 @@ private:
                     fn->getBasicBlockList().push_back(ifEndBlock);
                     builder->SetInsertPoint(ifEndBlock);
 
+                    // Branches of different numeric types produce the wider one:
+                    if (thenRes->getType() != elseRes->getType())
+                    {
+                        auto resTy = unifiedType(thenRes->getType(), elseRes->getType());
+
+                        builder->SetInsertPoint(thenBlock->getTerminator());
+                        thenRes = coerceValue(thenRes, resTy);
+
+                        builder->SetInsertPoint(elseBlock->getTerminator());
+                        elseRes = coerceValue(elseRes, resTy);
+
+                        builder->SetInsertPoint(ifEndBlock);
+                    }
+
                     auto phi = builder->CreatePHI(thenRes->getType(), 2, "tmpif");
                     phi->addIncoming(thenRes, thenBlock);
                     phi->addIncoming(elseRes, elseBlock);
@@ -258,6 +483,159 @@ private:
                     return phi;
                 }
 
+                /**
+                 * (switch <value>
+                 *   (case <key> <body>)
+                 *   (case (<key> ...) <body>)
+                 *   ...
+                 *   (default <body>))
+                 *
+                 * Keys are integer literals, the value an integer. Compiled
+                 * to a switch instruction: dense keys become a jump table,
+                 * sparse ones a binary search. Without a default the
+                 * result for other values is 0.
+                 */
+                else if (op == "switch")
+                {
+                    auto value = gen(exp.list[1], env);
+                    auto valueTy = llvm::dyn_cast<llvm::IntegerType>(value->getType());
+
+                    if (valueTy == nullptr)
+                    {
+                        DIE << "[JovianVM]: switch on " << getTypeName(value->getType()) << ", expected an integer";
+                    }
+
+                    auto defaultBlock = createBB("default");
+                    auto switchEndBlock = createBB("switchend");
+
+                    const Exp *defaultBody = nullptr;
+                    std::vector<const Exp *> caseBodies;
+                    std::vector<llvm::BasicBlock *> caseBlocks;
+
+                    auto switchInst = builder->CreateSwitch(value, defaultBlock, exp.list.size() - 2);
+                    std::set<int64_t> keys;
+
+                    for (auto i = 2; i < exp.list.size(); i++)
+                    {
+                        auto &clause = exp.list[i];
+
+                        if (isTaggedList(clause, "default") && clause.list.size() == 2 && defaultBody == nullptr)
+                        {
+                            defaultBody = &clause.list[1];
+                            continue;
+                        }
+
+                        if (!isTaggedList(clause, "case") || clause.list.size() != 3)
+                        {
+                            DIE << "[JovianVM]: expected (case <key> <body>) or a single (default <body>) in switch";
+                        }
+
+                        auto caseBlock = createBB("case");
+                        auto &caseKeys = clause.list[1];
+
+                        for (auto &key : caseKeys.type == ExpType::LIST ? caseKeys.list : std::vector<Exp>{caseKeys})
+                        {
+                            if (key.type != ExpType::NUMBER)
+                            {
+                                DIE << "[JovianVM]: switch keys must be integer literals";
+                            }
+                            if (!keys.insert(key.number).second)
+                            {
+                                DIE << "[JovianVM]: duplicate switch key " << key.number;
+                            }
+
+                            switchInst->addCase(llvm::ConstantInt::get(valueTy, key.number, /* isSigned */ true),
+                                                caseBlock);
+                        }
+
+                        caseBodies.push_back(&clause.list[2]);
+                        caseBlocks.push_back(caseBlock);
+                    }
+
+                    std::vector<std::pair<llvm::BasicBlock *, llvm::Value *>> results;
+
+                    for (auto i = 0; i < caseBlocks.size(); i++)
+                    {
+                        fn->getBasicBlockList().push_back(caseBlocks[i]);
+                        builder->SetInsertPoint(caseBlocks[i]);
+
+                        auto caseRes = gen(*caseBodies[i], env);
+                        builder->CreateBr(switchEndBlock);
+                        results.push_back({builder->GetInsertBlock(), caseRes});
+                    }
+
+                    fn->getBasicBlockList().push_back(defaultBlock);
+                    builder->SetInsertPoint(defaultBlock);
+
+                    auto defaultRes = defaultBody != nullptr ? gen(*defaultBody, env) : nullptr;
+                    builder->CreateBr(switchEndBlock);
+                    results.push_back({builder->GetInsertBlock(), defaultRes});
+
+                    fn->getBasicBlockList().push_back(switchEndBlock);
+
+                    return genBranchResult(results, switchEndBlock, "tmpswitch");
+                }
+
+                /**
+                 * (cond
+                 *   (<test> <body>)
+                 *   ...
+                 *   (else <body>))
+                 *
+                 * The body of the first true test; without an else the
+                 * result is 0 if none is.
+                 */
+                else if (op == "cond")
+                {
+                    auto condEndBlock = createBB("condend");
+
+                    std::vector<std::pair<llvm::BasicBlock *, llvm::Value *>> results;
+                    const Exp *elseBody = nullptr;
+
+                    for (auto i = 1; i < exp.list.size(); i++)
+                    {
+                        auto &clause = exp.list[i];
+
+                        if (clause.type != ExpType::LIST || clause.list.size() != 2)
+                        {
+                            DIE << "[JovianVM]: expected (<test> <body>) in cond";
+                        }
+
+                        if (clause.list[0].type == ExpType::SYMBOL && clause.list[0].string == "else")
+                        {
+                            if (i != exp.list.size() - 1)
+                            {
+                                DIE << "[JovianVM]: else must be the last clause of cond";
+                            }
+                            elseBody = &clause.list[1];
+                            break;
+                        }
+
+                        auto test = gen(clause.list[0], env);
+
+                        auto thenBlock = createBB("then", fn);
+                        auto nextBlock = createBB("next");
+
+                        genProfiledCondBr("cond", test, thenBlock, nextBlock);
+
+                        builder->SetInsertPoint(thenBlock);
+                        auto thenRes = gen(clause.list[1], env);
+                        builder->CreateBr(condEndBlock);
+                        results.push_back({builder->GetInsertBlock(), thenRes});
+
+                        fn->getBasicBlockList().push_back(nextBlock);
+                        builder->SetInsertPoint(nextBlock);
+                    }
+
+                    auto elseRes = elseBody != nullptr ? gen(*elseBody, env) : nullptr;
+                    builder->CreateBr(condEndBlock);
+                    results.push_back({builder->GetInsertBlock(), elseRes});
+
+                    fn->getBasicBlockList().push_back(condEndBlock);
+
+                    return genBranchResult(results, condEndBlock, "tmpcond");
+                }
+
                 // --------------------------------------------
                 // While loop:
 
@@ -273,614 +651,8377 @@ private:
                     auto bodyBlock = createBB("body");
                     auto loopEndBlock = createBB("loopend");
 
+                    // Assignments in the loop affect accesses of
+                    // all of its iterations:
+                    invalidateCheckedIndices(exp, env);
+                    auto prevCheckedIndices = checkedIndices;
+
                     builder->SetInsertPoint(condBlock);
                     auto cond = gen(exp.list[1], env);
 
-                    builder->CreateCondBr(cond, bodyBlock, loopEndBlock);
+                    genProfiledCondBr("while", cond, bodyBlock, loopEndBlock);
+
+                    addCheckedIndex(exp.list[1], env);
 
                     fn->getBasicBlockList().push_back(bodyBlock);
                     builder->SetInsertPoint(bodyBlock);
-                    gen(exp.list[2], env);
+                    genLoopBody(exp.list[2], env, condBlock, loopEndBlock);
                     builder->CreateBr(condBlock);
 
+                    checkedIndices = prevCheckedIndices;
+
                     fn->getBasicBlockList().push_back(loopEndBlock);
                     builder->SetInsertPoint(loopEndBlock);
 
                     return builder->getInt32(0);
                 }
 
-                // --------------------------------------------
-                // Function declaration: (def <name> <params> <body>)
-                //
-
-                else if (op == "def")
+                /**
+                 * (do-while <body> <cond>)
+                 *
+                 * The body runs at least once.
+                 */
+                else if (op == "do-while")
                 {
-                    return compileFunction(exp, /* name */ exp.list[1].string, env);
-                }
+                    auto bodyBlock = createBB("do_body", fn);
+                    auto condBlock = createBB("do_cond");
+                    auto loopEndBlock = createBB("do_end");
 
-                if (op == "var")
-                {
-                    if (cls != nullptr)
-                    {
-                        return builder->getInt32(0);
-                    }
+                    builder->CreateBr(bodyBlock);
 
-                    auto varNameDecl = exp.list[1];
-                    auto varName = extractVarName(varNameDecl);
+                    invalidateCheckedIndices(exp, env);
+                    auto prevCheckedIndices = checkedIndices;
 
-                    if (isNew(exp.list[2]))
-                    {
-                        auto instance = createInstance(exp.list[2], env, varName);
-                        return env->define(varName, instance);
-                    }
+                    builder->SetInsertPoint(bodyBlock);
+                    genLoopBody(exp.list[1], env, condBlock, loopEndBlock);
+                    builder->CreateBr(condBlock);
 
-                    auto init = gen(exp.list[2], env);
+                    fn->getBasicBlockList().push_back(condBlock);
+                    builder->SetInsertPoint(condBlock);
+                    auto cond = gen(exp.list[2], env);
+                    genProfiledCondBr("do-while", cond, bodyBlock, loopEndBlock);
 
-                    auto varTy = extractVarType(varNameDecl);
+                    checkedIndices = prevCheckedIndices;
 
-                    auto varBinding = allocVar(varName, varTy, env);
+                    fn->getBasicBlockList().push_back(loopEndBlock);
+                    builder->SetInsertPoint(loopEndBlock);
 
-                    return builder->CreateStore(init, varBinding);
+                    return builder->getInt32(0);
                 }
 
-                else if (op == "set")
+                /**
+                 * Counted loop: (for (i <start> <end> [<step>]) [<hints>...] <body>)
+                 *
+                 * i runs from start while i < end (i > end for a negative
+                 * step), end is evaluated once. The step is an integer
+                 * literal, (- 1) counts down. i is read-only in the body and
+                 * lives in a register, so the trip count is known to LLVM.
+                 *
+                 * Hints: vectorize, unroll, (unroll N), parallel. A parallel
+                 * loop has no dependencies between iterations through memory.
+                 */
+                else if (op == "for")
                 {
-                    auto value = gen(exp.list[2], env);
+                    auto &header = exp.list[1];
+                    auto &body = exp.list.back();
 
-                    if (isProp(exp.list[1]))
+                    if (header.type != ExpType::LIST || header.list.size() < 3 || header.list.size() > 4 ||
+                        header.list[0].type != ExpType::SYMBOL)
                     {
-                        auto instance = gen(exp.list[1].list[1], env);
-                        auto fieldName = exp.list[1].list[2].string;
-                        auto ptrName = std::string("p") + fieldName;
+                        DIE << "[JovianVM]: expected (for (<var> <start> <end> [<step>]) ...)";
+                    }
 
-                        auto cls = (llvm::StructType *)(instance->getType()->getContainedType(0));
+                    auto &varName = header.list[0].string;
 
-                        auto fieldIdx = getFieldIndex(cls, fieldName);
+                    if (isAssigned(body, varName))
+                    {
+                        DIE << "[JovianVM]: loop variable " << varName << " is assigned in the loop body";
+                    }
 
-                        auto address = builder->CreateStructGEP(cls, instance, fieldIdx, ptrName);
+                    auto step = header.list.size() == 4 ? getLoopStep(header.list[3]) : 1;
 
-                        builder->CreateStore(value, address);
+                    auto start = gen(header.list[1], env);
+                    auto end = gen(header.list[2], env);
 
-                        return value;
-                    }
+                    auto varTy = unifiedType(start->getType(), end->getType());
 
-                    else
+                    if (!varTy->isIntegerTy() || varTy->isIntegerTy(1))
                     {
-                        auto varName = exp.list[1].string;
+                        DIE << "[JovianVM]: loop variable " << varName << " must be an integer";
+                    }
 
-                        auto varBinding = env->lookup(varName);
+                    start = coerceValue(start, varTy);
+                    end = coerceValue(end, varTy);
 
-                        builder->CreateStore(value, varBinding);
+                    auto preheaderBlock = builder->GetInsertBlock();
+                    auto condBlock = createBB("for_cond", fn);
+                    auto bodyBlock = createBB("for_body");
+                    auto latchBlock = createBB("for_latch");
+                    auto loopEndBlock = createBB("for_end");
 
-                        return value;
+                    builder->CreateBr(condBlock);
+
+                    builder->SetInsertPoint(condBlock);
+                    auto var = builder->CreatePHI(varTy, 2, varName);
+                    var->addIncoming(start, preheaderBlock);
+
+                    auto cond = step > 0 ? builder->CreateICmpSLT(var, end, "for_cond")
+                                         : builder->CreateICmpSGT(var, end, "for_cond");
+                    genProfiledCondBr("for", cond, bodyBlock, loopEndBlock);
+
+                    auto loopEnv = std::make_shared<Environment>(
+                        std::map<std::string, llvm::Value *>{{varName, var}}, env);
+
+                    invalidateCheckedIndices(exp, env);
+                    auto prevCheckedIndices = checkedIndices;
+
+                    // (for (i 0 (len a)) ...) indexes a in bounds. The length
+                    // is taken once, so a must not be reassigned in the body,
+                    // e.g. to a shorter array:
+                    if (step > 0 && header.list[1].type == ExpType::NUMBER && isTaggedList(header.list[2], "len") &&
+                        header.list[2].list[1].type == ExpType::SYMBOL && !isAssigned(body, header.list[2].list[1].string))
+                    {
+                        auto &arrayName = header.list[2].list[1].string;
+                        auto arraySlot = env->lookup(arrayName);
+
+                        if (llvm::isa<llvm::AllocaInst>(arraySlot))
+                        {
+                            checkedIndices.push_back({var, arraySlot, varName, arrayName});
+                        }
                     }
+
+                    fn->getBasicBlockList().push_back(bodyBlock);
+                    builder->SetInsertPoint(bodyBlock);
+                    genLoopBody(body, loopEnv, latchBlock, loopEndBlock);
+                    builder->CreateBr(latchBlock);
+
+                    checkedIndices = prevCheckedIndices;
+
+                    fn->getBasicBlockList().push_back(latchBlock);
+                    builder->SetInsertPoint(latchBlock);
+                    auto next = builder->CreateNSWAdd(var, llvm::ConstantInt::get(varTy, step, true), varName + "_next");
+                    var->addIncoming(next, latchBlock);
+
+                    auto backEdge = builder->CreateBr(condBlock);
+                    backEdge->setMetadata(llvm::LLVMContext::MD_loop,
+                                          createLoopMetadata(exp, bodyBlock, latchBlock));
+
+                    fn->getBasicBlockList().push_back(loopEndBlock);
+                    builder->SetInsertPoint(loopEndBlock);
+
+                    return builder->getInt32(0);
                 }
 
-                else if (op == "begin")
+                /**
+                 * (break), (continue): leave or continue the innermost loop.
+                 */
+                else if (op == "break" || op == "continue")
                 {
-                    auto blockEnv = std::make_shared<Environment>(
-                        std::map<std::string, llvm::Value *>{}, env);
+                    if (loopTargets.empty())
+                    {
+                        DIE << "[JovianVM]: (" << op << ") outside of a loop";
+                    }
 
-                    llvm::Value *blockRes;
-                    for (auto i = 1; i < exp.list.size(); i++)
+                    auto &target = loopTargets.back();
+
+                    // Leave regions entered in the loop body:
+                    if (options.memory == MemoryMode::Malloc)
+                    {
+                        for (auto i = target.regionDepth; i < regionEnvs.size(); i++)
+                        {
+                            builder->CreateCall(module->getFunction("jovian_region_exit"));
+                        }
+                    }
+
+                    builder->CreateBr(op == "break" ? target.breakBlock : target.continueBlock);
+
+                    // Code after the jump is unreachable:
+                    builder->SetInsertPoint(createBB(op + "_end", fn));
+
+                    return builder->getInt32(0);
+                }
+
+                // --------------------------------------------
+                // Function declaration: (def <name> <params> <body>)
+                //
+
+                else if (op == "def")
+                {
+                    // Generic function: (def <name><T>... <params> -> <type> <body>)
+                    if (isGenericName(exp.list[1].string) && !isInstanceName(exp.list[1].string))
                     {
-                        blockRes = gen(exp.list[i], blockEnv);
+                        if (cls != nullptr)
+                        {
+                            DIE << "[JovianVM]: generic methods are not supported, make the class generic: "
+                                << exp.list[1].string;
+                        }
+
+                        declareGeneric(genericFunctions_, exp, env);
+                        return builder->getInt32(0);
                     }
-                    return blockRes;
+
+                    return compileFunction(exp, /* name */ exp.list[1].string, env);
                 }
 
-                else if (op == "printf")
+                /**
+                 * Memoized function:
+                 *
+                 *   (def-memo [(cache <entries> [replace | lru])] <name> <params> -> <type> <body>)
+                 *
+                 * Results are cached per thread in a table of <entries> (a
+                 * power of two, default --memo-entries) keyed on the
+                 * arguments. replace: each arguments hash to one entry, a new
+                 * result replaces it. lru: two entries per hash, the least
+                 * recently used one is replaced.
+                 *
+                 * Parameters and result are numbers, and the body has to be
+                 * pure, see checkPure. Calls in the body, including recursive
+                 * ones, go through the cache.
+                 */
+                else if (op == "def-memo")
                 {
-                    auto printFn = module->getFunction("printf");
+                    return compileMemoFunction(exp, env);
+                }
 
-                    std::vector<llvm::Value*> args{};
+                /**
+                 * (def-pure <name> <params> -> <type> <body>)
+                 *
+                 * A function checked to be pure, which memoized functions
+                 * may call.
+                 */
+                else if (op == "def-pure")
+                {
+                    checkPureFunction(exp, env);
+                    pureFunctions_.emplace(exp.list[1].string, exp);
 
-                    for (auto i = 1; i < exp.list.size(); i++)
+                    return compileFunction(exp, exp.list[1].string, env);
+                }
+
+                // --------------------------------------------
+                // Compile-time evaluation:
+
+                /**
+                 * (comptime <expression>)
+                 *
+                 * Evaluated by the compiler, the result is a constant. The
+                 * expression may use numbers, variables, loops, arrays, and
+                 * call pure functions (def-pure, def-memo) and readnone
+                 * extern math functions (sqrt, sin, ...). An array result is
+                 * emitted as constant data, e.g. a lookup table: it must not
+                 * be modified.
+                 *
+                 * Calls of pure functions with constant arguments are
+                 * evaluated at compile time too, if they finish within
+                 * COMPTIME_AUTO_STEPS; a call which does not is compiled,
+                 * and not tried again with the same arguments.
+                 */
+                else if (op == "comptime")
+                {
+                    return genComptime(exp, env);
+                }
+
+                // --------------------------------------------
+                // Foreign functions:
+
+                /**
+                 * (extern <name> (<params>) -> <type> [(<attributes>)])
+                 *
+                 * Declares a C function. Parameters are (<name> <type>),
+                 * a trailing varargs accepts variadic arguments. Besides Eva
+                 * numbers the types are int8, int16, ptr (void*, also
+                 * passed arrays, bytes, strings and C structs as their
+                 * data), cstring (a char* returned as a copied string)
+                 * and void. Attributes are LLVM function attributes, e.g.
+                 * (readonly nounwind willreturn), which the optimizer
+                 * trusts.
+                 */
+                else if (op == "extern")
+                {
+                    declareExternFunction(exp, env);
+                    return builder->getInt32(0);
+                }
+
+                /**
+                 * (cstruct <name> (<field> <type>) ...)
+                 *
+                 * A struct with the layout of C: fields in order, aligned
+                 * naturally. (new <name>) allocates a zeroed one, fields
+                 * are accessed with (prop ...), (delete ...) frees it.
+                 */
+                else if (op == "cstruct")
+                {
+                    declareCStruct(exp);
+                    return builder->getInt32(0);
+                }
+
+                // --------------------------------------------
+                // Generators:
+
+                /**
+                 * (generator <name> <params> -> <type> <body>)
+                 * (async <name> <params> -> <type> <body>)
+                 *
+                 * A call creates a suspended coroutine, (gen <type>), which
+                 * runs to its next (yield ...) on each resumption. The value
+                 * of the body is the last value of the coroutine. An async
+                 * function is a generator whose yields mark points where it
+                 * waits, see (await ...) and (run ...).
+                 */
+                else if (op == "generator" || op == "async")
+                {
+                    return compileGenerator(exp, /* name */ exp.list[1].string, env);
+                }
+
+                /**
+                 * (yield <value>): suspends the generator with the value.
+                 */
+                else if (op == "yield")
+                {
+                    if (coroutine == nullptr)
                     {
-                        args.push_back(gen(exp.list[i], env));
+                        DIE << "[JovianVM]: (yield ...) outside of a generator";
                     }
 
-                    return builder->CreateCall(printFn, args);
+                    auto value = coerceValue(gen(exp.list[1], env), coroutine->valueTy);
+                    builder->CreateStore(value, coroutine->promise);
+                    genSuspend(/* final */ false);
+
+                    return value;
                 }
 
-                else if (op == "class")
+                /**
+                 * (next <generator>): resumes the generator, false once it
+                 * has finished.
+                 */
+                else if (op == "next")
                 {
-                    auto name = exp.list[1].string;
+                    return resumeGenerator(gen(exp.list[1], env));
+                }
 
-                    auto parent = exp.list[2].string == "null"
-                                      ? nullptr
-                                      : getClassByName(exp.list[2].string);
+                /**
+                 * (current <generator>): the last yielded value, or the
+                 * value of the body once finished.
+                 */
+                else if (op == "current")
+                {
+                    return loadGeneratorValue(gen(exp.list[1], env));
+                }
 
-                    cls = llvm::StructType::create(*ctx, name);
+                /**
+                 * (for-each (<var> <generator>) <body>)
+                 *
+                 * Runs the body for each yielded value, then destroys the
+                 * generator (also on break). The variable is read-only.
+                 */
+                else if (op == "for-each")
+                {
+                    auto &header = exp.list[1];
+                    auto &body = exp.list[2];
 
-                    if (parent != nullptr)
+                    if (header.type != ExpType::LIST || header.list.size() != 2 ||
+                        header.list[0].type != ExpType::SYMBOL)
                     {
-                        inheritClass(cls, parent);
+                        DIE << "[JovianVM]: expected (for-each (<var> <generator>) ...)";
                     }
-                    else
+
+                    auto &varName = header.list[0].string;
+
+                    if (isAssigned(body, varName))
                     {
-                        classMap_[name] = {cls, parent, {}, {}};
+                        DIE << "[JovianVM]: loop variable " << varName << " is assigned in the loop body";
                     }
 
-                    buildClassInfo(cls, exp, env);
+                    auto generator = gen(header.list[1], env);
+                    getGeneratorValueType(generator->getType());
 
-                    gen(exp.list[3], env);
+                    auto condBlock = createBB("each_cond", fn);
+                    auto bodyBlock = createBB("each_body");
+                    auto loopEndBlock = createBB("each_end");
 
-                    cls = nullptr;
+                    builder->CreateBr(condBlock);
+
+                    builder->SetInsertPoint(condBlock);
+                    builder->CreateCondBr(resumeGenerator(generator), bodyBlock, loopEndBlock);
+
+                    invalidateCheckedIndices(exp, env);
+                    auto prevCheckedIndices = checkedIndices;
+
+                    fn->getBasicBlockList().push_back(bodyBlock);
+                    builder->SetInsertPoint(bodyBlock);
+
+                    auto loopEnv = std::make_shared<Environment>(
+                        std::map<std::string, llvm::Value *>{{varName, loadGeneratorValue(generator, varName)}}, env);
+
+                    genLoopBody(body, loopEnv, condBlock, loopEndBlock);
+                    builder->CreateBr(condBlock);
+
+                    checkedIndices = prevCheckedIndices;
+
+                    fn->getBasicBlockList().push_back(loopEndBlock);
+                    builder->SetInsertPoint(loopEndBlock);
+                    destroyGenerator(generator);
 
                     return builder->getInt32(0);
                 }
 
-                else if (op == "new")
+                /**
+                 * (await <generator>)
+                 *
+                 * In an async function or generator: runs the awaited
+                 * coroutine, suspending the current one whenever it
+                 * suspends (forwarding yielded values of the same type).
+                 * Returns its last value and destroys it.
+                 */
+                else if (op == "await")
                 {
-                    return createInstance(exp, env, "");
+                    if (coroutine == nullptr)
+                    {
+                        DIE << "[JovianVM]: (await ...) outside of an async function, use (run ...)";
+                    }
+
+                    auto awaited = gen(exp.list[1], env);
+                    auto valueTy = getGeneratorValueType(awaited->getType());
+
+                    auto resumeBlock = createBB("await_resume", fn);
+                    auto suspendBlock = createBB("await_suspend");
+                    auto awaitEndBlock = createBB("await_end");
+
+                    builder->CreateBr(resumeBlock);
+
+                    builder->SetInsertPoint(resumeBlock);
+                    builder->CreateCondBr(resumeGenerator(awaited), suspendBlock, awaitEndBlock);
+
+                    fn->getBasicBlockList().push_back(suspendBlock);
+                    builder->SetInsertPoint(suspendBlock);
+
+                    if (valueTy == coroutine->valueTy)
+                    {
+                        builder->CreateStore(loadGeneratorValue(awaited), coroutine->promise);
+                    }
+
+                    genSuspend(/* final */ false);
+                    builder->CreateBr(resumeBlock);
+
+                    fn->getBasicBlockList().push_back(awaitEndBlock);
+                    builder->SetInsertPoint(awaitEndBlock);
+
+                    auto value = loadGeneratorValue(awaited, "awaited");
+                    destroyGenerator(awaited);
+
+                    return value;
                 }
 
-                else if (op == "prop")
+                /**
+                 * (run <generator>): resumes the coroutine until it
+                 * finishes, returns its last value and destroys it.
+                 */
+                else if (op == "run")
                 {
-                    auto instance = gen(exp.list[1], env);
-                    auto fieldName = exp.list[2].string;
-                    auto ptrName = std::string("p") + fieldName;
+                    auto generator = gen(exp.list[1], env);
+                    getGeneratorValueType(generator->getType());
 
-                    auto cls = (llvm::StructType*)(instance->getType()->getContainedType(0));
-                    auto fieldIdx = getFieldIndex(cls, fieldName);
+                    auto resumeBlock = createBB("run_resume", fn);
+                    auto runEndBlock = createBB("run_end");
 
-                    auto address = builder->CreateStructGEP(cls, instance, fieldIdx, ptrName);
+                    builder->CreateBr(resumeBlock);
 
-                    return builder->CreateLoad(cls->getElementType(fieldIdx), address, fieldName);
-                }
+                    builder->SetInsertPoint(resumeBlock);
+                    builder->CreateCondBr(resumeGenerator(generator), resumeBlock, runEndBlock);
 
-                else if(op == "method") {
-                    auto methodName = exp.list[2].string;
+                    fn->getBasicBlockList().push_back(runEndBlock);
+                    builder->SetInsertPoint(runEndBlock);
 
-                    llvm::StructType* cls;
-                    llvm::Value* vTable;
-                    llvm::StructType* vTableTy;
+                    auto value = loadGeneratorValue(generator, "result");
+                    destroyGenerator(generator);
 
-                    if(isSuper(exp.list[1])) {
-                        auto className = exp.list[1].list[1].string;
-                        cls = classMap_[className].parent;
-                        auto parentName = std::string{cls->getName().data()};
+                    return value;
+                }
 
-                        vTable = module->getNamedGlobal(parentName + "_vTable");
-                        vTableTy = llvm::StructType::getTypeByName(*ctx, parentName + "_vTable");
-                    } else {
-                        auto instance = gen(exp.list[1], env);
-                        cls = (llvm::StructType*) (instance->getType()->getContainedType(0));
-                        auto vTableAddr = builder->CreateStructGEP(cls, instance, VTABLE_INDEX);
+                if (op == "var")
+                {
+                    if (cls != nullptr)
+                    {
+                        return builder->getInt32(0);
+                    }
 
-                        vTable = builder->CreateLoad(cls->getElementType(VTABLE_INDEX), vTableAddr, "vt");
+                    auto varNameDecl = exp.list[1];
+                    auto varName = extractVarName(varNameDecl);
 
-                        vTableTy = (llvm::StructType*)(vTable->getType()->getContainedType(0));
+                    if (isNew(exp.list[2]) && cStructs_.count(exp.list[2].list[1].string) == 0)
+                    {
+                        auto instance = createInstance(exp.list[2], env, varName);
+
+                        // Heap instances are accessed through a slot, so the
+                        // variable can be reassigned (and collected instances
+                        // can move):
+                        if (!llvm::isa<llvm::AllocaInst>(instance))
+                        {
+                            auto varBinding = allocVar(varName, instance->getType(), env);
+                            storeValue(instance, varBinding);
+                            return retainValue(instance);
+                        }
+
+                        return env->define(varName, instance);
                     }
 
-                    auto methodIdx = getMethodIndex(cls, methodName);
+                    auto init = gen(exp.list[2], env);
 
-                    auto methodTy= (llvm::FunctionType*) vTableTy->getElementType(methodIdx);
+                    // Untyped variables take the type of the initializer:
+                    auto varTy = varNameDecl.type == ExpType::LIST ? extractVarType(varNameDecl) : init->getType();
 
-                    auto methodAddr = builder->CreateStructGEP(vTableTy, vTable, methodIdx);
+                    auto varBinding = allocVar(varName, varTy, env);
 
-                    return builder->CreateLoad(methodTy, methodAddr);
+                    return storeValue(coerceValue(init, varTy), varBinding);
                 }
 
-                else
+                else if (op == "set")
                 {
+                    auto value = gen(exp.list[2], env);
 
-                    auto callable = gen(exp.list[0], env);
-                    auto callableTy = callable->getType()->getContainedType(0);
-                    
-                    std::vector<llvm::Value*> args{};
-                    auto argIdx = 0;
+                    checkRegionEscape(exp.list[1], exp.list[2], value, env);
 
-                    if(callableTy->isStructTy()) {
-                        auto cls = (llvm::StructType*) callableTy;
-                        std::string className{cls->getName().data()};
+                    if (isProp(exp.list[1]))
+                    {
+                        auto instance = gen(exp.list[1].list[1], env);
+                        auto fieldName = exp.list[1].list[2].string;
+                        auto ptrName = std::string("p") + fieldName;
 
-                        args.push_back(callable);
-                        argIdx++;
+                        if (isCStructPointer(instance->getType()))
+                        {
+                            auto address = cStructFieldAddress(instance, fieldName);
+                            value = coerceForeignValue(value, address->getType()->getPointerElementType());
+                            builder->CreateStore(value, address);
+                            return value;
+                        }
 
-                        callable = module->getFunction(className + "___call__");
-                    }
+                        auto cls = (llvm::StructType *)(instance->getType()->getContainedType(0));
+
+                        auto fieldIdx = getFieldIndex(cls, fieldName);
 
+                        auto address = builder->CreateStructGEP(cls, instance, fieldIdx, ptrName);
 
-                    auto fn = (llvm::Function*) callable;
-                    for (auto i = 1; i < exp.list.size(); i++)
-                    {
-                        auto argValue = gen(exp.list[i], env);
-                        auto paramTy = fn->getArg(argIdx) ->getType();
-                        auto bitCastArgVal = builder->CreateBitCast(argValue, paramTy);
-                        args.push_back(bitCastArgVal);
+                        value = coerceValue(value, cls->getElementType(fieldIdx));
+
+                        if (isAtomicField(cls, fieldName))
+                        {
+                            auto store = builder->CreateStore(value, address);
+                            store->setAtomic(llvm::AtomicOrdering::SequentiallyConsistent);
+                        }
+                        else
+                        {
+                            storeValue(value, address);
+                        }
+
+                        if (options.memory == MemoryMode::GC && isClassPointer(value->getType()))
+                        {
+                            auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+                            builder->CreateCall(module->getFunction("jovian_gc_write_barrier"),
+                                                builder->CreatePointerCast(instance, bytePtrTy));
+                        }
+
+                        retainValue(value);
+                        releaseValue(instance);
+
+                        return value;
                     }
 
-                    return builder->CreateCall(fn, args);
+                    else
+                    {
+                        auto varName = exp.list[1].string;
+
+                        auto varBinding = env->lookup(varName);
+
+                        value = coerceValue(value, getSlotType(varBinding));
+                        storeValue(value, varBinding);
+                        invalidateCheckedIndices(varBinding);
+
+                        return retainValue(value);
+                    }
                 }
-            }
 
-            else {
-                auto loadedMethod = (llvm::LoadInst*) gen(exp.list[0], env);
-                auto fnTy = (llvm::FunctionType*) (loadedMethod->getPointerOperand()->getType()->getContainedType(0)->getContainedType(0));
-            
+                else if (op == "begin")
+                {
+                    auto blockEnv = std::make_shared<Environment>(
+                        std::map<std::string, llvm::Value *>{}, env);
+
+                    return genBlock(exp, blockEnv);
+                }
+
+                /**
+                 * Region block: (region <expressions>)
+                 *
+                 * Every (new ...) executed in the dynamic extent of the block
+                 * allocates from a region arena, which is freed at once when the
+                 * block exits. Objects may not escape the region lexically: storing
+                 * them to outer variables or objects, returning them, or passing
+                 * them to a function which may keep them (see
+                 * EscapeAnalysis::callCaptures) is a compile error. In GC and ARC
+                 * modes it's a plain block.
+                 */
+                else if (op == "region")
+                {
+                    auto regionEnv = std::make_shared<Environment>(
+                        std::map<std::string, llvm::Value *>{}, env);
+
+                    if (options.memory == MemoryMode::Malloc)
+                    {
+                        builder->CreateCall(module->getFunction("jovian_region_enter"));
+                    }
+
+                    regionEnvs.push_back(regionEnv);
+                    auto regionRes = genBlock(exp, regionEnv);
+                    regionEnvs.pop_back();
+
+                    if (isClassPointer(regionRes->getType()))
+                    {
+                        DIE << "[JovianVM]: region result escapes its region";
+                    }
+
+                    if (options.memory == MemoryMode::Malloc)
+                    {
+                        builder->CreateCall(module->getFunction("jovian_region_exit"));
+                    }
+
+                    return regionRes;
+                }
+
+                /**
+                 * Explicit deallocation: (delete obj)
+                 *
+                 * The instance goes back to the free list of its size, and
+                 * the next (new ...) of a same sized class reuses it. In GC
+                 * and ARC modes lifetime is automatic, and delete only
+                 * evaluates (and releases) its argument.
+                 */
+                else if (op == "delete")
+                {
+                    auto instance = gen(exp.list[1], env);
+
+                    if (isArrayPointer(instance->getType()))
+                    {
+                        if (options.memory == MemoryMode::Malloc)
+                        {
+                            freeArray(instance);
+                        }
+                        return builder->getInt32(0);
+                    }
+
+                    // Strings are never managed by GC or ARC:
+                    if (isStringPointer(instance->getType()))
+                    {
+                        callStringFunction("jovian_string_free", builder->getVoidTy(), {instance});
+                        return builder->getInt32(0);
+                    }
+
+                    if (instance->getType() == getStringBuilderType()->getPointerTo())
+                    {
+                        callStringFunction("jovian_builder_free", builder->getVoidTy(), {instance});
+                        return builder->getInt32(0);
+                    }
+
+                    if (isBytesPointer(instance->getType()))
+                    {
+                        builder->CreateCall(getIOFunction("jovian_bytes_free"), instance);
+                        return builder->getInt32(0);
+                    }
+
+                    if (isCStructPointer(instance->getType()))
+                    {
+                        builder->CreateCall(module->getFunction("free"),
+                                            builder->CreatePointerCast(instance, builder->getInt8Ty()->getPointerTo()));
+                        return builder->getInt32(0);
+                    }
+
+                    if (isMapPointer(instance->getType()))
+                    {
+                        builder->CreateCall(getMapFunction("jovian_map_free"),
+                                            builder->CreatePointerCast(instance, builder->getInt8Ty()->getPointerTo()));
+                        return builder->getInt32(0);
+                    }
+
+                    if (isGeneratorPointer(instance->getType()))
+                    {
+                        destroyGenerator(instance);
+                        return builder->getInt32(0);
+                    }
+
+                    if (!isClassPointer(instance->getType()))
+                    {
+                        DIE << "[JovianVM]: delete expects a class instance, an array or a string";
+                    }
+
+                    if (options.memory == MemoryMode::Malloc)
+                    {
+                        auto cls = (llvm::StructType *)(instance->getType()->getContainedType(0));
+
+                        // Region objects are freed with their region:
+                        if (usesRegions)
+                        {
+                            auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+                            auto owned = builder->CreateCall(module->getFunction("jovian_region_owns"),
+                                                             builder->CreatePointerCast(instance, bytePtrTy));
+
+                            auto freeBlock = createBB("delete_free", fn);
+                            auto deleteEndBlock = createBB("delete_end", fn);
+
+                            builder->CreateCondBr(builder->CreateIsNull(owned), freeBlock, deleteEndBlock);
+
+                            builder->SetInsertPoint(freeBlock);
+                            poolFree(instance, getTypeSize(cls));
+                            builder->CreateBr(deleteEndBlock);
+
+                            builder->SetInsertPoint(deleteEndBlock);
+                        }
+                        else
+                        {
+                            poolFree(instance, getTypeSize(cls));
+                        }
+                    }
+
+                    releaseValue(instance);
+
+                    return builder->getInt32(0);
+                }
+
+                // --------------------------------------------
+                // Arrays:
+
+                /**
+                 * (array <type> <length>)
+                 *
+                 * Creates a zero-initialized, growable array.
+                 */
+                else if (op == "array")
+                {
+                    auto elementTy = getTypeFromExp(exp.list[1]);
+                    auto length = gen(exp.list[2], env);
+
+                    return createArray(elementTy, length);
+                }
+
+                /**
+                 * (aref <array> <index>), also of bytes.
+                 */
+                else if (op == "aref")
+                {
+                    auto checked = !isCheckedIndex(exp, env);
+                    auto array = gen(exp.list[1], env);
+                    auto index = gen(exp.list[2], env);
+
+                    if (isBytesPointer(array->getType()))
+                    {
+                        return loadByte(array, index, checked);
+                    }
+
+                    auto address = arrayElementAddress(array, index, checked);
+                    auto elementTy = getArrayElementType(array->getType());
+
+                    auto element = builder->CreateLoad(elementTy, address, "elem");
+                    element->setMetadata(llvm::LLVMContext::MD_tbaa, getArrayTBAATag(elementTy));
+
+                    return retainValue(element);
+                }
+
+                /**
+                 * (aset <array> <index> <value>)
+                 */
+                else if (op == "aset")
+                {
+                    auto checked = !isCheckedIndex(exp, env);
+                    auto array = checkMutableArray(gen(exp.list[1], env));
+                    auto index = gen(exp.list[2], env);
+                    auto value = gen(exp.list[3], env);
+
+                    auto address = arrayElementAddress(array, index, checked);
+                    auto elementTy = getArrayElementType(array->getType());
+
+                    value = coerceValue(value, elementTy);
+
+                    auto store = storeValue(value, address);
+                    llvm::cast<llvm::Instruction>(store)->setMetadata(llvm::LLVMContext::MD_tbaa,
+                                                                      getArrayTBAATag(elementTy));
+
+                    return retainValue(value);
+                }
+
+                /**
+                 * (len <array>)
+                 */
+                else if (op == "len")
+                {
+                    auto array = gen(exp.list[1], env);
+
+                    if (isStringPointer(array->getType()))
+                    {
+                        return builder->CreateTrunc(getStringData(array).second, builder->getInt32Ty(), "len");
+                    }
+
+                    if (isBytesPointer(array->getType()))
+                    {
+                        return builder->CreateTrunc(loadBytesField(array, BYTES_LENGTH_INDEX, "len"),
+                                                    builder->getInt32Ty(), "len");
+                    }
+
+                    if (isMapPointer(array->getType()))
+                    {
+                        auto size = builder->CreateCall(getMapFunction("jovian_map_size"),
+                                                        builder->CreatePointerCast(array, builder->getInt8Ty()->getPointerTo()));
+                        return builder->CreateTrunc(size, builder->getInt32Ty(), "len");
+                    }
+
+                    return builder->CreateTrunc(loadArrayField(array, ARRAY_LENGTH_INDEX, "len"),
+                                                builder->getInt32Ty(), "len");
+                }
+
+                /**
+                 * (push <array> <value>)
+                 *
+                 * Appends a value, growing the storage by doubling.
+                 * Returns the new length.
+                 */
+                else if (op == "push")
+                {
+                    auto array = checkMutableArray(gen(exp.list[1], env));
+                    auto value = gen(exp.list[2], env);
+
+                    return pushArray(array, value);
+                }
+
+                // --------------------------------------------
+                // Vectors:
+                //
+                // SIMD types <element>x<lanes>: i32x8, f64x4, ... Math
+                // operations are element-wise, with scalars splat to all
+                // lanes; compares give masks, (< a b) : <lanes x i1>.
+
+                /**
+                 * (vec <type> <value>): all lanes set to the value.
+                 * (vec <type> <lane 0> ... <lane N-1>)
+                 */
+                else if (op == "vec")
+                {
+                    auto vectorTy = getVectorType(getTypeFromExp(exp.list[1]));
+                    auto lanes = vectorTy->getNumElements();
+
+                    if (exp.list.size() == 3)
+                    {
+                        return coerceValue(gen(exp.list[2], env), vectorTy);
+                    }
+
+                    if (exp.list.size() != lanes + 2)
+                    {
+                        DIE << "[JovianVM]: vec of " << getTypeName(vectorTy) << " needs 1 or " << lanes << " values";
+                    }
+
+                    llvm::Value *vector = llvm::UndefValue::get(vectorTy);
+
+                    for (auto i = 0; i < lanes; i++)
+                    {
+                        auto value = coerceValue(gen(exp.list[i + 2], env), vectorTy->getElementType());
+                        vector = builder->CreateInsertElement(vector, value, (uint64_t)i, "vec");
+                    }
+
+                    return vector;
+                }
+
+                /**
+                 * (lane <vector> <index>)
+                 */
+                else if (op == "lane")
+                {
+                    auto vector = gen(exp.list[1], env);
+                    getVectorType(vector->getType());
+
+                    return builder->CreateExtractElement(vector, gen(exp.list[2], env), "lane");
+                }
+
+                /**
+                 * (with-lane <vector> <index> <value>): copy with one lane replaced.
+                 */
+                else if (op == "with-lane")
+                {
+                    auto vector = gen(exp.list[1], env);
+                    auto vectorTy = getVectorType(vector->getType());
+                    auto index = gen(exp.list[2], env);
+                    auto value = coerceValue(gen(exp.list[3], env), vectorTy->getElementType());
+
+                    return builder->CreateInsertElement(vector, value, index, "vec");
+                }
+
+                /**
+                 * (shuffle <vector> [<vector>] (<lane> ...))
+                 *
+                 * Lanes picked by constant indices, those of the second
+                 * vector following the first. The result has as many
+                 * lanes as indices.
+                 */
+                else if (op == "shuffle")
+                {
+                    auto &indices = exp.list.back();
+
+                    if (exp.list.size() < 3 || exp.list.size() > 4 || indices.type != ExpType::LIST)
+                    {
+                        DIE << "[JovianVM]: expected (shuffle <vector> [<vector>] (<lane> ...))";
+                    }
+
+                    auto vector1 = gen(exp.list[1], env);
+                    auto vectorTy = getVectorType(vector1->getType());
+
+                    auto vector2 = exp.list.size() == 4 ? coerceValue(gen(exp.list[2], env), vectorTy)
+                                                        : llvm::PoisonValue::get(vectorTy);
+
+                    auto maxLane = vectorTy->getNumElements() * (exp.list.size() == 4 ? 2 : 1);
+
+                    std::vector<int> mask;
+                    for (auto &index : indices.list)
+                    {
+                        if (index.type != ExpType::NUMBER || index.number < 0 || index.number >= maxLane)
+                        {
+                            DIE << "[JovianVM]: shuffle lanes must be literals in [0, " << maxLane << ")";
+                        }
+                        mask.push_back(index.number);
+                    }
+
+                    return builder->CreateShuffleVector(vector1, vector2, mask, "shuffle");
+                }
+
+                /**
+                 * (select <mask> <a> <b>): lanes of a where the mask is set,
+                 * else of b. A scalar condition picks a or b.
+                 */
+                else if (op == "select")
+                {
+                    auto mask = gen(exp.list[1], env);
+                    auto a = gen(exp.list[2], env);
+                    auto b = gen(exp.list[3], env);
+
+                    auto valueTy = unifiedType(a->getType(), b->getType());
+
+                    return builder->CreateSelect(mask, coerceValue(a, valueTy), coerceValue(b, valueTy), "select");
+                }
+
+                /**
+                 * Horizontal reductions of a vector to a scalar:
+                 *
+                 *   (reduce-add <vector>), (reduce-mul ...), (reduce-min ...),
+                 *   (reduce-max ...), and of masks: (any <mask>), (all <mask>)
+                 *
+                 * Floating point sums and products are reassociated.
+                 */
+                else if (op == "reduce-add" || op == "reduce-mul" || op == "reduce-min" || op == "reduce-max" ||
+                         op == "any" || op == "all")
+                {
+                    auto vector = gen(exp.list[1], env);
+                    auto elementTy = getVectorType(vector->getType())->getElementType();
+                    auto isFloat = elementTy->isFloatingPointTy();
+
+                    if ((op == "any" || op == "all") != elementTy->isIntegerTy(1))
+                    {
+                        DIE << "[JovianVM]: " << op << " of " << getTypeName(vector->getType());
+                    }
+
+                    return genReduction(op, vector, isFloat);
+                }
+
+                /**
+                 * (vmask <type> <count>): mask of the first count lanes.
+                 */
+                else if (op == "vmask")
+                {
+                    auto vectorTy = getVectorType(getTypeFromExp(exp.list[1]));
+                    auto count = coerceValue(gen(exp.list[2], env), builder->getInt64Ty());
+
+                    return builder->CreateICmpSLT(getLaneIndices(vectorTy->getNumElements()),
+                                                  coerceValue(count, getLaneIndices(vectorTy->getNumElements())->getType()),
+                                                  "vmask");
+                }
+
+                /**
+                 * (vload <type> <array> <index> [<mask>])
+                 *
+                 * Loads the lanes from consecutive elements starting at
+                 * index. With a mask only the lanes set are loaded (others
+                 * are zero), so a mask keeps the tail of an array in bounds.
+                 */
+                else if (op == "vload")
+                {
+                    auto vectorTy = getVectorType(getTypeFromExp(exp.list[1]));
+                    auto array = gen(exp.list[2], env);
+                    auto index = gen(exp.list[3], env);
+                    auto mask = exp.list.size() > 4 ? gen(exp.list[4], env) : nullptr;
+
+                    auto address = arrayVectorAddress(array, index, vectorTy, mask);
+                    auto align = llvm::Align(getTypeSize(vectorTy->getElementType()));
+
+                    llvm::Instruction *load = mask != nullptr
+                        ? (llvm::Instruction *)builder->CreateMaskedLoad(vectorTy, address, align, mask,
+                                                    llvm::Constant::getNullValue(vectorTy), "vload")
+                        : builder->CreateAlignedLoad(vectorTy, address, align, "vload");
+
+                    load->setMetadata(llvm::LLVMContext::MD_tbaa, getArrayTBAATag(vectorTy->getElementType()));
+
+                    return load;
+                }
+
+                /**
+                 * (vstore <array> <index> <vector> [<mask>])
+                 */
+                else if (op == "vstore")
+                {
+                    auto array = gen(exp.list[1], env);
+                    auto index = gen(exp.list[2], env);
+                    auto vector = gen(exp.list[3], env);
+                    auto mask = exp.list.size() > 4 ? gen(exp.list[4], env) : nullptr;
+
+                    auto vectorTy = getVectorType(vector->getType());
+                    auto address = arrayVectorAddress(array, index, vectorTy, mask);
+                    auto align = llvm::Align(getTypeSize(vectorTy->getElementType()));
+
+                    llvm::Instruction *store = mask != nullptr
+                        ? (llvm::Instruction *)builder->CreateMaskedStore(vector, address, align, mask)
+                        : builder->CreateAlignedStore(vector, address, align);
+
+                    store->setMetadata(llvm::LLVMContext::MD_tbaa, getArrayTBAATag(vectorTy->getElementType()));
+
+                    return vector;
+                }
+
+                // --------------------------------------------
+                // Maps:
+
+                /**
+                 * (map <key type> <value type>)
+                 *
+                 * Creates an empty hash map. Keys are number, int64 or
+                 * string (not copied), values any type of up to 8 bytes.
+                 */
+                else if (op == "map")
+                {
+                    auto mapTy = getMapType(getTypeFromExp(exp.list[1]), getTypeFromExp(exp.list[2]));
+                    auto keyKind = isStringPointer(getMapKeyType(mapTy->getPointerTo())) ? MAP_KEY_STRING : MAP_KEY_INT;
+
+                    auto map = builder->CreateCall(getMapFunction("jovian_map_new"), builder->getInt32(keyKind));
+                    return builder->CreatePointerCast(map, mapTy->getPointerTo(), "map");
+                }
+
+                /**
+                 * (get <map> <key> [<default>])
+                 *
+                 * The default of an absent key is zero (null).
+                 */
+                else if (op == "get")
+                {
+                    auto map = gen(exp.list[1], env);
+                    auto key = gen(exp.list[2], env);
+                    auto valueTy = getMapValueType(map->getType());
+
+                    auto valueSlot = callMapKeyFunction("find", map, key);
+
+                    auto loadBlock = createBB("map_load", fn);
+                    auto defaultBlock = createBB("map_default", fn);
+                    auto getEndBlock = createBB("map_get_end", fn);
+
+                    builder->CreateCondBr(builder->CreateIsNull(valueSlot), defaultBlock, loadBlock);
+
+                    builder->SetInsertPoint(loadBlock);
+                    auto value = builder->CreateLoad(
+                        valueTy, builder->CreatePointerCast(valueSlot, valueTy->getPointerTo()), "value");
+                    builder->CreateBr(getEndBlock);
+
+                    builder->SetInsertPoint(defaultBlock);
+                    llvm::Value *defaultValue = llvm::Constant::getNullValue(valueTy);
+                    if (exp.list.size() > 3)
+                    {
+                        defaultValue = coerceValue(gen(exp.list[3], env), valueTy);
+                    }
+                    defaultBlock = builder->GetInsertBlock();
+                    builder->CreateBr(getEndBlock);
+
+                    builder->SetInsertPoint(getEndBlock);
+                    auto result = builder->CreatePHI(valueTy, 2, "get");
+                    result->addIncoming(value, loadBlock);
+                    result->addIncoming(defaultValue, defaultBlock);
+
+                    return result;
+                }
+
+                /**
+                 * (put <map> <key> <value>)
+                 */
+                else if (op == "put")
+                {
+                    auto map = gen(exp.list[1], env);
+                    auto key = gen(exp.list[2], env);
+                    auto valueTy = getMapValueType(map->getType());
+                    auto value = coerceValue(gen(exp.list[3], env), valueTy);
+
+                    auto valueSlot = callMapKeyFunction("insert", map, key);
+                    builder->CreateStore(value, builder->CreatePointerCast(valueSlot, valueTy->getPointerTo()));
+
+                    return value;
+                }
+
+                /**
+                 * (has <map> <key>)
+                 */
+                else if (op == "has")
+                {
+                    auto map = gen(exp.list[1], env);
+                    auto key = gen(exp.list[2], env);
+
+                    return builder->CreateIsNotNull(callMapKeyFunction("find", map, key), "has");
+                }
+
+                /**
+                 * (remove <map> <key>): whether the key was present.
+                 */
+                else if (op == "remove")
+                {
+                    auto map = gen(exp.list[1], env);
+                    auto key = gen(exp.list[2], env);
+
+                    auto removed = callMapKeyFunction("remove", map, key);
+                    return builder->CreateICmpNE(removed, builder->getInt32(0), "removed");
+                }
+
+                /**
+                 * (map-keys <map>): array of the keys, in no particular order.
+                 */
+                else if (op == "map-keys")
+                {
+                    auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+                    auto map = gen(exp.list[1], env);
+                    auto keyTy = getMapKeyType(map->getType());
+                    map = builder->CreatePointerCast(map, bytePtrTy);
+
+                    auto size = builder->CreateCall(getMapFunction("jovian_map_size"), map);
+                    auto keys = createArray(keyTy, size);
+
+                    auto data = loadArrayField(keys, ARRAY_DATA_INDEX, "data");
+                    builder->CreateCall(getMapFunction("jovian_map_keys"),
+                                        {map, builder->CreatePointerCast(data, bytePtrTy),
+                                         builder->getInt64(getTypeSize(keyTy))});
+
+                    return keys;
+                }
+
+                // --------------------------------------------
+                // Tasks:
+
+                /**
+                 * (spawn <exp>)
+                 *
+                 * Evaluates the expression in a task of the work-stealing
+                 * runtime, returns a future of its value.
+                 */
+                else if (op == "spawn")
+                {
+                    return genSpawn(exp.list[1], env);
+                }
+
+                /**
+                 * (join <future>)
+                 *
+                 * Waits for the task (running other tasks meanwhile),
+                 * returns its value. A future is joined once.
+                 */
+                else if (op == "join")
+                {
+                    auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+                    auto future = gen(exp.list[1], env);
+                    auto resultTy = getFutureResultType(future->getType());
+
+                    auto entry = &fn->getEntryBlock();
+                    varsBuilder->SetInsertPoint(entry, entry->begin());
+                    auto resultSlot = varsBuilder->CreateAlloca(builder->getInt64Ty(), 0, "join_result");
+
+                    builder->CreateCall(getTaskFunction("jovian_join"),
+                                        {builder->CreatePointerCast(future, bytePtrTy),
+                                         builder->CreatePointerCast(resultSlot, bytePtrTy)});
+
+                    return builder->CreateLoad(
+                        resultTy, builder->CreatePointerCast(resultSlot, resultTy->getPointerTo()), "joined");
+                }
+
+                // --------------------------------------------
+                // Parallel algorithms:
+                //
+                // Run on the task workers, in chunks of at least <grain>
+                // indices (default: a few chunks per worker). Bodies are
+                // compiled into kernels which loop over a chunk, and see
+                // the local variables they use by value.
+
+                /**
+                 * (parallel-for (<var> <start> <end> [<grain>]) <body>)
+                 */
+                else if (op == "parallel-for")
+                {
+                    return genParallelFor(exp, env);
+                }
+
+                /**
+                 * (parallel-map (<var> <array> [<grain>]) <expression>)
+                 *
+                 * A new array of the values of the expression for each
+                 * element.
+                 */
+                else if (op == "parallel-map")
+                {
+                    return genParallelMap(exp, env);
+                }
+
+                /**
+                 * (parallel-reduce (<acc> <var> <array> [<grain>]) <init> <expression>)
+                 *
+                 * Folds the elements into <acc>, starting from <init>, by
+                 * the expression. Chunks are folded in parallel, then their
+                 * results by the same expression, so it must be associative
+                 * and <init> its identity.
+                 */
+                else if (op == "parallel-reduce")
+                {
+                    return genParallelReduce(exp, env);
+                }
+
+                /**
+                 * (parallel-sort <array>): sorts numbers ascending.
+                 * (prefix-sum <array>): inclusive prefix sums in place.
+                 */
+                else if (op == "parallel-sort" || op == "prefix-sum")
+                {
+                    checkTaskContext(op);
+
+                    auto array = gen(exp.list[1], env);
+                    auto elementTy = getArrayElementType(array->getType());
+
+                    auto kind = elementTy->isIntegerTy(32)   ? PARALLEL_KIND_I32
+                                : elementTy->isIntegerTy(64) ? PARALLEL_KIND_I64
+                                : elementTy->isFloatTy()     ? PARALLEL_KIND_F32
+                                : elementTy->isDoubleTy()    ? PARALLEL_KIND_F64
+                                                             : -1;
+                    if (kind < 0)
+                    {
+                        DIE << "[JovianVM]: " << op << " of an array of " << getTypeName(elementTy);
+                    }
+
+                    auto data = builder->CreatePointerCast(loadArrayField(array, ARRAY_DATA_INDEX, "data"),
+                                                           builder->getInt8Ty()->getPointerTo());
+                    auto length = loadArrayField(array, ARRAY_LENGTH_INDEX, "len");
+
+                    builder->CreateCall(
+                        getParallelFunction(op == "parallel-sort" ? "jovian_parallel_sort" : "jovian_prefix_sum"),
+                        {data, length, builder->getInt32(kind)});
+
+                    return array;
+                }
+
+                // --------------------------------------------
+                // Atomics:
+                //
+                // Operations on atomic fields, (var (<name> (atomic <type>)) ...)
+                // in the class body. Plain (prop ...) and (set (prop ...) ...)
+                // of an atomic field are seq_cst. The ordering argument is one
+                // of relaxed, acquire, release, acq_rel, seq_cst (default).
+
+                /**
+                 * (atomic-load <object> <field> [<ordering>])
+                 */
+                else if (op == "atomic-load")
+                {
+                    auto field = genAtomicField(exp, env);
+                    auto ordering = getAtomicOrdering(exp, 3);
+
+                    if (ordering == llvm::AtomicOrdering::Release || ordering == llvm::AtomicOrdering::AcquireRelease)
+                    {
+                        DIE << "[JovianVM]: atomic-load cannot have release ordering";
+                    }
+
+                    auto load = builder->CreateLoad(field.type, field.address, exp.list[2].string);
+                    load->setAtomic(ordering);
+                    releaseValue(field.instance);
+
+                    return retainValue(load);
+                }
+
+                /**
+                 * (atomic-store <object> <field> <value> [<ordering>])
+                 */
+                else if (op == "atomic-store")
+                {
+                    auto field = genAtomicField(exp, env);
+                    auto value = coerceValue(gen(exp.list[3], env), field.type);
+                    auto ordering = getAtomicOrdering(exp, 4);
+
+                    if (ordering == llvm::AtomicOrdering::Acquire || ordering == llvm::AtomicOrdering::AcquireRelease)
+                    {
+                        DIE << "[JovianVM]: atomic-store cannot have acquire ordering";
+                    }
+
+                    auto store = builder->CreateStore(value, field.address);
+                    store->setAtomic(ordering);
+                    genAtomicWriteBarrier(field, value);
+                    releaseValue(field.instance);
+
+                    return value;
+                }
+
+                /**
+                 * (cas <object> <field> <expected> <new> [<ordering>])
+                 *
+                 * Compare-and-swap: stores new if the field holds expected,
+                 * returns whether it did.
+                 */
+                else if (op == "cas")
+                {
+                    auto field = genAtomicField(exp, env);
+
+                    if (field.type->isFloatingPointTy())
+                    {
+                        DIE << "[JovianVM]: cas needs an integer or object field";
+                    }
+
+                    auto expected = coerceValue(gen(exp.list[3], env), field.type);
+                    auto desired = coerceValue(gen(exp.list[4], env), field.type);
+                    auto ordering = getAtomicOrdering(exp, 5);
+
+                    auto cmpXchg = builder->CreateAtomicCmpXchg(
+                        field.address, expected, desired, llvm::MaybeAlign(), ordering,
+                        llvm::AtomicCmpXchgInst::getStrongestFailureOrdering(ordering));
+
+                    genAtomicWriteBarrier(field, desired);
+                    releaseValue(field.instance);
+
+                    return builder->CreateExtractValue(cmpXchg, 1, "swapped");
+                }
+
+                /**
+                 * (fetch-add <object> <field> <value> [<ordering>])
+                 * (fetch-sub <object> <field> <value> [<ordering>])
+                 * (exchange <object> <field> <value> [<ordering>])
+                 *
+                 * Read-modify-write, returns the previous value.
+                 */
+                else if (op == "fetch-add" || op == "fetch-sub" || op == "exchange")
+                {
+                    auto field = genAtomicField(exp, env);
+                    auto value = coerceValue(gen(exp.list[3], env), field.type);
+                    auto ordering = getAtomicOrdering(exp, 4);
+
+                    auto isFloat = field.type->isFloatingPointTy();
+
+                    if (op != "exchange" && !field.type->isIntegerTy() && !isFloat)
+                    {
+                        DIE << "[JovianVM]: " << op << " needs a number field";
+                    }
+
+                    auto rmwOp = op == "exchange"    ? llvm::AtomicRMWInst::Xchg
+                                 : op == "fetch-add" ? (isFloat ? llvm::AtomicRMWInst::FAdd : llvm::AtomicRMWInst::Add)
+                                                     : (isFloat ? llvm::AtomicRMWInst::FSub : llvm::AtomicRMWInst::Sub);
+
+                    auto previous = builder->CreateAtomicRMW(rmwOp, field.address, value, llvm::MaybeAlign(), ordering);
+
+                    if (op == "exchange")
+                    {
+                        genAtomicWriteBarrier(field, value);
+                    }
+                    releaseValue(field.instance);
+
+                    return previous;
+                }
+
+                /**
+                 * (fence [<ordering>])
+                 */
+                else if (op == "fence")
+                {
+                    auto ordering = getAtomicOrdering(exp, 1);
+
+                    if (ordering == llvm::AtomicOrdering::Monotonic)
+                    {
+                        DIE << "[JovianVM]: fence cannot be relaxed";
+                    }
+
+                    builder->CreateFence(ordering);
+
+                    return builder->getInt32(0);
+                }
+
+                // --------------------------------------------
+                // Strings:
+
+                /**
+                 * (str-concat <a> <b>)
+                 */
+                else if (op == "str-concat")
+                {
+                    auto a = genString(exp.list[1], env);
+                    auto b = genString(exp.list[2], env);
+
+                    return callStringFunction("jovian_string_concat", getStringType()->getPointerTo(), {a, b});
+                }
+
+                /**
+                 * (str-sub <s> <start> <count>)
+                 */
+                else if (op == "str-sub")
+                {
+                    auto s = genString(exp.list[1], env);
+                    auto start = coerceValue(gen(exp.list[2], env), builder->getInt64Ty());
+                    auto count = coerceValue(gen(exp.list[3], env), builder->getInt64Ty());
+
+                    return callStringFunction("jovian_string_sub", getStringType()->getPointerTo(), {s, start, count});
+                }
+
+                /**
+                 * (str-find <s> <needle>): index of needle in s, or -1.
+                 */
+                else if (op == "str-find")
+                {
+                    auto s = genString(exp.list[1], env);
+                    auto needle = genString(exp.list[2], env);
+
+                    auto index = callStringFunction("jovian_string_find", builder->getInt64Ty(), {s, needle});
+                    return builder->CreateTrunc(index, builder->getInt32Ty(), "index");
+                }
+
+                /**
+                 * (str-char <s> <index>): byte at index.
+                 */
+                else if (op == "str-char")
+                {
+                    auto s = genString(exp.list[1], env);
+                    auto index = coerceValue(gen(exp.list[2], env), builder->getInt64Ty());
+
+                    return callStringFunction("jovian_string_char_at", builder->getInt32Ty(), {s, index});
+                }
+
+                /**
+                 * (str-hash <s>): int64 hash of the characters.
+                 */
+                else if (op == "str-hash")
+                {
+                    auto s = genString(exp.list[1], env);
+
+                    return callStringFunction("jovian_string_hash", builder->getInt64Ty(), {s});
+                }
+
+                /**
+                 * (str-builder)
+                 *
+                 * Builds a string by appends in amortized O(1).
+                 */
+                else if (op == "str-builder")
+                {
+                    return callStringFunction("jovian_builder_new", getStringBuilderType()->getPointerTo(), {});
+                }
+
+                /**
+                 * (str-append <builder> <string or integer>)
+                 */
+                else if (op == "str-append")
+                {
+                    auto stringBuilder = gen(exp.list[1], env);
+                    auto value = gen(exp.list[2], env);
+
+                    if (stringBuilder->getType() != getStringBuilderType()->getPointerTo())
+                    {
+                        DIE << "[JovianVM]: str-append expects a string builder";
+                    }
+
+                    if (value->getType()->isIntegerTy())
+                    {
+                        callStringFunction("jovian_builder_append_int", builder->getVoidTy(),
+                                           {stringBuilder, coerceValue(value, builder->getInt64Ty())});
+                    }
+                    else if (isStringPointer(value->getType()))
+                    {
+                        callStringFunction("jovian_builder_append", builder->getVoidTy(), {stringBuilder, value});
+                    }
+                    else
+                    {
+                        DIE << "[JovianVM]: str-append expects a string or an integer";
+                    }
+
+                    return builder->getInt32(0);
+                }
+
+                /**
+                 * (str-build <builder>)
+                 */
+                else if (op == "str-build")
+                {
+                    auto stringBuilder = gen(exp.list[1], env);
+
+                    return callStringFunction("jovian_builder_build", getStringType()->getPointerTo(), {stringBuilder});
+                }
+
+                // --------------------------------------------
+                // Input and output:
+
+                /**
+                 * (read-file <path>), (read-stdin)
+                 *
+                 * The contents as bytes: read with (aref ...), (len ...)
+                 * and (for-lines ...) without copies. Regular files are
+                 * memory-mapped until deleted.
+                 */
+                else if (op == "read-file")
+                {
+                    auto path = getStringData(genString(exp.list[1], env)).first;
+
+                    return builder->CreateCall(getIOFunction("jovian_read_file"), path, "bytes");
+                }
+
+                else if (op == "read-stdin")
+                {
+                    return builder->CreateCall(getIOFunction("jovian_read_stdin"), {}, "bytes");
+                }
+
+                /**
+                 * (for-lines (<var> <bytes>) <body>)
+                 *
+                 * Runs the body for each line, without its newline. The
+                 * line is a view into the bytes, valid in its iteration.
+                 */
+                else if (op == "for-lines")
+                {
+                    auto &header = exp.list[1];
+                    auto &body = exp.list[2];
+
+                    if (header.type != ExpType::LIST || header.list.size() != 2 ||
+                        header.list[0].type != ExpType::SYMBOL)
+                    {
+                        DIE << "[JovianVM]: expected (for-lines (<var> <bytes>) ...)";
+                    }
+
+                    auto &varName = header.list[0].string;
+
+                    if (isAssigned(body, varName))
+                    {
+                        DIE << "[JovianVM]: loop variable " << varName << " is assigned in the loop body";
+                    }
+
+                    auto source = gen(header.list[1], env);
+
+                    if (!isBytesPointer(source->getType()))
+                    {
+                        DIE << "[JovianVM]: for-lines expects bytes";
+                    }
+
+                    auto entry = &fn->getEntryBlock();
+                    varsBuilder->SetInsertPoint(entry, entry->begin());
+                    auto pos = varsBuilder->CreateAlloca(builder->getInt64Ty(), 0, "line_pos");
+                    auto line = varsBuilder->CreateAlloca(getBytesType(), 0, varName);
+
+                    builder->CreateStore(builder->getInt64(0), pos);
+
+                    auto condBlock = createBB("lines_cond", fn);
+                    auto bodyBlock = createBB("lines_body");
+                    auto loopEndBlock = createBB("lines_end");
+
+                    builder->CreateBr(condBlock);
+
+                    builder->SetInsertPoint(condBlock);
+                    auto hasLine = builder->CreateCall(getIOFunction("jovian_next_line"), {source, pos, line});
+                    builder->CreateCondBr(builder->CreateICmpNE(hasLine, builder->getInt32(0)), bodyBlock, loopEndBlock);
+
+                    invalidateCheckedIndices(exp, env);
+                    auto prevCheckedIndices = checkedIndices;
+
+                    fn->getBasicBlockList().push_back(bodyBlock);
+                    builder->SetInsertPoint(bodyBlock);
+
+                    auto loopEnv =
+                        std::make_shared<Environment>(std::map<std::string, llvm::Value *>{{varName, line}}, env);
+
+                    genLoopBody(body, loopEnv, condBlock, loopEndBlock);
+                    builder->CreateBr(condBlock);
+
+                    checkedIndices = prevCheckedIndices;
+
+                    fn->getBasicBlockList().push_back(loopEndBlock);
+                    builder->SetInsertPoint(loopEndBlock);
+
+                    return builder->getInt32(0);
+                }
+
+                /**
+                 * (bytes-string <bytes>): a string of a copy of the bytes.
+                 */
+                else if (op == "bytes-string")
+                {
+                    auto bytes = gen(exp.list[1], env);
+
+                    if (!isBytesPointer(bytes->getType()))
+                    {
+                        DIE << "[JovianVM]: bytes-string expects bytes";
+                    }
+
+                    return builder->CreateCall(getIOFunction("jovian_bytes_string"), bytes, "str");
+                }
+
+                /**
+                 * (parse-int <bytes or string>): int64 value of the leading
+                 * decimal digits, 0 if none.
+                 */
+                else if (op == "parse-int")
+                {
+                    auto data = getCharsData(gen(exp.list[1], env));
+
+                    return builder->CreateCall(getIOFunction("jovian_parse_int"), {data.first, data.second}, "int");
+                }
+
+                /**
+                 * (open-file <path> <mode>): descriptor of a file opened
+                 * for writing, mode "w" truncates, "a" appends.
+                 */
+                else if (op == "open-file")
+                {
+                    auto path = getStringData(genString(exp.list[1], env)).first;
+                    auto mode = getStringData(genString(exp.list[2], env)).first;
+
+                    return builder->CreateCall(getIOFunction("jovian_open"), {path, mode}, "fd");
+                }
+
+                /**
+                 * (write <fd> <string or bytes>)
+                 *
+                 * Buffered write. Standard output (1) shares the buffer
+                 * of printf, so both stay in order.
+                 */
+                else if (op == "write")
+                {
+                    auto fd = coerceValue(gen(exp.list[1], env), builder->getInt32Ty());
+                    auto data = getCharsData(gen(exp.list[2], env));
+
+                    auto stdoutBlock = createBB("write_stdout", fn);
+                    auto fdBlock = createBB("write_fd", fn);
+                    auto writeEndBlock = createBB("write_end", fn);
+
+                    builder->CreateCondBr(builder->CreateICmpEQ(fd, builder->getInt32(1)), stdoutBlock, fdBlock);
+
+                    builder->SetInsertPoint(stdoutBlock);
+                    builder->CreateCall(getPrintFunction("jovian_print_chars"), {data.first, data.second});
+                    builder->CreateBr(writeEndBlock);
+
+                    builder->SetInsertPoint(fdBlock);
+                    builder->CreateCall(getIOFunction("jovian_write"), {fd, data.first, data.second});
+                    builder->CreateBr(writeEndBlock);
+
+                    builder->SetInsertPoint(writeEndBlock);
+
+                    return builder->getInt32(0);
+                }
+
+                /**
+                 * (close-file <fd>): flushes buffered writes and closes.
+                 */
+                else if (op == "close-file")
+                {
+                    auto fd = coerceValue(gen(exp.list[1], env), builder->getInt32Ty());
+                    builder->CreateCall(getIOFunction("jovian_close"), fd);
+
+                    return builder->getInt32(0);
+                }
+
+                /**
+                 * (argc), (argv <index>): command line arguments, the
+                 * program path first.
+                 */
+                else if (op == "argc")
+                {
+                    return builder->CreateLoad(builder->getInt32Ty(), getArgsGlobal("jovian_argc"), "argc");
+                }
+
+                else if (op == "argv")
+                {
+                    auto int64Ty = builder->getInt64Ty();
+                    auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+
+                    auto index = coerceValue(gen(exp.list[1], env), int64Ty);
+                    auto argc = builder->CreateLoad(builder->getInt32Ty(), getArgsGlobal("jovian_argc"), "argc");
+                    auto argc64 = builder->CreateZExt(argc, int64Ty);
+
+                    genBoundsCheck(builder->CreateICmpULT(index, argc64), index, argc64);
+
+                    auto argv = builder->CreateLoad(bytePtrTy->getPointerTo(), getArgsGlobal("jovian_argv"), "argv");
+                    auto arg = builder->CreateLoad(bytePtrTy, builder->CreateInBoundsGEP(bytePtrTy, argv, index), "arg");
+
+                    auto strlenFn = module->getOrInsertFunction("strlen", llvm::FunctionType::get(int64Ty, bytePtrTy, false));
+                    auto length = builder->CreateCall(strlenFn, arg, "length");
+
+                    return callStringFunction("jovian_string_new", getStringType()->getPointerTo(), {arg, length});
+                }
+
+                else if (op == "printf")
+                {
+                    std::vector<FormatPart> format;
+
+                    // Literal formats are parsed at compile time:
+                    if (exp.list[1].type == ExpType::STRING && parseFormat(exp, format))
+                    {
+                        return genFormattedPrint(exp, format, env);
+                    }
+
+                    auto printFn = module->getFunction("printf");
+
+                    // Buffered output goes first:
+                    builder->CreateCall(getPrintFunction("jovian_print_flush"));
+
+                    std::vector<llvm::Value*> args{};
+
+                    for (auto i = 1; i < exp.list.size(); i++)
+                    {
+                        args.push_back(promoteVarArg(gen(exp.list[i], env)));
+                    }
+
+                    auto result = builder->CreateCall(printFn, args);
+                    releaseValues(args);
+
+                    return result;
+                }
+
+                else if (op == "class")
+                {
+                    auto name = exp.list[1].string;
+
+                    // Generic class: (class <name><T>... <parent> <body>)
+                    if (isGenericName(name) && !isInstanceName(name))
+                    {
+                        declareGeneric(genericClasses_, exp, env);
+                        return builder->getInt32(0);
+                    }
+
+                    auto parent = exp.list[2].string == "null"
+                                      ? nullptr
+                                      : getClassByName(exp.list[2].string);
+
+                    cls = llvm::StructType::create(*ctx, name);
+
+                    if (parent != nullptr)
+                    {
+                        inheritClass(cls, parent);
+                    }
+                    else
+                    {
+                        classMap_[name] = {cls, parent, {}, {}};
+                    }
+
+                    buildClassInfo(cls, exp, env);
+
+                    gen(exp.list[3], env);
+
+                    cls = nullptr;
+
+                    return builder->getInt32(0);
+                }
+
+                else if (op == "new")
+                {
+                    if (exp.list[1].type == ExpType::SYMBOL && cStructs_.count(exp.list[1].string) != 0)
+                    {
+                        auto structTy = cStructs_[exp.list[1].string].structTy;
+                        auto memory = builder->CreateCall(module->getFunction("calloc"),
+                                                          {builder->getInt64(1), builder->getInt64(getTypeSize(structTy))});
+
+                        return builder->CreatePointerCast(memory, structTy->getPointerTo(), exp.list[1].string);
+                    }
+
+                    return createInstance(exp, env, "");
+                }
+
+                else if (op == "prop")
+                {
+                    auto instance = gen(exp.list[1], env);
+                    auto fieldName = exp.list[2].string;
+                    auto ptrName = std::string("p") + fieldName;
+
+                    if (isCStructPointer(instance->getType()))
+                    {
+                        auto address = cStructFieldAddress(instance, fieldName);
+                        return builder->CreateLoad(address->getType()->getPointerElementType(), address, fieldName);
+                    }
+
+                    auto cls = (llvm::StructType*)(instance->getType()->getContainedType(0));
+                    auto fieldIdx = getFieldIndex(cls, fieldName);
+
+                    auto address = builder->CreateStructGEP(cls, instance, fieldIdx, ptrName);
+
+                    auto load = builder->CreateLoad(cls->getElementType(fieldIdx), address, fieldName);
+
+                    if (isAtomicField(cls, fieldName))
+                    {
+                        load->setAtomic(llvm::AtomicOrdering::SequentiallyConsistent);
+                    }
+
+                    auto value = retainValue(load);
+                    releaseValue(instance);
+
+                    return value;
+                }
+
+                else if(op == "method") {
+                    auto methodName = exp.list[2].string;
+
+                    llvm::StructType* cls;
+                    llvm::Value* vTable;
+                    llvm::StructType* vTableTy;
+
+                    if(isSuper(exp.list[1])) {
+                        auto className = exp.list[1].list[1].string;
+                        cls = classMap_[className].parent;
+                        auto parentName = std::string{cls->getName().data()};
+
+                        vTable = module->getNamedGlobal(parentName + "_vTable");
+                        vTableTy = llvm::StructType::getTypeByName(*ctx, parentName + "_vTable");
+                    } else {
+                        auto instance = gen(exp.list[1], env);
+                        cls = (llvm::StructType*) (instance->getType()->getContainedType(0));
+                        auto vTableAddr = builder->CreateStructGEP(cls, instance, VTABLE_INDEX);
+
+                        vTable = builder->CreateLoad(cls->getElementType(VTABLE_INDEX), vTableAddr, "vt");
+                        releaseValue(instance);
+
+                        vTableTy = (llvm::StructType*)(vTable->getType()->getContainedType(0));
+                    }
+
+                    auto methodIdx = getMethodIndex(cls, methodName);
+
+                    auto methodTy= (llvm::FunctionType*) vTableTy->getElementType(methodIdx);
+
+                    auto methodAddr = builder->CreateStructGEP(vTableTy, vTable, methodIdx);
+
+                    return builder->CreateLoad(methodTy, methodAddr);
+                }
+
+                else
+                {
+                    // Pure function with constant arguments:
+                    if (auto constant = tryComptimeCall(exp, env))
+                    {
+                        return constant;
+                    }
+
+                    // Generic function, type arguments deduced from the arguments: (max a b)
+                    if (exp.list[0].type == ExpType::SYMBOL && genericFunctions_.count(exp.list[0].string) != 0 &&
+                        !env->isDefined(exp.list[0].string))
+                    {
+                        return genGenericCall(exp, env);
+                    }
+
+                    auto callable = gen(exp.list[0], env);
+                    auto callableTy = callable->getType()->getContainedType(0);
+                    
+                    std::vector<llvm::Value*> args{};
+                    auto argIdx = 0;
+
+                    if(callableTy->isStructTy()) {
+                        auto cls = (llvm::StructType*) callableTy;
+                        std::string className{cls->getName().data()};
+
+                        args.push_back(pinValue(callable));
+                        argIdx++;
+
+                        callable = module->getFunction(className + "___call__");
+                    }
+
+
+                    auto fn = (llvm::Function*) callable;
+
+                    if (exp.list.size() - 1 + argIdx < fn->arg_size() ||
+                        (exp.list.size() - 1 + argIdx > fn->arg_size() && !fn->isVarArg()))
+                    {
+                        DIE << "[JovianVM]: " << fn->getName().str() << " expects " << fn->arg_size() - argIdx
+                            << " arguments, got " << exp.list.size() - 1;
+                    }
+
+                    std::set<size_t> regionArgs;
+
+                    for (auto i = 1; i < exp.list.size(); i++)
+                    {
+                        auto argValue = gen(exp.list[i], env);
+
+                        if (isRegionArgument(exp.list[i], argValue, env))
+                        {
+                            regionArgs.insert(i);
+                        }
+
+                        // Variadic arguments of C functions:
+                        if (argIdx >= fn->arg_size())
+                        {
+                            args.push_back(promoteVarArg(coerceForeignValue(argValue, argValue->getType())));
+                            continue;
+                        }
+
+                        auto paramTy = fn->getArg(argIdx++)->getType();
+                        args.push_back(pinValue(coerceForeignValue(argValue, paramTy)));
+                    }
+
+                    checkRegionCallEscape(exp, regionArgs);
+                    unpinValues(args);
+
+                    if (tailCalls.count(&exp) != 0)
+                    {
+                        if (auto tailResult = genTailCall(fn->getFunctionType(), fn, args))
+                        {
+                            return tailResult;
+                        }
+                    }
+
+                    auto result = builder->CreateCall(fn, args);
+                    releaseValues(args);
+
+                    if (cStringFunctions_.count(fn) != 0)
+                    {
+                        return genStringFromC(result);
+                    }
+
+                    if (result->getType()->isVoidTy())
+                    {
+                        return builder->getInt32(0);
+                    }
+
+                    return result;
+                }
+            }
+
+            else {
+                auto loadedMethod = (llvm::LoadInst*) gen(exp.list[0], env);
+                auto fnTy = (llvm::FunctionType*) (loadedMethod->getPointerOperand()->getType()->getContainedType(0)->getContainedType(0));
+            
                 std::vector<llvm::Value*> args{};
+                std::set<size_t> regionArgs;
+
+                for(auto i = 1; i < exp.list.size(); i++) {
+                    auto argValue = gen(exp.list[i], env);
+
+                    if (isRegionArgument(exp.list[i], argValue, env))
+                    {
+                        regionArgs.insert(i);
+                    }
+
+                    auto paramTy = fnTy->getParamType(i -1);
+                    args.push_back(pinValue(coerceValue(argValue, paramTy)));
+                }
+
+                checkRegionCallEscape(exp, regionArgs, args.empty() ? nullptr : args[0]);
+                unpinValues(args);
+
+                if (tailCalls.count(&exp) != 0)
+                {
+                    if (auto tailResult = genTailCall(fnTy, loadedMethod, args))
+                    {
+                        return tailResult;
+                    }
+                }
+
+                auto result = builder->CreateCall(fnTy, loadedMethod, args);
+                releaseValues(args);
+
+                return result;
+            }
+        }
+
+        break;
+        }
+
+        return builder->getInt32(0);
+    }
+
+    /**
+     * Returns field index.
+     */
+    size_t getFieldIndex(llvm::StructType *cls, const std::string &fieldName)
+    {
+        auto fields = &classMap_[cls->getName().data()].fieldsMap;
+        auto it = fields->find(fieldName);
+        return std::distance(fields->begin(), it) + reservedFieldsCount();
+    }
+
+    /**
+     * Returns method index.
+     */
+    size_t getMethodIndex(llvm::StructType *cls, const std::string &methodName)
+    {
+        auto methods = &classMap_[cls->getName().data()].methodsMap;
+        auto it = methods->find(methodName);
+        return std::distance(methods->begin(), it) + reservedMethodsCount();
+    }
+
+    /**
+     * Creates an instance of a class.
+     */
+    llvm::Value *createInstance(const Exp &exp, Env env, const std::string &name)
+    {
+        auto className = exp.list[1].string;
+        auto cls = getClassByName(className);
+
+        if (cls == nullptr)
+        {
+            DIE << "[JovianVM]: Unknow class" << cls;
+        }
+
+        auto ctor = module->getFunction(className + "_constructor");
+
+        if (exp.list.size() - 1 != ctor->arg_size())
+        {
+            DIE << "[JovianVM]: " << className << " constructor expects " << ctor->arg_size() - 1
+                << " arguments, got " << exp.list.size() - 2;
+        }
+
+        // Arguments are evaluated before the allocation, which
+        // may trigger a collection in GC mode:
+        std::vector<llvm::Value *> args{nullptr};
+        std::set<size_t> regionArgs;
+
+        for (auto i = 2; i < exp.list.size(); i++)
+        {
+            auto argValue = gen(exp.list[i], env);
+
+            if (isRegionArgument(exp.list[i], argValue, env))
+            {
+                regionArgs.insert(i);
+            }
+
+            args.push_back(pinValue(coerceValue(argValue, ctor->getArg(i - 1)->getType())));
+        }
+
+        checkRegionCallEscape(exp, regionArgs);
+
+        // Instances which never escape the function live in its frame:
+        auto instance = localInstances.count(&exp) != 0 && canAllocaInstance(cls)
+                            ? allocaInstance(cls, name)
+                            : mallocInstance(cls, name);
+
+        args[0] = instance;
+        unpinValues(args);
+
+        releaseValue(builder->CreateCall(ctor, args));
+
+        if (options.heapProfile && !llvm::isa<llvm::AllocaInst>(instance))
+        {
+            profileAllocation(exp, cls);
+        }
+
+        args.erase(args.begin());
+        releaseValues(args);
+
+        return instance;
+    }
+
+    /**
+     * Heap profile: bumps the allocation count and bytes of a
+     * (new ...) site, sampling a stack trace every
+     * HEAP_PROFILE_SAMPLE_PERIOD allocations.
+     */
+    void profileAllocation(const Exp &exp, llvm::StructType *cls)
+    {
+        auto siteIdx = heapSites.size();
+        auto countersTy = llvm::StructType::get(builder->getInt64Ty(), builder->getInt64Ty());
+        auto counters = new llvm::GlobalVariable(*module, countersTy, false, llvm::GlobalVariable::InternalLinkage,
+                                                 llvm::Constant::getNullValue(countersTy),
+                                                 "jovian_heap_site_" + std::to_string(siteIdx));
+
+        heapSites.push_back({cls->getName().str(), fn->getName().str(), exp.line, counters});
+
+        auto count = builder->CreateAtomicRMW(llvm::AtomicRMWInst::Add, builder->CreateStructGEP(countersTy, counters, 0),
+                                              builder->getInt64(1), llvm::MaybeAlign(8),
+                                              llvm::AtomicOrdering::Monotonic);
+        builder->CreateAtomicRMW(llvm::AtomicRMWInst::Add, builder->CreateStructGEP(countersTy, counters, 1),
+                                 builder->getInt64(getTypeSize(cls)), llvm::MaybeAlign(8),
+                                 llvm::AtomicOrdering::Monotonic);
+
+        auto sampleBlock = createBB("heap_sample", fn);
+        auto profileEndBlock = createBB("heap_profile_end", fn);
+
+        auto sampled = builder->CreateAnd(count, builder->getInt64(HEAP_PROFILE_SAMPLE_PERIOD - 1));
+        builder->CreateCondBr(builder->CreateICmpEQ(sampled, builder->getInt64(0)), sampleBlock, profileEndBlock);
+
+        builder->SetInsertPoint(sampleBlock);
+        builder->CreateCall(module->getFunction("jovian_heap_profile_sample"), builder->getInt64(siteIdx));
+        builder->CreateBr(profileEndBlock);
+
+        builder->SetInsertPoint(profileEndBlock);
+    }
+
+    /**
+     * Heap profile: passes the site table to the runtime at the
+     * beginning of main. Each site is:
+     *
+     *   { i8* className, i8* function, i64 line, { i64 count, i64 bytes }* counters }
+     */
+    void registerHeapSites()
+    {
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+        auto siteTy = llvm::StructType::get(bytePtrTy, bytePtrTy, builder->getInt64Ty(), bytePtrTy);
+
+        auto mainFn = module->getFunction("main");
+        auto entry = &mainFn->getEntryBlock();
+        builder->SetInsertPoint(entry, entry->getFirstInsertionPt());
+
+        std::vector<llvm::Constant *> sites;
+
+        for (auto &site : heapSites)
+        {
+            sites.push_back(llvm::ConstantStruct::get(
+                siteTy, {builder->CreateGlobalStringPtr(site.className),
+                         builder->CreateGlobalStringPtr(site.function),
+                         builder->getInt64(site.line),
+                         llvm::ConstantExpr::getPointerCast(site.counters, bytePtrTy)}));
+        }
+
+        auto sitesTy = llvm::ArrayType::get(siteTy, sites.size());
+        auto sitesTable = new llvm::GlobalVariable(*module, sitesTy, true, llvm::GlobalVariable::InternalLinkage,
+                                                   llvm::ConstantArray::get(sitesTy, sites), "jovian_heap_sites");
+
+        builder->CreateCall(module->getFunction("jovian_heap_profile_init"),
+                            {builder->CreatePointerCast(sitesTable, bytePtrTy), builder->getInt64(sites.size())});
+    }
+
+    // --------------------------------------------
+    // Profile-guided optimization:
+
+    /**
+     * Name of the next branch of the current function in the profile:
+     * <function>:<form>:<index>. Both builds compile the same program,
+     * so names match.
+     */
+    std::string getProfileSiteName(const std::string &form)
+    {
+        auto fnName = fn->getName().str();
+        return fnName + ":" + form + ":" + std::to_string(profileBranchCounts_[fnName]++);
+    }
+
+    /**
+     * Profile: counters of a site, { i64 true, i64 false }. Function
+     * entries count in the first one.
+     */
+    llvm::GlobalVariable *createProfileSite(const std::string &name)
+    {
+        auto countersTy = llvm::ArrayType::get(builder->getInt64Ty(), 2);
+        auto counters = new llvm::GlobalVariable(*module, countersTy, false, llvm::GlobalVariable::InternalLinkage,
+                                                 llvm::Constant::getNullValue(countersTy),
+                                                 "jovian_profile_site_" + std::to_string(profileSites.size()));
+
+        profileSites.push_back({name, counters});
+        return counters;
+    }
+
+    /**
+     * Bumps a counter of a site. Not atomic: tasks running the same
+     * code may lose counts, which only makes the profile approximate.
+     */
+    void incrementProfileCounter(llvm::GlobalVariable *counters, llvm::Value *index)
+    {
+        auto counter = builder->CreateInBoundsGEP(counters->getValueType(), counters, {builder->getInt64(0), index});
+        auto count = builder->CreateLoad(builder->getInt64Ty(), counter);
+        builder->CreateStore(builder->CreateAdd(count, builder->getInt64(1)), counter);
+    }
+
+    /**
+     * Conditional branch of an (if ...), (cond ...) or loop: counted
+     * with --profile-generate, weighted by the counts with
+     * --profile-use, which guides block layout, inlining and
+     * unrolling.
+     */
+    void genProfiledCondBr(const std::string &form, llvm::Value *cond, llvm::BasicBlock *trueBlock,
+                           llvm::BasicBlock *falseBlock)
+    {
+        if (options.profileGenerate.empty() && options.profileUse.empty())
+        {
+            builder->CreateCondBr(cond, trueBlock, falseBlock);
+            return;
+        }
+
+        auto siteName = getProfileSiteName(form);
+
+        if (!options.profileGenerate.empty())
+        {
+            auto index = builder->CreateZExt(builder->CreateNot(cond), builder->getInt64Ty());
+            incrementProfileCounter(createProfileSite(siteName), index);
+        }
+
+        auto counts = profileCounts_.find(siteName);
+
+        if (counts == profileCounts_.end())
+        {
+            builder->CreateCondBr(cond, trueBlock, falseBlock);
+            return;
+        }
+
+        // Weights are 32 bits:
+        auto trueCount = counts->second.first;
+        auto falseCount = counts->second.second;
+
+        while (trueCount > UINT32_MAX || falseCount > UINT32_MAX)
+        {
+            trueCount >>= 1;
+            falseCount >>= 1;
+        }
+
+        builder->CreateCondBr(cond, trueBlock, falseBlock,
+                              llvm::MDBuilder(*ctx).createBranchWeights(trueCount, falseCount));
+    }
+
+    /**
+     * Function entry: counted with --profile-generate, the count is
+     * the entry count of the function with --profile-use.
+     */
+    void profileFunctionEntry(llvm::Function *fn)
+    {
+        auto fnName = fn->getName().str();
+
+        if (!options.profileGenerate.empty())
+        {
+            incrementProfileCounter(createProfileSite(fnName), builder->getInt64(0));
+        }
+
+        auto counts = profileCounts_.find(fnName);
+
+        if (counts != profileCounts_.end())
+        {
+            fn->setEntryCount(llvm::Function::ProfileCount(counts->second.first, llvm::Function::PCT_Real));
+        }
+    }
+
+    /**
+     * Reads a profile written by a --profile-generate build, lines:
+     *
+     *   <site> <true count> <false count>
+     */
+    void loadProfile(const std::string &path)
+    {
+        std::ifstream file(path);
+
+        if (!file)
+        {
+            DIE << "[JovianVM]: cannot read profile " << path;
+        }
+
+        std::string site;
+        uint64_t trueCount, falseCount;
+
+        while (file >> site >> trueCount >> falseCount)
+        {
+            profileCounts_[site] = {trueCount, falseCount};
+        }
+
+        if (!file.eof())
+        {
+            DIE << "[JovianVM]: malformed profile " << path << " after " << site;
+        }
+    }
+
+    /**
+     * Profile generate: passes the site table and the profile path to
+     * the runtime at the beginning of main. Each site is:
+     *
+     *   { i8* name, [2 x i64]* counters }
+     */
+    void registerProfileSites()
+    {
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+        auto siteTy = llvm::StructType::get(bytePtrTy, bytePtrTy);
+
+        auto mainFn = module->getFunction("main");
+        auto entry = &mainFn->getEntryBlock();
+        builder->SetInsertPoint(entry, entry->getFirstInsertionPt());
+
+        std::vector<llvm::Constant *> sites;
+
+        for (auto &site : profileSites)
+        {
+            sites.push_back(llvm::ConstantStruct::get(
+                siteTy, {builder->CreateGlobalStringPtr(site.name),
+                         llvm::ConstantExpr::getPointerCast(site.counters, bytePtrTy)}));
+        }
+
+        auto sitesTy = llvm::ArrayType::get(siteTy, sites.size());
+        auto sitesTable = new llvm::GlobalVariable(*module, sitesTy, true, llvm::GlobalVariable::InternalLinkage,
+                                                   llvm::ConstantArray::get(sitesTy, sites), "jovian_profile_sites");
+
+        builder->CreateCall(module->getFunction("jovian_profile_init"),
+                            {builder->CreatePointerCast(sitesTable, bytePtrTy), builder->getInt64(sites.size()),
+                             builder->CreateGlobalStringPtr(options.profileGenerate)});
+    }
+
+    /**
+     * Profile use: marks functions never entered cold and the most
+     * entered ones hot, which places them in .text.unlikely and
+     * .text.hot, and orders the module hot first, so the code run
+     * together is close.
+     */
+    void layoutProfiledFunctions()
+    {
+        std::vector<llvm::Function *> functions;
+        uint64_t maxCount = 0;
+
+        for (auto &function : *module)
+        {
+            if (!function.isDeclaration())
+            {
+                functions.push_back(&function);
+            }
+            if (auto count = function.getEntryCount())
+            {
+                maxCount = std::max(maxCount, count->getCount());
+            }
+        }
+
+        // Unprofiled functions rank between hot and cold ones:
+        auto rank = [&](llvm::Function *function) -> int64_t {
+            auto count = function->getEntryCount();
+            return count ? (count->getCount() == 0 ? -1 : (int64_t)count->getCount()) : 0;
+        };
+
+        std::stable_sort(functions.begin(), functions.end(),
+                         [&](llvm::Function *a, llvm::Function *b) { return rank(a) > rank(b); });
+
+        for (auto function : functions)
+        {
+            auto count = function->getEntryCount();
+
+            if (count && count->getCount() == 0)
+            {
+                function->addFnAttr(llvm::Attribute::Cold);
+                function->setSectionPrefix("unlikely");
+            }
+            else if (count && count->getCount() * PROFILE_HOT_FRACTION >= maxCount)
+            {
+                function->addFnAttr(llvm::Attribute::Hot);
+                function->setSectionPrefix("hot");
+            }
+
+            function->removeFromParent();
+            module->getFunctionList().push_back(function);
+        }
+    }
+
+    // --------------------------------------------
+    // Vectors:
+
+    /**
+     * SIMD type names: <i32|i64|f32|f64>x<lanes>, lanes a power
+     * of two up to 64. Null if the name is not a vector type.
+     */
+    llvm::FixedVectorType *getVectorTypeFromString(const std::string &type_)
+    {
+        static const std::regex vectorName("(i32|i64|f32|f64)x([0-9]+)");
+        std::smatch match;
+
+        if (!std::regex_match(type_, match, vectorName))
+        {
+            return nullptr;
+        }
+
+        auto lanes = std::stoul(match[2]);
+
+        if (lanes < 2 || lanes > 64 || (lanes & (lanes - 1)) != 0)
+        {
+            DIE << "[JovianVM]: vector lanes must be a power of two in [2, 64]: " << type_;
+        }
+
+        auto &element = match[1];
+        auto elementTy = element == "i32"   ? (llvm::Type *)builder->getInt32Ty()
+                         : element == "i64" ? (llvm::Type *)builder->getInt64Ty()
+                         : element == "f32" ? builder->getFloatTy()
+                                            : builder->getDoubleTy();
+
+        return llvm::FixedVectorType::get(elementTy, lanes);
+    }
+
+    llvm::FixedVectorType *getVectorType(llvm::Type *type_)
+    {
+        auto vectorTy = llvm::dyn_cast<llvm::FixedVectorType>(type_);
+
+        if (vectorTy == nullptr)
+        {
+            DIE << "[JovianVM]: expected a vector, got " << getTypeName(type_);
+        }
+
+        return vectorTy;
+    }
+
+    /**
+     * <0, 1, ..., lanes - 1> as i64.
+     */
+    llvm::Constant *getLaneIndices(unsigned lanes)
+    {
+        std::vector<llvm::Constant *> indices;
+        for (auto i = 0; i < lanes; i++)
+        {
+            indices.push_back(builder->getInt64(i));
+        }
+        return llvm::ConstantVector::get(indices);
+    }
+
+    /**
+     * Address of the elements of a vector access at an index. All
+     * lanes (or those of the mask) must be in bounds.
+     */
+    llvm::Value *arrayVectorAddress(llvm::Value *array, llvm::Value *index, llvm::FixedVectorType *vectorTy,
+                                    llvm::Value *mask)
+    {
+        auto elementTy = getArrayElementType(array->getType());
+
+        if (elementTy != vectorTy->getElementType())
+        {
+            DIE << "[JovianVM]: cannot access " << getTypeName(vectorTy) << " in an array of "
+                << getTypeName(elementTy);
+        }
+
+        auto lanes = vectorTy->getNumElements();
+        auto index64 = builder->CreateZExt(index, builder->getInt64Ty(), "idx");
+        auto length = loadArrayField(array, ARRAY_LENGTH_INDEX, "len");
+        auto lastIndex = builder->CreateAdd(index64, builder->getInt64(lanes - 1));
+
+        if (mask == nullptr)
+        {
+            // index < length && lanes <= length - index:
+            auto inBounds = builder->CreateAnd(
+                builder->CreateICmpULT(index64, length),
+                builder->CreateICmpULE(builder->getInt64(lanes), builder->CreateSub(length, index64)));
+
+            genBoundsCheck(inBounds, lastIndex, length);
+        }
+        else
+        {
+            if (mask->getType() != llvm::FixedVectorType::get(builder->getInt1Ty(), lanes))
+            {
+                DIE << "[JovianVM]: expected a mask of " << lanes << " lanes";
+            }
+
+            // No lane of the mask outside of the array:
+            auto laneIndices = builder->CreateAdd(builder->CreateVectorSplat(lanes, index64), getLaneIndices(lanes));
+            auto outside = builder->CreateICmpUGE(laneIndices, builder->CreateVectorSplat(lanes, length));
+
+            auto inBounds = builder->CreateNot(builder->CreateOrReduce(builder->CreateAnd(mask, outside)));
+
+            genBoundsCheck(inBounds, lastIndex, length);
+        }
+
+        auto data = loadArrayField(array, ARRAY_DATA_INDEX, "data");
+        auto address = builder->CreateInBoundsGEP(elementTy, data, index64, "paddr");
+
+        return builder->CreatePointerCast(address, vectorTy->getPointerTo());
+    }
+
+    /**
+     * Horizontal reduction, see (reduce-add ...).
+     */
+    llvm::Value *genReduction(const std::string &op, llvm::Value *vector, bool isFloat)
+    {
+        if (op == "any")
+        {
+            return builder->CreateOrReduce(vector);
+        }
+        if (op == "all")
+        {
+            return builder->CreateAndReduce(vector);
+        }
+
+        if (isFloat)
+        {
+            auto elementTy = vector->getType()->getScalarType();
+            llvm::CallInst *reduction = nullptr;
+
+            if (op == "reduce-add")
+            {
+                reduction = builder->CreateFAddReduce(llvm::ConstantFP::getNegativeZero(elementTy), vector);
+            }
+            else if (op == "reduce-mul")
+            {
+                reduction = builder->CreateFMulReduce(llvm::ConstantFP::get(elementTy, 1.0), vector);
+            }
+            else
+            {
+                return op == "reduce-min" ? builder->CreateFPMinReduce(vector) : builder->CreateFPMaxReduce(vector);
+            }
+
+            // In any order, as a tree of vector operations:
+            reduction->setHasAllowReassoc(true);
+            return reduction;
+        }
+
+        if (op == "reduce-add")
+        {
+            return builder->CreateAddReduce(vector);
+        }
+        if (op == "reduce-mul")
+        {
+            return builder->CreateMulReduce(vector);
+        }
+
+        return op == "reduce-min" ? builder->CreateIntMinReduce(vector, /* isSigned */ true)
+                                  : builder->CreateIntMaxReduce(vector, /* isSigned */ true);
+    }
+
+    // --------------------------------------------
+    // Maps:
+
+    /**
+     * Hash map type for key and value types, opaque to the compiled
+     * code, see src/runtime/map.c.
+     */
+    llvm::StructType *getMapType(llvm::Type *keyTy, llvm::Type *valueTy)
+    {
+        auto &mapTy = mapTypes_[{keyTy, valueTy}];
+
+        if (mapTy != nullptr)
+        {
+            return mapTy;
+        }
+
+        if (!keyTy->isIntegerTy(32) && !keyTy->isIntegerTy(64) && !isStringPointer(keyTy))
+        {
+            DIE << "[JovianVM]: map keys must be number, int64 or string";
+        }
+
+        if (getTypeSize(valueTy) > 8)
+        {
+            DIE << "[JovianVM]: map values must fit 8 bytes";
+        }
+
+        // Neither the collector nor reference counting see map values:
+        if (options.memory != MemoryMode::Malloc && isClassPointer(valueTy))
+        {
+            DIE << "[JovianVM]: maps of instances need --memory=malloc";
+        }
+
+        mapTy = llvm::StructType::create(*ctx, "map<" + getTypeName(keyTy) + ", " + getTypeName(valueTy) + ">");
+        mapElementTypes_[mapTy->getPointerTo()] = {keyTy, valueTy};
+
+        return mapTy;
+    }
+
+    bool isMapPointer(llvm::Type *type_)
+    {
+        return mapElementTypes_.count(type_) != 0;
+    }
+
+    llvm::Type *getMapKeyType(llvm::Type *mapPtrTy)
+    {
+        if (!isMapPointer(mapPtrTy))
+        {
+            DIE << "[JovianVM]: expected a map";
+        }
+        return mapElementTypes_[mapPtrTy].first;
+    }
+
+    llvm::Type *getMapValueType(llvm::Type *mapPtrTy)
+    {
+        if (!isMapPointer(mapPtrTy))
+        {
+            DIE << "[JovianVM]: expected a map";
+        }
+        return mapElementTypes_[mapPtrTy].second;
+    }
+
+    /**
+     * Key hash: integers are hashed inline (the same as hashInt of
+     * the runtime), strings by their cached runtime hash.
+     */
+    llvm::Value *hashMapKey(llvm::Value *key)
+    {
+        if (isStringPointer(key->getType()))
+        {
+            return callStringFunction("jovian_string_hash", builder->getInt64Ty(), {key});
+        }
+
+        auto hash = builder->CreateMul(key, builder->getInt64(0x9e3779b97f4a7c15ull));
+        return builder->CreateXor(hash, builder->CreateLShr(hash, 32), "hash");
+    }
+
+    /**
+     * Calls the find/insert/remove function of the map key kind:
+     *
+     *   i64* jovian_map_find_int(map, i64 key, i64 hash)
+     *   i64* jovian_map_insert_string(map, string* key, i64 hash)
+     *   ...
+     */
+    llvm::Value *callMapKeyFunction(const std::string &op, llvm::Value *map, llvm::Value *key)
+    {
+        auto keyTy = getMapKeyType(map->getType());
+        auto isStringKey = isStringPointer(keyTy);
+
+        // Integer keys are stored sign extended:
+        key = coerceValue(key, isStringKey ? keyTy : builder->getInt64Ty());
+
+        auto mapFn = getMapFunction("jovian_map_" + op + (isStringKey ? "_string" : "_int"));
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+
+        return builder->CreateCall(mapFn, {builder->CreatePointerCast(map, bytePtrTy),
+                                           builder->CreatePointerCast(key, mapFn->getArg(1)->getType()),
+                                           hashMapKey(key)});
+    }
+
+    /**
+     * Map runtime function, declared on first use. Maps are passed as i8*.
+     */
+    llvm::Function *getMapFunction(const std::string &name)
+    {
+        auto mapFn = module->getFunction(name);
+
+        if (mapFn != nullptr)
+        {
+            return mapFn;
+        }
+
+        auto int64Ty = builder->getInt64Ty();
+        auto int32Ty = builder->getInt32Ty();
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+        auto slotPtrTy = int64Ty->getPointerTo();
+        auto stringPtrTy = getStringType()->getPointerTo();
+
+        llvm::FunctionType *fnTy = nullptr;
+
+        if (name == "jovian_map_new")
+        {
+            fnTy = llvm::FunctionType::get(bytePtrTy, int32Ty, false);
+        }
+        else if (name == "jovian_map_free")
+        {
+            fnTy = llvm::FunctionType::get(builder->getVoidTy(), bytePtrTy, false);
+        }
+        else if (name == "jovian_map_size")
+        {
+            fnTy = llvm::FunctionType::get(int64Ty, bytePtrTy, false);
+        }
+        else if (name == "jovian_map_keys")
+        {
+            fnTy = llvm::FunctionType::get(builder->getVoidTy(), {bytePtrTy, bytePtrTy, int64Ty}, false);
+        }
+        else
+        {
+            // jovian_map_<op>_<int|string>:
+            auto op = name.substr(11, name.rfind('_') - 11);
+            auto keyTy = name.substr(name.rfind('_') + 1) == "string" ? (llvm::Type *)stringPtrTy : int64Ty;
+
+            fnTy = llvm::FunctionType::get(op == "remove" ? int32Ty : (llvm::Type *)slotPtrTy,
+                                           {bytePtrTy, keyTy, int64Ty}, false);
+        }
+
+        mapFn = llvm::Function::Create(fnTy, llvm::Function::ExternalLinkage, name, *module);
+
+        return mapFn;
+    }
+
+    // --------------------------------------------
+    // Tasks:
+
+    /**
+     * Future of a task value, opaque to the compiled code, see
+     * src/runtime/task.c.
+     */
+    llvm::StructType *getFutureType(llvm::Type *resultTy)
+    {
+        auto &futureTy = futureTypes_[resultTy];
+
+        if (futureTy != nullptr)
+        {
+            return futureTy;
+        }
+
+        if (getTypeSize(resultTy) > 8)
+        {
+            DIE << "[JovianVM]: task values must fit 8 bytes";
+        }
+
+        futureTy = llvm::StructType::create(*ctx, "future<" + getTypeName(resultTy) + ">");
+        futureResultTypes_[futureTy->getPointerTo()] = resultTy;
+
+        return futureTy;
+    }
+
+    llvm::Type *getFutureResultType(llvm::Type *futurePtrTy)
+    {
+        if (futureResultTypes_.count(futurePtrTy) == 0)
+        {
+            DIE << "[JovianVM]: expected a future";
+        }
+        return futureResultTypes_[futurePtrTy];
+    }
+
+    /**
+     * Outlines the expression into a task function and queues it. The
+     * local variables it uses are captured by value into a malloc'ed
+     * environment, which the task frees.
+     */
+    llvm::Value *genSpawn(const Exp &exp, Env env)
+    {
+        checkTaskContext("spawn");
+
+        std::vector<std::string> names;
+        collectCaptures(exp, env, names);
+
+        auto captures = loadCaptures(names, env);
+        auto captureTy = getCaptureType(captures);
+        auto captureEnv = storeCaptures(captures, captureTy, /* onHeap */ true);
+
+        llvm::Type *resultTy = nullptr;
+        auto taskFn = compileTask(exp, names, captureTy, env, resultTy);
+
+        // Output printed before the spawn comes before that of the task:
+        if (auto flushFn = module->getFunction("jovian_print_flush"))
+        {
+            builder->CreateCall(flushFn);
+        }
+
+        auto task = builder->CreateCall(getTaskFunction("jovian_spawn"), {taskFn, captureEnv});
+        return builder->CreatePointerCast(task, getFutureType(resultTy)->getPointerTo(), "future");
+    }
+
+    /**
+     * Code running on other threads needs --memory=malloc: the shadow
+     * stack and reference counts are not thread-safe. Region objects
+     * could be freed under it.
+     */
+    void checkTaskContext(const std::string &form)
+    {
+        if (options.memory != MemoryMode::Malloc)
+        {
+            DIE << "[JovianVM]: " << form << " needs --memory=malloc";
+        }
+
+        if (!regionEnvs.empty())
+        {
+            DIE << "[JovianVM]: " << form << " inside a region";
+        }
+    }
+
+    /**
+     * Values of captured variables, see collectCaptures.
+     */
+    std::vector<llvm::Value *> loadCaptures(const std::vector<std::string> &names, Env env)
+    {
+        std::vector<llvm::Value *> captures;
+
+        for (auto &name : names)
+        {
+            auto value = env->lookup(name);
+            auto localVar = llvm::dyn_cast<llvm::AllocaInst>(value);
+
+            if (localVar != nullptr && !localVar->getAllocatedType()->isStructTy())
+            {
+                value = builder->CreateLoad(localVar->getAllocatedType(), localVar, name.c_str());
+            }
+
+            captures.push_back(value);
+        }
+
+        return captures;
+    }
+
+    llvm::StructType *getCaptureType(const std::vector<llvm::Value *> &captures)
+    {
+        std::vector<llvm::Type *> captureTypes;
+
+        for (auto capture : captures)
+        {
+            captureTypes.push_back(capture->getType());
+        }
+
+        return llvm::StructType::get(*ctx, captureTypes);
+    }
+
+    /**
+     * Stores captured values into a malloc'ed struct, or a stack slot
+     * when the outlined code finishes before the function returns.
+     */
+    llvm::Value *storeCaptures(const std::vector<llvm::Value *> &captures, llvm::StructType *captureTy, bool onHeap)
+    {
+        llvm::Value *captureStruct;
+
+        if (onHeap)
+        {
+            auto captureEnv = builder->CreateCall(module->getFunction("malloc"),
+                                                  builder->getInt64(std::max<size_t>(getTypeSize(captureTy), 1)));
+            captureStruct = builder->CreatePointerCast(captureEnv, captureTy->getPointerTo());
+        }
+        else
+        {
+            auto entry = &fn->getEntryBlock();
+            varsBuilder->SetInsertPoint(entry, entry->begin());
+            captureStruct = varsBuilder->CreateAlloca(captureTy, 0, "captures");
+        }
+
+        for (auto i = 0; i < captures.size(); i++)
+        {
+            builder->CreateStore(captures[i], builder->CreateStructGEP(captureTy, captureStruct, i));
+        }
+
+        return builder->CreatePointerCast(captureStruct, builder->getInt8Ty()->getPointerTo(), "captures");
+    }
+
+    /**
+     * Names of the local variables used in an expression: stack
+     * slots and SSA values (e.g. counters of for loops) of the
+     * current function.
+     */
+    void collectCaptures(const Exp &exp, Env env, std::vector<std::string> &names)
+    {
+        if (exp.type == ExpType::SYMBOL)
+        {
+            if (!env->isDefined(exp.string) ||
+                std::find(names.begin(), names.end(), exp.string) != names.end())
+            {
+                return;
+            }
+
+            auto value = env->lookup(exp.string);
+
+            if (llvm::isa<llvm::Instruction>(value) || llvm::isa<llvm::Argument>(value))
+            {
+                names.push_back(exp.string);
+            }
+        }
+        else if (exp.type == ExpType::LIST)
+        {
+            for (auto &sub : exp.list)
+            {
+                collectCaptures(sub, env, names);
+            }
+        }
+    }
+
+    /**
+     * Task function of a spawned expression:
+     *
+     *   void task(i8* captures, i8* result)
+     *
+     * Loads the captured variables into its own slots, frees the
+     * captures, and stores the value to the result slot of the task.
+     */
+    llvm::Function *compileTask(const Exp &exp, const std::vector<std::string> &names,
+                                llvm::StructType *captureTy, Env env, llvm::Type *&resultTy)
+    {
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+        auto taskFnTy = llvm::FunctionType::get(builder->getVoidTy(), {bytePtrTy, bytePtrTy}, false);
+
+        return compileOutlined("task", taskFnTy, exp, names, captureTy, env,
+                               [&](llvm::Function *taskFn, llvm::Value *captureStruct, Env taskEnv) {
+                                   builder->CreateCall(module->getFunction("free"), taskFn->getArg(0));
+
+                                   auto result = gen(exp, taskEnv);
+                                   resultTy = result->getType();
+
+                                   builder->CreateStore(
+                                       result, builder->CreatePointerCast(taskFn->getArg(1), resultTy->getPointerTo()));
+                               });
+    }
+
+    /**
+     * Outlines code into an internal void function whose first parameter
+     * points to the captured variables (see storeCaptures). Loads the
+     * first names.size() of them into slots of the function, then
+     * genBody compiles the rest.
+     */
+    llvm::Function *compileOutlined(const std::string &fnName, llvm::FunctionType *fnTy, const Exp &exp,
+                                    const std::vector<std::string> &names, llvm::StructType *captureTy, Env env,
+                                    const std::function<void(llvm::Function *, llvm::Value *, Env)> &genBody)
+    {
+        auto prevFn = fn;
+        auto prevBlock = builder->GetInsertBlock();
+
+        auto outlinedFn = llvm::Function::Create(fnTy, llvm::Function::InternalLinkage, fnName, *module);
+        fn = outlinedFn;
+        createFunctionBlock(fn);
+
+        // Captured variables are parameters of the task:
+        std::vector<Exp> paramList;
+        for (auto name : names)
+        {
+            paramList.push_back(Exp(name));
+        }
+        Exp params(paramList);
+
+        auto prevLocalInstances = localInstances;
+        localInstances = escapeAnalysis->findLocalInstances(exp, &params);
+
+        auto prevOwnedSlots = ownedSlots;
+        ownedSlots.clear();
+
+        auto prevRegionEnvs = regionEnvs;
+        regionEnvs.clear();
+
+        auto prevCheckedIndices = checkedIndices;
+        checkedIndices.clear();
+
+        auto prevLoopTargets = loopTargets;
+        loopTargets.clear();
+
+        auto prevFnBody = fnBody;
+        auto prevFnParams = fnParams;
+        fnBody = &exp;
+        fnParams = &params;
+
+        auto prevTailCalls = tailCalls;
+        auto prevTailRecurseBlock = tailRecurseBlock;
+        auto prevTailParamSlots = tailParamSlots;
+        tailCalls.clear();
+        tailRecurseBlock = nullptr;
+        tailParamSlots.clear();
+
+        auto prevCoroutine = coroutine;
+        coroutine = nullptr;
+
+        auto outlinedEnv = std::make_shared<Environment>(
+            std::map<std::string, llvm::Value *>{}, env);
+
+        auto captureStruct = builder->CreatePointerCast(outlinedFn->getArg(0), captureTy->getPointerTo());
+
+        for (auto i = 0; i < names.size(); i++)
+        {
+            auto name = names[i];
+            auto captureType = captureTy->getElementType(i);
+            auto value = builder->CreateLoad(captureType, builder->CreateStructGEP(captureTy, captureStruct, i), name);
+            builder->CreateStore(value, allocVar(name, captureType, outlinedEnv));
+        }
+
+        genBody(outlinedFn, captureStruct, outlinedEnv);
+
+        // Output of the outlined code is flushed by its worker thread:
+        if (auto flushFn = module->getFunction("jovian_print_flush"))
+        {
+            builder->CreateCall(flushFn);
+        }
+
+        builder->CreateRetVoid();
+
+        builder->SetInsertPoint(prevBlock);
+        fn = prevFn;
+        localInstances = prevLocalInstances;
+        ownedSlots = prevOwnedSlots;
+        regionEnvs = prevRegionEnvs;
+        checkedIndices = prevCheckedIndices;
+        loopTargets = prevLoopTargets;
+        fnBody = prevFnBody;
+        fnParams = prevFnParams;
+        tailCalls = prevTailCalls;
+        tailRecurseBlock = prevTailRecurseBlock;
+        tailParamSlots = prevTailParamSlots;
+        coroutine = prevCoroutine;
+
+        return outlinedFn;
+    }
+
+    /**
+     * Task runtime function, declared on first use:
+     *
+     *   i8* jovian_spawn(void (i8*, i8*)* fn, i8* captures)
+     *   void jovian_join(i8* task, i8* result)
+     */
+    llvm::Function *getTaskFunction(const std::string &name)
+    {
+        auto taskFn = module->getFunction(name);
+
+        if (taskFn != nullptr)
+        {
+            return taskFn;
+        }
+
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+        llvm::FunctionType *fnTy = nullptr;
+
+        if (name == "jovian_spawn")
+        {
+            auto bodyTy = llvm::FunctionType::get(builder->getVoidTy(), {bytePtrTy, bytePtrTy}, false);
+            fnTy = llvm::FunctionType::get(bytePtrTy, {bodyTy->getPointerTo(), bytePtrTy}, false);
+        }
+        else
+        {
+            fnTy = llvm::FunctionType::get(builder->getVoidTy(), {bytePtrTy, bytePtrTy}, false);
+        }
+
+        return llvm::Function::Create(fnTy, llvm::Function::ExternalLinkage, name, *module);
+    }
+
+    // --------------------------------------------
+    // Parallel algorithms:
+
+    /**
+     * Header of a parallel form: (<names>... <expressions>... [<grain>]).
+     * Returns the grain, 0 (the default) if not given.
+     */
+    llvm::Value *parseParallelHeader(const Exp &exp, size_t nameCount, size_t expCount, Env env)
+    {
+        auto &header = exp.list[1];
+        auto size = nameCount + expCount;
+
+        if (header.type != ExpType::LIST || header.list.size() < size || header.list.size() > size + 1)
+        {
+            DIE << "[JovianVM]: bad header of " << exp.list[0].string;
+        }
+
+        for (auto i = 0; i < nameCount; i++)
+        {
+            if (header.list[i].type != ExpType::SYMBOL)
+            {
+                DIE << "[JovianVM]: expected a variable name in " << exp.list[0].string;
+            }
+        }
+
+        return header.list.size() > size ? coerceValue(gen(header.list[size], env), builder->getInt64Ty())
+                                         : builder->getInt64(0);
+    }
+
+    /**
+     * Variables used by a parallel body, without its own. Assignments
+     * to them would be lost, they are captured by value.
+     */
+    std::vector<std::string> collectParallelCaptures(const Exp &body, const std::vector<std::string> &ownNames,
+                                                     Env env)
+    {
+        std::vector<std::string> names;
+        collectCaptures(body, env, names);
+
+        for (auto &ownName : ownNames)
+        {
+            names.erase(std::remove(names.begin(), names.end(), ownName), names.end());
+
+            if (isAssigned(body, ownName))
+            {
+                DIE << "[JovianVM]: " << ownName << " is assigned in a parallel body";
+            }
+        }
+
+        for (auto &name : names)
+        {
+            if (isAssigned(body, name))
+            {
+                DIE << "[JovianVM]: local variable " << name << " is assigned in a parallel body, use an array "
+                    << "or an atomic field";
+            }
+        }
+
+        return names;
+    }
+
+    /**
+     * Kernel of a parallel form:
+     *
+     *   void kernel(i8* captures, i64 begin, i64 end)
+     *
+     * genIndex compiles the body for an index of [begin, end).
+     */
+    llvm::Function *compileKernel(const Exp &exp, const std::vector<std::string> &names, llvm::StructType *captureTy,
+                                  Env env, const std::function<void(llvm::Value *, llvm::Value *, Env)> &genIndex)
+    {
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+        auto int64Ty = builder->getInt64Ty();
+        auto kernelFnTy = llvm::FunctionType::get(builder->getVoidTy(), {bytePtrTy, int64Ty, int64Ty}, false);
+
+        return compileOutlined("kernel", kernelFnTy, exp, names, captureTy, env,
+                               [&](llvm::Function *kernelFn, llvm::Value *captureStruct, Env kernelEnv) {
+                                   genCountedLoop(kernelFn->getArg(1), kernelFn->getArg(2), [&](llvm::Value *index) {
+                                       genIndex(index, captureStruct, kernelEnv);
+                                   });
+                               });
+    }
+
+    /**
+     * Loop over the i64 indices [begin, end).
+     */
+    void genCountedLoop(llvm::Value *begin, llvm::Value *end, const std::function<void(llvm::Value *)> &genBody)
+    {
+        auto preheaderBlock = builder->GetInsertBlock();
+        auto condBlock = createBB("chunk_cond", fn);
+        auto bodyBlock = createBB("chunk_body", fn);
+        auto loopEndBlock = createBB("chunk_end");
+
+        builder->CreateBr(condBlock);
+
+        builder->SetInsertPoint(condBlock);
+        auto index = builder->CreatePHI(builder->getInt64Ty(), 2, "index");
+        index->addIncoming(begin, preheaderBlock);
+        builder->CreateCondBr(builder->CreateICmpSLT(index, end), bodyBlock, loopEndBlock);
+
+        builder->SetInsertPoint(bodyBlock);
+        genBody(index);
+        index->addIncoming(builder->CreateAdd(index, builder->getInt64(1), "next"), builder->GetInsertBlock());
+        builder->CreateBr(condBlock);
+
+        fn->getBasicBlockList().push_back(loopEndBlock);
+        builder->SetInsertPoint(loopEndBlock);
+    }
+
+    /**
+     * Runs a kernel on the workers and waits for it. Output printed
+     * before comes first.
+     */
+    void genParallelCall(llvm::Function *kernel, llvm::Value *captureEnv, llvm::Value *begin, llvm::Value *end,
+                         llvm::Value *grain)
+    {
+        if (auto flushFn = module->getFunction("jovian_print_flush"))
+        {
+            builder->CreateCall(flushFn);
+        }
+
+        builder->CreateCall(getParallelFunction("jovian_parallel_for"), {kernel, captureEnv, begin, end, grain});
+    }
+
+    /**
+     * Element of an array, in bounds.
+     */
+    llvm::Value *loadArrayElement(llvm::Value *array, llvm::Value *index)
+    {
+        auto elementTy = getArrayElementType(array->getType());
+        auto address = arrayElementAddress(array, index, /* checked */ false);
+
+        auto element = builder->CreateLoad(elementTy, address, "elem");
+        element->setMetadata(llvm::LLVMContext::MD_tbaa, getArrayTBAATag(elementTy));
+
+        return element;
+    }
+
+    llvm::Value *genParallelFor(const Exp &exp, Env env)
+    {
+        checkTaskContext("parallel-for");
+
+        auto &header = exp.list[1];
+        auto &body = exp.list[2];
+
+        auto grain = parseParallelHeader(exp, 1, 2, env);
+        auto &varName = header.list[0].string;
+
+        auto start = gen(header.list[1], env);
+        auto end = gen(header.list[2], env);
+        auto varTy = unifiedType(start->getType(), end->getType());
+
+        if (!varTy->isIntegerTy() || varTy->isIntegerTy(1))
+        {
+            DIE << "[JovianVM]: loop variable " << varName << " must be an integer";
+        }
+
+        auto names = collectParallelCaptures(body, {varName}, env);
+
+        auto captures = loadCaptures(names, env);
+        auto captureTy = getCaptureType(captures);
+        auto captureEnv = storeCaptures(captures, captureTy, /* onHeap */ false);
+
+        auto kernel = compileKernel(body, names, captureTy, env,
+                                    [&](llvm::Value *index, llvm::Value *captureStruct, Env kernelEnv) {
+                                        auto loopEnv = std::make_shared<Environment>(
+                                            std::map<std::string, llvm::Value *>{
+                                                {varName, builder->CreateTrunc(index, varTy, varName)}},
+                                            kernelEnv);
+
+                                        releaseValue(gen(body, loopEnv));
+                                    });
+
+        genParallelCall(kernel, captureEnv, builder->CreateSExt(coerceValue(start, varTy), builder->getInt64Ty()),
+                        builder->CreateSExt(coerceValue(end, varTy), builder->getInt64Ty()), grain);
+
+        return builder->getInt32(0);
+    }
+
+    llvm::Value *genParallelMap(const Exp &exp, Env env)
+    {
+        checkTaskContext("parallel-map");
+
+        auto &header = exp.list[1];
+        auto &body = exp.list[2];
+
+        auto grain = parseParallelHeader(exp, 1, 1, env);
+        auto &varName = header.list[0].string;
+
+        auto array = gen(header.list[1], env);
+        getArrayElementType(array->getType());
+
+        auto names = collectParallelCaptures(body, {varName}, env);
+
+        // Captures, then the source array and the data of the result:
+        auto captures = loadCaptures(names, env);
+        captures.push_back(array);
+        captures.push_back(llvm::Constant::getNullValue(builder->getInt8Ty()->getPointerTo()));
+
+        auto captureTy = getCaptureType(captures);
+        auto captureEnv = storeCaptures(captures, captureTy, /* onHeap */ false);
+
+        llvm::Type *resultTy = nullptr;
+
+        auto kernel = compileKernel(
+            body, names, captureTy, env, [&](llvm::Value *index, llvm::Value *captureStruct, Env kernelEnv) {
+                auto source = builder->CreateLoad(array->getType(),
+                                                  builder->CreateStructGEP(captureTy, captureStruct, names.size()));
+                auto resultData = builder->CreateLoad(
+                    captureTy->getElementType(names.size() + 1),
+                    builder->CreateStructGEP(captureTy, captureStruct, names.size() + 1), "result_data");
+
+                auto elementEnv = std::make_shared<Environment>(
+                    std::map<std::string, llvm::Value *>{{varName, loadArrayElement(source, index)}}, kernelEnv);
+
+                auto value = gen(body, elementEnv);
+                resultTy = value->getType();
+
+                auto address = builder->CreateInBoundsGEP(
+                    resultTy, builder->CreatePointerCast(resultData, resultTy->getPointerTo()), index);
+                auto store = builder->CreateStore(value, address);
+                store->setMetadata(llvm::LLVMContext::MD_tbaa, getArrayTBAATag(resultTy));
+            });
+
+        auto length = loadArrayField(array, ARRAY_LENGTH_INDEX, "len");
+        auto result = createArray(resultTy, length);
+
+        builder->CreateStore(builder->CreatePointerCast(loadArrayField(result, ARRAY_DATA_INDEX, "data"),
+                                                        builder->getInt8Ty()->getPointerTo()),
+                             builder->CreateStructGEP(captureTy,
+                                                      builder->CreatePointerCast(captureEnv, captureTy->getPointerTo()),
+                                                      names.size() + 1));
+
+        genParallelCall(kernel, captureEnv, builder->getInt64(0), length, grain);
+
+        return result;
+    }
+
+    llvm::Value *genParallelReduce(const Exp &exp, Env env)
+    {
+        checkTaskContext("parallel-reduce");
+
+        auto &header = exp.list[1];
+        auto &body = exp.list[3];
+
+        auto grain = parseParallelHeader(exp, 2, 1, env);
+        auto &accName = header.list[0].string;
+        auto &varName = header.list[1].string;
+
+        auto array = gen(header.list[2], env);
+        auto elementTy = getArrayElementType(array->getType());
+
+        auto init = gen(exp.list[2], env);
+        auto accTy = unifiedType(init->getType(), elementTy);
+        init = coerceValue(init, accTy);
+
+        auto length = loadArrayField(array, ARRAY_LENGTH_INDEX, "len");
+
+        // Fixed chunks, each folds into its own partial result:
+        auto defaultGrain = builder->CreateCall(getParallelFunction("jovian_parallel_grain"), length);
+        grain = builder->CreateSelect(builder->CreateICmpSGT(grain, builder->getInt64(0)), grain, defaultGrain,
+                                      "grain");
+        auto chunks = builder->CreateUDiv(builder->CreateAdd(length, builder->CreateSub(grain, builder->getInt64(1))),
+                                          grain, "chunks");
+
+        auto partialsEnv = builder->CreateCall(module->getFunction("malloc"),
+                                               builder->CreateMul(chunks, builder->getInt64(getTypeSize(accTy))));
+        auto partials = builder->CreatePointerCast(partialsEnv, accTy->getPointerTo(), "partials");
+
+        auto names = collectParallelCaptures(body, {accName, varName}, env);
+
+        // Captures, then the array, the initial value, the partial results and the grain:
+        auto captures = loadCaptures(names, env);
+        captures.insert(captures.end(), {array, init, partials, grain});
+
+        auto captureTy = getCaptureType(captures);
+        auto captureEnv = storeCaptures(captures, captureTy, /* onHeap */ false);
+
+        auto allocAcc = [&]() {
+            auto entry = &fn->getEntryBlock();
+            varsBuilder->SetInsertPoint(entry, entry->begin());
+            return varsBuilder->CreateAlloca(accTy, 0, accName.c_str());
+        };
+
+        auto fold = [&](llvm::Value *acc, llvm::Value *value, Env foldEnv) {
+            auto elementEnv = std::make_shared<Environment>(
+                std::map<std::string, llvm::Value *>{{accName, acc}, {varName, value}}, foldEnv);
+
+            return coerceValue(gen(body, elementEnv), accTy);
+        };
+
+        auto kernel = compileKernel(
+            body, names, captureTy, env, [&](llvm::Value *chunk, llvm::Value *captureStruct, Env kernelEnv) {
+                auto field = [&](size_t i, const std::string &name) {
+                    auto fieldIdx = names.size() + i;
+                    return builder->CreateLoad(captureTy->getElementType(fieldIdx),
+                                               builder->CreateStructGEP(captureTy, captureStruct, fieldIdx), name);
+                };
+
+                auto source = field(0, "source");
+                auto chunkGrain = field(3, "grain");
+                auto sourceLength = loadArrayField(source, ARRAY_LENGTH_INDEX, "len");
+
+                auto begin = builder->CreateMul(chunk, chunkGrain, "begin");
+                auto end = builder->CreateAdd(begin, chunkGrain);
+                end = builder->CreateSelect(builder->CreateICmpULT(end, sourceLength), end, sourceLength, "end");
+
+                auto accSlot = allocAcc();
+                builder->CreateStore(field(1, "init"), accSlot);
+
+                genCountedLoop(begin, end, [&](llvm::Value *index) {
+                    auto acc = builder->CreateLoad(accTy, accSlot, accName);
+                    builder->CreateStore(fold(acc, loadArrayElement(source, index), kernelEnv), accSlot);
+                });
+
+                builder->CreateStore(builder->CreateLoad(accTy, accSlot, accName),
+                                     builder->CreateInBoundsGEP(accTy, field(2, "partials"), chunk));
+            });
+
+        genParallelCall(kernel, captureEnv, builder->getInt64(0), chunks, builder->getInt64(1));
+
+        // The partial results, in order:
+        auto accSlot = allocAcc();
+        builder->CreateStore(init, accSlot);
+
+        genCountedLoop(builder->getInt64(0), chunks, [&](llvm::Value *chunk) {
+            auto acc = builder->CreateLoad(accTy, accSlot, accName);
+            auto partial = builder->CreateLoad(accTy, builder->CreateInBoundsGEP(accTy, partials, chunk), "partial");
+            builder->CreateStore(fold(acc, partial, env), accSlot);
+        });
+
+        builder->CreateCall(module->getFunction("free"), partialsEnv);
+
+        return builder->CreateLoad(accTy, accSlot, accName);
+    }
+
+    /**
+     * Parallel runtime function, declared on first use, see
+     * src/runtime/parallel.c.
+     */
+    llvm::Function *getParallelFunction(const std::string &name)
+    {
+        auto parallelFn = module->getFunction(name);
+
+        if (parallelFn != nullptr)
+        {
+            return parallelFn;
+        }
+
+        auto int64Ty = builder->getInt64Ty();
+        auto voidTy = builder->getVoidTy();
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+        auto kernelTy = llvm::FunctionType::get(voidTy, {bytePtrTy, int64Ty, int64Ty}, false);
+
+        std::map<std::string, llvm::FunctionType *> parallelFnTypes{
+            {"jovian_parallel_for",
+             llvm::FunctionType::get(voidTy, {kernelTy->getPointerTo(), bytePtrTy, int64Ty, int64Ty, int64Ty}, false)},
+            {"jovian_parallel_grain", llvm::FunctionType::get(int64Ty, int64Ty, false)},
+            {"jovian_parallel_sort", llvm::FunctionType::get(voidTy, {bytePtrTy, int64Ty, builder->getInt32Ty()}, false)},
+            {"jovian_prefix_sum", llvm::FunctionType::get(voidTy, {bytePtrTy, int64Ty, builder->getInt32Ty()}, false)},
+        };
+
+        return llvm::Function::Create(parallelFnTypes.at(name), llvm::Function::ExternalLinkage, name, *module);
+    }
+
+    // --------------------------------------------
+    // Atomics:
+
+    bool isAtomicField(llvm::StructType *cls, const std::string &fieldName)
+    {
+        return classMap_[cls->getName().data()].atomicFields.count(fieldName) != 0;
+    }
+
+    /**
+     * Atomic fields are numbers or objects. ARC counts of objects
+     * can't be updated together with the field.
+     */
+    void checkAtomicType(llvm::Type *fieldTy, const std::string &fieldName)
+    {
+        auto isObject = isClassPointer(fieldTy);
+
+        if (!fieldTy->isIntegerTy() && !fieldTy->isFloatingPointTy() && !isObject)
+        {
+            DIE << "[JovianVM]: atomic field " << fieldName << " must be a number or an object";
+        }
+
+        if (isObject && options.memory == MemoryMode::ARC)
+        {
+            DIE << "[JovianVM]: atomic object field " << fieldName << " needs --memory=malloc or --memory=gc";
+        }
+    }
+
+    /**
+     * Operand of an atomic operation: the object, and the address
+     * and type of its field.
+     */
+    struct AtomicField
+    {
+        llvm::Value *instance;
+        llvm::Value *address;
+        llvm::Type *type;
+    };
+
+    /**
+     * Atomic field of (<op> <object> <field> ...).
+     */
+    AtomicField genAtomicField(const Exp &exp, Env env)
+    {
+        auto instance = gen(exp.list[1], env);
+
+        if (!isClassPointer(instance->getType()))
+        {
+            DIE << "[JovianVM]: " << exp.list[0].string << " expects an object";
+        }
+
+        auto cls = (llvm::StructType *)(instance->getType()->getContainedType(0));
+        auto &fieldName = exp.list[2].string;
+
+        if (!isAtomicField(cls, fieldName))
+        {
+            DIE << "[JovianVM]: field " << fieldName << " of " << cls->getName().str() << " is not atomic";
+        }
+
+        auto fieldIdx = getFieldIndex(cls, fieldName);
+        auto address = builder->CreateStructGEP(cls, instance, fieldIdx, std::string("p") + fieldName);
+
+        return {instance, address, cls->getElementType(fieldIdx)};
+    }
+
+    /**
+     * GC mode: an object stored by an atomic operation is recorded
+     * by the write barrier of its holder.
+     */
+    void genAtomicWriteBarrier(const AtomicField &field, llvm::Value *value)
+    {
+        if (options.memory != MemoryMode::GC || !isClassPointer(value->getType()))
+        {
+            return;
+        }
+
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+        builder->CreateCall(module->getFunction("jovian_gc_write_barrier"),
+                            builder->CreatePointerCast(field.instance, bytePtrTy));
+    }
+
+    /**
+     * Memory ordering argument at an index of the expression,
+     * seq_cst if omitted.
+     */
+    llvm::AtomicOrdering getAtomicOrdering(const Exp &exp, size_t idx)
+    {
+        if (exp.list.size() <= idx)
+        {
+            return llvm::AtomicOrdering::SequentiallyConsistent;
+        }
+
+        auto &name = exp.list[idx].string;
+
+        if (name == "relaxed")
+        {
+            return llvm::AtomicOrdering::Monotonic;
+        }
+        if (name == "acquire")
+        {
+            return llvm::AtomicOrdering::Acquire;
+        }
+        if (name == "release")
+        {
+            return llvm::AtomicOrdering::Release;
+        }
+        if (name == "acq_rel")
+        {
+            return llvm::AtomicOrdering::AcquireRelease;
+        }
+        if (name != "seq_cst")
+        {
+            DIE << "[JovianVM]: unknown memory ordering " << name;
+        }
+
+        return llvm::AtomicOrdering::SequentiallyConsistent;
+    }
+
+    // --------------------------------------------
+    // Generators:
+
+    /**
+     * Generator of values of a type: handle of a coroutine frame,
+     * opaque to the compiled code.
+     */
+    llvm::StructType *getGeneratorType(llvm::Type *valueTy)
+    {
+        auto &generatorTy = generatorTypes_[valueTy];
+
+        if (generatorTy == nullptr)
+        {
+            generatorTy = llvm::StructType::create(*ctx, "gen<" + getTypeName(valueTy) + ">");
+            generatorValueTypes_[generatorTy->getPointerTo()] = valueTy;
+        }
+
+        return generatorTy;
+    }
+
+    bool isGeneratorPointer(llvm::Type *type_)
+    {
+        return generatorValueTypes_.count(type_) != 0;
+    }
+
+    llvm::Type *getGeneratorValueType(llvm::Type *generatorPtrTy)
+    {
+        if (!isGeneratorPointer(generatorPtrTy))
+        {
+            DIE << "[JovianVM]: expected a generator";
+        }
+        return generatorValueTypes_[generatorPtrTy];
+    }
+
+    /**
+     * Compiles a generator into a coroutine with the llvm.coro
+     * intrinsics (switched-resume lowering, done by the CoroSplit
+     * pass of opt). The function returns the handle at its initial
+     * suspension; the frame is malloc'ed unless CoroElide places it
+     * in the frame of a caller which destroys the generator.
+     */
+    llvm::Value *compileGenerator(const Exp &fnExp, std::string fnName, Env env)
+    {
+        // Frames are not scanned by the collector, nor released by ARC:
+        if (options.memory != MemoryMode::Malloc)
+        {
+            DIE << "[JovianVM]: generators need --memory=malloc";
+        }
+
+        if (!hasReturnType(fnExp))
+        {
+            DIE << "[JovianVM]: generator " << fnName << " needs a value type: -> <type>";
+        }
+
+        auto params = fnExp.list[2];
+        auto body = fnExp.list[5];
+
+        auto valueTy = getTypeFromExp(fnExp.list[4]);
+        auto generatorPtrTy = getGeneratorType(valueTy)->getPointerTo();
+
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+
+        auto prevFn = fn;
+        auto prevBlock = builder->GetInsertBlock();
+
+        auto fnTy = llvm::FunctionType::get(generatorPtrTy, extractFunctionType(fnExp)->params(), false);
+        auto newFn = createFunction(fnName, fnTy, env);
+        fn = newFn;
+
+        // Marks the function for the coroutine passes (not yet split):
+        fn->addFnAttr("coroutine.presplit", "0");
+
+        auto prevLocalInstances = localInstances;
+        localInstances = escapeAnalysis->findLocalInstances(body, &params);
+
+        auto prevOwnedSlots = ownedSlots;
+        ownedSlots.clear();
+
+        auto prevRegionEnvs = regionEnvs;
+        regionEnvs.clear();
+
+        auto prevCheckedIndices = checkedIndices;
+        checkedIndices.clear();
+
+        auto prevLoopTargets = loopTargets;
+        loopTargets.clear();
+
+        auto prevFnBody = fnBody;
+        auto prevFnParams = fnParams;
+        fnBody = &body;
+        fnParams = &params;
+
+        auto prevTailCalls = tailCalls;
+        auto prevTailRecurseBlock = tailRecurseBlock;
+        auto prevTailParamSlots = tailParamSlots;
+        tailCalls.clear();
+        tailRecurseBlock = nullptr;
+        tailParamSlots.clear();
+
+        // Frame setup:
+        //
+        //   %id = coro.id(align, %promise, null, null)
+        //   %frame = coro.alloc(%id) ? malloc(coro.size()) : null
+        //   %hdl = coro.begin(%id, %frame)
+
+        auto promise = builder->CreateAlloca(valueTy, 0, "promise");
+        promise->setAlignment(llvm::Align(GENERATOR_PROMISE_ALIGN));
+
+        auto id = builder->CreateCall(
+            llvm::Intrinsic::getDeclaration(module.get(), llvm::Intrinsic::coro_id),
+            {builder->getInt32(GENERATOR_PROMISE_ALIGN), builder->CreatePointerCast(promise, bytePtrTy),
+             llvm::ConstantPointerNull::get(bytePtrTy), llvm::ConstantPointerNull::get(bytePtrTy)},
+            "id");
+
+        auto needAlloc = builder->CreateCall(
+            llvm::Intrinsic::getDeclaration(module.get(), llvm::Intrinsic::coro_alloc), id, "need_alloc");
+
+        auto entryBlock = builder->GetInsertBlock();
+        auto allocBlock = createBB("coro_alloc", fn);
+        auto beginBlock = createBB("coro_begin", fn);
+
+        builder->CreateCondBr(needAlloc, allocBlock, beginBlock);
+
+        builder->SetInsertPoint(allocBlock);
+        auto frameSize = builder->CreateCall(
+            llvm::Intrinsic::getDeclaration(module.get(), llvm::Intrinsic::coro_size, builder->getInt64Ty()));
+        auto frameAlloc = builder->CreateCall(module->getFunction("malloc"), frameSize, "frame");
+        builder->CreateBr(beginBlock);
+
+        builder->SetInsertPoint(beginBlock);
+        auto frame = builder->CreatePHI(bytePtrTy, 2, "frame");
+        frame->addIncoming(llvm::ConstantPointerNull::get(bytePtrTy), entryBlock);
+        frame->addIncoming(frameAlloc, allocBlock);
+
+        auto handle = builder->CreateCall(
+            llvm::Intrinsic::getDeclaration(module.get(), llvm::Intrinsic::coro_begin), {id, frame}, "hdl");
+
+        // Destruction frees the frame (null if elided):
+        auto cleanupBlock = createBB("coro_cleanup");
+        auto suspendBlock = createBB("coro_suspend");
+
+        Coroutine generator{valueTy, promise, cleanupBlock, suspendBlock};
+        auto prevCoroutine = coroutine;
+        coroutine = &generator;
+
+        auto fnEnv = std::make_shared<Environment>(
+            std::map<std::string, llvm::Value *>{}, env);
+
+        auto idx = 0;
+
+        for (auto &arg : fn->args())
+        {
+            auto argName = extractVarName(params.list[idx++]);
+
+            arg.setName(argName);
+            builder->CreateStore(&arg, allocVar(argName, arg.getType(), fnEnv));
+        }
+
+        // Starts suspended, the first (next ...) runs to the first yield:
+        genSuspend(/* final */ false);
+
+        auto result = coerceValue(gen(body, fnEnv), valueTy);
+        builder->CreateStore(result, promise);
+
+        // Resuming a finished coroutine is undefined:
+        genSuspend(/* final */ true);
+        builder->CreateUnreachable();
+
+        fn->getBasicBlockList().push_back(cleanupBlock);
+        builder->SetInsertPoint(cleanupBlock);
+        auto frameFree = builder->CreateCall(
+            llvm::Intrinsic::getDeclaration(module.get(), llvm::Intrinsic::coro_free), {id, handle}, "frame");
+        builder->CreateCall(module->getFunction("free"), frameFree);
+        builder->CreateBr(suspendBlock);
+
+        fn->getBasicBlockList().push_back(suspendBlock);
+        builder->SetInsertPoint(suspendBlock);
+        builder->CreateCall(llvm::Intrinsic::getDeclaration(module.get(), llvm::Intrinsic::coro_end),
+                            {handle, builder->getFalse()});
+        builder->CreateRet(builder->CreatePointerCast(handle, generatorPtrTy));
+
+        builder->SetInsertPoint(prevBlock);
+        fn = prevFn;
+        localInstances = prevLocalInstances;
+        ownedSlots = prevOwnedSlots;
+        regionEnvs = prevRegionEnvs;
+        checkedIndices = prevCheckedIndices;
+        loopTargets = prevLoopTargets;
+        fnBody = prevFnBody;
+        fnParams = prevFnParams;
+        tailCalls = prevTailCalls;
+        tailRecurseBlock = prevTailRecurseBlock;
+        tailParamSlots = prevTailParamSlots;
+        coroutine = prevCoroutine;
+
+        return newFn;
+    }
+
+    /**
+     * Suspension point of the current coroutine: returns to the
+     * resumer, continues in a new block when resumed.
+     */
+    void genSuspend(bool final)
+    {
+        // Regions would stay entered while suspended, or forever:
+        if (!regionEnvs.empty())
+        {
+            DIE << "[JovianVM]: suspending a generator inside a region";
+        }
+
+        auto state = builder->CreateCall(
+            llvm::Intrinsic::getDeclaration(module.get(), llvm::Intrinsic::coro_suspend),
+            {llvm::ConstantTokenNone::get(*ctx), builder->getInt1(final)}, "state");
+
+        auto resumeBlock = createBB(final ? "coro_final" : "coro_resume", fn);
+
+        // 0: resumed, 1: destroyed, -1: suspended
+        auto dispatch = builder->CreateSwitch(state, coroutine->suspendBlock, 2);
+        dispatch->addCase(builder->getInt8(0), resumeBlock);
+        dispatch->addCase(builder->getInt8(1), coroutine->cleanupBlock);
+
+        builder->SetInsertPoint(resumeBlock);
+    }
+
+    /**
+     * Resumes a generator unless it has finished. Returns whether
+     * it has yielded a value.
+     */
+    llvm::Value *resumeGenerator(llvm::Value *generator)
+    {
+        getGeneratorValueType(generator->getType());
+        auto handle = builder->CreatePointerCast(generator, builder->getInt8Ty()->getPointerTo());
+        auto coroDone = llvm::Intrinsic::getDeclaration(module.get(), llvm::Intrinsic::coro_done);
+
+        auto checkBlock = builder->GetInsertBlock();
+        auto resumeBlock = createBB("gen_resume", fn);
+        auto nextBlock = createBB("gen_next", fn);
+
+        builder->CreateCondBr(builder->CreateCall(coroDone, handle), nextBlock, resumeBlock);
+
+        builder->SetInsertPoint(resumeBlock);
+        builder->CreateCall(llvm::Intrinsic::getDeclaration(module.get(), llvm::Intrinsic::coro_resume), handle);
+        auto resumedDone = builder->CreateCall(coroDone, handle);
+        builder->CreateBr(nextBlock);
+
+        builder->SetInsertPoint(nextBlock);
+        auto done = builder->CreatePHI(builder->getInt1Ty(), 2, "done");
+        done->addIncoming(builder->getTrue(), checkBlock);
+        done->addIncoming(resumedDone, resumeBlock);
+
+        return builder->CreateNot(done, "has_next");
+    }
+
+    /**
+     * Value slot (promise) of a generator.
+     */
+    llvm::Value *loadGeneratorValue(llvm::Value *generator, const std::string &name = "current")
+    {
+        auto valueTy = getGeneratorValueType(generator->getType());
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+
+        auto promise = builder->CreateCall(
+            llvm::Intrinsic::getDeclaration(module.get(), llvm::Intrinsic::coro_promise),
+            {builder->CreatePointerCast(generator, bytePtrTy), builder->getInt32(GENERATOR_PROMISE_ALIGN),
+             builder->getFalse()});
+
+        return builder->CreateLoad(valueTy, builder->CreatePointerCast(promise, valueTy->getPointerTo()), name);
+    }
+
+    void destroyGenerator(llvm::Value *generator)
+    {
+        builder->CreateCall(llvm::Intrinsic::getDeclaration(module.get(), llvm::Intrinsic::coro_destroy),
+                            builder->CreatePointerCast(generator, builder->getInt8Ty()->getPointerTo()));
+    }
+
+    // --------------------------------------------
+    // Strings:
+
+    /**
+     * Immutable string object, see src/runtime/string.c:
+     *
+     *   { i64 length, i64 hash, i32 flags, [0 x i8] chars }
+     *
+     * Strings of up to SMALL_STRING_MAX bytes are stored in the pointer
+     * itself: byte 0 is length << 1 | 1, then the characters, then 0.
+     */
+    llvm::StructType *getStringType()
+    {
+        if (stringTy_ == nullptr)
+        {
+            auto int64Ty = builder->getInt64Ty();
+            stringTy_ = llvm::StructType::create(
+                *ctx, {int64Ty, int64Ty, builder->getInt32Ty(), llvm::ArrayType::get(builder->getInt8Ty(), 0)},
+                "string");
+        }
+        return stringTy_;
+    }
+
+    /**
+     * String builder, opaque to the compiled code.
+     */
+    llvm::StructType *getStringBuilderType()
+    {
+        if (stringBuilderTy_ == nullptr)
+        {
+            stringBuilderTy_ = llvm::StructType::create(*ctx, "string-builder");
+        }
+        return stringBuilderTy_;
+    }
+
+    bool isStringPointer(llvm::Type *type_)
+    {
+        return type_ == getStringType()->getPointerTo();
+    }
+
+    llvm::Value *genString(const Exp &exp, Env env)
+    {
+        auto value = gen(exp, env);
+
+        if (!isStringPointer(value->getType()))
+        {
+            DIE << "[JovianVM]: expected a string, got " << getTypeName(value->getType());
+        }
+
+        return value;
+    }
+
+    /**
+     * Literals are static string objects, or small strings.
+     */
+    llvm::Constant *getStringLiteral(const std::string &str)
+    {
+        auto stringPtrTy = getStringType()->getPointerTo();
+
+        if (str.size() <= SMALL_STRING_MAX)
+        {
+            uint64_t word = str.size() << 1 | 1;
+            for (auto i = 0; i < str.size(); i++)
+            {
+                word |= (uint64_t)(unsigned char)str[i] << (8 * (i + 1));
+            }
+            return llvm::ConstantExpr::getIntToPtr(builder->getInt64(word), stringPtrTy);
+        }
+
+        if (stringLiterals_.count(str) != 0)
+        {
+            return stringLiterals_[str];
+        }
+
+        // Not constant: the runtime caches the hash in the object.
+        auto chars = llvm::ConstantDataArray::getString(*ctx, str);
+        auto literal = llvm::ConstantStruct::getAnon(
+            {builder->getInt64(str.size()), builder->getInt64(0), builder->getInt32(STRING_STATIC), chars});
+
+        auto global = new llvm::GlobalVariable(*module, literal->getType(), false,
+                                               llvm::GlobalVariable::PrivateLinkage, literal, "str");
+        global->setAlignment(llvm::MaybeAlign(8));
+
+        return stringLiterals_[str] = llvm::ConstantExpr::getPointerCast(global, stringPtrTy);
+    }
+
+    /**
+     * NUL-terminated characters and length of a string. A small string
+     * is decoded into a stack slot of the function.
+     */
+    std::pair<llvm::Value *, llvm::Value *> getStringData(llvm::Value *str)
+    {
+        auto int64Ty = builder->getInt64Ty();
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+
+        auto entry = &fn->getEntryBlock();
+        varsBuilder->SetInsertPoint(entry, entry->begin());
+        auto slot = varsBuilder->CreateAlloca(int64Ty, 0, "small_str");
+
+        auto word = builder->CreatePtrToInt(str, int64Ty);
+        auto isSmall = builder->CreateTrunc(word, builder->getInt1Ty());
+
+        auto smallBlock = createBB("str_small", fn);
+        auto heapBlock = createBB("str_heap", fn);
+        auto dataEndBlock = createBB("str_data", fn);
+
+        builder->CreateCondBr(isSmall, smallBlock, heapBlock);
+
+        builder->SetInsertPoint(smallBlock);
+        builder->CreateStore(word, slot);
+        auto smallChars = builder->CreateConstInBoundsGEP1_64(builder->getInt8Ty(),
+                                                              builder->CreatePointerCast(slot, bytePtrTy), 1);
+        auto smallLength = builder->CreateLShr(builder->CreateAnd(word, 0xff), 1);
+        builder->CreateBr(dataEndBlock);
+
+        builder->SetInsertPoint(heapBlock);
+        auto heapChars = builder->CreatePointerCast(builder->CreateStructGEP(getStringType(), str, 3), bytePtrTy);
+        auto heapLength = builder->CreateLoad(int64Ty, builder->CreateStructGEP(getStringType(), str, 0), "length");
+        builder->CreateBr(dataEndBlock);
+
+        builder->SetInsertPoint(dataEndBlock);
+        auto chars = builder->CreatePHI(bytePtrTy, 2, "chars");
+        chars->addIncoming(smallChars, smallBlock);
+        chars->addIncoming(heapChars, heapBlock);
+
+        auto length = builder->CreatePHI(int64Ty, 2, "length");
+        length->addIncoming(smallLength, smallBlock);
+        length->addIncoming(heapLength, heapBlock);
+
+        return {chars, length};
+    }
+
+    /**
+     * Calls a function of the string runtime, declared on first use.
+     */
+    llvm::Value *callStringFunction(const std::string &name, llvm::Type *returnTy, std::vector<llvm::Value *> args)
+    {
+        std::vector<llvm::Type *> paramTys;
+
+        for (auto arg : args)
+        {
+            paramTys.push_back(arg->getType());
+        }
+
+        auto stringFn = module->getOrInsertFunction(name, llvm::FunctionType::get(returnTy, paramTys, false));
+
+        return builder->CreateCall(stringFn, args);
+    }
+
+    // --------------------------------------------
+    // Input and output:
+
+    /**
+     * Byte view, see src/runtime/io.c:
+     *
+     *   {i8* data, i64 length, i32 flags}
+     */
+    llvm::StructType *getBytesType()
+    {
+        if (bytesTy_ == nullptr)
+        {
+            auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+            bytesTy_ = llvm::StructType::create(*ctx, {bytePtrTy, builder->getInt64Ty(), builder->getInt32Ty()},
+                                                "bytes");
+        }
+        return bytesTy_;
+    }
+
+    bool isBytesPointer(llvm::Type *type_)
+    {
+        return type_ == getBytesType()->getPointerTo();
+    }
+
+    llvm::Value *loadBytesField(llvm::Value *bytes, size_t fieldIdx, const std::string &name)
+    {
+        auto bytesTy = getBytesType();
+        return builder->CreateLoad(bytesTy->getElementType(fieldIdx),
+                                   builder->CreateStructGEP(bytesTy, bytes, fieldIdx), name);
+    }
+
+    /**
+     * (aref <bytes> <index>): the unsigned byte as a number.
+     */
+    llvm::Value *loadByte(llvm::Value *bytes, llvm::Value *index, bool checked)
+    {
+        auto index64 = builder->CreateZExt(index, builder->getInt64Ty(), "idx");
+
+        if (checked)
+        {
+            auto length = loadBytesField(bytes, BYTES_LENGTH_INDEX, "len");
+            genBoundsCheck(builder->CreateICmpULT(index64, length), index64, length);
+        }
+
+        auto data = loadBytesField(bytes, BYTES_DATA_INDEX, "data");
+        auto byte = builder->CreateLoad(builder->getInt8Ty(), builder->CreateInBoundsGEP(builder->getInt8Ty(), data, index64),
+                                        "byte");
+
+        return builder->CreateZExt(byte, builder->getInt32Ty());
+    }
+
+    /**
+     * Characters and length of a string or bytes.
+     */
+    std::pair<llvm::Value *, llvm::Value *> getCharsData(llvm::Value *value)
+    {
+        if (isBytesPointer(value->getType()))
+        {
+            return {loadBytesField(value, BYTES_DATA_INDEX, "data"), loadBytesField(value, BYTES_LENGTH_INDEX, "len")};
+        }
+
+        if (!isStringPointer(value->getType()))
+        {
+            DIE << "[JovianVM]: expected a string or bytes, got " << getTypeName(value->getType());
+        }
+
+        return getStringData(value);
+    }
+
+    /**
+     * I/O runtime function, declared on first use.
+     */
+    llvm::Function *getIOFunction(const std::string &name)
+    {
+        auto ioFn = module->getFunction(name);
+
+        if (ioFn != nullptr)
+        {
+            return ioFn;
+        }
+
+        auto int64Ty = builder->getInt64Ty();
+        auto int32Ty = builder->getInt32Ty();
+        auto voidTy = builder->getVoidTy();
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+        auto bytesPtrTy = getBytesType()->getPointerTo();
+
+        std::map<std::string, llvm::FunctionType *> ioFnTypes{
+            {"jovian_read_file", llvm::FunctionType::get(bytesPtrTy, bytePtrTy, false)},
+            {"jovian_read_stdin", llvm::FunctionType::get(bytesPtrTy, false)},
+            {"jovian_next_line",
+             llvm::FunctionType::get(int32Ty, {bytesPtrTy, int64Ty->getPointerTo(), bytesPtrTy}, false)},
+            {"jovian_parse_int", llvm::FunctionType::get(int64Ty, {bytePtrTy, int64Ty}, false)},
+            {"jovian_bytes_string", llvm::FunctionType::get(getStringType()->getPointerTo(), bytesPtrTy, false)},
+            {"jovian_bytes_free", llvm::FunctionType::get(voidTy, bytesPtrTy, false)},
+            {"jovian_open", llvm::FunctionType::get(int32Ty, {bytePtrTy, bytePtrTy}, false)},
+            {"jovian_write", llvm::FunctionType::get(voidTy, {int32Ty, bytePtrTy, int64Ty}, false)},
+            {"jovian_close", llvm::FunctionType::get(voidTy, int32Ty, false)},
+        };
+
+        ioFn = llvm::Function::Create(ioFnTypes.at(name), llvm::Function::ExternalLinkage, name, *module);
+
+        return ioFn;
+    }
+
+    /**
+     * jovian_argc, jovian_argv: arguments of main, stored on its entry
+     * when first used.
+     */
+    llvm::GlobalVariable *getArgsGlobal(const std::string &name)
+    {
+        if (auto global = module->getNamedGlobal(name))
+        {
+            return global;
+        }
+
+        auto mainFn = module->getFunction("main");
+        auto arg = mainFn->getArg(name == "jovian_argc" ? 0 : 1);
+
+        auto global = new llvm::GlobalVariable(*module, arg->getType(), false, llvm::GlobalVariable::InternalLinkage,
+                                               llvm::Constant::getNullValue(arg->getType()), name);
+
+        auto entry = &mainFn->getEntryBlock();
+        llvm::IRBuilder<> entryBuilder(entry, entry->getFirstInsertionPt());
+        entryBuilder.CreateStore(arg, global);
+
+        return global;
+    }
+
+    // --------------------------------------------
+    // Formatted output:
+
+    /**
+     * Literal text, or a conversion of a printf format. Plain %d, %s
+     * and %c conversions are printed directly, others by printf with
+     * the conversion spec as the format.
+     */
+    struct FormatPart
+    {
+        std::string text;
+        char conversion;
+        bool direct;
+    };
+
+    /**
+     * Splits a literal printf format into parts. Returns false for
+     * formats which must be left to printf: * widths, %n, unknown
+     * conversions, or a wrong number of arguments.
+     */
+    bool parseFormat(const Exp &exp, std::vector<FormatPart> &format)
+    {
+        auto str = std::regex_replace(exp.list[1].string, std::regex("\\\\n"), "\n");
+        std::string text;
+        size_t conversions = 0;
+
+        for (size_t i = 0; i < str.size(); i++)
+        {
+            if (str[i] != '%')
+            {
+                text += str[i];
+                continue;
+            }
+
+            if (i + 1 < str.size() && str[i + 1] == '%')
+            {
+                text += '%';
+                i++;
+                continue;
+            }
+
+            auto specEnd = str.find_first_not_of("-+ #0123456789.hlLqjzt", i + 1);
+
+            if (specEnd == std::string::npos || std::string("diouxXeEfFgGaAcsp").find(str[specEnd]) == std::string::npos)
+            {
+                return false;
+            }
+
+            if (!text.empty())
+            {
+                format.push_back({text, 0, true});
+                text.clear();
+            }
+
+            auto spec = str.substr(i, specEnd - i + 1);
+            auto conversion = str[specEnd];
+
+            // No flags, width or precision, only length modifiers:
+            auto direct = spec.find_first_not_of("%hlLqjz" + std::string(1, conversion)) == std::string::npos &&
+                          std::string("disc").find(conversion) != std::string::npos;
+
+            format.push_back({spec, conversion, direct});
+            conversions++;
+
+            i = specEnd;
+        }
+
+        if (!text.empty())
+        {
+            format.push_back({text, 0, true});
+        }
+
+        return conversions == exp.list.size() - 2;
+    }
+
+    /**
+     * (printf <literal format> <args>...) as a sequence of writes into
+     * the thread's output buffer. Returns the number of printed bytes
+     * like printf.
+     */
+    llvm::Value *genFormattedPrint(const Exp &exp, const std::vector<FormatPart> &format, Env env)
+    {
+        std::vector<llvm::Value *> args{};
+
+        for (auto i = 2; i < exp.list.size(); i++)
+        {
+            args.push_back(gen(exp.list[i], env));
+        }
+
+        auto int64Ty = builder->getInt64Ty();
+
+        llvm::Value *length = builder->getInt64(0);
+        auto argIdx = 0;
+
+        for (auto &part : format)
+        {
+            if (part.conversion == 0)
+            {
+                builder->CreateCall(getPrintFunction("jovian_print_chars"),
+                                    {builder->CreateGlobalStringPtr(part.text), builder->getInt64(part.text.size())});
+                length = builder->CreateAdd(length, builder->getInt64(part.text.size()));
+                continue;
+            }
+
+            auto arg = args[argIdx++];
+            auto argTy = arg->getType();
+            llvm::Value *partLength;
+
+            if (part.direct && part.conversion == 's' && isStringPointer(argTy))
+            {
+                auto data = getStringData(arg);
+                builder->CreateCall(getPrintFunction("jovian_print_chars"), {data.first, data.second});
+                partLength = data.second;
+            }
+            else if (part.direct && part.conversion == 'c' && argTy->isIntegerTy())
+            {
+                builder->CreateCall(getPrintFunction("jovian_print_char"), builder->CreateTrunc(arg, builder->getInt8Ty()));
+                partLength = builder->getInt64(1);
+            }
+            else if (part.direct && part.conversion != 's' && part.conversion != 'c' && argTy->isIntegerTy())
+            {
+                // %hd and %hhd print the value converted to short and char:
+                if (part.text.find("hh") != std::string::npos)
+                {
+                    arg = coerceValue(arg, builder->getInt8Ty());
+                }
+                else if (part.text.find('h') != std::string::npos)
+                {
+                    arg = coerceValue(arg, builder->getInt16Ty());
+                }
+
+                partLength = builder->CreateCall(getPrintFunction("jovian_print_int"), coerceValue(arg, int64Ty));
+            }
+            else
+            {
+                arg = promoteVarArg(arg);
+
+                builder->CreateCall(getPrintFunction("jovian_print_flush"));
+                auto printed = builder->CreateCall(module->getFunction("printf"),
+                                                   {builder->CreateGlobalStringPtr(part.text), arg});
+                partLength = builder->CreateSExt(printed, int64Ty);
+            }
+
+            length = builder->CreateAdd(length, partLength);
+        }
+
+        releaseValues(args);
+
+        return builder->CreateTrunc(length, builder->getInt32Ty());
+    }
+
+    /**
+     * C variadic argument promotions; strings are passed as their
+     * NUL-terminated characters.
+     */
+    llvm::Value *promoteVarArg(llvm::Value *arg)
+    {
+        if (arg->getType()->isFloatTy())
+        {
+            return builder->CreateFPExt(arg, builder->getDoubleTy());
+        }
+
+        if (arg->getType()->isIntegerTy(1))
+        {
+            return builder->CreateZExt(arg, builder->getInt32Ty());
+        }
+
+        if (isStringPointer(arg->getType()))
+        {
+            return getStringData(arg).first;
+        }
+
+        return arg;
+    }
+
+    /**
+     * Output buffer functions, created on first use.
+     */
+    llvm::Function *getPrintFunction(const std::string &name)
+    {
+        if (module->getFunction("jovian_print_flush") == nullptr)
+        {
+            createPrintFunctions();
+        }
+
+        return module->getFunction(name);
+    }
+
+    /**
+     * Thread-local output buffer of PRINT_BUFFER_SIZE bytes, written
+     * to stdout when full, before printf calls and at exit:
+     *
+     *   void jovian_print_flush()
+     *   void jovian_print_chars(i8* chars, i64 length)
+     *   void jovian_print_char(i8 c)
+     *   i64 jovian_print_int(i64 value)
+     *
+     * The main thread flushes at the end of main (lli does not run
+     * atexit handlers of the program); with the runtime, the exiting
+     * thread flushes at exit and runtime errors flush first.
+     */
+    void createPrintFunctions()
+    {
+        auto prevBlock = builder->GetInsertBlock();
+        auto prevPoint = builder->GetInsertPoint();
+
+        auto int64Ty = builder->getInt64Ty();
+        auto int8Ty = builder->getInt8Ty();
+        auto bytePtrTy = int8Ty->getPointerTo();
+        auto bufferTy = llvm::ArrayType::get(int8Ty, PRINT_BUFFER_SIZE);
+
+        auto buffer = new llvm::GlobalVariable(*module, bufferTy, false, llvm::GlobalVariable::InternalLinkage,
+                                               llvm::Constant::getNullValue(bufferTy), "jovian_print_buffer");
+        buffer->setThreadLocal(true);
+
+        auto used = new llvm::GlobalVariable(*module, int64Ty, false, llvm::GlobalVariable::InternalLinkage,
+                                             builder->getInt64(0), "jovian_print_used");
+        used->setThreadLocal(true);
+
+        auto stdoutVar = module->getOrInsertGlobal("stdout", bytePtrTy);
+        auto fwriteFn = module->getOrInsertFunction(
+            "fwrite", llvm::FunctionType::get(int64Ty, {bytePtrTy, int64Ty, int64Ty, bytePtrTy}, false));
+
+        auto createPrintFn = [&](const std::string &name, llvm::Type *returnTy, std::vector<llvm::Type *> paramTys) {
+            return llvm::Function::Create(llvm::FunctionType::get(returnTy, paramTys, false),
+                                          llvm::Function::InternalLinkage, name, *module);
+        };
+
+        auto bufferAt = [&](llvm::Value *index) {
+            return builder->CreateInBoundsGEP(bufferTy, buffer, {builder->getInt64(0), index});
+        };
+
+        // Flush, also called by the runtime at exit and on errors (runtime/print.c):
+        auto flushFn = createPrintFn("jovian_print_flush", builder->getVoidTy(), {});
+        flushFn->setLinkage(llvm::Function::ExternalLinkage);
+        flushFn->addFnAttr(llvm::Attribute::NoInline);
+        {
+            auto entry = createBB("entry", flushFn);
+            auto writeBlock = createBB("write", flushFn);
+            auto endBlock = createBB("end", flushFn);
+
+            builder->SetInsertPoint(entry);
+            auto count = builder->CreateLoad(int64Ty, used, "used");
+            builder->CreateCondBr(builder->CreateICmpEQ(count, builder->getInt64(0)), endBlock, writeBlock);
+
+            builder->SetInsertPoint(writeBlock);
+            builder->CreateCall(fwriteFn, {bufferAt(builder->getInt64(0)), builder->getInt64(1), count,
+                                           builder->CreateLoad(bytePtrTy, stdoutVar, "stdout")});
+            builder->CreateStore(builder->getInt64(0), used);
+            builder->CreateBr(endBlock);
+
+            builder->SetInsertPoint(endBlock);
+            builder->CreateRetVoid();
+        }
+
+        // Chars, longer than the buffer are written directly:
+        auto charsFn = createPrintFn("jovian_print_chars", builder->getVoidTy(), {bytePtrTy, int64Ty});
+        {
+            auto entry = createBB("entry", charsFn);
+            auto flushBlock = createBB("flush", charsFn);
+            auto directBlock = createBB("direct", charsFn);
+            auto copyBlock = createBB("copy", charsFn);
+
+            auto chars = charsFn->getArg(0);
+            auto length = charsFn->getArg(1);
+
+            builder->SetInsertPoint(entry);
+            auto count = builder->CreateLoad(int64Ty, used, "used");
+            auto fits = builder->CreateICmpULE(builder->CreateAdd(count, length), builder->getInt64(PRINT_BUFFER_SIZE));
+            builder->CreateCondBr(fits, copyBlock, flushBlock,
+                                  llvm::MDBuilder(*ctx).createBranchWeights(1 << 10, 1));
+
+            builder->SetInsertPoint(flushBlock);
+            builder->CreateCall(flushFn);
+            auto large = builder->CreateICmpUGT(length, builder->getInt64(PRINT_BUFFER_SIZE));
+            builder->CreateCondBr(large, directBlock, copyBlock);
+
+            builder->SetInsertPoint(directBlock);
+            builder->CreateCall(fwriteFn, {chars, builder->getInt64(1), length,
+                                           builder->CreateLoad(bytePtrTy, stdoutVar, "stdout")});
+            builder->CreateRetVoid();
+
+            builder->SetInsertPoint(copyBlock);
+            count = builder->CreateLoad(int64Ty, used, "used");
+            builder->CreateMemCpy(bufferAt(count), llvm::MaybeAlign(1), chars, llvm::MaybeAlign(1), length);
+            builder->CreateStore(builder->CreateAdd(count, length), used);
+            builder->CreateRetVoid();
+        }
+
+        // Char:
+        auto charFn = createPrintFn("jovian_print_char", builder->getVoidTy(), {int8Ty});
+        {
+            auto entry = createBB("entry", charFn);
+            auto flushBlock = createBB("flush", charFn);
+            auto storeBlock = createBB("store", charFn);
+
+            builder->SetInsertPoint(entry);
+            auto count = builder->CreateLoad(int64Ty, used, "used");
+            auto fits = builder->CreateICmpULT(count, builder->getInt64(PRINT_BUFFER_SIZE));
+            builder->CreateCondBr(fits, storeBlock, flushBlock,
+                                  llvm::MDBuilder(*ctx).createBranchWeights(1 << 10, 1));
+
+            builder->SetInsertPoint(flushBlock);
+            builder->CreateCall(flushFn);
+            builder->CreateBr(storeBlock);
+
+            builder->SetInsertPoint(storeBlock);
+            count = builder->CreateLoad(int64Ty, used, "used");
+            builder->CreateStore(charFn->getArg(0), bufferAt(count));
+            builder->CreateStore(builder->CreateAdd(count, builder->getInt64(1)), used);
+            builder->CreateRetVoid();
+        }
+
+        // Decimal integer, digits are formatted backwards in a local buffer:
+        auto intFn = createPrintFn("jovian_print_int", int64Ty, {int64Ty});
+        {
+            auto entry = createBB("entry", intFn);
+            auto digitBlock = createBB("digit", intFn);
+            auto signBlock = createBB("sign", intFn);
+            auto printBlock = createBB("print", intFn);
+
+            auto value = intFn->getArg(0);
+            auto digitsTy = llvm::ArrayType::get(int8Ty, 20);
+
+            builder->SetInsertPoint(entry);
+            auto digits = builder->CreateAlloca(digitsTy, nullptr, "digits");
+            auto negative = builder->CreateICmpSLT(value, builder->getInt64(0));
+            // Unsigned magnitude, also of INT64_MIN:
+            auto magnitude = builder->CreateSelect(negative, builder->CreateSub(builder->getInt64(0), value), value);
+            builder->CreateBr(digitBlock);
+
+            builder->SetInsertPoint(digitBlock);
+            auto rest = builder->CreatePHI(int64Ty, 2, "rest");
+            auto pos = builder->CreatePHI(int64Ty, 2, "pos");
+            rest->addIncoming(magnitude, entry);
+            pos->addIncoming(builder->getInt64(20), entry);
+
+            auto nextPos = builder->CreateSub(pos, builder->getInt64(1));
+            auto digit = builder->CreateTrunc(builder->CreateURem(rest, builder->getInt64(10)), int8Ty);
+            builder->CreateStore(builder->CreateAdd(digit, builder->getInt8('0')),
+                                 builder->CreateInBoundsGEP(digitsTy, digits, {builder->getInt64(0), nextPos}));
+            auto nextRest = builder->CreateUDiv(rest, builder->getInt64(10));
+            rest->addIncoming(nextRest, digitBlock);
+            pos->addIncoming(nextPos, digitBlock);
+            builder->CreateCondBr(builder->CreateICmpEQ(nextRest, builder->getInt64(0)), signBlock, digitBlock);
+
+            // The sign goes into the output buffer directly:
+            builder->SetInsertPoint(signBlock);
+            auto length = builder->CreateSub(builder->getInt64(20), nextPos);
+            auto minusBlock = createBB("minus", intFn);
+            builder->CreateCondBr(negative, minusBlock, printBlock);
+
+            builder->SetInsertPoint(minusBlock);
+            builder->CreateCall(charFn, builder->getInt8('-'));
+            builder->CreateBr(printBlock);
+
+            builder->SetInsertPoint(printBlock);
+            builder->CreateCall(charsFn, {builder->CreateInBoundsGEP(digitsTy, digits, {builder->getInt64(0), nextPos}),
+                                          length});
+            builder->CreateRet(builder->CreateAdd(length, builder->CreateZExt(negative, int64Ty)));
+        }
+
+        builder->SetInsertPoint(prevBlock, prevPoint);
+    }
+
+    /**
+     * Allocates an object of a given class on the heap.
+     */
+    llvm::Value *mallocInstance(llvm::StructType *cls, const std::string &name)
+    {
+        llvm::Value *mallocPtr;
+
+        if (options.memory == MemoryMode::GC)
+        {
+            auto layout = module->getNamedGlobal(std::string(cls->getName().data()) + "_layout");
+            auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+
+            mallocPtr = builder->CreateCall(module->getFunction("jovian_gc_alloc"),
+                                            builder->CreatePointerCast(layout, bytePtrTy), name);
+        }
+        else if (usesRegions && options.memory == MemoryMode::Malloc)
+        {
+            mallocPtr = regionAlloc(getTypeSize(cls), name);
+        }
+        else
+        {
+            mallocPtr = poolAlloc(getTypeSize(cls), name);
+
+            // Zeroed, so the destructor can release unset fields:
+            if (options.memory == MemoryMode::ARC)
+            {
+                builder->CreateMemSet(mallocPtr, builder->getInt8(0), getTypeSize(cls), llvm::MaybeAlign(8));
+            }
+        }
+
+        auto instance = builder->CreatePointerCast(mallocPtr, cls->getPointerTo());
+
+        initObjectHeader(cls, instance);
+
+        return instance;
+    }
+
+    /**
+     * Pops a block of the given size from its thread-local free list,
+     * falling back to malloc when the list is empty:
+     *
+     *   obj = pool ? pool : malloc(size); pool = *(i8**)obj
+     */
+    llvm::Value *poolAlloc(size_t size, const std::string &name)
+    {
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+        auto pool = getPool(size);
+        auto currentFn = builder->GetInsertBlock()->getParent();
+
+        auto popBlock = createBB("pool_pop", currentFn);
+        auto mallocBlock = createBB("pool_malloc", currentFn);
+        auto allocEndBlock = createBB("pool_end", currentFn);
+
+        auto head = builder->CreateLoad(bytePtrTy, pool);
+        builder->CreateCondBr(builder->CreateIsNull(head), mallocBlock, popBlock);
+
+        builder->SetInsertPoint(popBlock);
+        auto next = builder->CreateLoad(bytePtrTy, builder->CreatePointerCast(head, bytePtrTy->getPointerTo()));
+        builder->CreateStore(next, pool);
+        builder->CreateBr(allocEndBlock);
+
+        builder->SetInsertPoint(mallocBlock);
+        auto mallocPtr = builder->CreateCall(module->getFunction("malloc"), builder->getInt64(size));
+        builder->CreateBr(allocEndBlock);
+
+        builder->SetInsertPoint(allocEndBlock);
+        auto ptr = builder->CreatePHI(bytePtrTy, 2, name);
+        ptr->addIncoming(head, popBlock);
+        ptr->addIncoming(mallocPtr, mallocBlock);
+
+        return ptr;
+    }
+
+    /**
+     * Allocates from the innermost active region, or from the pools
+     * outside of regions. The bump allocation is inlined, a new chunk
+     * is requested from the runtime (runtime/region.c) when it's full:
+     *
+     *   region ? (top + size <= end ? bump : jovian_region_alloc(size)) : pool
+     */
+    llvm::Value *regionAlloc(size_t size, const std::string &name)
+    {
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+        auto regionTy = llvm::StructType::getTypeByName(*ctx, "jovian_region_header");
+        auto currentFn = builder->GetInsertBlock()->getParent();
+
+        // Bump allocations keep the runtime's 16 bytes alignment:
+        auto alignedSize = (size + 15) & ~(size_t)15;
+
+        auto bumpBlock = createBB("region_bump", currentFn);
+        auto fastBlock = createBB("region_fast", currentFn);
+        auto slowBlock = createBB("region_slow", currentFn);
+        auto poolBlock = createBB("region_none", currentFn);
+        auto allocEndBlock = createBB("region_end", currentFn);
+
+        auto region = builder->CreateLoad(regionTy->getPointerTo(), module->getNamedGlobal("jovian_region"));
+        builder->CreateCondBr(builder->CreateIsNull(region), poolBlock, bumpBlock);
+
+        builder->SetInsertPoint(bumpBlock);
+        auto topAddr = builder->CreateStructGEP(regionTy, region, 0);
+        auto top = builder->CreateLoad(bytePtrTy, topAddr);
+        auto newTop = builder->CreateGEP(builder->getInt8Ty(), top, builder->getInt64(alignedSize));
+        auto end = builder->CreateLoad(bytePtrTy, builder->CreateStructGEP(regionTy, region, 1));
+        builder->CreateCondBr(builder->CreateICmpULE(newTop, end), fastBlock, slowBlock);
+
+        builder->SetInsertPoint(fastBlock);
+        builder->CreateStore(newTop, topAddr);
+        builder->CreateBr(allocEndBlock);
+
+        builder->SetInsertPoint(slowBlock);
+        auto chunkPtr = builder->CreateCall(module->getFunction("jovian_region_alloc"), builder->getInt64(size));
+        builder->CreateBr(allocEndBlock);
+
+        builder->SetInsertPoint(poolBlock);
+        auto pooledPtr = poolAlloc(size, name);
+        auto pooledBlock = builder->GetInsertBlock();
+        builder->CreateBr(allocEndBlock);
+
+        builder->SetInsertPoint(allocEndBlock);
+        auto ptr = builder->CreatePHI(bytePtrTy, 3, name);
+        ptr->addIncoming(top, fastBlock);
+        ptr->addIncoming(chunkPtr, slowBlock);
+        ptr->addIncoming(pooledPtr, pooledBlock);
+
+        return ptr;
+    }
+
+    /**
+     * Pushes a block onto the free list of its size. Pooled
+     * memory is reused by later allocations, never unmapped.
+     */
+    void poolFree(llvm::Value *ptr, size_t size)
+    {
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+        auto pool = getPool(size);
+
+        ptr = builder->CreatePointerCast(ptr, bytePtrTy);
+
+        builder->CreateStore(builder->CreateLoad(bytePtrTy, pool),
+                             builder->CreatePointerCast(ptr, bytePtrTy->getPointerTo()));
+        builder->CreateStore(ptr, pool);
+    }
+
+    /**
+     * Thread-local free list head for objects of the given size.
+     */
+    llvm::GlobalVariable *getPool(size_t size)
+    {
+        auto poolName = "jovian_pool_" + std::to_string(size);
+        auto pool = module->getNamedGlobal(poolName);
+
+        if (pool == nullptr)
+        {
+            auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+            pool = new llvm::GlobalVariable(*module, bytePtrTy, false, llvm::GlobalVariable::InternalLinkage,
+                                            llvm::Constant::getNullValue(bytePtrTy), poolName);
+            pool->setThreadLocal(true);
+        }
+
+        return pool;
+    }
+
+    /**
+     * Allocates an object of a given class in the function entry block,
+     * so SROA can later break it into registers.
+     */
+    llvm::Value *allocaInstance(llvm::StructType *cls, const std::string &name)
+    {
+        auto entry = &fn->getEntryBlock();
+        varsBuilder->SetInsertPoint(entry, entry->begin());
+
+        auto instance = varsBuilder->CreateAlloca(cls, 0, name);
+
+        initObjectHeader(cls, instance);
+
+        return instance;
+    }
+
+    /**
+     * Whether a non-escaping instance may live on the stack. Stack
+     * objects are neither scanned by the collector nor destroyed
+     * in ARC mode, so only classes without object fields qualify.
+     */
+    bool canAllocaInstance(llvm::StructType *cls)
+    {
+        if (options.memory == MemoryMode::Malloc)
+        {
+            return true;
+        }
+
+        for (auto fieldTy : cls->elements())
+        {
+            if (isClassPointer(fieldTy))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * Stores the class vTable (and in ARC mode the initial reference
+     * count) into a freshly allocated instance.
+     */
+    void initObjectHeader(llvm::StructType *cls, llvm::Value *instance)
+    {
+        std::string className(cls->getName().data());
+        auto vTableName = className + "_vTable";
+        auto vTableAddr = builder->CreateStructGEP(cls, instance, VTABLE_INDEX);
+        auto vTable = module->getNamedGlobal(vTableName);
+        builder->CreateStore(vTable, vTableAddr);
+
+        if (options.memory == MemoryMode::ARC)
+        {
+            auto refCountAddr = builder->CreateStructGEP(cls, instance, REFCOUNT_INDEX);
+            builder->CreateStore(builder->getInt64(1), refCountAddr);
+        }
+    }
+
+    /**
+     * Number of reserved fields at the beginning of the class layout.
+     */
+    size_t reservedFieldsCount()
+    {
+        return RESERVED_FIELDS_COUNT + (options.memory == MemoryMode::ARC ? 1 : 0);
+    }
+
+    /**
+     * Number of reserved entries at the beginning of the vTable.
+     */
+    size_t reservedMethodsCount()
+    {
+        return options.memory == MemoryMode::ARC ? 1 : 0;
+    }
+
+    /**
+     * Returns size of a type in bytes.
+     */
+    size_t getTypeSize(llvm::Type *type_)
+    {
+        return module->getDataLayout().getTypeAllocSize(type_);
+    }
+
+    /**
+     * Inherits parent class fields.
+     */
+    void inheritClass(llvm::StructType *cls, llvm::StructType *parent)
+    {
+        auto parentClassInfo = &classMap_[parent->getName().data()];
+
+        classMap_[cls->getName().data()] = {
+            cls,
+            parent,
+            parentClassInfo->fieldsMap,
+            parentClassInfo->methodsMap,
+            parentClassInfo->atomicFields
+        };
+    }
+
+    /**
+     * Extracts fields and methods from a class expression.
+     */
+    void buildClassInfo(llvm::StructType *cls, const Exp &clsExp, Env env)
+    {
+        auto className = clsExp.list[1].string;
+        auto classInfo = &classMap_[className];
+
+        auto body = clsExp.list[3];
+
+        for (auto i = 1; i < body.list.size(); i++)
+        {
+            auto exp = body.list[i];
+
+            if (isVar(exp))
+            {
+                auto varNameDecl = exp.list[1];
+                auto fieldName = extractVarName(varNameDecl);
+
+                // Atomic field: (var (<name> (atomic <type>)) <init>)
+                if (varNameDecl.type == ExpType::LIST && isTaggedList(varNameDecl.list[1], "atomic"))
+                {
+                    auto fieldTy = getTypeFromExp(varNameDecl.list[1].list[1]);
+                    checkAtomicType(fieldTy, fieldName);
+
+                    classInfo->fieldsMap[fieldName] = fieldTy;
+                    classInfo->atomicFields.insert(fieldName);
+                    continue;
+                }
+
+                auto fieldTy = extractVarType(varNameDecl);
+
+                classInfo->fieldsMap[fieldName] = fieldTy;
+            }
+            else if (isDef(exp))
+            {
+                auto methodName = exp.list[1].string;
+                auto fnName = className + "_" + methodName;
+
+                classInfo->methodsMap[methodName] = createFunctionProto(fnName, extractFunctionType(exp), env);
+            }
+        }
+
+        buildClassBody(cls);
+    }
+
+    /**
+     * Builds class body from class info.
+     */
+    void buildClassBody(llvm::StructType* cls)
+    {
+        std::string className{cls->getName().data()};
+
+        auto classInfo = &classMap_[className];
+
+        auto vTableName = className + "_vTable";
+        auto vTabley = llvm::StructType::create(*ctx, vTableName);
+
+        auto clsFields = std::vector<llvm::Type*>{vTabley->getPointerTo()};
+
+        if (options.memory == MemoryMode::ARC)
+        {
+            clsFields.push_back(builder->getInt64Ty());
+        }
+
+        for (const auto &fieldInfo : classInfo->fieldsMap)
+        {
+            clsFields.push_back(fieldInfo.second);
+        }
+
+        cls->setBody(clsFields, false);
+
+        if (options.memory == MemoryMode::ARC)
+        {
+            buildDestructor(cls);
+        }
+
+        buildVTable(cls);
+
+        if (options.memory == MemoryMode::GC)
+        {
+            buildLayout(cls);
+        }
+    }
+
+    /**
+     * ARC mode: creates the class destructor, which releases
+     * object fields and returns the instance to its pool:
+     *
+     *   void <Class>_destructor(i8* self)
+     */
+    void buildDestructor(llvm::StructType *cls)
+    {
+        std::string className(cls->getName().data());
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+
+        auto prevBlock = builder->GetInsertBlock();
+
+        auto destructor = llvm::Function::Create(
+            llvm::FunctionType::get(builder->getVoidTy(), bytePtrTy, false),
+            llvm::Function::ExternalLinkage, className + "_destructor", *module);
+
+        createFunctionBlock(destructor);
+
+        auto self = builder->CreatePointerCast(destructor->getArg(0), cls->getPointerTo(), "self");
+
+        for (auto i = reservedFieldsCount(); i < cls->getNumElements(); i++)
+        {
+            auto fieldTy = cls->getElementType(i);
+            if (isClassPointer(fieldTy))
+            {
+                auto address = builder->CreateStructGEP(cls, self, i);
+                releaseValue(builder->CreateLoad(fieldTy, address));
+            }
+        }
+
+        poolFree(destructor->getArg(0), getTypeSize(cls));
+        builder->CreateRetVoid();
+
+        builder->SetInsertPoint(prevBlock);
+    }
+
+    /**
+     * Creates a layout descriptor per class, used by the collector
+     * to trace objects:
+     *
+     *   { i64 size, i64 numPointers, [numPointers x i64] offsets }
+     */
+    void buildLayout(llvm::StructType *cls)
+    {
+        std::string className(cls->getName().data());
+        auto structLayout = module->getDataLayout().getStructLayout(cls);
+
+        std::vector<llvm::Constant *> offsets;
+
+        for (auto i = 0; i < cls->getNumElements(); i++)
+        {
+            if (isClassPointer(cls->getElementType(i)))
+            {
+                offsets.push_back(builder->getInt64(structLayout->getElementOffset(i)));
+            }
+        }
+
+        auto offsetsTy = llvm::ArrayType::get(builder->getInt64Ty(), offsets.size());
+
+        auto layoutValue = llvm::ConstantStruct::getAnon({
+            builder->getInt64(getTypeSize(cls)),
+            builder->getInt64(offsets.size()),
+            llvm::ConstantArray::get(offsetsTy, offsets),
+        });
+
+        createGlobalVar(className + "_layout", layoutValue)->setConstant(true);
+    }
+
+    /**
+     * Creates a vtable per class.
+     *
+     * vTable stores method references to support
+     * inheritance and methods overloading.
+     */
+    void buildVTable(llvm::StructType *cls)
+    {
+        std::string classsName(cls->getName().data());
+        auto vTableName = classsName + "_vTable";
+
+        auto vTableTy = llvm::StructType::getTypeByName(*ctx, vTableName);
+
+        std::vector<llvm::Constant*> vtableMethods;
+        std::vector<llvm::Type*> vtableMethodTys;
+
+        if (options.memory == MemoryMode::ARC)
+        {
+            auto destructor = module->getFunction(classsName + "_destructor");
+            vtableMethods.push_back(destructor);
+            vtableMethodTys.push_back(destructor->getType());
+        }
+
+        for(auto& methodInfo : classMap_[classsName].methodsMap) {
+            auto method = methodInfo.second;
+            vtableMethods.push_back(method);
+            vtableMethodTys.push_back(method->getType());
+        }
+
+
+        vTableTy->setBody(vtableMethodTys);
+        auto vTableValue = llvm::ConstantStruct::get(vTableTy, vtableMethods);
+        createGlobalVar(vTableName, vTableValue);
+
+    }
+
+    /**
+     * Tagged lists.
+     */
+    bool isTaggedList(const Exp &exp, const std::string &tag)
+    {
+        return exp.type == ExpType::LIST && !exp.list.empty() && exp.list[0].type == ExpType::SYMBOL &&
+               exp.list[0].string == tag;
+    }
+
+    /**
+     * (var ...)
+     */
+    bool isVar(const Exp &exp) { return isTaggedList(exp, "var"); }
+
+    /**
+     * (def ...)
+     */
+    bool isDef(const Exp &exp) { return isTaggedList(exp, "def"); }
+
+    /**
+     * (new ...)
+     */
+    bool isNew(const Exp &exp) { return isTaggedList(exp, "new"); }
+
+    /**
+     * (prop ...)
+     */
+    bool isProp(const Exp &exp) { return isTaggedList(exp, "prop"); }
+
+    /**
+     * (super ...)
+     */
+    bool isSuper(const Exp &exp) { return isTaggedList(exp, "super"); }
+
+    llvm::StructType *getClassByName(const std::string &name)
+    {
+        auto cls = llvm::StructType::getTypeByName(*ctx, name);
+
+        // Generic class instances are created on first use:
+        if (cls == nullptr && isGenericName(name))
+        {
+            instantiateGeneric(name);
+            cls = llvm::StructType::getTypeByName(*ctx, name);
+        }
+
+        return cls;
+    }
+
+    /**
+     * Whether a class is the ancestor class or inherits from it.
+     */
+    bool isSubclass(llvm::StructType *cls, llvm::StructType *ancestor)
+    {
+        for (; cls != nullptr; cls = classMap_[cls->getName().str()].parent)
+        {
+            if (cls == ancestor)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Whether the type is a pointer to a class instance.
+     */
+    bool isClassPointer(llvm::Type *type_)
+    {
+        if (!type_->isPointerTy() || !type_->getContainedType(0)->isStructTy())
+        {
+            return false;
+        }
+
+        auto structTy = (llvm::StructType *)type_->getContainedType(0);
+
+        return structTy->hasName() && classMap_.count(structTy->getName().data()) != 0;
+    }
+
+    std::string extractVarName(const Exp &exp)
+    {
+        return exp.type == ExpType::LIST ? exp.list[0].string : exp.string;
+    }
+
+    llvm::Type *extractVarType(const Exp &exp)
+    {
+        return exp.type == ExpType::LIST ? getTypeFromExp(exp.list[1]) : builder->getInt32Ty();
+    }
+
+    /**
+     * Type names are symbols, or lists for arrays: (array number)
+     */
+    llvm::Type *getTypeFromExp(const Exp &exp)
+    {
+        if (isTaggedList(exp, "array"))
+        {
+            return getArrayType(getTypeFromExp(exp.list[1]))->getPointerTo();
+        }
+
+        if (isTaggedList(exp, "map"))
+        {
+            return getMapType(getTypeFromExp(exp.list[1]), getTypeFromExp(exp.list[2]))->getPointerTo();
+        }
+
+        if (isTaggedList(exp, "future"))
+        {
+            return getFutureType(getTypeFromExp(exp.list[1]))->getPointerTo();
+        }
+
+        if (isTaggedList(exp, "gen"))
+        {
+            return getGeneratorType(getTypeFromExp(exp.list[1]))->getPointerTo();
+        }
+
+        return getTypeFromString(exp.string);
+    }
+
+    llvm::Type *getTypeFromString(const std::string &type_)
+    {
+        if (type_ == "number")
+        {
+            return builder->getInt32Ty();
+        }
+
+        if (type_ == "int64")
+        {
+            return builder->getInt64Ty();
+        }
+
+        if (type_ == "float64")
+        {
+            return builder->getDoubleTy();
+        }
+
+        if (type_ == "float32")
+        {
+            return builder->getFloatTy();
+        }
+
+        // C types, see (extern ...):
+        if (type_ == "int8")
+        {
+            return builder->getInt8Ty();
+        }
+
+        if (type_ == "int16")
+        {
+            return builder->getInt16Ty();
+        }
+
+        if (type_ == "ptr")
+        {
+            return builder->getInt8Ty()->getPointerTo();
+        }
+
+        if (cStructs_.count(type_) != 0)
+        {
+            return cStructs_[type_].structTy->getPointerTo();
+        }
+
+        if (type_ == "string")
+        {
+            return getStringType()->getPointerTo();
+        }
+
+        if (type_ == "string-builder")
+        {
+            return getStringBuilderType()->getPointerTo();
+        }
+
+        if (type_ == "bytes")
+        {
+            return getBytesType()->getPointerTo();
+        }
+
+        if (auto vectorTy = getVectorTypeFromString(type_))
+        {
+            return vectorTy;
+        }
+
+        if (classMap_.count(type_) == 0 && isGenericName(type_))
+        {
+            instantiateGeneric(type_);
+        }
+
+        if (classMap_.count(type_) == 0)
+        {
+            DIE << "[JovianVM]: Unknown type " << type_;
+        }
+
+        return classMap_[type_].cls->getPointerTo();
+    }
+
+    bool hasReturnType(const Exp &fnExp)
+    {
+        return fnExp.list[3].type == ExpType::SYMBOL &&
+               fnExp.list[3].string == "->";
+    }
+
+    llvm::FunctionType *extractFunctionType(const Exp &fnExp)
+    {
+        auto params = fnExp.list[2];
+
+        auto returnType = hasReturnType(fnExp)
+                              ? getTypeFromExp(fnExp.list[4])
+                              : builder->getInt32Ty();
+
+        std::vector<llvm::Type *> paramTypes;
+
+        for (auto &param : params.list)
+        {
+            auto paramName = extractVarName(param);
+            auto paramType = extractVarType(param);
+
+            // paramTypes.push_back(paramType);
+
+            paramTypes.push_back(
+                paramName == "self" ? (llvm::Type*)cls->getPointerTo() : paramType);
+        }
+
+        return llvm::FunctionType::get(returnType, paramTypes, false);
+    }
+
+    llvm::Value *compileFunction(const Exp &fnExp, std::string fnName, Env env)
+    {
+        auto params = fnExp.list[2];
+        auto body = hasReturnType(fnExp) ? fnExp.list[5] : fnExp.list[3];
+
+        auto prevFn = fn;
+        auto prevBlock = builder->GetInsertBlock();
+
+        auto origName = fnName;
+
+        if (cls != nullptr)
+        {
+            fnName = std::string(cls->getName().data()) + "_" + fnName;
+        }
+
+        auto newFn = createFunction(fnName, extractFunctionType(fnExp), env);
+        fn = newFn;
+
+        auto prevLocalInstances = localInstances;
+        localInstances = escapeAnalysis->findLocalInstances(
+            body, &params, cls != nullptr ? cls->getName().data() : "");
+
+        auto prevOwnedSlots = ownedSlots;
+        ownedSlots.clear();
+
+        auto prevRegionEnvs = regionEnvs;
+        regionEnvs.clear();
+
+        auto prevCheckedIndices = checkedIndices;
+        checkedIndices.clear();
+
+        auto prevLoopTargets = loopTargets;
+        loopTargets.clear();
+
+        auto prevFnBody = fnBody;
+        auto prevFnParams = fnParams;
+        fnBody = &body;
+        fnParams = &params;
+
+        auto prevTailCalls = tailCalls;
+        auto prevTailRecurseBlock = tailRecurseBlock;
+        auto prevTailParamSlots = tailParamSlots;
+        tailCalls.clear();
+        tailParamSlots.clear();
+
+        auto prevCoroutine = coroutine;
+        coroutine = nullptr;
+
+        // Reference counting releases after calls, so they're never in tail position:
+        if (options.memory != MemoryMode::ARC)
+        {
+            collectTailCalls(body);
+        }
+
+        auto idx = 0;
+
+        auto fnEnv = std::make_shared<Environment>(
+            std::map<std::string, llvm::Value *>{}, env);
+
+        for (auto &arg : fn->args())
+        {
+            auto param = params.list[idx++];
+            auto argName = extractVarName(param);
+
+            arg.setName(argName);
+            auto argBinding = allocVar(argName, arg.getType(), fnEnv);
+            builder->CreateStore(&arg, argBinding);
+
+            // ARC: arguments are borrowed from the caller, a reference
+            // is only taken if the parameter gets reassigned.
+            if (isCountedValue(&arg))
+            {
+                if (isAssigned(body, argName))
+                {
+                    retainValue(&arg);
+                }
+                else
+                {
+                    ownedSlots.erase(std::find(ownedSlots.begin(), ownedSlots.end(), argBinding));
+                }
+            }
+
+            tailParamSlots.push_back(argBinding);
+        }
+
+        // Self tail calls jump here with new arguments:
+        tailRecurseBlock = nullptr;
+
+        if (!tailCalls.empty())
+        {
+            tailRecurseBlock = createBB("tailrecurse", fn);
+            builder->CreateBr(tailRecurseBlock);
+            builder->SetInsertPoint(tailRecurseBlock);
+        }
+
+        auto result = coerceValue(gen(body, fnEnv), fn->getReturnType());
+        releaseSlots();
+
+        builder->CreateRet(result);
+
+        builder->SetInsertPoint(prevBlock);
+        fn = prevFn;
+        localInstances = prevLocalInstances;
+        ownedSlots = prevOwnedSlots;
+        regionEnvs = prevRegionEnvs;
+        checkedIndices = prevCheckedIndices;
+        loopTargets = prevLoopTargets;
+        fnBody = prevFnBody;
+        fnParams = prevFnParams;
+        tailCalls = prevTailCalls;
+        tailRecurseBlock = prevTailRecurseBlock;
+        tailParamSlots = prevTailParamSlots;
+        coroutine = prevCoroutine;
+
+        return newFn;
+    }
+
+    llvm::Value *allocVar(std::string &name, llvm::Type *type_, Env env)
+    {
+        auto entry = &fn->getEntryBlock();
+        varsBuilder->SetInsertPoint(entry, entry->begin());
+
+        auto varAlloc = varsBuilder->CreateAlloca(type_, 0, name.c_str());
+        env->define(name, varAlloc);
+
+        if (options.memory == MemoryMode::GC && isClassPointer(type_))
+        {
+            addGCRoot(varAlloc);
+        }
+
+        // Counted slots start empty and release their value on exit:
+        if (options.memory == MemoryMode::ARC && isClassPointer(type_))
+        {
+            varsBuilder->CreateStore(llvm::Constant::getNullValue(type_), varAlloc);
+            ownedSlots.push_back(varAlloc);
+        }
+
+        return varAlloc;
+    }
+
+    /**
+     * Stores a value into a variable or field. In ARC mode the
+     * slot takes over the (+1) value and releases the previous one.
+     */
+    llvm::Value *storeValue(llvm::Value *value, llvm::Value *address)
+    {
+        if (options.memory != MemoryMode::ARC || !isClassPointer(value->getType()))
+        {
+            return builder->CreateStore(value, address);
+        }
+
+        auto prevValue = builder->CreateLoad(value->getType(), address);
+        auto store = builder->CreateStore(value, address);
+        releaseValue(prevValue);
+
+        return store;
+    }
+
+    /**
+     * ARC mode: object values produced by expressions are owned (+1),
+     * loads of variables and fields take a new reference.
+     */
+    llvm::Value *retainValue(llvm::Value *value)
+    {
+        if (isCountedValue(value))
+        {
+            auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+            builder->CreateCall(module->getFunction("jovian_retain"),
+                                builder->CreatePointerCast(value, bytePtrTy));
+        }
+        return value;
+    }
+
+    /**
+     * ARC mode: drops the reference owned by a consumed value.
+     */
+    void releaseValue(llvm::Value *value)
+    {
+        if (isCountedValue(value))
+        {
+            auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+            builder->CreateCall(module->getFunction("jovian_release"),
+                                builder->CreatePointerCast(value, bytePtrTy));
+        }
+    }
+
+    void releaseValues(const std::vector<llvm::Value *> &values)
+    {
+        for (auto value : values)
+        {
+            releaseValue(value);
+        }
+    }
+
+    /**
+     * ARC mode: releases the variables of the current function.
+     */
+    void releaseSlots()
+    {
+        for (auto slot : ownedSlots)
+        {
+            releaseValue(builder->CreateLoad(slot->getAllocatedType(), slot));
+        }
+    }
+
+    /**
+     * Reference counted values: heap objects in ARC mode
+     * (stack instances are owned by their frame).
+     */
+    bool isCountedValue(llvm::Value *value)
+    {
+        return options.memory == MemoryMode::ARC && isClassPointer(value->getType()) &&
+               !llvm::isa<llvm::AllocaInst>(value->stripPointerCasts());
+    }
+
+    /**
+     * Array header type for an element type:
+     *
+     *   { i64 length, i64 capacity, T* data }
+     */
+    llvm::StructType *getArrayType(llvm::Type *elementTy)
+    {
+        if (arrayTypes_.count(elementTy) != 0)
+        {
+            return arrayTypes_[elementTy];
+        }
+
+        // The collector does not scan arrays:
+        if (options.memory == MemoryMode::GC && isClassPointer(elementTy))
+        {
+            DIE << "[JovianVM]: arrays of instances are not supported with --memory=gc";
+        }
+
+        auto arrayTy = llvm::StructType::create(
+            *ctx, {builder->getInt64Ty(), builder->getInt64Ty(), elementTy->getPointerTo()},
+            "array<" + getTypeName(elementTy) + ">");
+
+        arrayTypes_[elementTy] = arrayTy;
+        arrayElementTypes_[arrayTy->getPointerTo()] = elementTy;
+
+        return arrayTy;
+    }
+
+    bool isArrayPointer(llvm::Type *type_)
+    {
+        return arrayElementTypes_.count(type_) != 0;
+    }
+
+    llvm::Type *getArrayElementType(llvm::Type *arrayPtrTy)
+    {
+        if (!isArrayPointer(arrayPtrTy))
+        {
+            DIE << "[JovianVM]: expected an array";
+        }
+        return arrayElementTypes_[arrayPtrTy];
+    }
+
+    /**
+     * Distinct TBAA tags tell LLVM that element stores don't modify
+     * array headers, so length and data loads can be hoisted out of
+     * loops, which then vectorize.
+     */
+    llvm::MDNode *getArrayHeaderTBAATag()
+    {
+        if (arrayHeaderTBAATag == nullptr)
+        {
+            llvm::MDBuilder mdBuilder(*ctx);
+            auto headerTy = mdBuilder.createTBAAScalarTypeNode("array header", getTBAARoot());
+            arrayHeaderTBAATag = mdBuilder.createTBAAStructTagNode(headerTy, headerTy, 0);
+        }
+        return arrayHeaderTBAATag;
+    }
+
+    llvm::MDNode *getArrayTBAATag(llvm::Type *elementTy)
+    {
+        if (arrayElementTBAATags_.count(elementTy) == 0)
+        {
+            llvm::MDBuilder mdBuilder(*ctx);
+            auto arrayTy = getArrayType(elementTy);
+            auto elementTBAATy = mdBuilder.createTBAAScalarTypeNode(
+                std::string(arrayTy->getName().data()) + " element", getTBAARoot());
+            arrayElementTBAATags_[elementTy] = mdBuilder.createTBAAStructTagNode(elementTBAATy, elementTBAATy, 0);
+        }
+        return arrayElementTBAATags_[elementTy];
+    }
+
+    llvm::MDNode *getTBAARoot()
+    {
+        return llvm::MDBuilder(*ctx).createTBAARoot("Jovian TBAA");
+    }
+
+    /**
+     * Allocates an array header and zeroed storage for `length` elements.
+     */
+    llvm::Value *createArray(llvm::Type *elementTy, llvm::Value *length)
+    {
+        auto arrayTy = getArrayType(elementTy);
+        auto length64 = builder->CreateZExt(length, builder->getInt64Ty());
+
+        auto header = builder->CreateCall(module->getFunction("malloc"), builder->getInt64(getTypeSize(arrayTy)));
+        auto array = builder->CreatePointerCast(header, arrayTy->getPointerTo(), "array");
+
+        auto data = builder->CreateCall(module->getFunction("calloc"),
+                                        {length64, builder->getInt64(getTypeSize(elementTy))});
+
+        storeArrayField(array, ARRAY_LENGTH_INDEX, length64);
+        storeArrayField(array, ARRAY_CAPACITY_INDEX, length64);
+        storeArrayField(array, ARRAY_DATA_INDEX, builder->CreatePointerCast(data, elementTy->getPointerTo()));
+
+        return array;
+    }
+
+    /**
+     * Frees the storage and the header of an array.
+     */
+    void freeArray(llvm::Value *array)
+    {
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+        auto data = loadArrayField(array, ARRAY_DATA_INDEX, "data");
+
+        builder->CreateCall(module->getFunction("free"), builder->CreatePointerCast(data, bytePtrTy));
+        builder->CreateCall(module->getFunction("free"), builder->CreatePointerCast(array, bytePtrTy));
+    }
+
+    /**
+     * Appends an element, doubling the capacity when full.
+     */
+    llvm::Value *pushArray(llvm::Value *array, llvm::Value *value)
+    {
+        auto elementTy = getArrayElementType(array->getType());
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+
+        auto length = loadArrayField(array, ARRAY_LENGTH_INDEX, "len");
+        auto capacity = loadArrayField(array, ARRAY_CAPACITY_INDEX, "cap");
+
+        auto growBlock = createBB("push_grow", fn);
+        auto storeBlock = createBB("push_store", fn);
+
+        builder->CreateCondBr(builder->CreateICmpEQ(length, capacity), growBlock, storeBlock);
+
+        builder->SetInsertPoint(growBlock);
+        auto doubled = builder->CreateMul(capacity, builder->getInt64(2));
+        auto newCapacity = builder->CreateSelect(builder->CreateICmpULT(doubled, builder->getInt64(4)),
+                                                 builder->getInt64(4), doubled);
+        auto oldData = builder->CreatePointerCast(loadArrayField(array, ARRAY_DATA_INDEX, "data"), bytePtrTy);
+        auto newData = builder->CreateCall(
+            module->getFunction("realloc"),
+            {oldData, builder->CreateMul(newCapacity, builder->getInt64(getTypeSize(elementTy)))});
+        storeArrayField(array, ARRAY_DATA_INDEX, builder->CreatePointerCast(newData, elementTy->getPointerTo()));
+        storeArrayField(array, ARRAY_CAPACITY_INDEX, newCapacity);
+        builder->CreateBr(storeBlock);
+
+        builder->SetInsertPoint(storeBlock);
+        auto data = loadArrayField(array, ARRAY_DATA_INDEX, "data");
+        auto address = builder->CreateInBoundsGEP(elementTy, data, length);
+
+        value = coerceValue(value, elementTy);
+
+        auto store = builder->CreateStore(value, address);
+        store->setMetadata(llvm::LLVMContext::MD_tbaa, getArrayTBAATag(elementTy));
+
+        auto newLength = builder->CreateAdd(length, builder->getInt64(1));
+        storeArrayField(array, ARRAY_LENGTH_INDEX, newLength);
+
+        return builder->CreateTrunc(newLength, builder->getInt32Ty(), "len");
+    }
+
+    /**
+     * Address of an element, with a bounds check unless the
+     * index is known to be in range.
+     */
+    llvm::Value *arrayElementAddress(llvm::Value *array, llvm::Value *index, bool checked)
+    {
+        auto elementTy = getArrayElementType(array->getType());
+        auto index64 = builder->CreateZExt(index, builder->getInt64Ty(), "idx");
+
+        if (checked)
+        {
+            auto length = loadArrayField(array, ARRAY_LENGTH_INDEX, "len");
+
+            // Unsigned compare also rejects negative indices:
+            genBoundsCheck(builder->CreateICmpULT(index64, length), index64, length);
+        }
+
+        auto data = loadArrayField(array, ARRAY_DATA_INDEX, "data");
+        return builder->CreateInBoundsGEP(elementTy, data, index64, "paddr");
+    }
+
+    /**
+     * Reports the index as out of bounds unless inBounds holds.
+     */
+    void genBoundsCheck(llvm::Value *inBounds, llvm::Value *index, llvm::Value *length)
+    {
+        auto failBlock = createBB("bounds_fail", fn);
+        auto okBlock = createBB("bounds_ok", fn);
+
+        builder->CreateCondBr(inBounds, okBlock, failBlock, llvm::MDBuilder(*ctx).createBranchWeights(1 << 20, 1));
+
+        builder->SetInsertPoint(failBlock);
+        builder->CreateCall(getBoundsErrorFunction(), {index, length});
+        builder->CreateUnreachable();
+
+        builder->SetInsertPoint(okBlock);
+    }
+
+    llvm::Value *loadArrayField(llvm::Value *array, size_t fieldIdx, const std::string &name)
+    {
+        auto arrayTy = (llvm::StructType *)array->getType()->getContainedType(0);
+        auto address = builder->CreateStructGEP(arrayTy, array, fieldIdx);
+
+        auto value = builder->CreateLoad(arrayTy->getElementType(fieldIdx), address, name);
+        value->setMetadata(llvm::LLVMContext::MD_tbaa, getArrayHeaderTBAATag());
+
+        return value;
+    }
+
+    void storeArrayField(llvm::Value *array, size_t fieldIdx, llvm::Value *value)
+    {
+        auto arrayTy = (llvm::StructType *)array->getType()->getContainedType(0);
+        auto address = builder->CreateStructGEP(arrayTy, array, fieldIdx);
+
+        auto store = builder->CreateStore(value, address);
+        store->setMetadata(llvm::LLVMContext::MD_tbaa, getArrayHeaderTBAATag());
+    }
+
+    /**
+     * Reports an out of bounds access and exits:
+     *
+     *   void jovian_bounds_error(i64 index, i64 length)
+     */
+    llvm::Function *getBoundsErrorFunction()
+    {
+        auto errorFn = module->getFunction("jovian_bounds_error");
+
+        if (errorFn != nullptr)
+        {
+            return errorFn;
+        }
+
+        auto prevBlock = builder->GetInsertBlock();
+        auto int64Ty = builder->getInt64Ty();
+
+        auto dprintfFn = module->getOrInsertFunction(
+            "dprintf", llvm::FunctionType::get(builder->getInt32Ty(),
+                                               {builder->getInt32Ty(), builder->getInt8Ty()->getPointerTo()}, true));
+        auto exitFn = module->getOrInsertFunction(
+            "exit", llvm::FunctionType::get(builder->getVoidTy(), builder->getInt32Ty(), false));
+
+        errorFn = llvm::Function::Create(llvm::FunctionType::get(builder->getVoidTy(), {int64Ty, int64Ty}, false),
+                                         llvm::Function::InternalLinkage, "jovian_bounds_error", *module);
+        errorFn->addFnAttr(llvm::Attribute::NoReturn);
+        errorFn->addFnAttr(llvm::Attribute::NoInline);
+        errorFn->addFnAttr(llvm::Attribute::Cold);
+
+        auto fflushFn = module->getOrInsertFunction(
+            "fflush", llvm::FunctionType::get(builder->getInt32Ty(), builder->getInt8Ty()->getPointerTo(), false));
+
+        builder->SetInsertPoint(createBB("entry", errorFn));
+        builder->CreateCall(getPrintFunction("jovian_print_flush"));
+
+        // printf output is in the stdio buffer:
+        builder->CreateCall(fflushFn, llvm::ConstantPointerNull::get(builder->getInt8Ty()->getPointerTo()));
+        auto message = builder->CreateGlobalStringPtr("Fatal error: [Array]: index %lld out of bounds [0, %lld)\n");
+        builder->CreateCall(dprintfFn, {builder->getInt32(2), message, errorFn->getArg(0), errorFn->getArg(1)});
+        builder->CreateCall(exitFn, builder->getInt32(1));
+        builder->CreateUnreachable();
+
+        builder->SetInsertPoint(prevBlock);
+
+        return errorFn;
+    }
+
+    /**
+     * Loop condition (< i (len a)): records that accesses (aref a i) and
+     * (aset a i v) are in bounds, until i or a is assigned in the body.
+     * Both are local variables, which called functions cannot modify,
+     * and arrays never shrink. The compare is signed, so i must be a
+     * counter, which is never negative.
+     */
+    void addCheckedIndex(const Exp &cond, Env env)
+    {
+        if (!isTaggedList(cond, "<") || cond.list[1].type != ExpType::SYMBOL ||
+            !isTaggedList(cond.list[2], "len") || cond.list[2].list[1].type != ExpType::SYMBOL)
+        {
+            return;
+        }
+
+        auto indexName = cond.list[1].string;
+        auto arrayName = cond.list[2].list[1].string;
+
+        auto indexSlot = env->lookup(indexName);
+        auto arraySlot = env->lookup(arrayName);
+
+        if (llvm::isa<llvm::AllocaInst>(indexSlot) && llvm::isa<llvm::AllocaInst>(arraySlot) &&
+            isCounter(*fnBody, indexName) && !isParam(indexName))
+        {
+            checkedIndices.push_back({indexSlot, arraySlot, indexName, arrayName});
+        }
+    }
+
+    /**
+     * Whether all assignments of the variable in the function are
+     * (var i <literal>), (set i <literal>) or (set i (+ i 1)).
+     */
+    bool isCounter(const Exp &exp, const std::string &name)
+    {
+        if (exp.type != ExpType::LIST)
+        {
+            return true;
+        }
+
+        if ((isTaggedList(exp, "var") || isTaggedList(exp, "set")) && extractVarName(exp.list[1]) == name)
+        {
+            auto &value = exp.list[2];
+
+            auto isIncrement = isTaggedList(value, "+") &&
+                               ((value.list[1].type == ExpType::SYMBOL && value.list[1].string == name &&
+                                 value.list[2].type == ExpType::NUMBER && value.list[2].number == 1) ||
+                                (value.list[2].type == ExpType::SYMBOL && value.list[2].string == name &&
+                                 value.list[1].type == ExpType::NUMBER && value.list[1].number == 1));
+
+            if (value.type != ExpType::NUMBER && !isIncrement)
+            {
+                return false;
+            }
+        }
+
+        for (auto &sub : exp.list)
+        {
+            if (!isCounter(sub, name))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool isParam(const std::string &name)
+    {
+        if (fnParams == nullptr)
+        {
+            return false;
+        }
+
+        for (auto &param : fnParams->list)
+        {
+            if (extractVarName(param) == name)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Whether (aref a i ...) / (aset a i ...) needs no bounds check.
+     */
+    bool isCheckedIndex(const Exp &exp, Env env)
+    {
+        if (exp.list[1].type != ExpType::SYMBOL || exp.list[2].type != ExpType::SYMBOL)
+        {
+            return false;
+        }
+
+        auto indexSlot = env->lookup(exp.list[2].string);
+        auto arraySlot = env->lookup(exp.list[1].string);
+
+        for (auto &checkedIndex : checkedIndices)
+        {
+            if (checkedIndex.indexSlot == indexSlot && checkedIndex.arraySlot == arraySlot)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Forgets checked indices involving an assigned variable.
+     */
+    void invalidateCheckedIndices(llvm::Value *slot)
+    {
+        checkedIndices.erase(std::remove_if(checkedIndices.begin(), checkedIndices.end(),
+                                            [slot](const CheckedIndex &checkedIndex) {
+                                                return checkedIndex.indexSlot == slot ||
+                                                       checkedIndex.arraySlot == slot;
+                                            }),
+                             checkedIndices.end());
+    }
+
+    /**
+     * Forgets checked indices involving variables (by name, conservatively)
+     * assigned anywhere in the expression.
+     */
+    void invalidateCheckedIndices(const Exp &exp, Env env)
+    {
+        if (exp.type != ExpType::LIST || checkedIndices.empty())
+        {
+            return;
+        }
+
+        if (isTaggedList(exp, "set") && exp.list[1].type == ExpType::SYMBOL)
+        {
+            auto &name = exp.list[1].string;
+
+            checkedIndices.erase(std::remove_if(checkedIndices.begin(), checkedIndices.end(),
+                                                [&name](const CheckedIndex &checkedIndex) {
+                                                    return checkedIndex.indexName == name ||
+                                                           checkedIndex.arrayName == name;
+                                                }),
+                                 checkedIndices.end());
+        }
+
+        for (auto &sub : exp.list)
+        {
+            invalidateCheckedIndices(sub, env);
+        }
+    }
+
+    /**
+     * Loop body with (break) and (continue) targets.
+     */
+    void genLoopBody(const Exp &body, Env env, llvm::BasicBlock *continueBlock, llvm::BasicBlock *breakBlock)
+    {
+        loopTargets.push_back({continueBlock, breakBlock, regionEnvs.size()});
+        releaseValue(gen(body, env));
+        loopTargets.pop_back();
+    }
+
+    /**
+     * Step of a counted loop: <number> or (- <number>)
+     */
+    int64_t getLoopStep(const Exp &exp)
+    {
+        int64_t step = 0;
+
+        if (exp.type == ExpType::NUMBER)
+        {
+            step = exp.number;
+        }
+        else if (isTaggedList(exp, "-") && exp.list.size() == 2 && exp.list[1].type == ExpType::NUMBER)
+        {
+            step = -exp.list[1].number;
+        }
+
+        if (step == 0)
+        {
+            DIE << "[JovianVM]: loop step must be a non-zero integer literal";
+        }
+
+        return step;
+    }
+
+    /**
+     * llvm.loop metadata of a counted loop from its hints. Memory
+     * accesses of a parallel loop (the blocks from the body to the
+     * latch) are put in an access group.
+     */
+    llvm::MDNode *createLoopMetadata(const Exp &exp, llvm::BasicBlock *bodyBlock, llvm::BasicBlock *latchBlock)
+    {
+        std::vector<llvm::Metadata *> properties{nullptr};
+
+        auto addProperty = [&](const std::string &name, llvm::Metadata *value) {
+            std::vector<llvm::Metadata *> property{llvm::MDString::get(*ctx, name)};
+            if (value != nullptr)
+            {
+                property.push_back(value);
+            }
+            properties.push_back(llvm::MDNode::get(*ctx, property));
+        };
+
+        auto enable = llvm::ConstantAsMetadata::get(builder->getTrue());
+
+        // Counted loops always terminate:
+        addProperty("llvm.loop.mustprogress", nullptr);
+
+        for (auto i = 2; i < exp.list.size() - 1; i++)
+        {
+            auto &hint = exp.list[i];
+
+            if (hint.type == ExpType::SYMBOL && hint.string == "vectorize")
+            {
+                addProperty("llvm.loop.vectorize.enable", enable);
+            }
+            else if (hint.type == ExpType::SYMBOL && hint.string == "unroll")
+            {
+                addProperty("llvm.loop.unroll.enable", nullptr);
+            }
+            else if (isTaggedList(hint, "unroll") && hint.list.size() == 2 && hint.list[1].type == ExpType::NUMBER)
+            {
+                addProperty("llvm.loop.unroll.count",
+                            llvm::ConstantAsMetadata::get(builder->getInt32(hint.list[1].number)));
+            }
+            else if (hint.type == ExpType::SYMBOL && hint.string == "parallel")
+            {
+                auto accessGroup = llvm::MDNode::getDistinct(*ctx, {});
+
+                for (auto block = bodyBlock->getIterator(); &*block != latchBlock; block++)
+                {
+                    for (auto &inst : *block)
+                    {
+                        if (inst.mayReadOrWriteMemory())
+                        {
+                            inst.setMetadata(llvm::LLVMContext::MD_access_group, accessGroup);
+                        }
+                    }
+                }
+
+                addProperty("llvm.loop.parallel_accesses", accessGroup);
+                addProperty("llvm.loop.vectorize.enable", enable);
+            }
+            else
+            {
+                DIE << "[JovianVM]: unknown loop hint in (for ...)";
+            }
+        }
+
+        // The first operand refers to the loop metadata itself:
+        auto loopId = llvm::MDNode::getDistinct(*ctx, properties);
+        loopId->replaceOperandWith(0, loopId);
+
+        return loopId;
+    }
+
+    /**
+     * Finds expressions in tail position of a function body, looking
+     * through the branches of (if ...) and the last expression of (begin ...).
+     */
+    void collectTailCalls(const Exp &exp)
+    {
+        if (exp.type != ExpType::LIST || exp.list.empty())
+        {
+            return;
+        }
+
+        if (isTaggedList(exp, "if") && exp.list.size() == 4)
+        {
+            collectTailCalls(exp.list[2]);
+            collectTailCalls(exp.list[3]);
+            return;
+        }
+
+        if (isTaggedList(exp, "begin"))
+        {
+            collectTailCalls(exp.list.back());
+            return;
+        }
+
+        tailCalls.insert(&exp);
+    }
+
+    /**
+     * Call in tail position: a self call jumps back to the function
+     * start with the new arguments, and a call of a function with the
+     * same signature becomes a musttail call. Returns nullptr if it
+     * has to stay a regular call.
+     */
+    llvm::Value *genTailCall(llvm::FunctionType *fnTy, llvm::Value *callee, const std::vector<llvm::Value *> &args)
+    {
+        // Stack instances keep their slots across jumps: the next pass
+        // would overwrite one still referenced by a parameter.
+        auto passesInstance = !localInstances.empty() && std::any_of(args.begin(), args.end(), [&](llvm::Value *arg) {
+            return isClassPointer(arg->getType());
+        });
+
+        if (callee == fn && tailRecurseBlock != nullptr && !passesInstance)
+        {
+            for (auto i = 0; i < args.size(); i++)
+            {
+                builder->CreateStore(args[i], tailParamSlots[i]);
+            }
+
+            builder->CreateBr(tailRecurseBlock);
+        }
+
+        // The caller frame must be gone: no stack instances the arguments
+        // may point to, and no shadow stack frame to pop after the call.
+        else if (fnTy == fn->getFunctionType() && options.memory == MemoryMode::Malloc && localInstances.empty())
+        {
+            auto call = builder->CreateCall(fnTy, callee, args);
+            call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+
+            builder->CreateRet(call);
+        }
+
+        else
+        {
+            return nullptr;
+        }
+
+        // Code after the jump is unreachable:
+        builder->SetInsertPoint(createBB("tailcall_end", fn));
+
+        return llvm::UndefValue::get(fn->getReturnType());
+    }
+
+    /**
+     * Binary arithmetic and compare operations: (op a b)
+     */
+    llvm::Value *genBinaryOp(const Exp &exp, Env env)
+    {
+        auto op1 = gen(exp.list[1], env);
+        auto op2 = gen(exp.list[2], env);
+
+        return genBinaryValues(exp.list[0].string, op1, op2, llvm::isa<llvm::Constant>(op1),
+                               llvm::isa<llvm::Constant>(op2));
+    }
+
+    /**
+     * (op a b) of generated operands. literal1 and literal2 tell if
+     * the operands are constants, which take the type of the other
+     * operand.
+     */
+    llvm::Value *genBinaryValues(const std::string &op, llvm::Value *op1, llvm::Value *op2, bool literal1,
+                                 bool literal2)
+    {
+        // Strings compare by characters:
+        if (isStringPointer(op1->getType()) && isStringPointer(op2->getType()) && (op == "==" || op == "!="))
+        {
+            auto equal = callStringFunction("jovian_string_equal", builder->getInt32Ty(), {op1, op2});
+            return op == "==" ? builder->CreateICmpNE(equal, builder->getInt32(0), "tmpcmp")
+                              : builder->CreateICmpEQ(equal, builder->getInt32(0), "tmpcmp");
+        }
+
+        // Instances compare by identity:
+        if (op1->getType()->isPointerTy() && op2->getType()->isPointerTy() && (op == "==" || op == "!="))
+        {
+            op2 = builder->CreatePointerCast(op2, op1->getType());
+            return op == "==" ? builder->CreateICmpEQ(op1, op2, "tmpcmp") : builder->CreateICmpNE(op1, op2, "tmpcmp");
+        }
+
+        auto opTy = unifiedType(op1->getType(), op2->getType());
+
+        // Floating point literals take the type of the other operand:
+        if (opTy->isFloatingPointTy() && op1->getType()->isFloatingPointTy() &&
+            op2->getType()->isFloatingPointTy() && literal1 != literal2)
+        {
+            opTy = literal1 ? op2->getType() : op1->getType();
+        }
+
+        op1 = coerceValue(op1, opTy);
+        op2 = coerceValue(op2, opTy);
+
+        // Vectors operate element-wise, compares give masks:
+        auto isFloat = opTy->getScalarType()->isFloatingPointTy();
+
+        // op: { integer op, floating point op, name }
+        static const std::map<std::string, std::tuple<llvm::Instruction::BinaryOps, llvm::Instruction::BinaryOps, std::string>>
+            mathOps{
+                {"+", {llvm::Instruction::Add, llvm::Instruction::FAdd, "tmpadd"}},
+                {"-", {llvm::Instruction::Sub, llvm::Instruction::FSub, "tmpsub"}},
+                {"*", {llvm::Instruction::Mul, llvm::Instruction::FMul, "tmpmul"}},
+                {"/", {llvm::Instruction::SDiv, llvm::Instruction::FDiv, "tmpdiv"}},
+            };
+
+        static const std::map<std::string, std::pair<llvm::CmpInst::Predicate, llvm::CmpInst::Predicate>>
+            compareOps{
+                {">", {llvm::CmpInst::ICMP_SGT, llvm::CmpInst::FCMP_OGT}},
+                {"<", {llvm::CmpInst::ICMP_SLT, llvm::CmpInst::FCMP_OLT}},
+                {"==", {llvm::CmpInst::ICMP_EQ, llvm::CmpInst::FCMP_OEQ}},
+                {"!=", {llvm::CmpInst::ICMP_NE, llvm::CmpInst::FCMP_UNE}},
+                {">=", {llvm::CmpInst::ICMP_SGE, llvm::CmpInst::FCMP_OGE}},
+                {"<=", {llvm::CmpInst::ICMP_SLE, llvm::CmpInst::FCMP_OLE}},
+            };
+
+        // Floating point operations get the builder's fast-math flags:
+        if (mathOps.count(op) != 0)
+        {
+            auto &mathOp = mathOps.at(op);
+            return builder->CreateBinOp(isFloat ? std::get<1>(mathOp) : std::get<0>(mathOp), op1, op2,
+                                        std::get<2>(mathOp));
+        }
+
+        auto &compareOp = compareOps.at(op);
+        return builder->CreateCmp(isFloat ? compareOp.second : compareOp.first, op1, op2, "tmpcmp");
+    }
+
+    /**
+     * Common type of two operands: the wider numeric type, or
+     * the closest common ancestor class for instances.
+     */
+    llvm::Type *unifiedType(llvm::Type *type1, llvm::Type *type2)
+    {
+        if (type1 == type2)
+        {
+            return type1;
+        }
+
+        if (getNumericRank(type1) >= 0 && getNumericRank(type2) >= 0)
+        {
+            return getNumericRank(type1) >= getNumericRank(type2) ? type1 : type2;
+        }
+
+        // Scalars are splat to the vector type:
+        if (type1->isVectorTy() != type2->isVectorTy())
+        {
+            return type1->isVectorTy() ? type1 : type2;
+        }
+
+        if (isClassPointer(type1) && isClassPointer(type2))
+        {
+            auto cls1 = (llvm::StructType *)type1->getContainedType(0);
+            auto cls2 = (llvm::StructType *)type2->getContainedType(0);
+
+            for (auto ancestor = cls1; ancestor != nullptr; ancestor = classMap_[ancestor->getName().str()].parent)
+            {
+                if (isSubclass(cls2, ancestor))
+                {
+                    return ancestor->getPointerTo();
+                }
+            }
+        }
+
+        DIE << "[JovianVM]: incompatible types " << getTypeName(type1) << " and " << getTypeName(type2);
+        return nullptr;
+    }
+
+    /**
+     * i1 < number (i32) < int64 < float32 < float64, -1 if not numeric.
+     */
+    int getNumericRank(llvm::Type *type_)
+    {
+        std::vector<llvm::Type *> numericTypes{
+            builder->getInt1Ty(), builder->getInt32Ty(), builder->getInt64Ty(),
+            builder->getFloatTy(), builder->getDoubleTy()};
+
+        auto it = std::find(numericTypes.begin(), numericTypes.end(), type_);
+        return it != numericTypes.end() ? std::distance(numericTypes.begin(), it) : -1;
+    }
+
+    /**
+     * Converts a value to the type of the variable, field, element,
+     * parameter or result receiving it: numeric conversions as in C,
+     * and instances to a parent class pointer.
+     */
+    llvm::Value *coerceValue(llvm::Value *value, llvm::Type *targetTy)
+    {
+        auto valueTy = value->getType();
+
+        if (valueTy == targetTy)
+        {
+            return value;
+        }
+
+        // Scalar to vector: converted, then splat to all lanes.
+        auto vectorTy = llvm::dyn_cast<llvm::FixedVectorType>(targetTy);
+
+        if (vectorTy != nullptr && !valueTy->isVectorTy())
+        {
+            return builder->CreateVectorSplat(vectorTy->getNumElements(),
+                                              coerceValue(value, vectorTy->getElementType()), "splat");
+        }
+
+        // Vectors convert element-wise, between equal lane counts:
+        if (valueTy->isVectorTy() &&
+            (!targetTy->isVectorTy() || llvm::cast<llvm::FixedVectorType>(valueTy)->getNumElements() !=
+                                            llvm::cast<llvm::FixedVectorType>(targetTy)->getNumElements()))
+        {
+            DIE << "[JovianVM]: cannot convert " << getTypeName(valueTy) << " to " << getTypeName(targetTy);
+        }
+
+        auto valueElementTy = valueTy->getScalarType();
+        auto targetElementTy = targetTy->getScalarType();
+
+        if (valueElementTy->isIntegerTy() && targetElementTy->isIntegerTy())
+        {
+            return valueElementTy->isIntegerTy(1) ? builder->CreateZExt(value, targetTy)
+                                                  : builder->CreateSExtOrTrunc(value, targetTy);
+        }
+
+        if (valueElementTy->isIntegerTy() && targetElementTy->isFloatingPointTy())
+        {
+            return valueElementTy->isIntegerTy(1) ? builder->CreateUIToFP(value, targetTy)
+                                                  : builder->CreateSIToFP(value, targetTy);
+        }
+
+        if (valueElementTy->isFloatingPointTy() && targetElementTy->isIntegerTy())
+        {
+            return builder->CreateFPToSI(value, targetTy);
+        }
+
+        if (valueElementTy->isFloatingPointTy() && targetElementTy->isFloatingPointTy())
+        {
+            return builder->CreateFPCast(value, targetTy);
+        }
+
+        // Instances convert to their ancestors only:
+        if (isClassPointer(valueTy) && isClassPointer(targetTy) &&
+            isSubclass(llvm::cast<llvm::StructType>(valueTy->getPointerElementType()),
+                       llvm::cast<llvm::StructType>(targetTy->getPointerElementType())))
+        {
+            return builder->CreatePointerCast(value, targetTy);
+        }
+
+        DIE << "[JovianVM]: cannot convert " << getTypeName(valueTy) << " to " << getTypeName(targetTy);
+        return nullptr;
+    }
+
+    /**
+     * Type of the value stored in a variable slot.
+     */
+    llvm::Type *getSlotType(llvm::Value *slot)
+    {
+        if (auto localVar = llvm::dyn_cast<llvm::AllocaInst>(slot))
+        {
+            return localVar->getAllocatedType();
+        }
+
+        auto globalVar = llvm::dyn_cast<llvm::GlobalVariable>(slot);
+
+        if (globalVar != nullptr && !globalVar->isConstant())
+        {
+            return globalVar->getValueType();
+        }
+
+        DIE << "[JovianVM]: cannot assign to " << slot->getName().str();
+        return nullptr;
+    }
+
+    std::string getTypeName(llvm::Type *type_)
+    {
+        std::string typeName;
+        llvm::raw_string_ostream typeNameStream(typeName);
+        type_->print(typeNameStream);
+        return typeNameStream.str();
+    }
+
+    /**
+     * Phi of the results of branches which jump to endBlock. Results
+     * are converted to their widest type; a null result (a missing
+     * default) is zero. Leaves the builder at the end block.
+     */
+    llvm::Value *genBranchResult(std::vector<std::pair<llvm::BasicBlock *, llvm::Value *>> &results,
+                                 llvm::BasicBlock *endBlock, const std::string &name)
+    {
+        llvm::Type *resTy = nullptr;
+
+        for (auto &result : results)
+        {
+            if (result.second != nullptr)
+            {
+                resTy = resTy == nullptr ? result.second->getType() : unifiedType(resTy, result.second->getType());
+            }
+        }
+
+        resTy = resTy != nullptr ? resTy : builder->getInt32Ty();
+
+        for (auto &result : results)
+        {
+            if (result.second == nullptr)
+            {
+                result.second = llvm::Constant::getNullValue(resTy);
+            }
+            else if (result.second->getType() != resTy)
+            {
+                builder->SetInsertPoint(result.first->getTerminator());
+                result.second = coerceValue(result.second, resTy);
+            }
+        }
+
+        builder->SetInsertPoint(endBlock);
+
+        auto phi = builder->CreatePHI(resTy, results.size(), name);
+        for (auto &result : results)
+        {
+            phi->addIncoming(result.second, result.first);
+        }
+
+        return phi;
+    }
+
+    /**
+     * Evaluates the expressions of a block in the given
+     * environment, returns the last value.
+     */
+    llvm::Value *genBlock(const Exp &exp, Env blockEnv)
+    {
+        llvm::Value *blockRes;
+        for (auto i = 1; i < exp.list.size(); i++)
+        {
+            if (i > 1)
+            {
+                releaseValue(blockRes);
+            }
+            blockRes = gen(exp.list[i], blockEnv);
+        }
+        return blockRes;
+    }
+
+    /**
+     * Rejects storing an object allocated in a region to a variable
+     * or an object declared outside of it: (set <target> <value>)
+     *
+     * A variable holds objects of its own region or of the enclosing
+     * ones, so storing one variable to another of the same or a deeper
+     * region is allowed. Other values may be allocated in the innermost
+     * region.
+     */
+    void checkRegionEscape(const Exp &target, const Exp &valueExp, llvm::Value *value, Env env)
+    {
+        if (regionEnvs.empty() || !isClassPointer(value->getType()))
+        {
+            return;
+        }
+
+        // (prop (prop x a) b) is rooted at x:
+        auto root = &target;
+        while (isProp(*root))
+        {
+            root = &root->list[1];
+        }
+
+        auto targetLevel = root->type == ExpType::SYMBOL ? getRegionLevel(root->string, env) : -1;
+        auto valueLevel = valueExp.type == ExpType::SYMBOL ? getRegionLevel(valueExp.string, env)
+                                                            : (int)regionEnvs.size() - 1;
+
+        if (valueLevel > targetLevel)
+        {
+            DIE << "[JovianVM]: object escapes its region in (set " << (root->type == ExpType::SYMBOL ? root->string : "...") << " ...)";
+        }
+    }
+
+    /**
+     * Index in regionEnvs of the innermost region declaring the
+     * variable, -1 if it is declared outside of all regions.
+     */
+    int getRegionLevel(const std::string &name, Env env)
+    {
+        if (!env->isDefined(name))
+        {
+            return -1;
+        }
+
+        for (auto i = (int)regionEnvs.size() - 1; i >= 0; i--)
+        {
+            if (env->isDefinedWithin(name, regionEnvs[i]))
+            {
+                return i;
+            }
+        }
+
+        return -1;
+    }
+
+    /**
+     * Whether an argument of a call in a region may be an object
+     * allocated in it. Variables declared outside of all regions
+     * cannot hold one, see checkRegionEscape.
+     */
+    bool isRegionArgument(const Exp &arg, llvm::Value *value, Env env)
+    {
+        if (regionEnvs.empty() || !isClassPointer(value->getType()))
+        {
+            return false;
+        }
+
+        return arg.type != ExpType::SYMBOL || env->isDefinedWithin(arg.string, regionEnvs.front());
+    }
+
+    /**
+     * Rejects passing objects allocated in a region to a call which may
+     * keep them beyond the call, e.g. storing them to an outer object:
+     * they are freed with the region. positions are the indices of such
+     * arguments in the call.
+     */
+    void checkRegionCallEscape(const Exp &exp, const std::set<size_t> &positions, llvm::Value *receiver = nullptr)
+    {
+        if (positions.empty())
+        {
+            return;
+        }
+
+        auto captures = false;
+
+        if (isTaggedList(exp, "new"))
+        {
+            captures = escapeAnalysis->constructorCaptures(exp, positions);
+        }
+        else
+        {
+            auto receiverClass = receiver != nullptr && isClassPointer(receiver->getType())
+                                     ? receiver->getType()->getPointerElementType()->getStructName().str()
+                                     : "";
+            captures = escapeAnalysis->callCaptures(exp, positions, receiverClass);
+        }
+
+        if (captures)
+        {
+            auto argument = *positions.begin() - (isTaggedList(exp, "new") ? 1 : 0);
+            DIE << "[JovianVM]: object escapes its region as argument " << argument << " of a call which keeps it";
+        }
+    }
+
+    /**
+     * Whether the program contains a tagged list form.
+     */
+    bool containsForm(const Exp &exp, const std::string &tag)
+    {
+        if (exp.type != ExpType::LIST)
+        {
+            return false;
+        }
+
+        if (isTaggedList(exp, tag))
+        {
+            return true;
+        }
+
+        for (auto &sub : exp.list)
+        {
+            if (containsForm(sub, tag))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Whether the variable is reassigned with (set <name> ...).
+     */
+    bool isAssigned(const Exp &exp, const std::string &name)
+    {
+        if (exp.type != ExpType::LIST)
+        {
+            return false;
+        }
+
+        if (isTaggedList(exp, "set") && exp.list[1].type == ExpType::SYMBOL && exp.list[1].string == name)
+        {
+            return true;
+        }
+
+        for (auto &sub : exp.list)
+        {
+            if (isAssigned(sub, name))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Registers a stack slot with the shadow stack. The vars builder
+     * is expected to point right after the slot allocation.
+     */
+    void addGCRoot(llvm::AllocaInst *slot)
+    {
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+        auto gcroot = llvm::Intrinsic::getDeclaration(module.get(), llvm::Intrinsic::gcroot);
+
+        varsBuilder->CreateCall(gcroot, {varsBuilder->CreatePointerCast(slot, bytePtrTy->getPointerTo()),
+                                         llvm::ConstantPointerNull::get(bytePtrTy)});
+    }
+
+    /**
+     * GC mode: keeps an object value in a temporary root slot while
+     * evaluating the following call arguments, which may allocate
+     * and move it.
+     */
+    llvm::Value *pinValue(llvm::Value *value)
+    {
+        if (options.memory != MemoryMode::GC || !isClassPointer(value->getType()))
+        {
+            return value;
+        }
+
+        std::string name = "pin";
+        auto entry = &fn->getEntryBlock();
+        varsBuilder->SetInsertPoint(entry, entry->begin());
+
+        auto slot = varsBuilder->CreateAlloca(value->getType(), 0, name);
+        addGCRoot(slot);
+
+        builder->CreateStore(value, slot);
+        pinnedSlots.insert(slot);
+
+        return slot;
+    }
+
+    /**
+     * Reloads pinned values right before the call, clearing
+     * the slots so they do not retain the objects.
+     */
+    void unpinValues(std::vector<llvm::Value *> &values)
+    {
+        for (auto &value : values)
+        {
+            if (pinnedSlots.count(value) == 0)
+            {
+                continue;
+            }
+
+            auto slot = (llvm::AllocaInst *)value;
+            value = builder->CreateLoad(slot->getAllocatedType(), slot);
+            builder->CreateStore(llvm::Constant::getNullValue(slot->getAllocatedType()), slot);
+            pinnedSlots.erase(slot);
+        }
+    }
+
+    /**
+     * Creates a gloabl variable
+     */
+    llvm::GlobalVariable *createGlobalVar(const std::string &name, llvm::Constant *init)
+    {
+        module->getOrInsertGlobal(name, init->getType());
+        auto variable = module->getNamedGlobal(name);
+        variable->setAlignment(llvm::MaybeAlign(4));
+        variable->setConstant(false);
+        variable->setInitializer(init);
+        return variable;
+    }
+
+    // --------------------------------------------
+    // Generics:
+
+    /**
+     * Generic names are <name><T>..., one <...> per type parameter, e.g.
+     * Pair<K><V>. Instances replace the parameters with types:
+     * Pair<string><Box<number>>. Returns false for other names.
+     */
+    bool splitGenericName(const std::string &name, std::string &baseName, std::vector<std::string> &typeArgs)
+    {
+        auto start = name.find('<');
+
+        if (start == 0 || start == std::string::npos || name.back() != '>')
+        {
+            return false;
+        }
+
+        baseName = name.substr(0, start);
+        typeArgs.clear();
+
+        for (auto i = start; i < name.size(); i++)
+        {
+            if (name[i] != '<')
+            {
+                return false;
+            }
+
+            auto depth = 0;
+            auto end = i;
+
+            for (; end < name.size(); end++)
+            {
+                depth += name[end] == '<' ? 1 : name[end] == '>' ? -1 : 0;
+                if (depth == 0)
+                {
+                    break;
+                }
+            }
+
+            if (end == name.size() || end == i + 1)
+            {
+                return false;
+            }
+
+            typeArgs.push_back(name.substr(i + 1, end - i - 1));
+            i = end;
+        }
+
+        return true;
+    }
+
+    bool isGenericName(const std::string &name)
+    {
+        std::string baseName;
+        std::vector<std::string> typeArgs;
+        return splitGenericName(name, baseName, typeArgs);
+    }
+
+    /**
+     * Whether a name is an instance of a declared generic, as
+     * Box<number> of Box<T>, rather than a generic declaration.
+     */
+    bool isInstanceName(const std::string &name)
+    {
+        std::string baseName;
+        std::vector<std::string> typeArgs;
+        splitGenericName(name, baseName, typeArgs);
+
+        auto &generics = genericClasses_.count(baseName) != 0 ? genericClasses_ : genericFunctions_;
+
+        return generics.count(baseName) != 0 && generics[baseName].typeParams != typeArgs;
+    }
+
+    std::string getGenericInstanceName(const std::string &baseName, const std::vector<std::string> &typeArgs)
+    {
+        auto name = baseName;
+
+        for (auto &typeArg : typeArgs)
+        {
+            name += "<" + typeArg + ">";
+        }
+
+        return name;
+    }
+
+    /**
+     * Records a generic function or class. Nothing is compiled until
+     * it is instantiated.
+     */
+    void declareGeneric(std::map<std::string, GenericInfo> &generics, const Exp &exp, Env env)
+    {
+        std::string baseName;
+        std::vector<std::string> typeParams;
+        splitGenericName(exp.list[1].string, baseName, typeParams);
+
+        for (auto &typeParam : typeParams)
+        {
+            if (isGenericName(typeParam) || typeParam.find('(') != std::string::npos)
+            {
+                DIE << "[JovianVM]: type parameters of " << baseName << " must be names, got " << typeParam;
+            }
+        }
+
+        if (genericFunctions_.count(baseName) != 0 || genericClasses_.count(baseName) != 0)
+        {
+            DIE << "[JovianVM]: generic " << baseName << " is already defined";
+        }
+
+        generics[baseName] = {typeParams, exp, env};
+    }
+
+    /**
+     * Instance of a generic function or class, e.g. max<float64>: the
+     * declaration with the type parameters replaced is compiled once
+     * per list of type arguments, as a separate function or class.
+     * Returns the function, or nullptr for classes.
+     */
+    llvm::Function *instantiateGeneric(const std::string &instanceName)
+    {
+        std::string baseName;
+        std::vector<std::string> typeArgs;
+        splitGenericName(instanceName, baseName, typeArgs);
+
+        auto isClass = genericClasses_.count(baseName) != 0;
+
+        if (!isClass && genericFunctions_.count(baseName) == 0)
+        {
+            DIE << "[JovianVM]: unknown generic " << baseName << " of " << instanceName;
+        }
+
+        auto &generic = isClass ? genericClasses_[baseName] : genericFunctions_[baseName];
+
+        if (typeArgs.size() != generic.typeParams.size())
+        {
+            DIE << "[JovianVM]: " << baseName << " expects " << generic.typeParams.size() << " type arguments, got "
+                << instanceName;
+        }
+
+        // Instances are cached by name:
+        if (isClass && llvm::StructType::getTypeByName(*ctx, instanceName) != nullptr)
+        {
+            return nullptr;
+        }
+
+        if (!isClass && module->getFunction(instanceName) != nullptr)
+        {
+            return module->getFunction(instanceName);
+        }
+
+        // Compiled code refers to the expressions, which have to outlive it:
+        genericInstances_.push_back(substituteTypes(generic.exp, generic.typeParams, typeArgs));
+        auto &instanceExp = genericInstances_.back();
+
+        escapeAnalysis->addDeclaration(instanceExp);
+
+        // An instance may be needed while compiling a class:
+        auto prevCls = cls;
+        cls = nullptr;
+
+        gen(instanceExp, generic.env);
+
+        cls = prevCls;
+
+        return isClass ? nullptr : module->getFunction(instanceName);
+    }
+
+    /**
+     * Copy of a generic declaration with the type parameters replaced,
+     * also inside generic names: Box<T> becomes Box<number>.
+     */
+    Exp substituteTypes(const Exp &exp, const std::vector<std::string> &typeParams,
+                        const std::vector<std::string> &typeArgs)
+    {
+        if (exp.type == ExpType::LIST)
+        {
+            auto result = exp;
+
+            for (auto &element : result.list)
+            {
+                element = substituteTypes(element, typeParams, typeArgs);
+            }
+
+            return result;
+        }
+
+        if (exp.type != ExpType::SYMBOL)
+        {
+            return exp;
+        }
+
+        auto param = std::find(typeParams.begin(), typeParams.end(), exp.string);
+
+        // Type arguments like (array number) are parsed back to expressions:
+        if (param != typeParams.end())
+        {
+            auto &typeArg = typeArgs[param - typeParams.begin()];
+
+            if (typeArg.front() == '(')
+            {
+                return parser->parse(typeArg);
+            }
+
+            auto result = exp;
+            result.string = typeArg;
+
+            return result;
+        }
+
+        std::string baseName;
+        std::vector<std::string> nestedArgs;
+
+        if (!splitGenericName(exp.string, baseName, nestedArgs))
+        {
+            return exp;
+        }
+
+        for (auto &nestedArg : nestedArgs)
+        {
+            auto nestedExp = exp;
+            nestedExp.string = nestedArg;
+            nestedArg = substituteTypes(nestedExp, typeParams, typeArgs).string;
+        }
+
+        auto result = exp;
+        result.string = getGenericInstanceName(baseName, nestedArgs);
+
+        return result;
+    }
+
+    /**
+     * Call of a generic function without type arguments: (max a b). The
+     * type arguments are deduced from the types of the arguments, which
+     * are evaluated once.
+     */
+    llvm::Value *genGenericCall(const Exp &exp, Env env)
+    {
+        auto &baseName = exp.list[0].string;
+        auto &generic = genericFunctions_[baseName];
+        auto &params = generic.exp.list[2].list;
+
+        if (exp.list.size() - 1 != params.size())
+        {
+            DIE << "[JovianVM]: " << baseName << " expects " << params.size() << " arguments, got "
+                << exp.list.size() - 1;
+        }
+
+        std::vector<llvm::Value *> args;
+        std::map<std::string, std::string> bindings;
+
+        for (auto i = 1; i < exp.list.size(); i++)
+        {
+            auto argValue = gen(exp.list[i], env);
+
+            if (params[i - 1].type == ExpType::LIST)
+            {
+                deduceTypeArgs(params[i - 1].list[1], argValue->getType(), generic.typeParams, bindings, baseName);
+            }
+
+            args.push_back(pinValue(argValue));
+        }
+
+        std::vector<std::string> typeArgs;
+
+        for (auto &typeParam : generic.typeParams)
+        {
+            if (bindings.count(typeParam) == 0)
+            {
+                DIE << "[JovianVM]: cannot deduce " << typeParam << " of " << baseName << ", call "
+                    << exp.list[0].string << "<...> with explicit types";
+            }
+
+            typeArgs.push_back(bindings[typeParam]);
+        }
+
+        auto instance = instantiateGeneric(getGenericInstanceName(baseName, typeArgs));
+
+        unpinValues(args);
+
+        for (auto i = 0; i < args.size(); i++)
+        {
+            args[i] = coerceValue(args[i], instance->getArg(i)->getType());
+        }
+
+        if (tailCalls.count(&exp) != 0)
+        {
+            if (auto tailResult = genTailCall(instance->getFunctionType(), instance, args))
+            {
+                return tailResult;
+            }
+        }
+
+        auto result = builder->CreateCall(instance, args);
+        releaseValues(args);
+
+        return result;
+    }
+
+    /**
+     * Matches a declared parameter type against the type of an
+     * argument, binding the type parameters it contains: T, (array T)
+     * and generic classes like Box<T>.
+     */
+    void deduceTypeArgs(const Exp &paramTypeExp, llvm::Type *argTy, const std::vector<std::string> &typeParams,
+                        std::map<std::string, std::string> &bindings, const std::string &baseName)
+    {
+        if (isTaggedList(paramTypeExp, "array"))
+        {
+            if (isArrayPointer(argTy))
+            {
+                deduceTypeArgs(paramTypeExp.list[1], getArrayElementType(argTy), typeParams, bindings, baseName);
+            }
+            return;
+        }
+
+        if (paramTypeExp.type != ExpType::SYMBOL)
+        {
+            return;
+        }
+
+        auto &typeName = paramTypeExp.string;
+
+        if (std::find(typeParams.begin(), typeParams.end(), typeName) != typeParams.end())
+        {
+            bindTypeArg(typeName, getTypeExpName(argTy, baseName), bindings, baseName);
+            return;
+        }
+
+        // Box<T> against Box<number>:
+        std::string paramBase, argBase;
+        std::vector<std::string> paramArgs, argArgs;
+
+        if (!isClassPointer(argTy) || !splitGenericName(typeName, paramBase, paramArgs) ||
+            !splitGenericName(argTy->getPointerElementType()->getStructName().str(), argBase, argArgs) ||
+            paramBase != argBase || paramArgs.size() != argArgs.size())
+        {
+            return;
+        }
+
+        for (auto i = 0; i < paramArgs.size(); i++)
+        {
+            if (std::find(typeParams.begin(), typeParams.end(), paramArgs[i]) != typeParams.end())
+            {
+                bindTypeArg(paramArgs[i], argArgs[i], bindings, baseName);
+            }
+        }
+    }
+
+    void bindTypeArg(const std::string &typeParam, const std::string &typeArg,
+                     std::map<std::string, std::string> &bindings, const std::string &baseName)
+    {
+        if (bindings.count(typeParam) != 0 && bindings[typeParam] != typeArg)
+        {
+            DIE << "[JovianVM]: conflicting types " << bindings[typeParam] << " and " << typeArg << " for "
+                << typeParam << " of " << baseName;
+        }
+
+        bindings[typeParam] = typeArg;
+    }
+
+    /**
+     * Name of a type as written in programs, see getTypeFromExp.
+     */
+    std::string getTypeExpName(llvm::Type *type_, const std::string &baseName)
+    {
+        if (type_->isIntegerTy(32))
+        {
+            return "number";
+        }
+
+        if (type_->isIntegerTy(64))
+        {
+            return "int64";
+        }
+
+        if (type_->isDoubleTy())
+        {
+            return "float64";
+        }
+
+        if (type_->isFloatTy())
+        {
+            return "float32";
+        }
+
+        if (type_->isIntegerTy(8))
+        {
+            return "int8";
+        }
+
+        if (type_->isIntegerTy(16))
+        {
+            return "int16";
+        }
+
+        if (isStringPointer(type_))
+        {
+            return "string";
+        }
+
+        if (type_ == getStringBuilderType()->getPointerTo())
+        {
+            return "string-builder";
+        }
+
+        if (isBytesPointer(type_))
+        {
+            return "bytes";
+        }
+
+        if (type_ == builder->getInt8Ty()->getPointerTo())
+        {
+            return "ptr";
+        }
+
+        if (isArrayPointer(type_))
+        {
+            return "(array " + getTypeExpName(getArrayElementType(type_), baseName) + ")";
+        }
+
+        if (isClassPointer(type_) || isCStructPointer(type_))
+        {
+            return type_->getPointerElementType()->getStructName().str();
+        }
+
+        if (auto vectorTy = llvm::dyn_cast<llvm::FixedVectorType>(type_))
+        {
+            auto elementTy = vectorTy->getElementType();
+            std::string laneName = elementTy->isIntegerTy(32)   ? "i32"
+                                   : elementTy->isIntegerTy(64) ? "i64"
+                                   : elementTy->isFloatTy()     ? "f32"
+                                                                : "f64";
+
+            return laneName + "x" + std::to_string(vectorTy->getNumElements());
+        }
+
+        DIE << "[JovianVM]: cannot deduce type arguments of " << baseName << " from " << getTypeName(type_)
+            << ", use explicit types: " << baseName << "<...>";
+        return "";
+    }
+
+    // --------------------------------------------
+    // Memoized functions:
+
+    /**
+     * (def-memo ...): see the form. The body is compiled as
+     * <name>_compute, <name> looks the arguments up in the cache and
+     * calls it on a miss.
+     */
+    llvm::Value *compileMemoFunction(const Exp &exp, Env env)
+    {
+        auto fnExp = exp;
+        auto entries = options.memoEntries;
+        auto ways = 1;
+
+        if (isTaggedList(exp.list[1], "cache"))
+        {
+            auto &cacheExp = exp.list[1];
+
+            if (cacheExp.list.size() < 2 || cacheExp.list.size() > 3 || cacheExp.list[1].type != ExpType::NUMBER ||
+                (cacheExp.list.size() == 3 && cacheExp.list[2].string != "replace" && cacheExp.list[2].string != "lru"))
+            {
+                DIE << "[JovianVM]: expected (cache <entries> [replace | lru])";
+            }
+
+            entries = cacheExp.list[1].number;
+            ways = cacheExp.list.size() == 3 && cacheExp.list[2].string == "lru" ? 2 : 1;
+
+            fnExp.list.erase(fnExp.list.begin() + 1);
+        }
+
+        auto &name = fnExp.list[1].string;
+
+        if (entries < ways || (entries & (entries - 1)) != 0)
+        {
+            DIE << "[JovianVM]: cache of " << name << " must have a power of two entries, got " << entries;
+        }
+
+        if (cls != nullptr)
+        {
+            DIE << "[JovianVM]: methods cannot be memoized: " << name;
+        }
+
+        checkPureFunction(fnExp, env);
+
+        auto fnTy = extractFunctionType(fnExp);
+
+        for (auto type_ : fnTy->subtypes())
+        {
+            if (!type_->isIntegerTy() && !type_->isFloatingPointTy())
+            {
+                DIE << "[JovianVM]: parameters and result of memoized " << name << " must be numbers, got "
+                    << getTypeName(type_);
+            }
+        }
+
+        // Calls, also from the body, go through the cache:
+        auto memoFn = createFunctionProto(name, fnTy, env);
+        pureFunctions_.emplace(name, fnExp);
+
+        auto computeFn = (llvm::Function *)compileFunction(fnExp, name + "_compute", env);
+        computeFn->setLinkage(llvm::Function::InternalLinkage);
+
+        genMemoLookup(memoFn, computeFn, entries, ways);
+
+        return memoFn;
+    }
+
+    /**
+     * Body of a memoized function. Entries are
+     *
+     *   { <params>..., <result>, i8 valid }
+     *
+     * in a thread-local table, so tasks don't race on them. The index
+     * of a set of entries is the high bits of a multiplicative hash of
+     * the arguments. With two ways the first entry of a set is the
+     * most recently used one.
+     */
+    void genMemoLookup(llvm::Function *memoFn, llvm::Function *computeFn, uint64_t entries, int ways)
+    {
+        auto prevBlock = builder->GetInsertBlock();
+        auto int64Ty = builder->getInt64Ty();
+
+        std::vector<llvm::Type *> fieldTys(memoFn->getFunctionType()->param_begin(),
+                                           memoFn->getFunctionType()->param_end());
+        fieldTys.push_back(memoFn->getReturnType());
+        fieldTys.push_back(builder->getInt8Ty());
+
+        auto entryTy = llvm::StructType::create(*ctx, fieldTys, memoFn->getName().str() + "_memo_entry");
+        auto cacheTy = llvm::ArrayType::get(entryTy, entries);
+
+        auto cache = new llvm::GlobalVariable(*module, cacheTy, false, llvm::GlobalVariable::InternalLinkage,
+                                              llvm::Constant::getNullValue(cacheTy),
+                                              memoFn->getName().str() + "_memo", nullptr,
+                                              llvm::GlobalVariable::GeneralDynamicTLSModel);
+
+        createFunctionBlock(memoFn);
+
+        std::vector<llvm::Value *> args;
+        llvm::Value *hash = builder->getInt64(0);
+
+        for (auto &arg : memoFn->args())
+        {
+            args.push_back(&arg);
+
+            auto bits = builder->CreateBitCast(&arg, builder->getIntNTy(arg.getType()->getPrimitiveSizeInBits()));
+            hash = builder->CreateXor(hash, builder->CreateZExt(bits, int64Ty));
+            hash = builder->CreateMul(hash, builder->getInt64(0x9e3779b97f4a7c15ull), "hash");
+        }
+
+        auto setBits = llvm::Log2_64(entries / ways);
+        auto set = setBits == 0 ? builder->getInt64(0) : builder->CreateLShr(hash, 64 - setBits, "set");
+        auto first = builder->CreateMul(set, builder->getInt64(ways));
+
+        std::vector<llvm::Value *> wayAddresses;
+
+        for (auto way = 0; way < ways; way++)
+        {
+            wayAddresses.push_back(builder->CreateInBoundsGEP(
+                cacheTy, cache, {builder->getInt64(0), builder->CreateAdd(first, builder->getInt64(way))}, "way"));
+        }
+
+        auto resultIdx = args.size();
+        auto missBlock = createBB("memo_miss");
+
+        for (auto way = 0; way < ways; way++)
+        {
+            auto address = wayAddresses[way];
+            auto hitBlock = createBB("memo_hit", memoFn);
+            auto nextBlock = way == ways - 1 ? missBlock : createBB("memo_next");
+
+            builder->CreateCondBr(genMemoMatch(entryTy, address, args), hitBlock, nextBlock);
+
+            builder->SetInsertPoint(hitBlock);
+
+            // Second way hit: it becomes the most recently used one.
+            if (way == 1)
+            {
+                auto firstEntry = builder->CreateLoad(entryTy, wayAddresses[0]);
+                auto entry = builder->CreateLoad(entryTy, address);
+                builder->CreateStore(entry, wayAddresses[0]);
+                builder->CreateStore(firstEntry, address);
+            }
+
+            auto resultAddress = builder->CreateStructGEP(entryTy, wayAddresses[0], resultIdx);
+            builder->CreateRet(builder->CreateLoad(fieldTys[resultIdx], resultAddress, "cached"));
+
+            nextBlock->insertInto(memoFn);
+            builder->SetInsertPoint(nextBlock);
+        }
+
+        auto result = builder->CreateCall(computeFn, args, "result");
+
+        // Entries may have changed during the call:
+        if (ways == 2)
+        {
+            builder->CreateStore(builder->CreateLoad(entryTy, wayAddresses[0]), wayAddresses[1]);
+        }
+
+        for (auto i = 0; i < args.size(); i++)
+        {
+            builder->CreateStore(args[i], builder->CreateStructGEP(entryTy, wayAddresses[0], i));
+        }
+
+        builder->CreateStore(result, builder->CreateStructGEP(entryTy, wayAddresses[0], resultIdx));
+        builder->CreateStore(builder->getInt8(1), builder->CreateStructGEP(entryTy, wayAddresses[0], resultIdx + 1));
+        builder->CreateRet(result);
+
+        builder->SetInsertPoint(prevBlock);
+    }
+
+    /**
+     * Whether an entry is valid and has the arguments as its key.
+     * Floating point keys are compared bitwise.
+     */
+    llvm::Value *genMemoMatch(llvm::StructType *entryTy, llvm::Value *address, const std::vector<llvm::Value *> &args)
+    {
+        auto validAddress = builder->CreateStructGEP(entryTy, address, args.size() + 1);
+        llvm::Value *match = builder->CreateICmpNE(builder->CreateLoad(builder->getInt8Ty(), validAddress),
+                                                   builder->getInt8(0));
+
+        for (auto i = 0; i < args.size(); i++)
+        {
+            auto keyTy = builder->getIntNTy(args[i]->getType()->getPrimitiveSizeInBits());
+            auto key = builder->CreateLoad(args[i]->getType(), builder->CreateStructGEP(entryTy, address, i));
+
+            match = builder->CreateAnd(match, builder->CreateICmpEQ(builder->CreateBitCast(key, keyTy),
+                                                                    builder->CreateBitCast(args[i], keyTy)));
+        }
+
+        return match;
+    }
+
+    /**
+     * Checks that a function has no side effects: it only assigns its
+     * own variables, and only calls itself, pure and memoized functions
+     * and readnone extern functions. Reading fields and arrays, which
+     * may change between calls, is not allowed either.
+     */
+    void checkPureFunction(const Exp &fnExp, Env env)
+    {
+        std::set<std::string> locals;
+
+        for (auto &param : fnExp.list[2].list)
+        {
+            locals.insert(extractVarName(param));
+        }
+
+        checkPure(fnExp.list.back(), locals, fnExp.list[1].string, env);
+    }
+
+    void checkPure(const Exp &exp, std::set<std::string> &locals, const std::string &fnName, Env env)
+    {
+        if (exp.type != ExpType::LIST || exp.list.empty())
+        {
+            return;
+        }
+
+        auto impure = [&](const std::string &reason) {
+            DIE << "[JovianVM]: " << fnName << " is not pure: " << reason;
+        };
+
+        auto &tag = exp.list[0];
+
+        // Clauses of (cond ...):
+        if (tag.type != ExpType::SYMBOL)
+        {
+            for (auto &element : exp.list)
+            {
+                checkPure(element, locals, fnName, env);
+            }
+            return;
+        }
+
+        auto &op = tag.string;
+
+        static const std::set<std::string> pureForms{
+            "+", "-", "*", "/", ">", "<", "==", "!=", ">=", "<=",
+            "if", "while", "do-while", "begin", "break", "continue",
+        };
+
+        if (pureForms.count(op) != 0)
+        {
+            for (auto i = 1; i < exp.list.size(); i++)
+            {
+                checkPure(exp.list[i], locals, fnName, env);
+            }
+        }
+        else if (op == "var")
+        {
+            locals.insert(extractVarName(exp.list[1]));
+            checkPure(exp.list[2], locals, fnName, env);
+        }
+        else if (op == "set")
+        {
+            if (exp.list[1].type != ExpType::SYMBOL || locals.count(exp.list[1].string) == 0)
+            {
+                impure("assigns a field or a variable of another function");
+            }
+            checkPure(exp.list[2], locals, fnName, env);
+        }
+        else if (op == "for")
+        {
+            auto &header = exp.list[1];
+            locals.insert(header.list[0].string);
+
+            for (auto i = 1; i < header.list.size(); i++)
+            {
+                checkPure(header.list[i], locals, fnName, env);
+            }
+            checkPure(exp.list.back(), locals, fnName, env);
+        }
+        else if (op == "switch")
+        {
+            checkPure(exp.list[1], locals, fnName, env);
+
+            for (auto i = 2; i < exp.list.size(); i++)
+            {
+                checkPure(exp.list[i].list.back(), locals, fnName, env);
+            }
+        }
+        else if (op == "cond" || op == "else")
+        {
+            for (auto i = 1; i < exp.list.size(); i++)
+            {
+                checkPure(exp.list[i], locals, fnName, env);
+            }
+        }
+        else if (op == fnName || pureFunctions_.count(op) != 0 || isReadNoneExtern(op, env))
+        {
+            for (auto i = 1; i < exp.list.size(); i++)
+            {
+                checkPure(exp.list[i], locals, fnName, env);
+            }
+        }
+        else if (locals.count(op) == 0 && env->isDefined(op))
+        {
+            impure("calls " + op + ", which is not declared with def-pure or def-memo");
+        }
+        else
+        {
+            impure("uses (" + op + " ...)");
+        }
+    }
+
+    bool isReadNoneExtern(const std::string &name, Env env)
+    {
+        auto externFn = env->isDefined(name) ? llvm::dyn_cast<llvm::Function>(env->lookup(name)) : nullptr;
+
+        return externFn != nullptr && externFn->isDeclaration() && externFn->doesNotAccessMemory();
+    }
+
+    // --------------------------------------------
+    // Compile-time evaluation:
+
+    /**
+     * (comptime ...): see the form.
+     */
+    llvm::Value *genComptime(const Exp &exp, Env env)
+    {
+        comptimeSteps_ = COMPTIME_MAX_STEPS;
+        comptimeDepth_ = 0;
+        comptimeAuto_ = false;
+
+        ComptimeScope scope(1);
+
+        try
+        {
+            return getComptimeConstant(evalComptime(exp.list[1], scope, env));
+        }
+        catch (const ComptimeError &error)
+        {
+            DIE << "[JovianVM]: cannot evaluate at compile time: " << error.message;
+        }
+        catch (const ComptimeJump &)
+        {
+            DIE << "[JovianVM]: cannot evaluate at compile time: break or continue outside of a loop";
+        }
+
+        return nullptr;
+    }
+
+    /**
+     * Result of a pure call with constant arguments, nullptr if the
+     * call is compiled.
+     */
+    llvm::Constant *tryComptimeCall(const Exp &exp, Env env)
+    {
+        auto &name = exp.list[0].string;
+
+        if (exp.list[0].type != ExpType::SYMBOL || pureFunctions_.count(name) == 0 || !env->isDefined(name) ||
+            env->lookup(name) != module->getFunction(name))
+        {
+            return nullptr;
+        }
+
+        comptimeSteps_ = COMPTIME_AUTO_STEPS;
+        comptimeDepth_ = 0;
+        comptimeAuto_ = true;
+
+        ComptimeScope scope(1);
+
+        try
+        {
+            auto result = evalComptime(exp, scope, env);
+            return result.constant;
+        }
+        catch (const ComptimeError &)
+        {
+        }
+        catch (const ComptimeJump &)
+        {
+        }
+
+        return nullptr;
+    }
+
+    /**
+     * Evaluation failed, e.g. a variable is not known at compile time.
+     */
+    struct ComptimeError
+    {
+        std::string message;
+    };
+
+    /**
+     * (break) and (continue) unwind to their loop.
+     */
+    struct ComptimeJump
+    {
+        bool isBreak;
+    };
+
+    ComptimeValue comptimeScalar(llvm::Value *value, bool literal, const std::string &op)
+    {
+        auto constant = llvm::dyn_cast<llvm::Constant>(value);
+
+        // Folding gives poison for division by zero, overflowing conversions, ...
+        if (constant == nullptr || llvm::isa<llvm::UndefValue>(constant) ||
+            (!llvm::isa<llvm::ConstantInt>(constant) && !llvm::isa<llvm::ConstantFP>(constant)))
+        {
+            throw ComptimeError{"undefined result of (" + op + " ...)"};
+        }
+
+        return {constant->getType(), constant, nullptr, literal};
+    }
+
+    ComptimeValue coerceComptime(const ComptimeValue &value, llvm::Type *targetTy)
+    {
+        if (value.type == targetTy)
+        {
+            return value;
+        }
+
+        if (value.elements != nullptr || getNumericRank(targetTy) < 0)
+        {
+            throw ComptimeError{"cannot convert " + getTypeName(value.type) + " to " + getTypeName(targetTy)};
+        }
+
+        return comptimeScalar(coerceValue(value.constant, targetTy), value.literal, "convert");
+    }
+
+    ComptimeValue evalComptimeScalar(const Exp &exp, ComptimeScope &scope, Env env)
+    {
+        auto value = evalComptime(exp, scope, env);
+
+        if (value.elements != nullptr)
+        {
+            throw ComptimeError{"expected a number, got an array"};
+        }
+
+        return value;
+    }
+
+    bool evalComptimeCondition(const Exp &exp, ComptimeScope &scope, Env env)
+    {
+        auto cond = evalComptimeScalar(exp, scope, env);
+
+        if (!cond.type->isIntegerTy(1))
+        {
+            throw ComptimeError{"condition is not a comparison"};
+        }
+
+        return cond.constant->isOneValue();
+    }
+
+    int64_t evalComptimeInteger(const Exp &exp, ComptimeScope &scope, Env env)
+    {
+        auto value = evalComptimeScalar(exp, scope, env);
+
+        if (!value.type->isIntegerTy())
+        {
+            throw ComptimeError{"expected an integer"};
+        }
+
+        return value.constant->getUniqueInteger().getSExtValue();
+    }
+
+    ComptimeValue *lookupComptime(const std::string &name, ComptimeScope &scope)
+    {
+        for (auto frame = scope.rbegin(); frame != scope.rend(); frame++)
+        {
+            if (frame->count(name) != 0)
+            {
+                return &frame->at(name);
+            }
+        }
+
+        return nullptr;
+    }
+
+    /**
+     * Interprets an expression. Numbers are LLVM constants, and math
+     * operations and conversions are the ones of code generation on
+     * constants, which the builder folds: results are the same as at
+     * run time. Arrays are shared by reference.
+     */
+    ComptimeValue evalComptime(const Exp &exp, ComptimeScope &scope, Env env)
+    {
+        if (--comptimeSteps_ < 0)
+        {
+            throw ComptimeError{"too many steps"};
+        }
+
+        switch (exp.type)
+        {
+        case ExpType::NUMBER:
+        case ExpType::FLOAT:
+            return comptimeScalar(gen(exp, env), true, "literal");
+
+        case ExpType::STRING:
+            throw ComptimeError{"strings are not supported"};
+
+        case ExpType::SYMBOL:
+        {
+            if (exp.string == "true" || exp.string == "false")
+            {
+                return comptimeScalar(builder->getInt1(exp.string == "true"), true, exp.string);
+            }
+
+            if (auto value = lookupComptime(exp.string, scope))
+            {
+                auto result = *value;
+                result.literal = false;
+                return result;
+            }
+
+            auto globalVar = env->isDefined(exp.string) ? llvm::dyn_cast<llvm::GlobalVariable>(env->lookup(exp.string))
+                                                        : nullptr;
+
+            if (globalVar != nullptr && globalVar->isConstant())
+            {
+                return comptimeScalar(globalVar->getInitializer(), false, exp.string);
+            }
+
+            throw ComptimeError{exp.string + " is not known at compile time"};
+        }
+
+        case ExpType::LIST:
+            break;
+        }
+
+        if (exp.list.empty() || exp.list[0].type != ExpType::SYMBOL)
+        {
+            throw ComptimeError{"unsupported expression"};
+        }
+
+        auto &op = exp.list[0].string;
+
+        static const std::set<std::string> binaryOps{"+", "-", "*", "/", ">", "<", "==", "!=", ">=", "<="};
+
+        if (binaryOps.count(op) != 0)
+        {
+            auto op1 = evalComptimeScalar(exp.list[1], scope, env);
+            auto op2 = evalComptimeScalar(exp.list[2], scope, env);
+
+            auto result = genBinaryValues(op, op1.constant, op2.constant, op1.literal, op2.literal);
+            return comptimeScalar(result, op1.literal && op2.literal, op);
+        }
+
+        if (op == "comptime")
+        {
+            return evalComptime(exp.list[1], scope, env);
+        }
+
+        if (op == "begin")
+        {
+            scope.emplace_back();
+
+            ComptimeValue result = comptimeScalar(builder->getInt32(0), true, op);
+
+            for (auto i = 1; i < exp.list.size(); i++)
+            {
+                result = evalComptime(exp.list[i], scope, env);
+            }
+
+            scope.pop_back();
+            return result;
+        }
+
+        if (op == "var")
+        {
+            auto &decl = exp.list[1];
+            auto value = evalComptime(exp.list[2], scope, env);
+
+            if (decl.type == ExpType::LIST)
+            {
+                value = coerceComptime(value, extractVarType(decl));
+            }
+
+            value.literal = false;
+            scope.back()[extractVarName(decl)] = value;
+
+            return value;
+        }
+
+        if (op == "set")
+        {
+            auto target = exp.list[1].type == ExpType::SYMBOL ? lookupComptime(exp.list[1].string, scope) : nullptr;
+
+            if (target == nullptr)
+            {
+                throw ComptimeError{"only variables of the expression can be assigned"};
+            }
+
+            auto value = coerceComptime(evalComptime(exp.list[2], scope, env), target->type);
+            value.literal = false;
+
+            return *target = value;
+        }
+
+        if (op == "if")
+        {
+            auto isThen = evalComptimeCondition(exp.list[1], scope, env);
+
+            auto result = evalComptime(exp.list[isThen ? 2 : 3], scope, env);
+            result = unifyComptimeBranches(result, {&exp.list[2], &exp.list[3]}, scope, env);
+
+            return result;
+        }
+
+        if (op == "cond" || op == "switch")
+        {
+            return evalComptimeBranches(exp, scope, env);
+        }
+
+        if (op == "while" || op == "do-while" || op == "for")
+        {
+            evalComptimeLoop(exp, scope, env);
+            return comptimeScalar(builder->getInt32(0), true, op);
+        }
+
+        if (op == "break" || op == "continue")
+        {
+            throw ComptimeJump{op == "break"};
+        }
+
+        if (op == "array")
+        {
+            auto elementTy = getTypeFromExp(exp.list[1]);
+            auto length = evalComptimeInteger(exp.list[2], scope, env);
+
+            if (length < 0 || length > (1 << 24))
+            {
+                throw ComptimeError{"array length " + std::to_string(length) + " out of range"};
+            }
+
+            auto elements = std::make_shared<std::vector<llvm::Constant *>>(
+                length, llvm::Constant::getNullValue(elementTy));
+
+            return {getArrayType(elementTy)->getPointerTo(), nullptr, elements, false};
+        }
+
+        if (op == "aref" || op == "aset" || op == "len" || op == "push")
+        {
+            auto array = evalComptime(exp.list[1], scope, env);
+
+            if (array.elements == nullptr)
+            {
+                throw ComptimeError{"(" + op + " ...) of a number"};
+            }
+
+            auto &elements = *array.elements;
+            auto elementTy = getArrayElementType(array.type);
+
+            if (op == "len")
+            {
+                return comptimeScalar(builder->getInt32(elements.size()), false, op);
+            }
+
+            if (op == "push")
+            {
+                elements.push_back(coerceComptime(evalComptimeScalar(exp.list[2], scope, env), elementTy).constant);
+                return comptimeScalar(builder->getInt32(elements.size()), false, op);
+            }
+
+            auto index = evalComptimeInteger(exp.list[2], scope, env);
+
+            if (index < 0 || index >= elements.size())
+            {
+                throw ComptimeError{"index " + std::to_string(index) + " out of bounds of " +
+                                    std::to_string(elements.size())};
+            }
+
+            if (op == "aref")
+            {
+                return comptimeScalar(elements[index], false, op);
+            }
+
+            auto value = coerceComptime(evalComptimeScalar(exp.list[3], scope, env), elementTy);
+            elements[index] = value.constant;
+
+            return value;
+        }
+
+        if (pureFunctions_.count(op) != 0)
+        {
+            return callComptime(exp, scope, env);
+        }
+
+        if (isReadNoneExtern(op, env))
+        {
+            return callComptimeExtern(exp, scope, env);
+        }
+
+        throw ComptimeError{"(" + op + " ...) is not supported"};
+    }
+
+    /**
+     * Branches of different numeric types produce the wider one, as
+     * in code generation: the result is converted to the type all
+     * branches have.
+     */
+    ComptimeValue unifyComptimeBranches(const ComptimeValue &result, const std::vector<const Exp *> &branches,
+                                        ComptimeScope &scope, Env env)
+    {
+        auto resultTy = result.type;
+
+        for (auto branch : branches)
+        {
+            auto branchTy = getComptimeType(*branch, scope, env);
+
+            if (branchTy == nullptr || getNumericRank(branchTy) < 0 || getNumericRank(resultTy) < 0)
+            {
+                return result;
+            }
+
+            resultTy = unifiedType(resultTy, branchTy);
+        }
+
+        auto unified = coerceComptime(result, resultTy);
+        unified.literal = false;
+
+        return unified;
+    }
+
+    /**
+     * (cond ...) and (switch ...): see the forms.
+     */
+    ComptimeValue evalComptimeBranches(const Exp &exp, ComptimeScope &scope, Env env)
+    {
+        std::vector<const Exp *> bodies;
+        const Exp *taken = nullptr;
+
+        if (exp.list[0].string == "cond")
+        {
+            for (auto i = 1; i < exp.list.size(); i++)
+            {
+                auto &clause = exp.list[i];
+                auto isElse = clause.list[0].type == ExpType::SYMBOL && clause.list[0].string == "else";
+
+                bodies.push_back(&clause.list[1]);
+
+                if (taken == nullptr && (isElse || evalComptimeCondition(clause.list[0], scope, env)))
+                {
+                    taken = &clause.list[1];
+                }
+            }
+        }
+        else
+        {
+            auto value = evalComptimeInteger(exp.list[1], scope, env);
+
+            for (auto i = 2; i < exp.list.size(); i++)
+            {
+                auto &clause = exp.list[i];
+                bodies.push_back(&clause.list.back());
+
+                if (isTaggedList(clause, "default"))
+                {
+                    continue;
+                }
+
+                auto &keys = clause.list[1];
+
+                for (auto &key : keys.type == ExpType::LIST ? keys.list : std::vector<Exp>{keys})
+                {
+                    if (taken == nullptr && key.number == value)
+                    {
+                        taken = &clause.list[2];
+                    }
+                }
+            }
+
+            for (auto i = 2; taken == nullptr && i < exp.list.size(); i++)
+            {
+                if (isTaggedList(exp.list[i], "default"))
+                {
+                    taken = &exp.list[i].list[1];
+                }
+            }
+        }
+
+        // No branch taken: zero of the type of the branches.
+        auto result = taken != nullptr ? evalComptime(*taken, scope, env)
+                                       : comptimeScalar(builder->getInt32(0), false, exp.list[0].string);
+
+        return unifyComptimeBranches(result, bodies, scope, env);
+    }
+
+    void evalComptimeLoop(const Exp &exp, ComptimeScope &scope, Env env)
+    {
+        auto &op = exp.list[0].string;
+        auto depth = scope.size();
+
+        // Runs the body, false on (break):
+        auto runBody = [&](const Exp &body) {
+            try
+            {
+                evalComptime(body, scope, env);
+            }
+            catch (const ComptimeJump &jump)
+            {
+                scope.resize(depth);
+                return !jump.isBreak;
+            }
+            return true;
+        };
+
+        if (op == "while")
+        {
+            while (evalComptimeCondition(exp.list[1], scope, env) && runBody(exp.list[2]))
+            {
+            }
+            return;
+        }
+
+        if (op == "do-while")
+        {
+            while (runBody(exp.list[1]) && evalComptimeCondition(exp.list[2], scope, env))
+            {
+            }
+            return;
+        }
+
+        auto &header = exp.list[1];
+        auto step = header.list.size() == 4 ? getLoopStep(header.list[3]) : 1;
+
+        auto start = evalComptimeScalar(header.list[1], scope, env);
+        auto end = evalComptimeScalar(header.list[2], scope, env);
+        auto varTy = unifiedType(start.type, end.type);
+
+        if (!varTy->isIntegerTy() || varTy->isIntegerTy(1))
+        {
+            throw ComptimeError{"loop variable " + header.list[0].string + " must be an integer"};
+        }
+
+        auto last = coerceComptime(end, varTy).constant->getUniqueInteger().getSExtValue();
+
+        for (auto i = coerceComptime(start, varTy).constant->getUniqueInteger().getSExtValue();
+             step > 0 ? i < last : i > last; i += step)
+        {
+            scope.push_back({{header.list[0].string, {varTy, llvm::ConstantInt::get(varTy, i, true), nullptr, false}}});
+
+            auto next = runBody(exp.list.back());
+            scope.resize(depth);
+
+            if (!next)
+            {
+                break;
+            }
+        }
+    }
+
+    /**
+     * Call of a pure function: its body is evaluated with the arguments
+     * converted to the parameter types. Results are cached.
+     */
+    ComptimeValue callComptime(const Exp &exp, ComptimeScope &scope, Env env)
+    {
+        auto &name = exp.list[0].string;
+        auto &fnExp = pureFunctions_.at(name);
+        auto &params = fnExp.list[2].list;
+        auto fnTy = module->getFunction(name)->getFunctionType();
+
+        if (exp.list.size() - 1 != params.size())
+        {
+            throw ComptimeError{name + " expects " + std::to_string(params.size()) + " arguments"};
+        }
+
+        ComptimeScope fnScope(1);
+        std::vector<llvm::Constant *> args;
+        auto literal = true;
+
+        for (auto i = 0; i < params.size(); i++)
+        {
+            auto arg = coerceComptime(evalComptimeScalar(exp.list[i + 1], scope, env), fnTy->getParamType(i));
+
+            literal = literal && arg.literal;
+            arg.literal = false;
+
+            args.push_back(arg.constant);
+            fnScope[0][extractVarName(params[i])] = arg;
+        }
+
+        // A call of constants is folded in code generation:
+        auto &cached = comptimeCalls_[{name, args}];
+
+        if (cached != nullptr)
+        {
+            return comptimeScalar(cached, literal, name);
+        }
+
+        if (comptimeAuto_ && comptimeFailures_.count({name, args}) != 0)
+        {
+            throw ComptimeError{name + " failed before with these arguments"};
+        }
 
-                for(auto i = 1; i < exp.list.size(); i++) {
-                    auto argValue = gen(exp.list[i], env);
+        if (++comptimeDepth_ > COMPTIME_MAX_DEPTH)
+        {
+            comptimeDepth_--;
+            throw ComptimeError{"calls nested too deep"};
+        }
 
-                    auto paramTy = fnTy->getParamType(i -1);
-                    if(argValue->getType() != paramTy) {
-                        auto bitCastArgVal = builder->CreateBitCast(argValue, paramTy);
-                        args.push_back(bitCastArgVal);
-                    } else {
-                        args.push_back(argValue);
-                    }
-                }
+        ComptimeValue result;
 
-                return builder->CreateCall(fnTy, loadedMethod, args);
-            }
+        try
+        {
+            result = coerceComptime(evalComptime(fnExp.list.back(), fnScope, env), fnTy->getReturnType());
         }
+        catch (...)
+        {
+            comptimeDepth_--;
 
-        break;
+            if (comptimeAuto_)
+            {
+                comptimeFailures_.insert({name, args});
+            }
+
+            throw;
         }
 
-        return builder->getInt32(exp.number);
-    }
+        comptimeDepth_--;
 
-    /**
-     * Returns field index.
-     */
-    size_t getFieldIndex(llvm::StructType *cls, const std::string &fieldName)
-    {
-        auto fields = &classMap_[cls->getName().data()].fieldsMap;
-        auto it = fields->find(fieldName);
-        return std::distance(fields->begin(), it) + RESERVED_FIELDS_COUNT;
+        cached = result.constant;
+        result.literal = literal;
+
+        return result;
     }
 
     /**
-     * Returns method index.
+     * Math functions of the C library, declared readnone, on float64.
      */
-    size_t getMethodIndex(llvm::StructType *cls, const std::string &methodName)
+    ComptimeValue callComptimeExtern(const Exp &exp, ComptimeScope &scope, Env env)
     {
-        auto methods = &classMap_[cls->getName().data()].methodsMap;
-        auto it = methods->find(methodName);
-        return std::distance(methods->begin(), it);
+        static const std::map<std::string, double (*)(double)> unaryFns{
+            {"sqrt", std::sqrt}, {"sin", std::sin},     {"cos", std::cos},     {"tan", std::tan},
+            {"exp", std::exp},   {"log", std::log},     {"floor", std::floor}, {"ceil", std::ceil},
+            {"fabs", std::fabs}, {"atan", std::atan},   {"log2", std::log2},   {"round", std::round},
+        };
+
+        static const std::map<std::string, double (*)(double, double)> binaryFns{
+            {"pow", std::pow}, {"atan2", std::atan2}, {"fmod", std::fmod},
+        };
+
+        auto &name = exp.list[0].string;
+        auto fnTy = module->getFunction(name)->getFunctionType();
+        auto arity = exp.list.size() - 1;
+
+        if ((unaryFns.count(name) == 0 || arity != 1) && (binaryFns.count(name) == 0 || arity != 2))
+        {
+            throw ComptimeError{"extern " + name + " cannot be called at compile time"};
+        }
+
+        std::vector<double> args;
+
+        for (auto i = 0; i < arity; i++)
+        {
+            auto arg = coerceComptime(evalComptimeScalar(exp.list[i + 1], scope, env), builder->getDoubleTy());
+            args.push_back(llvm::cast<llvm::ConstantFP>(arg.constant)->getValueAPF().convertToDouble());
+        }
+
+        auto result = arity == 1 ? unaryFns.at(name)(args[0]) : binaryFns.at(name)(args[0], args[1]);
+
+        return coerceComptime(comptimeScalar(llvm::ConstantFP::get(builder->getDoubleTy(), result), false, name),
+                              fnTy->getReturnType());
     }
 
     /**
-     * Creates an instance of a class.
+     * Static type of an expression, as code generation gives it; nullptr
+     * if it cannot be told without evaluating it.
      */
-    llvm::Value *createInstance(const Exp &exp, Env env, const std::string &name)
+    llvm::Type *getComptimeType(const Exp &exp, ComptimeScope &scope, Env env)
     {
-        auto className = exp.list[1].string;
-        auto cls = getClassByName(className);
+        if (exp.type == ExpType::NUMBER || exp.type == ExpType::FLOAT)
+        {
+            return gen(exp, env)->getType();
+        }
 
-        if (cls == nullptr)
+        if (exp.type == ExpType::SYMBOL)
         {
-            DIE << "[JovianVM]: Unknow class" << cls;
+            if (exp.string == "true" || exp.string == "false")
+            {
+                return builder->getInt1Ty();
+            }
+
+            auto value = lookupComptime(exp.string, scope);
+            return value != nullptr ? value->type : nullptr;
         }
 
-        // auto instance = name.empty() ? builder->CreateAlloca(cls)
-        //                              : builder->CreateAlloca(cls, 0, name);
+        if (exp.type != ExpType::LIST || exp.list.empty() || exp.list[0].type != ExpType::SYMBOL)
+        {
+            return nullptr;
+        }
 
-        auto instance = mallocInstance(cls, name);
+        auto &op = exp.list[0].string;
 
-        auto ctor = module->getFunction(className + "_constructor");
+        if (op == "+" || op == "-" || op == "*" || op == "/")
+        {
+            auto type1 = getComptimeType(exp.list[1], scope, env);
+            auto type2 = getComptimeType(exp.list[2], scope, env);
 
-        std::vector<llvm::Value *> args{instance};
+            if (type1 == nullptr || type2 == nullptr || getNumericRank(type1) < 0 || getNumericRank(type2) < 0)
+            {
+                return nullptr;
+            }
 
-        for (auto i = 2; i < exp.list.size(); i++)
+            // Floating point literals take the type of the other operand:
+            auto literal1 = exp.list[1].type == ExpType::NUMBER || exp.list[1].type == ExpType::FLOAT;
+            auto literal2 = exp.list[2].type == ExpType::NUMBER || exp.list[2].type == ExpType::FLOAT;
+
+            if (type1->isFloatingPointTy() && type2->isFloatingPointTy() && literal1 != literal2)
+            {
+                return literal1 ? type2 : type1;
+            }
+
+            return unifiedType(type1, type2);
+        }
+
+        if (op == ">" || op == "<" || op == "==" || op == "!=" || op == ">=" || op == "<=")
         {
-            args.push_back(gen(exp.list[i], env));
+            return builder->getInt1Ty();
         }
 
-        builder->CreateCall(ctor, args);
+        if (op == "if")
+        {
+            auto thenTy = getComptimeType(exp.list[2], scope, env);
+            auto elseTy = getComptimeType(exp.list[3], scope, env);
 
-        return instance;
-    }
+            if (thenTy == nullptr || elseTy == nullptr)
+            {
+                return nullptr;
+            }
 
-    /**
-     * Allocates an object of a given class on the heap.
-     */
-    llvm::Value *mallocInstance(llvm::StructType *cls, const std::string &name)
-    {
-        auto typeSize = builder->getInt64(getTypeSize(cls));
+            return thenTy == elseTy ? thenTy : unifiedType(thenTy, elseTy);
+        }
+
+        if (op == "begin")
+        {
+            return exp.list.size() > 1 ? getComptimeType(exp.list.back(), scope, env) : builder->getInt32Ty();
+        }
 
-        auto mallocPtr = builder->CreateCall(module->getFunction("malloc"), typeSize, name);
+        if (op == "comptime")
+        {
+            return getComptimeType(exp.list[1], scope, env);
+        }
 
-        auto instance = builder->CreatePointerCast(mallocPtr, cls->getPointerTo());
+        if (op == "while" || op == "do-while" || op == "for" || op == "len" || op == "push")
+        {
+            return builder->getInt32Ty();
+        }
 
-        std::string className(cls->getName().data());
-        auto vTableName = className + "_vTable";
-        auto vTableAddr = builder->CreateStructGEP(cls, instance, VTABLE_INDEX);
-        auto vTable = module->getNamedGlobal(vTableName);
-        builder->CreateStore(vTable, vTableAddr);
+        if (op == "array")
+        {
+            return getArrayType(getTypeFromExp(exp.list[1]))->getPointerTo();
+        }
 
-        return instance;
+        if (op == "aref")
+        {
+            auto arrayTy = getComptimeType(exp.list[1], scope, env);
+            return arrayTy != nullptr && isArrayPointer(arrayTy) ? getArrayElementType(arrayTy) : nullptr;
+        }
+
+        if (pureFunctions_.count(op) != 0 || isReadNoneExtern(op, env))
+        {
+            return module->getFunction(op)->getReturnType();
+        }
 
-        // return builder->CreatePointerCast(mallocPtr, cls->getPointerTo());
+        return nullptr;
     }
 
     /**
-     * Returns size of a type in bytes.
+     * Constant of an evaluated value. Arrays are emitted as constant
+     * globals, the header and the elements, so loads from them are
+     * folded.
      */
-    size_t getTypeSize(llvm::Type *type_)
+    llvm::Constant *getComptimeConstant(const ComptimeValue &value)
     {
-        return module->getDataLayout().getTypeAllocSize(type_);
+        if (value.elements == nullptr)
+        {
+            return value.constant;
+        }
+
+        auto arrayTy = llvm::cast<llvm::StructType>(value.type->getPointerElementType());
+        auto elementTy = getArrayElementType(value.type);
+        auto dataTy = llvm::ArrayType::get(elementTy, value.elements->size());
+
+        auto data = new llvm::GlobalVariable(*module, dataTy, true, llvm::GlobalVariable::PrivateLinkage,
+                                             llvm::ConstantArray::get(dataTy, *value.elements), "comptime_data");
+
+        auto length = builder->getInt64(value.elements->size());
+        auto dataPtr = llvm::ConstantExpr::getInBoundsGetElementPtr(dataTy, data,
+                                                                    llvm::ArrayRef<llvm::Constant *>{
+                                                                        builder->getInt64(0), builder->getInt64(0)});
+
+        return new llvm::GlobalVariable(*module, arrayTy, true, llvm::GlobalVariable::PrivateLinkage,
+                                        llvm::ConstantStruct::get(arrayTy, {length, length, dataPtr}), "comptime_array");
     }
 
     /**
-     * Inherits parent class fields.
+     * Arrays of (comptime ...) are constant data.
      */
-    void inheritClass(llvm::StructType *cls, llvm::StructType *parent)
+    llvm::Value *checkMutableArray(llvm::Value *array)
     {
-        auto parentClassInfo = &classMap_[parent->getName().data()];
+        auto globalVar = llvm::dyn_cast<llvm::GlobalVariable>(array);
 
-        classMap_[cls->getName().data()] = {
-            cls,
-            parent,
-            parentClassInfo->fieldsMap,
-            parentClassInfo->methodsMap
-        };
+        if (globalVar != nullptr && globalVar->isConstant())
+        {
+            DIE << "[JovianVM]: arrays computed at compile time cannot be modified";
+        }
+
+        return array;
     }
 
+    // --------------------------------------------
+    // Foreign functions:
+
     /**
-     * Extracts fields and methods from a class expression.
+     * (extern ...): see the form.
      */
-    void buildClassInfo(llvm::StructType *cls, const Exp &clsExp, Env env)
+    void declareExternFunction(const Exp &exp, Env env)
     {
-        auto className = clsExp.list[1].string;
-        auto classInfo = &classMap_[className];
+        if (exp.list.size() < 5 || exp.list.size() > 6 || exp.list[1].type != ExpType::SYMBOL ||
+            exp.list[2].type != ExpType::LIST || exp.list[3].string != "->")
+        {
+            DIE << "[JovianVM]: expected (extern <name> (<params>) -> <type> [(<attributes>)])";
+        }
 
-        auto body = clsExp.list[3];
+        auto &name = exp.list[1].string;
+        auto &params = exp.list[2].list;
+        auto &returnExp = exp.list[4];
 
-        for (auto i = 1; i < body.list.size(); i++)
-        {
-            auto exp = body.list[i];
+        std::vector<llvm::Type *> paramTys;
+        auto isVarArg = false;
 
-            if (isVar(exp))
+        for (auto i = 0; i < params.size(); i++)
+        {
+            if (params[i].type == ExpType::SYMBOL && params[i].string == "varargs")
             {
-                auto varNameDecl = exp.list[1];
-                auto fieldName = extractVarName(varNameDecl);
-                auto fieldTy = extractVarType(varNameDecl);
+                if (i != params.size() - 1)
+                {
+                    DIE << "[JovianVM]: varargs must be the last parameter of " << name;
+                }
+                isVarArg = true;
+                break;
+            }
 
-                classInfo->fieldsMap[fieldName] = fieldTy;
+            if (params[i].type != ExpType::LIST)
+            {
+                paramTys.push_back(builder->getInt32Ty());
+                continue;
             }
-            else if (isDef(exp))
+
+            paramTys.push_back(getForeignType(params[i].list[1]));
+        }
+
+        auto isCString = returnExp.type == ExpType::SYMBOL && returnExp.string == "cstring";
+        auto returnTy = returnExp.type == ExpType::SYMBOL && returnExp.string == "void" ? builder->getVoidTy()
+                                                                                         : getForeignType(returnExp);
+
+        auto fnTy = llvm::FunctionType::get(returnTy, paramTys, isVarArg);
+
+        // Functions used by the compiler (malloc, free, ...) keep their declaration:
+        auto externFn = module->getFunction(name);
+
+        if (externFn != nullptr && externFn->getFunctionType() != fnTy)
+        {
+            DIE << "[JovianVM]: extern " << name << " conflicts with its declaration " << getTypeName(externFn->getType());
+        }
+
+        if (externFn == nullptr)
+        {
+            externFn = llvm::Function::Create(fnTy, llvm::Function::ExternalLinkage, name, *module);
+        }
+
+        if (exp.list.size() == 6)
+        {
+            for (auto &attribute : exp.list[5].list)
             {
-                auto methodName = exp.list[1].string;
-                auto fnName = className + "_" + methodName;
+                auto kind = llvm::Attribute::getAttrKindFromName(attribute.string);
 
-                classInfo->methodsMap[methodName] = createFunctionProto(fnName, extractFunctionType(exp), env);
+                if (kind == llvm::Attribute::None || !llvm::Attribute::isEnumAttrKind(kind))
+                {
+                    DIE << "[JovianVM]: unknown function attribute " << attribute.string << " of " << name;
+                }
+
+                externFn->addFnAttr(kind);
             }
         }
 
-        buildClassBody(cls);
+        if (isCString)
+        {
+            cStringFunctions_.insert(externFn);
+        }
+
+        env->define(name, externFn);
     }
 
     /**
-     * Builds class body from class info.
+     * Parameter and return types of C functions: Eva numbers, int8,
+     * int16, ptr and cstring (char*), and C structs by pointer.
      */
-    void buildClassBody(llvm::StructType* cls)
+    llvm::Type *getForeignType(const Exp &exp)
     {
-        std::string className{cls->getName().data()};
-
-        auto classInfo = &classMap_[className];
-
-        auto vTableName = className + "_vTable";
-        auto vTabley = llvm::StructType::create(*ctx, vTableName);
+        if (exp.type == ExpType::SYMBOL && exp.string == "cstring")
+        {
+            return builder->getInt8Ty()->getPointerTo();
+        }
 
-        auto clsFields = std::vector<llvm::Type*>{vTabley->getPointerTo()};
+        auto type_ = getTypeFromExp(exp);
 
-        for (const auto &fieldInfo : classInfo->fieldsMap)
+        if (!type_->isIntegerTy() && !type_->isFloatingPointTy() && !type_->isVectorTy() && !isForeignPointer(type_))
         {
-            clsFields.push_back(fieldInfo.second);
+            DIE << "[JovianVM]: " << getTypeName(type_) << " cannot be passed to C";
         }
 
-        cls->setBody(clsFields, false);
+        return type_;
+    }
 
-        buildVTable(cls);
+    bool isForeignPointer(llvm::Type *type_)
+    {
+        return type_ == builder->getInt8Ty()->getPointerTo() || isCStructPointer(type_);
     }
 
     /**
-     * Creates a vtable per class.
-     *
-     * vTable stores method references to support
-     * inheritance and methods overloading.
+     * Converts a value for C: to ptr, arrays and bytes are passed as
+     * their data, strings as their NUL-terminated characters, C structs
+     * by address, and integers (0 for NULL) as addresses.
      */
-    void buildVTable(llvm::StructType *cls)
+    llvm::Value *coerceForeignValue(llvm::Value *value, llvm::Type *targetTy)
     {
-        std::string classsName(cls->getName().data());
-        auto vTableName = classsName + "_vTable";
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+        auto valueTy = value->getType();
 
-        auto vTableTy = llvm::StructType::getTypeByName(*ctx, vTableName);
+        if (targetTy != bytePtrTy || valueTy == bytePtrTy)
+        {
+            return coerceValue(value, targetTy);
+        }
 
-        std::vector<llvm::Constant*> vtableMethods;
-        std::vector<llvm::Type*> vtableMethodTys;
+        if (isArrayPointer(valueTy))
+        {
+            return builder->CreatePointerCast(loadArrayField(value, ARRAY_DATA_INDEX, "data"), bytePtrTy);
+        }
 
-        for(auto& methodInfo : classMap_[classsName].methodsMap) {
-            auto method = methodInfo.second;
-            vtableMethods.push_back(method);
-            vtableMethodTys.push_back(method->getType());
+        if (isBytesPointer(valueTy))
+        {
+            return loadBytesField(value, BYTES_DATA_INDEX, "data");
         }
 
+        if (isStringPointer(valueTy))
+        {
+            return getStringData(value).first;
+        }
 
-        vTableTy->setBody(vtableMethodTys);
-        auto vTableValue = llvm::ConstantStruct::get(vTableTy, vtableMethods);
-        createGlobalVar(vTableName, vTableValue);
+        if (isCStructPointer(valueTy))
+        {
+            return builder->CreatePointerCast(value, bytePtrTy);
+        }
+
+        if (valueTy->isIntegerTy())
+        {
+            return builder->CreateIntToPtr(value, bytePtrTy);
+        }
 
+        DIE << "[JovianVM]: " << getTypeName(valueTy) << " cannot be passed as ptr";
+        return nullptr;
     }
 
     /**
-     * Tagged lists.
+     * Copy of the characters of a char* result as a string, empty
+     * for NULL.
      */
-    bool isTaggedList(const Exp &exp, const std::string &tag)
+    llvm::Value *genStringFromC(llvm::Value *chars)
     {
-        return exp.type == ExpType::LIST && exp.list[0].type == ExpType::SYMBOL &&
-               exp.list[0].string == tag;
+        auto int64Ty = builder->getInt64Ty();
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+
+        chars = builder->CreateSelect(builder->CreateIsNull(chars), builder->CreateGlobalStringPtr(""), chars);
+
+        auto strlenFn = module->getOrInsertFunction("strlen", llvm::FunctionType::get(int64Ty, bytePtrTy, false));
+        auto length = builder->CreateCall(strlenFn, chars, "length");
+
+        return callStringFunction("jovian_string_new", getStringType()->getPointerTo(), {chars, length});
     }
 
     /**
-     * (var ...)
+     * (cstruct ...): see the form. The data layout of the module is the
+     * one of the C ABI, see setupTargetTriple.
      */
-    bool isVar(const Exp &exp) { return isTaggedList(exp, "var"); }
+    void declareCStruct(const Exp &exp)
+    {
+        auto &name = exp.list[1].string;
 
-    /**
-     * (def ...)
-     */
-    bool isDef(const Exp &exp) { return isTaggedList(exp, "def"); }
+        if (cStructs_.count(name) != 0 || classMap_.count(name) != 0)
+        {
+            DIE << "[JovianVM]: type " << name << " is already defined";
+        }
 
-    /**
-     * (new ...)
-     */
-    bool isNew(const Exp &exp) { return isTaggedList(exp, "new"); }
+        CStructInfo info;
+        info.structTy = llvm::StructType::create(*ctx, name);
 
-    /**
-     * (prop ...)
-     */
-    bool isProp(const Exp &exp) { return isTaggedList(exp, "prop"); }
+        std::vector<llvm::Type *> elementTys;
 
-    /**
-     * (super ...)
-     */
-    bool isSuper(const Exp &exp) { return isTaggedList(exp, "super"); }
+        for (auto i = 2; i < exp.list.size(); i++)
+        {
+            auto &field = exp.list[i];
 
-    llvm::StructType *getClassByName(const std::string &name)
-    {
-        return llvm::StructType::getTypeByName(*ctx, name);
+            if (field.type != ExpType::LIST || field.list.size() != 2)
+            {
+                DIE << "[JovianVM]: expected (<field> <type>) in cstruct " << name;
+            }
+
+            info.fieldIndices[field.list[0].string] = elementTys.size();
+            elementTys.push_back(getForeignType(field.list[1]));
+        }
+
+        info.structTy->setBody(elementTys);
+        cStructs_[name] = info;
     }
 
-    std::string extractVarName(const Exp &exp)
+    bool isCStructPointer(llvm::Type *type_)
     {
-        return exp.type == ExpType::LIST ? exp.list[0].string : exp.string;
-    }
+        if (!type_->isPointerTy() || !type_->getPointerElementType()->isStructTy())
+        {
+            return false;
+        }
+
+        auto structTy = llvm::cast<llvm::StructType>(type_->getPointerElementType());
 
-    llvm::Type *extractVarType(const Exp &exp)
-    {
-        return exp.type == ExpType::LIST ? getTypeFromString(exp.list[1].string) : builder->getInt32Ty();
+        return structTy->hasName() && cStructs_.count(structTy->getName().str()) != 0 &&
+               cStructs_[structTy->getName().str()].structTy == structTy;
     }
 
-    llvm::Type *getTypeFromString(const std::string &type_)
+    llvm::Value *cStructFieldAddress(llvm::Value *instance, const std::string &fieldName)
     {
-        if (type_ == "number")
-        {
-            return builder->getInt32Ty();
-        }
+        auto structTy = llvm::cast<llvm::StructType>(instance->getType()->getPointerElementType());
+        auto &fieldIndices = cStructs_[structTy->getName().str()].fieldIndices;
 
-        if (type_ == "string")
+        if (fieldIndices.count(fieldName) == 0)
         {
-            return builder->getInt8Ty()->getPointerTo();
+            DIE << "[JovianVM]: " << structTy->getName().str() << " has no field " << fieldName;
         }
 
-        return classMap_[type_].cls->getPointerTo();
+        return builder->CreateStructGEP(structTy, instance, fieldIndices[fieldName], "p" + fieldName);
     }
 
-    bool hasReturnType(const Exp &fnExp)
+    /**
+     * Define external function(from libc++)
+     */
+    void setupExternalFunction()
     {
-        return fnExp.list[3].type == ExpType::SYMBOL &&
-               fnExp.list[3].string == "->";
-    }
+        // 18* to substitue for char*, void*, etc
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
 
-    llvm::FunctionType *extractFunctionType(const Exp &fnExp)
-    {
-        auto params = fnExp.list[2];
+        module->getOrInsertFunction("printf", llvm::FunctionType::get(
+                                                  /*return type*/ builder->getInt32Ty(),
+                                                  /*format arg*/ bytePtrTy,
+                                                  /* varargs*/ true));
 
-        auto returnType = hasReturnType(fnExp)
-                              ? getTypeFromString(fnExp.list[4].string)
-                              : builder->getInt32Ty();
+        module->getOrInsertFunction(
+            "malloc", llvm::FunctionType::get(bytePtrTy, builder->getInt64Ty(), false));
 
-        std::vector<llvm::Type *> paramTypes;
+        module->getOrInsertFunction(
+            "calloc", llvm::FunctionType::get(bytePtrTy, {builder->getInt64Ty(), builder->getInt64Ty()}, false));
 
-        for (auto &param : params.list)
-        {
-            auto paramName = extractVarName(param);
-            auto paramType = extractVarType(param);
+        module->getOrInsertFunction(
+            "realloc", llvm::FunctionType::get(bytePtrTy, {bytePtrTy, builder->getInt64Ty()}, false));
 
-            // paramTypes.push_back(paramType);
+        module->getOrInsertFunction(
+            "free", llvm::FunctionType::get(builder->getVoidTy(), bytePtrTy, false));
 
-            paramTypes.push_back(
-                paramName == "self" ? (llvm::Type*)cls->getPointerTo() : paramType);
+        if (options.memory == MemoryMode::ARC)
+        {
+            createRefCountFunctions();
         }
 
-        return llvm::FunctionType::get(returnType, paramTypes, false);
-    }
-
-    llvm::Value *compileFunction(const Exp &fnExp, std::string fnName, Env env)
-    {
-        auto params = fnExp.list[2];
-        auto body = hasReturnType(fnExp) ? fnExp.list[5] : fnExp.list[3];
-
-        auto prevFn = fn;
-        auto prevBlock = builder->GetInsertBlock();
+        if (options.heapProfile)
+        {
+            module->getOrInsertFunction(
+                "jovian_heap_profile_init",
+                llvm::FunctionType::get(builder->getVoidTy(), {bytePtrTy, builder->getInt64Ty()}, false));
 
-        auto origName = fnName;
+            module->getOrInsertFunction(
+                "jovian_heap_profile_sample",
+                llvm::FunctionType::get(builder->getVoidTy(), builder->getInt64Ty(), false));
+        }
 
-        if (cls != nullptr)
+        if (!options.profileGenerate.empty())
         {
-            fnName = std::string(cls->getName().data()) + "_" + fnName;
+            module->getOrInsertFunction(
+                "jovian_profile_init",
+                llvm::FunctionType::get(builder->getVoidTy(), {bytePtrTy, builder->getInt64Ty(), bytePtrTy}, false));
         }
 
-        auto newFn = createFunction(fnName, extractFunctionType(fnExp), env);
-        fn = newFn;
+        if (options.memory == MemoryMode::GC)
+        {
+            module->getOrInsertFunction(
+                "jovian_gc_alloc", llvm::FunctionType::get(bytePtrTy, bytePtrTy, false));
 
-        auto idx = 0;
+            module->getOrInsertFunction(
+                "jovian_gc_write_barrier",
+                llvm::FunctionType::get(builder->getVoidTy(), bytePtrTy, false));
+        }
+    }
 
-        auto fnEnv = std::make_shared<Environment>(
-            std::map<std::string, llvm::Value *>{}, env);
+    /**
+     * ARC mode: defines inline retain/release operations. The object
+     * header is { vTable*, i64 refCount }, and the destructor is the
+     * first vTable entry:
+     *
+     *   void jovian_retain(i8* obj)
+     *   void jovian_release(i8* obj)
+     */
+    void createRefCountFunctions()
+    {
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+        auto fnTy = llvm::FunctionType::get(builder->getVoidTy(), bytePtrTy, false);
+        auto destructorTy = fnTy->getPointerTo();
+        auto headerTy = llvm::StructType::create(
+            *ctx, {destructorTy->getPointerTo(), builder->getInt64Ty()}, "jovian_header");
 
-        for (auto &arg : fn->args())
+        for (auto name : {"jovian_retain", "jovian_release"})
         {
-            auto param = params.list[idx++];
-            auto argName = extractVarName(param);
+            auto isRetain = std::string(name) == "jovian_retain";
 
-            arg.setName(argName);
-            auto argBinding = allocVar(argName, arg.getType(), fnEnv);
-            builder->CreateStore(&arg, argBinding);
-        }
+            auto refCountFn = llvm::Function::Create(fnTy, llvm::Function::InternalLinkage, name, *module);
+            refCountFn->addFnAttr(llvm::Attribute::AlwaysInline);
 
-        builder->CreateRet(gen(body, fnEnv));
+            auto obj = refCountFn->getArg(0);
 
-        builder->SetInsertPoint(prevBlock);
-        fn = prevFn;
+            auto entry = createBB("entry", refCountFn);
+            auto countBlock = createBB("count", refCountFn);
+            auto endBlock = createBB("end", refCountFn);
 
-        return newFn;
-    }
+            builder->SetInsertPoint(entry);
+            builder->CreateCondBr(builder->CreateIsNull(obj), endBlock, countBlock);
 
-    llvm::Value *allocVar(std::string &name, llvm::Type *type_, Env env)
-    {
-        varsBuilder->SetInsertPoint(&fn->getEntryBlock());
+            builder->SetInsertPoint(countBlock);
+            auto header = builder->CreatePointerCast(obj, headerTy->getPointerTo());
+            auto refCountAddr = builder->CreateStructGEP(headerTy, header, REFCOUNT_INDEX);
+            auto refCount = builder->CreateLoad(builder->getInt64Ty(), refCountAddr);
 
-        auto varAlloc = varsBuilder->CreateAlloca(type_, 0, name.c_str());
-        env->define(name, varAlloc);
+            if (isRetain)
+            {
+                builder->CreateStore(builder->CreateAdd(refCount, builder->getInt64(1)), refCountAddr);
+                builder->CreateBr(endBlock);
+            }
+            else
+            {
+                auto newCount = builder->CreateSub(refCount, builder->getInt64(1));
+                builder->CreateStore(newCount, refCountAddr);
 
-        return varAlloc;
+                auto destroyBlock = createBB("destroy", refCountFn);
+                builder->CreateCondBr(builder->CreateICmpEQ(newCount, builder->getInt64(0)), destroyBlock, endBlock);
+
+                auto destroyFn = createDestroyFunction(headerTy);
+
+                builder->SetInsertPoint(destroyBlock);
+                builder->CreateCall(destroyFn, obj);
+                builder->CreateBr(endBlock);
+            }
+
+            builder->SetInsertPoint(endBlock);
+            builder->CreateRetVoid();
+        }
     }
 
     /**
-     * Creates a gloabl variable
+     * ARC mode: runs the destructor of an object whose count dropped
+     * to zero. Objects released to zero by a running destructor are
+     * queued (linked through their count field) and destroyed by the
+     * outermost call, so freeing long chains does not overflow the stack:
+     *
+     *   void jovian_destroy(i8* obj)
      */
-    llvm::GlobalVariable *createGlobalVar(const std::string &name, llvm::Constant *init)
+    llvm::Function *createDestroyFunction(llvm::StructType *headerTy)
     {
-        module->getOrInsertGlobal(name, init->getType());
-        auto variable = module->getNamedGlobal(name);
-        variable->setAlignment(llvm::MaybeAlign(4));
-        variable->setConstant(false);
-        variable->setInitializer(init);
-        return variable;
+        auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
+        auto fnTy = llvm::FunctionType::get(builder->getVoidTy(), bytePtrTy, false);
+        auto destructorTy = fnTy->getPointerTo();
+
+        auto createTLS = [&](const std::string &name, llvm::Type *type) {
+            auto var = new llvm::GlobalVariable(*module, type, false, llvm::GlobalVariable::InternalLinkage,
+                                                llvm::Constant::getNullValue(type), name);
+            var->setThreadLocal(true);
+            return var;
+        };
+
+        auto pending = createTLS("jovian_destroy_pending", bytePtrTy);
+        auto destroying = createTLS("jovian_destroying", builder->getInt1Ty());
+
+        auto destroyFn = llvm::Function::Create(fnTy, llvm::Function::InternalLinkage, "jovian_destroy", *module);
+        destroyFn->addFnAttr(llvm::Attribute::NoInline);
+
+        auto entry = createBB("entry", destroyFn);
+        auto queueBlock = createBB("queue", destroyFn);
+        auto loopBlock = createBB("loop", destroyFn);
+        auto nextBlock = createBB("next", destroyFn);
+        auto endBlock = createBB("end", destroyFn);
+
+        auto countAddr = [&](llvm::Value *obj) {
+            auto header = builder->CreatePointerCast(obj, headerTy->getPointerTo());
+            return builder->CreatePointerCast(builder->CreateStructGEP(headerTy, header, REFCOUNT_INDEX),
+                                              bytePtrTy->getPointerTo());
+        };
+
+        builder->SetInsertPoint(entry);
+        auto obj = destroyFn->getArg(0);
+        builder->CreateCondBr(builder->CreateLoad(builder->getInt1Ty(), destroying), queueBlock, loopBlock);
+
+        builder->SetInsertPoint(queueBlock);
+        builder->CreateStore(builder->CreateLoad(bytePtrTy, pending), countAddr(obj));
+        builder->CreateStore(obj, pending);
+        builder->CreateRetVoid();
+
+        builder->SetInsertPoint(loopBlock);
+        auto current = builder->CreatePHI(bytePtrTy, 2, "current");
+        current->addIncoming(obj, entry);
+        builder->CreateStore(builder->getTrue(), destroying);
+
+        auto header = builder->CreatePointerCast(current, headerTy->getPointerTo());
+        auto vTableAddr = builder->CreateStructGEP(headerTy, header, VTABLE_INDEX);
+        auto vTable = builder->CreateLoad(destructorTy->getPointerTo(), vTableAddr, "vt");
+        auto destructor = builder->CreateLoad(destructorTy, vTable);
+        builder->CreateCall(fnTy, destructor, current);
+
+        auto next = builder->CreateLoad(bytePtrTy, pending);
+        builder->CreateCondBr(builder->CreateIsNull(next), endBlock, nextBlock);
+
+        builder->SetInsertPoint(nextBlock);
+        builder->CreateStore(builder->CreateLoad(bytePtrTy, countAddr(next)), pending);
+        current->addIncoming(next, nextBlock);
+        builder->CreateBr(loopBlock);
+
+        builder->SetInsertPoint(endBlock);
+        builder->CreateStore(builder->getFalse(), destroying);
+        builder->CreateRetVoid();
+
+        return destroyFn;
     }
 
     /**
-     * Define external function(from libc++)
+     * Declares the region runtime (runtime/region.c).
      */
-    void setupExternalFunction()
+    void setupRegionFunctions()
     {
-        // 18* to substitue for char*, void*, etc
         auto bytePtrTy = builder->getInt8Ty()->getPointerTo();
 
-        module->getOrInsertFunction("printf", llvm::FunctionType::get(
-                                                  /*return type*/ builder->getInt32Ty(),
-                                                  /*format arg*/ bytePtrTy,
-                                                  /* varargs*/ true));
+        auto regionTy = llvm::StructType::create(*ctx, {bytePtrTy, bytePtrTy}, "jovian_region_header");
+
+        auto region = new llvm::GlobalVariable(*module, regionTy->getPointerTo(), false,
+                                               llvm::GlobalVariable::ExternalLinkage, nullptr, "jovian_region");
+        region->setThreadLocal(true);
 
         module->getOrInsertFunction(
-            "malloc", llvm::FunctionType::get(bytePtrTy, builder->getInt64Ty(), false));
+            "jovian_region_enter", llvm::FunctionType::get(builder->getVoidTy(), false));
+
+        module->getOrInsertFunction(
+            "jovian_region_exit", llvm::FunctionType::get(builder->getVoidTy(), false));
+
+        module->getOrInsertFunction(
+            "jovian_region_alloc", llvm::FunctionType::get(bytePtrTy, builder->getInt64Ty(), false));
+
+        module->getOrInsertFunction(
+            "jovian_region_owns", llvm::FunctionType::get(builder->getInt32Ty(), bytePtrTy, false));
     }
 
     /**
@@ -898,6 +9039,8 @@ private:
         }
 
         createFunctionBlock(fn);
+        profileFunctionEntry(fn);
+
         return fn;
     }
 
@@ -925,6 +9068,11 @@ private:
     {
         auto fn = llvm::Function::Create(fnType, llvm::Function::ExternalLinkage, fnName, *module);
 
+        if (options.memory == MemoryMode::GC)
+        {
+            fn->setGC("shadow-stack");
+        }
+
         verifyFunction(*fn);
 
         env->define(fnName, fn);
@@ -955,17 +9103,44 @@ private:
 
         std::map<std::string, llvm::Value *> globalRec{};
 
+        // Constants, reads are folded:
         for (auto &entry : globalObject)
         {
-            globalRec[entry.first] = createGlobalVar(entry.first, (llvm::Constant *)entry.second);
+            auto globalVar = createGlobalVar(entry.first, (llvm::Constant *)entry.second);
+            globalVar->setConstant(true);
+
+            globalRec[entry.first] = globalVar;
         }
 
         GlobalEnv = std::make_shared<Environment>(globalRec, nullptr);
     }
 
+    /**
+     * Target x86-64 Linux, with its data layout.
+     */
     void setupTargetTriple()
     {
-        module->setTargetTriple("x86_64-pc-linux-gnu");
+        LLVMInitializeX86TargetInfo();
+        LLVMInitializeX86Target();
+        LLVMInitializeX86TargetMC();
+
+        std::string triple = "x86_64-pc-linux-gnu";
+        std::string error;
+
+        auto target = llvm::TargetRegistry::lookupTarget(triple, error);
+
+        if (target == nullptr)
+        {
+            DIE << "[JovianVM]: " << error;
+        }
+
+        // Sizes and alignments (allocations, class and C struct layouts)
+        // follow the data layout of the target:
+        std::unique_ptr<llvm::TargetMachine> machine(
+            target->createTargetMachine(triple, "generic", "", llvm::TargetOptions(), llvm::None));
+
+        module->setTargetTriple(triple);
+        module->setDataLayout(machine->createDataLayout());
     }
 
     /**
@@ -983,6 +9158,11 @@ private:
      */
     std::unique_ptr<JovianParser> parser;
 
+    /**
+     * Compiler options.
+     */
+    CompilerOptions options;
+
     /**
      * Global Environment (symbol table).
      */
@@ -998,11 +9178,238 @@ private:
      */
     std::map<std::string, ClassInfo> classMap_;
 
+    /**
+     * C structs, see (cstruct ...): the struct and the element
+     * index of each field.
+     */
+    struct CStructInfo
+    {
+        llvm::StructType *structTy;
+        std::map<std::string, size_t> fieldIndices;
+    };
+
+    std::map<std::string, CStructInfo> cStructs_;
+
+    std::map<std::string, GenericInfo> genericFunctions_;
+    std::map<std::string, GenericInfo> genericClasses_;
+
+    /**
+     * Declarations of the generic instances.
+     */
+    std::list<Exp> genericInstances_;
+
+    /**
+     * Functions declared with def-pure or def-memo, by name.
+     */
+    std::map<std::string, Exp> pureFunctions_;
+
+    /**
+     * Results of pure calls evaluated at compile time, by function
+     * and arguments.
+     */
+    std::map<std::pair<std::string, std::vector<llvm::Constant *>>, llvm::Constant *> comptimeCalls_;
+
+    /**
+     * Pure calls whose automatic evaluation failed, by function and
+     * arguments: they are compiled without trying again.
+     */
+    std::set<std::pair<std::string, std::vector<llvm::Constant *>>> comptimeFailures_;
+
+    /**
+     * Remaining steps and call depth of the current compile-time
+     * evaluation.
+     */
+    int64_t comptimeSteps_ = 0;
+    int comptimeDepth_ = 0;
+
+    /**
+     * Whether the current evaluation is an automatic one of a pure call.
+     */
+    bool comptimeAuto_ = false;
+
+    /**
+     * Extern functions returning cstring.
+     */
+    std::set<llvm::Function *> cStringFunctions_;
+
     /**
      * Currently compiling function.
      */
     llvm::Function *fn;
 
+    /**
+     * Escape analysis of the compiling program.
+     */
+    std::unique_ptr<EscapeAnalysis> escapeAnalysis;
+
+    /**
+     * (new ...) expressions of the current function allocated
+     * on the stack.
+     */
+    std::set<const Exp *> localInstances;
+
+    /**
+     * Temporary root slots of arguments being evaluated.
+     */
+    std::set<llvm::Value *> pinnedSlots;
+
+    /**
+     * ARC mode: object variables of the current function,
+     * released when it returns.
+     */
+    std::vector<llvm::AllocaInst *> ownedSlots;
+
+    /**
+     * Whether the program uses (region ...) blocks.
+     */
+    bool usesRegions = false;
+
+    /**
+     * Environments of the enclosing region blocks
+     * of the current function.
+     */
+    std::vector<Env> regionEnvs;
+
+    /**
+     * Heap profile: allocation site of a (new ...) expression.
+     */
+    struct HeapSite
+    {
+        std::string className;
+        std::string function;
+        int line;
+        llvm::GlobalVariable *counters;
+    };
+
+    /**
+     * Heap profile: allocation sites, indexed by site ID.
+     */
+    std::vector<HeapSite> heapSites;
+
+    /**
+     * Profile generate: counted branch or function entry.
+     */
+    struct ProfileSite
+    {
+        std::string name;
+        llvm::GlobalVariable *counters;
+    };
+
+    /**
+     * Profile generate: counted sites, in the order of the table.
+     */
+    std::vector<ProfileSite> profileSites;
+
+    /**
+     * Profile use: counts read from the profile, by site name.
+     */
+    std::map<std::string, std::pair<uint64_t, uint64_t>> profileCounts_;
+
+    /**
+     * Number of profiled branches per function, see getProfileSiteName.
+     */
+    std::map<std::string, int> profileBranchCounts_;
+
+    /**
+     * Array header types by element type, and back.
+     */
+    std::map<llvm::Type *, llvm::StructType *> arrayTypes_;
+    std::map<llvm::Type *, llvm::Type *> arrayElementTypes_;
+
+    /**
+     * String types, and static objects of string literals.
+     */
+    llvm::StructType *stringTy_ = nullptr;
+    llvm::StructType *stringBuilderTy_ = nullptr;
+    std::map<std::string, llvm::Constant *> stringLiterals_;
+
+    /**
+     * Byte view type, see getBytesType.
+     */
+    llvm::StructType *bytesTy_ = nullptr;
+
+    /**
+     * Map types by key and value types, and back.
+     */
+    std::map<std::pair<llvm::Type *, llvm::Type *>, llvm::StructType *> mapTypes_;
+    std::map<llvm::Type *, std::pair<llvm::Type *, llvm::Type *>> mapElementTypes_;
+
+    /**
+     * Future types by task value type, and back.
+     */
+    std::map<llvm::Type *, llvm::StructType *> futureTypes_;
+    std::map<llvm::Type *, llvm::Type *> futureResultTypes_;
+
+    /**
+     * Generator types by value type, and back.
+     */
+    std::map<llvm::Type *, llvm::StructType *> generatorTypes_;
+    std::map<llvm::Type *, llvm::Type *> generatorValueTypes_;
+
+    /**
+     * TBAA tags of array headers and elements by element type.
+     */
+    llvm::MDNode *arrayHeaderTBAATag = nullptr;
+    std::map<llvm::Type *, llvm::MDNode *> arrayElementTBAATags_;
+
+    /**
+     * Index and array variables for which index < (len array) holds
+     * in the current loop body, so accesses need no bounds check.
+     */
+    struct CheckedIndex
+    {
+        llvm::Value *indexSlot;
+        llvm::Value *arraySlot;
+        std::string indexName;
+        std::string arrayName;
+    };
+
+    std::vector<CheckedIndex> checkedIndices;
+
+    /**
+     * Jump targets of (continue) and (break) of the enclosing loops,
+     * and the number of regions active at the loop.
+     */
+    struct LoopTarget
+    {
+        llvm::BasicBlock *continueBlock;
+        llvm::BasicBlock *breakBlock;
+        size_t regionDepth;
+    };
+
+    std::vector<LoopTarget> loopTargets;
+
+    /**
+     * Body and parameters of the function being compiled.
+     */
+    const Exp *fnBody = nullptr;
+    const Exp *fnParams = nullptr;
+
+    /**
+     * Calls in tail position of the current function.
+     */
+    std::set<const Exp *> tailCalls;
+
+    /**
+     * Loop header and parameter slots for self tail calls.
+     */
+    llvm::BasicBlock *tailRecurseBlock = nullptr;
+    std::vector<llvm::Value *> tailParamSlots;
+
+    /**
+     * Generator being compiled: its value type and slot, and the
+     * blocks of destruction and of returning to the resumer.
+     */
+    struct Coroutine
+    {
+        llvm::Type *valueTy;
+        llvm::AllocaInst *promise;
+        llvm::BasicBlock *cleanupBlock;
+        llvm::BasicBlock *suspendBlock;
+    };
+
+    Coroutine *coroutine = nullptr;
+
     /**
      * Global LLVM context.
      * It owns and manages the core "global" data of LLVM's core
@@ -0,0 +1,213 @@
+#ifndef RetainReleaseElision_h
+#define RetainReleaseElision_h
+
+#include <set>
+
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+
+/**
+ * Removes redundant jovian_retain/jovian_release pairs emitted
+ * in ARC mode.
+ *
+ * A retain(x) followed in the same block by release(x) can be
+ * removed if either nothing in between uses x (the object may only
+ * be destroyed earlier, unobserved), or nothing in between may
+ * release an object (someone else keeps x alive). Direct calls are
+ * resolved to the called function; indirect method calls may reach
+ * any defined function of the same type.
+ */
+class RetainReleaseElision
+{
+public:
+    RetainReleaseElision(llvm::Module &module)
+        : module(module),
+          retainFn(module.getFunction("jovian_retain")),
+          releaseFn(module.getFunction("jovian_release")) {}
+
+    /**
+     * Runs to a fixed point, returns number of removed pairs.
+     */
+    size_t run()
+    {
+        size_t removed = 0;
+        bool changed = true;
+
+        while (changed)
+        {
+            changed = false;
+            computeMayRelease();
+
+            for (auto &fn : module)
+            {
+                for (auto &block : fn)
+                {
+                    while (elidePair(block))
+                    {
+                        removed++;
+                        changed = true;
+                    }
+                }
+            }
+        }
+
+        return removed;
+    }
+
+private:
+    /**
+     * Finds and removes one redundant pair in the block.
+     */
+    bool elidePair(llvm::BasicBlock &block)
+    {
+        for (auto &inst : block)
+        {
+            if (!isCallTo(&inst, retainFn))
+            {
+                continue;
+            }
+
+            auto object = objectOf(&inst);
+            auto used = false;
+            auto released = false;
+
+            for (auto next = inst.getNextNode(); next != nullptr; next = next->getNextNode())
+            {
+                if (isCallTo(next, releaseFn) && objectOf(next) == object)
+                {
+                    if (used && released)
+                    {
+                        break;
+                    }
+
+                    next->eraseFromParent();
+                    inst.eraseFromParent();
+                    return true;
+                }
+
+                if (!isCallTo(next, retainFn) && usesObject(next, object))
+                {
+                    used = true;
+                }
+
+                if (mayRelease(next))
+                {
+                    released = true;
+                }
+
+                if (used && released)
+                {
+                    break;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Functions which may (transitively) release an object.
+     */
+    void computeMayRelease()
+    {
+        mayReleaseFns.clear();
+
+        bool changed = true;
+
+        while (changed)
+        {
+            changed = false;
+
+            for (auto &fn : module)
+            {
+                if (fn.isDeclaration() || mayReleaseFns.count(&fn) != 0)
+                {
+                    continue;
+                }
+
+                for (auto &block : fn)
+                {
+                    for (auto &inst : block)
+                    {
+                        if (mayRelease(&inst))
+                        {
+                            mayReleaseFns.insert(&fn);
+                            changed = true;
+                            break;
+                        }
+                    }
+
+                    if (mayReleaseFns.count(&fn) != 0)
+                    {
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    bool mayRelease(llvm::Instruction *inst)
+    {
+        auto call = llvm::dyn_cast<llvm::CallInst>(inst);
+
+        if (call == nullptr)
+        {
+            return false;
+        }
+
+        if (auto callee = call->getCalledFunction())
+        {
+            return callee == releaseFn || mayReleaseFns.count(callee) != 0;
+        }
+
+        // Indirect (method) call: any function of this type.
+        for (auto fn : mayReleaseFns)
+        {
+            if (fn->getFunctionType() == call->getFunctionType())
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool isCallTo(llvm::Instruction *inst, llvm::Function *fn)
+    {
+        auto call = llvm::dyn_cast<llvm::CallInst>(inst);
+        return fn != nullptr && call != nullptr && call->getCalledFunction() == fn;
+    }
+
+    /**
+     * Object a retain/release call operates on.
+     */
+    llvm::Value *objectOf(llvm::Instruction *call)
+    {
+        return ((llvm::CallInst *)call)->getArgOperand(0)->stripPointerCasts();
+    }
+
+    /**
+     * Whether the instruction uses the object or a field address of it.
+     */
+    bool usesObject(llvm::Instruction *inst, llvm::Value *object)
+    {
+        for (auto &operand : inst->operands())
+        {
+            if (operand->stripInBoundsConstantOffsets() == object)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    llvm::Module &module;
+
+    llvm::Function *retainFn;
+
+    llvm::Function *releaseFn;
+
+    std::set<llvm::Function *> mayReleaseFns;
+};
+
+#endif
@@ -42,6 +42,7 @@
  */
 enum class ExpType {
   NUMBER,
+  FLOAT,
   STRING,
   SYMBOL,
   LIST,
@@ -53,12 +54,19 @@ enum class ExpType {
 struct Exp {
   ExpType type;
 
-  int number;
+  long long number;
+  double floatNumber;
   std::string string;
   std::vector<Exp> list;
 
+  // Source line of lists (the opening paren):
+  int line = 0;
+
   // Numbers:
-  Exp(int number) : type(ExpType::NUMBER), number(number) {}
+  Exp(long long number) : type(ExpType::NUMBER), number(number) {}
+
+  // Floating point numbers:
+  Exp(double floatNumber) : type(ExpType::FLOAT), floatNumber(floatNumber) {}
 
   // Strings, Symbols:
   Exp(std::string& strVal) {
@@ -432,7 +440,7 @@ std::array<LexRule, Tokenizer::LEX_RULES_COUNT> Tokenizer::lexRules_ = {{
   {std::regex(R"(^\/\*[\s\S]*?\*\/)"), &_lexRule4},
   {std::regex(R"(^\s+)"), &_lexRule5},
   {std::regex(R"(^"[^\"]*")"), &_lexRule6},
-  {std::regex(R"(^\d+)"), &_lexRule7},
+  {std::regex(R"(^\d+(\.\d+)?)"), &_lexRule7},
   {std::regex(R"(^[\w\-+*=!<>/]+)"), &_lexRule8}
 }};
 std::map<TokenizerState, std::vector<size_t>> Tokenizer::lexRulesByStartConditions_ =  {{TokenizerState::INITIAL, {0, 1, 2, 3, 4, 5, 6, 7}}};
@@ -445,9 +453,10 @@ std::map<TokenizerState, std::vector<size_t>> Tokenizer::lexRulesByStartConditio
   parser.valuesStack.back(); \
   parser.valuesStack.pop_back()
 
-#define POP_T()              \
-  parser.tokensStack.back(); \
-  parser.tokensStack.pop_back()
+#define POP_T()                  \
+  parser.tokensStack.back();     \
+  parser.tokensStack.pop_back(); \
+  parser.tokenLinesStack.pop_back()
 
 #define PUSH_VR() parser.valuesStack.push_back(__)
 #define PUSH_TR() parser.tokensStack.push_back(__)
@@ -511,6 +520,11 @@ class JovianParser {
    */
   std::vector<std::string> tokensStack;
 
+  /**
+   * Start lines of the tokens on the tokens stack.
+   */
+  std::vector<int> tokenLinesStack;
+
   /**
    * Parsing states stack.
    */
@@ -540,6 +554,7 @@ class JovianParser {
     // Initialize the stacks.
     valuesStack.clear();
     tokensStack.clear();
+    tokenLinesStack.clear();
     statesStack.clear();
 
     // Initial 0 state.
@@ -563,6 +578,7 @@ class JovianParser {
       if (entry.type == TE::Shift) {
         // Push token.
         tokensStack.push_back(token->value);
+        tokenLinesStack.push_back(token->startLine);
 
         // Push next state number: "s5" -> 5
         statesStack.push_back(entry.value);
@@ -686,7 +702,7 @@ void _handler4(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_T();
 
-auto __ = Exp(std::stoi(_1)) ;
+auto __ = _1.find('.') == std::string::npos ? Exp(std::stoll(_1)) : Exp(std::stod(_1)) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -718,10 +734,14 @@ PUSH_VR();
 void _handler7(yyparse& parser) {
 // Semantic action prologue.
 parser.tokensStack.pop_back();
+parser.tokenLinesStack.pop_back();
 auto _2 = POP_V();
 parser.tokensStack.pop_back();
+auto _1Line = parser.tokenLinesStack.back();
+parser.tokenLinesStack.pop_back();
 
-auto __ = _2 ;
+// Source line of the opening paren:
+auto __ = _2; __.line = _1Line;
 
  // Semantic action epilogue.
 PUSH_VR();
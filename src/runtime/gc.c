@@ -0,0 +1,352 @@
+/**
+ * Precise generational garbage collector for Eva programs
+ * compiled with --memory=gc.
+ *
+ * Roots are found through the LLVM shadow stack (functions are
+ * compiled with gc "shadow-stack" and register their object slots
+ * with llvm.gcroot). Objects are described by layout descriptors
+ * emitted per class, which list the offsets of pointer fields.
+ *
+ * Young generation: bump-allocated nursery, collected by Cheney
+ * copying; survivors are promoted to the old generation.
+ *
+ * Old generation: contiguous bump-allocated space, collected by
+ * sliding (Lisp 2) mark-compact once it outgrows its budget.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// ---------------------------------------------------------------
+// Compiler interface.
+
+/**
+ * Class layout descriptor: see JovianVM::buildLayout.
+ */
+typedef struct JovianLayout {
+  uint64_t size;
+  uint64_t numPointers;
+  uint64_t offsets[];
+} JovianLayout;
+
+/**
+ * Shadow stack frame, as laid out by LLVM's ShadowStackGCLowering.
+ */
+typedef struct FrameMap {
+  int32_t numRoots;
+  int32_t numMeta;
+  const void *meta[];
+} FrameMap;
+
+typedef struct StackEntry {
+  struct StackEntry *next;
+  const FrameMap *map;
+  void *roots[];
+} StackEntry;
+
+/**
+ * Defined by modules compiled with --memory=gc; the weak fallback
+ * lets the runtime link with programs using other memory modes.
+ */
+__attribute__((weak)) StackEntry *llvm_gc_root_chain;
+
+/**
+ * Output runtime, see print.c.
+ */
+void jovian_flush_output(void);
+
+// ---------------------------------------------------------------
+// Heap.
+
+/**
+ * Object header, placed right before the object. For young objects
+ * `word` holds the forwarding address once copied; for old objects
+ * it holds the mark/remembered bits and, during compaction, the
+ * forwarding address.
+ */
+typedef struct Header {
+  const JovianLayout *layout;
+  uintptr_t word;
+} Header;
+
+#define MARK_BIT ((uintptr_t)1)
+#define REMEMBERED_BIT ((uintptr_t)2)
+#define FLAG_BITS (MARK_BIT | REMEMBERED_BIT)
+
+#define ALIGNMENT 16
+#define NURSERY_SIZE ((size_t)4 << 20)
+#define OLD_RESERVE ((size_t)1 << 36)
+#define MIN_OLD_BUDGET ((size_t)32 << 20)
+
+static char *nurseryStart, *nurseryTop, *nurseryEnd;
+static char *oldStart, *oldTop, *oldEnd;
+static size_t oldBudget = MIN_OLD_BUDGET;
+
+/**
+ * Old objects which had a pointer field written since
+ * the last minor collection.
+ */
+static void **rememberedSet;
+static size_t rememberedCount, rememberedCapacity;
+
+/**
+ * Mark stack of the old generation collector.
+ */
+static void **markStack;
+static size_t markCount, markCapacity;
+
+static inline Header *headerOf(void *obj) { return (Header *)obj - 1; }
+
+static inline size_t allocSize(const JovianLayout *layout) {
+  return (sizeof(Header) + layout->size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+}
+
+static inline int isYoung(void *p) {
+  return (char *)p >= nurseryStart && (char *)p < nurseryTop;
+}
+
+static inline int isOld(void *p) {
+  return (char *)p >= oldStart && (char *)p < oldTop;
+}
+
+static void fatal(const char *message) {
+  jovian_flush_output();
+  fprintf(stderr, "Fatal error: [GC]: %s\n", message);
+  abort();
+}
+
+static void *reserve(size_t size) {
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED) {
+    fatal("cannot reserve heap");
+  }
+  return mem;
+}
+
+static void init(void) {
+  nurseryStart = nurseryTop = reserve(NURSERY_SIZE);
+  nurseryEnd = nurseryStart + NURSERY_SIZE;
+
+  oldStart = oldTop = reserve(OLD_RESERVE);
+  oldEnd = oldStart + OLD_RESERVE;
+}
+
+static void push(void ***stack, size_t *count, size_t *capacity, void *obj) {
+  if (*count == *capacity) {
+    *capacity = *capacity == 0 ? 1024 : *capacity * 2;
+    *stack = realloc(*stack, *capacity * sizeof(void *));
+    if (*stack == NULL) {
+      fatal("out of memory");
+    }
+  }
+  (*stack)[(*count)++] = obj;
+}
+
+static void *allocOld(size_t size) {
+  if (oldTop + size > oldEnd) {
+    fatal("out of memory");
+  }
+  void *mem = oldTop;
+  oldTop += size;
+  return mem;
+}
+
+/**
+ * Calls `visit` on every root slot of the shadow stack.
+ */
+static void visitRoots(void (*visit)(void **slot)) {
+  for (StackEntry *entry = llvm_gc_root_chain; entry != NULL; entry = entry->next) {
+    for (int32_t i = 0; i < entry->map->numRoots; i++) {
+      if (entry->roots[i] != NULL) {
+        visit(&entry->roots[i]);
+      }
+    }
+  }
+}
+
+/**
+ * Calls `visit` on every pointer field of an object.
+ */
+static inline void visitFields(void *obj, void (*visit)(void **slot)) {
+  const JovianLayout *layout = headerOf(obj)->layout;
+  for (uint64_t i = 0; i < layout->numPointers; i++) {
+    void **slot = (void **)((char *)obj + layout->offsets[i]);
+    if (*slot != NULL) {
+      visit(slot);
+    }
+  }
+}
+
+// ---------------------------------------------------------------
+// Minor collection: copy live young objects into the old space.
+
+static void evacuate(void **slot) {
+  void *obj = *slot;
+
+  if (!isYoung(obj)) {
+    return;
+  }
+
+  Header *header = headerOf(obj);
+
+  if (header->word != 0) {
+    *slot = (void *)header->word;
+    return;
+  }
+
+  size_t size = allocSize(header->layout);
+  Header *copy = allocOld(size);
+  memcpy(copy, header, size);
+  copy->word = 0;
+
+  header->word = (uintptr_t)(copy + 1);
+  *slot = copy + 1;
+}
+
+static void minorCollect(void) {
+  char *scan = oldTop;
+
+  visitRoots(evacuate);
+
+  for (size_t i = 0; i < rememberedCount; i++) {
+    void *obj = rememberedSet[i];
+    headerOf(obj)->word &= ~REMEMBERED_BIT;
+    visitFields(obj, evacuate);
+  }
+  rememberedCount = 0;
+
+  // Cheney scan of the promoted objects:
+  while (scan < oldTop) {
+    Header *header = (Header *)scan;
+    visitFields(header + 1, evacuate);
+    scan += allocSize(header->layout);
+  }
+
+  nurseryTop = nurseryStart;
+}
+
+// ---------------------------------------------------------------
+// Major collection: sliding mark-compact of the old space.
+
+static void markObject(void **slot) {
+  void *obj = *slot;
+
+  if (!isOld(obj) || (headerOf(obj)->word & MARK_BIT)) {
+    return;
+  }
+
+  headerOf(obj)->word |= MARK_BIT;
+  push(&markStack, &markCount, &markCapacity, obj);
+}
+
+static void updateReference(void **slot) {
+  if (isOld(*slot)) {
+    *slot = (void *)(headerOf(*slot)->word & ~FLAG_BITS);
+  }
+}
+
+static void majorCollect(void) {
+  minorCollect();
+
+  // 1. Mark:
+  visitRoots(markObject);
+
+  while (markCount > 0) {
+    visitFields(markStack[--markCount], markObject);
+  }
+
+  // 2. Compute forwarding addresses:
+  char *free = oldStart;
+
+  for (char *scan = oldStart; scan < oldTop; scan += allocSize(((Header *)scan)->layout)) {
+    Header *header = (Header *)scan;
+    if (header->word & MARK_BIT) {
+      header->word = (uintptr_t)((Header *)free + 1) | MARK_BIT;
+      free += allocSize(header->layout);
+    }
+  }
+
+  // 3. Update references:
+  visitRoots(updateReference);
+
+  for (char *scan = oldStart; scan < oldTop; scan += allocSize(((Header *)scan)->layout)) {
+    Header *header = (Header *)scan;
+    if (header->word & MARK_BIT) {
+      visitFields(header + 1, updateReference);
+    }
+  }
+
+  // 4. Slide objects down:
+  for (char *scan = oldStart; scan < oldTop;) {
+    Header *header = (Header *)scan;
+    size_t size = allocSize(header->layout);
+
+    if (header->word & MARK_BIT) {
+      Header *dest = (Header *)(header->word & ~FLAG_BITS) - 1;
+      memmove(dest, header, size);
+      dest->word = 0;
+    }
+
+    scan += size;
+  }
+
+  oldTop = free;
+
+  size_t live = oldTop - oldStart;
+  oldBudget = live * 2 > MIN_OLD_BUDGET ? live * 2 : MIN_OLD_BUDGET;
+}
+
+static void collect(void) {
+  minorCollect();
+
+  if ((size_t)(oldTop - oldStart) > oldBudget) {
+    majorCollect();
+  }
+}
+
+// ---------------------------------------------------------------
+// Runtime API.
+
+/**
+ * Allocates a zeroed object of the given class layout.
+ */
+void *jovian_gc_alloc(const JovianLayout *layout) {
+  if (nurseryStart == NULL) {
+    init();
+  }
+
+  size_t size = allocSize(layout);
+  Header *header;
+
+  // Large objects are allocated directly in the old space:
+  if (size > NURSERY_SIZE / 4) {
+    collect();
+    header = allocOld(size);
+  } else {
+    if (nurseryTop + size > nurseryEnd) {
+      collect();
+    }
+    header = (Header *)nurseryTop;
+    nurseryTop += size;
+  }
+
+  memset(header, 0, size);
+  header->layout = layout;
+
+  return header + 1;
+}
+
+/**
+ * Records an old object whose pointer field was written, so that
+ * young objects it references survive the next minor collection.
+ */
+void jovian_gc_write_barrier(void *obj) {
+  if (isOld(obj) && !(headerOf(obj)->word & REMEMBERED_BIT)) {
+    headerOf(obj)->word |= REMEMBERED_BIT;
+    push(&rememberedSet, &rememberedCount, &rememberedCapacity, obj);
+  }
+}
@@ -0,0 +1,195 @@
+/**
+ * Heap profiler for Eva programs compiled with --heap-profile.
+ *
+ * Generated code counts allocations and bytes per (new ...) site
+ * atomically, and samples a stack trace every
+ * HEAP_PROFILE_SAMPLE_PERIOD allocations of a site, from any thread. At exit the sites are reported ranked by
+ * bytes, then count, to stderr or to the file named by the
+ * JOVIAN_HEAP_PROFILE environment variable.
+ *
+ * Link with -rdynamic to see Eva function names in stack traces.
+ */
+
+#include <execinfo.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ---------------------------------------------------------------
+// Compiler interface.
+
+typedef struct HeapCounters {
+  uint64_t count;
+  uint64_t bytes;
+} HeapCounters;
+
+/**
+ * Allocation site: see JovianVM::registerHeapSites.
+ */
+typedef struct HeapSite {
+  const char *className;
+  const char *function;
+  int64_t line;
+  HeapCounters *counters;
+} HeapSite;
+
+// ---------------------------------------------------------------
+// Samples.
+
+#define MAX_FRAMES 16
+#define MAX_TRACES 4
+
+typedef struct Trace {
+  void *frames[MAX_FRAMES];
+  int depth;
+  uint64_t hits;
+} Trace;
+
+typedef struct SiteTraces {
+  Trace traces[MAX_TRACES];
+  int count;
+} SiteTraces;
+
+static const HeapSite *sites;
+static uint64_t sitesCount;
+static SiteTraces *siteTraces;
+
+/**
+ * Guards siteTraces: tasks sample concurrently.
+ */
+static pthread_mutex_t tracesLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t loadCount(const HeapSite *site) {
+  return __atomic_load_n(&site->counters->count, __ATOMIC_RELAXED);
+}
+
+static uint64_t loadBytes(const HeapSite *site) {
+  return __atomic_load_n(&site->counters->bytes, __ATOMIC_RELAXED);
+}
+
+static int compareSites(const void *a, const void *b) {
+  const HeapSite *x = &sites[*(const uint64_t *)a];
+  const HeapSite *y = &sites[*(const uint64_t *)b];
+
+  if (loadBytes(x) != loadBytes(y)) {
+    return loadBytes(x) < loadBytes(y) ? 1 : -1;
+  }
+  if (loadCount(x) != loadCount(y)) {
+    return loadCount(x) < loadCount(y) ? 1 : -1;
+  }
+  return 0;
+}
+
+static void printTraces(FILE *out, const SiteTraces *traces) {
+  for (int i = 0; i < traces->count; i++) {
+    const Trace *trace = &traces->traces[i];
+    char **symbols = backtrace_symbols(trace->frames, trace->depth);
+
+    fprintf(out, "      sampled %llu time(s):\n", (unsigned long long)trace->hits);
+
+    // Frame 0 is jovian_heap_profile_sample:
+    for (int frame = 1; frame < trace->depth; frame++) {
+      fprintf(out, "        %s\n", symbols != NULL ? symbols[frame] : "?");
+    }
+
+    free(symbols);
+  }
+}
+
+static void report(void) {
+  const char *path = getenv("JOVIAN_HEAP_PROFILE");
+  FILE *out = path != NULL ? fopen(path, "w") : stderr;
+
+  if (out == NULL) {
+    out = stderr;
+  }
+
+  // Tasks still running may allocate while the report is written:
+  pthread_mutex_lock(&tracesLock);
+
+  uint64_t *order = malloc(sitesCount * sizeof(uint64_t));
+  uint64_t totalCount = 0, totalBytes = 0;
+
+  for (uint64_t i = 0; i < sitesCount; i++) {
+    order[i] = i;
+    totalCount += loadCount(&sites[i]);
+    totalBytes += loadBytes(&sites[i]);
+  }
+
+  qsort(order, sitesCount, sizeof(uint64_t), compareSites);
+
+  fprintf(out, "\nHeap profile: %llu allocations, %llu bytes\n\n",
+          (unsigned long long)totalCount, (unsigned long long)totalBytes);
+  fprintf(out, "%14s %12s %7s  %-20s %-24s %s\n", "bytes", "count", "%bytes", "class",
+          "function", "line");
+
+  for (uint64_t i = 0; i < sitesCount; i++) {
+    const HeapSite *site = &sites[order[i]];
+    uint64_t count = loadCount(site), bytes = loadBytes(site);
+
+    if (count == 0) {
+      continue;
+    }
+
+    fprintf(out, "%14llu %12llu %6.2f%%  %-20s %-24s %lld\n",
+            (unsigned long long)bytes, (unsigned long long)count,
+            totalBytes != 0 ? 100.0 * bytes / totalBytes : 0.0,
+            site->className, site->function, (long long)site->line);
+
+    printTraces(out, &siteTraces[order[i]]);
+  }
+
+  if (out != stderr) {
+    fclose(out);
+  }
+
+  free(order);
+
+  pthread_mutex_unlock(&tracesLock);
+}
+
+// ---------------------------------------------------------------
+// Runtime API.
+
+/**
+ * Registers the allocation sites, called at the beginning of main.
+ */
+void jovian_heap_profile_init(const HeapSite *table, uint64_t count) {
+  sites = table;
+  sitesCount = count;
+  siteTraces = calloc(count != 0 ? count : 1, sizeof(SiteTraces));
+
+  atexit(report);
+}
+
+/**
+ * Records the current stack trace of an allocation site. Up to
+ * MAX_TRACES distinct traces are kept per site.
+ */
+void jovian_heap_profile_sample(uint64_t site) {
+  Trace trace;
+  trace.depth = backtrace(trace.frames, MAX_FRAMES);
+
+  SiteTraces *traces = &siteTraces[site];
+
+  pthread_mutex_lock(&tracesLock);
+
+  for (int i = 0; i < traces->count; i++) {
+    Trace *known = &traces->traces[i];
+    if (known->depth == trace.depth &&
+        memcmp(known->frames, trace.frames, trace.depth * sizeof(void *)) == 0) {
+      known->hits++;
+      pthread_mutex_unlock(&tracesLock);
+      return;
+    }
+  }
+
+  if (traces->count < MAX_TRACES) {
+    trace.hits = 1;
+    traces->traces[traces->count++] = trace;
+  }
+
+  pthread_mutex_unlock(&tracesLock);
+}
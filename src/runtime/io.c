@@ -0,0 +1,370 @@
+/**
+ * File I/O runtime for Eva programs.
+ *
+ * (read-file ...) maps regular files into memory, so reading is a
+ * page fault per page and no copy; pipes and other files are read
+ * into a heap buffer. Contents are `bytes` views: data and length,
+ * which the compiled code reads directly. Lines are views into their
+ * source, found with memchr.
+ *
+ * Writes to files are buffered per descriptor and flushed when full,
+ * on close and at exit. Standard output is written by the compiled
+ * code through its own print buffer, see JovianVM::createPrintFunctions.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// ---------------------------------------------------------------
+// Compiler interface.
+
+/**
+ * Byte view: see JovianVM::getBytesType. Views of lines are
+ * allocated by the compiled code and own nothing.
+ */
+typedef struct JovianBytes {
+  const char *data;
+  uint64_t length;
+  uint32_t flags;
+} JovianBytes;
+
+#define BYTES_VIEW 0
+#define BYTES_MAPPED 1
+#define BYTES_HEAP 2
+
+/**
+ * String runtime, see string.c.
+ */
+typedef struct JovianString JovianString;
+
+JovianString *jovian_string_new(const char *chars, uint64_t length);
+
+/**
+ * Output runtime, see print.c.
+ */
+void jovian_flush_output(void);
+
+// ---------------------------------------------------------------
+// Reading.
+
+#define READ_CHUNK (1 << 16)
+
+/**
+ * Whether the calling thread holds writeLock, see Writing.
+ */
+static __thread int holdsWriteLock;
+
+static void unlockWrites(void);
+
+static void fatal(const char *message, const char *detail) {
+  // Writes are flushed at exit, under the lock:
+  if (holdsWriteLock) {
+    unlockWrites();
+  }
+
+  jovian_flush_output();
+  fprintf(stderr, "Fatal error: [IO]: %s%s%s\n", message, detail != NULL ? ": " : "", detail != NULL ? detail : "");
+  exit(1);
+}
+
+static JovianBytes *newBytes(const char *data, uint64_t length, uint32_t flags) {
+  JovianBytes *bytes = malloc(sizeof(JovianBytes));
+  if (bytes == NULL) {
+    fatal("out of memory", NULL);
+  }
+
+  bytes->data = data;
+  bytes->length = length;
+  bytes->flags = flags;
+
+  return bytes;
+}
+
+/**
+ * Reads a descriptor to its end into a heap buffer.
+ */
+static JovianBytes *readAll(int fd, const char *name) {
+  uint64_t capacity = READ_CHUNK;
+  uint64_t length = 0;
+  char *data = malloc(capacity);
+
+  for (;;) {
+    if (length == capacity) {
+      capacity *= 2;
+      data = realloc(data, capacity);
+    }
+    if (data == NULL) {
+      fatal("out of memory", NULL);
+    }
+
+    ssize_t count = read(fd, data + length, capacity - length);
+
+    if (count == 0) {
+      break;
+    }
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fatal("cannot read", name);
+    }
+
+    length += count;
+  }
+
+  return newBytes(data, length, BYTES_HEAP);
+}
+
+/**
+ * Maps a regular file, other files are read.
+ */
+static JovianBytes *readFd(int fd, const char *name) {
+  struct stat info;
+
+  if (fstat(fd, &info) != 0) {
+    fatal("cannot read", name);
+  }
+
+  if (!S_ISREG(info.st_mode) || info.st_size == 0) {
+    return readAll(fd, name);
+  }
+
+  void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (data == MAP_FAILED) {
+    return readAll(fd, name);
+  }
+
+  madvise(data, info.st_size, MADV_SEQUENTIAL);
+
+  return newBytes(data, info.st_size, BYTES_MAPPED);
+}
+
+// ---------------------------------------------------------------
+// Writing.
+
+#define WRITE_BUFFER_SIZE (1 << 16)
+#define MAX_BUFFERED_FD 64
+
+typedef struct WriteBuffer {
+  char *data;
+  uint64_t used;
+} WriteBuffer;
+
+static WriteBuffer writeBuffers[MAX_BUFFERED_FD];
+static pthread_mutex_t writeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t exitOnce = PTHREAD_ONCE_INIT;
+
+static void lockWrites(void) {
+  pthread_mutex_lock(&writeLock);
+  holdsWriteLock = 1;
+}
+
+static void unlockWrites(void) {
+  holdsWriteLock = 0;
+  pthread_mutex_unlock(&writeLock);
+}
+
+static void writeFully(int fd, const char *chars, uint64_t length) {
+  while (length > 0) {
+    ssize_t count = write(fd, chars, length);
+
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fatal("cannot write", strerror(errno));
+    }
+
+    chars += count;
+    length -= count;
+  }
+}
+
+/**
+ * The buffer is emptied before writing: if the write fails, the
+ * flush at exit does not retry it.
+ */
+static void flushBuffer(int fd) {
+  WriteBuffer *buffer = &writeBuffers[fd];
+  uint64_t used = buffer->used;
+
+  if (used > 0) {
+    buffer->used = 0;
+    writeFully(fd, buffer->data, used);
+  }
+}
+
+static void flushAll(void) {
+  lockWrites();
+  for (int fd = 0; fd < MAX_BUFFERED_FD; fd++) {
+    flushBuffer(fd);
+  }
+  unlockWrites();
+}
+
+static void registerFlush(void) { atexit(flushAll); }
+
+// ---------------------------------------------------------------
+// Runtime API.
+
+/**
+ * Contents of a file; fatal error if it cannot be read. Paths are
+ * the characters of strings, see JovianVM::getStringData.
+ */
+JovianBytes *jovian_read_file(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fatal("cannot open", path);
+  }
+
+  JovianBytes *bytes = readFd(fd, path);
+  close(fd);
+
+  return bytes;
+}
+
+/**
+ * Contents of the standard input.
+ */
+JovianBytes *jovian_read_stdin(void) { return readFd(0, "stdin"); }
+
+/**
+ * Next line of source from *pos, without its '\n'. Returns 0 when
+ * all lines have been read.
+ */
+int32_t jovian_next_line(const JovianBytes *source, uint64_t *pos, JovianBytes *line) {
+  uint64_t start = *pos;
+
+  if (start >= source->length) {
+    return 0;
+  }
+
+  const char *chars = source->data + start;
+  const char *newline = memchr(chars, '\n', source->length - start);
+  uint64_t length = newline != NULL ? (uint64_t)(newline - chars) : source->length - start;
+
+  line->data = chars;
+  line->length = length;
+  line->flags = BYTES_VIEW;
+
+  *pos = start + length + 1;
+
+  return 1;
+}
+
+/**
+ * Decimal integer at the start of the bytes, after blanks; 0 if none.
+ */
+int64_t jovian_parse_int(const char *chars, uint64_t length) {
+  uint64_t i = 0;
+
+  while (i < length && (chars[i] == ' ' || chars[i] == '\t')) {
+    i++;
+  }
+
+  int negative = i < length && chars[i] == '-';
+  i += i < length && (chars[i] == '-' || chars[i] == '+');
+
+  uint64_t value = 0;
+  for (; i < length && chars[i] >= '0' && chars[i] <= '9'; i++) {
+    value = value * 10 + (chars[i] - '0');
+  }
+
+  return negative ? -(int64_t)value : (int64_t)value;
+}
+
+JovianString *jovian_bytes_string(const JovianBytes *bytes) { return jovian_string_new(bytes->data, bytes->length); }
+
+/**
+ * Releases the contents of read bytes; views are ignored.
+ */
+void jovian_bytes_free(JovianBytes *bytes) {
+  if (bytes->flags == BYTES_VIEW) {
+    return;
+  }
+
+  if (bytes->flags == BYTES_MAPPED) {
+    munmap((void *)bytes->data, bytes->length);
+  } else {
+    free((void *)bytes->data);
+  }
+
+  free(bytes);
+}
+
+/**
+ * Opens a file for (write ...): mode "w" (truncate) or "a" (append).
+ */
+int32_t jovian_open(const char *path, const char *mode) {
+  int flags;
+
+  if (strcmp(mode, "w") == 0) {
+    flags = O_WRONLY | O_CREAT | O_TRUNC;
+  } else if (strcmp(mode, "a") == 0) {
+    flags = O_WRONLY | O_CREAT | O_APPEND;
+  } else {
+    fatal("unknown open mode, expected \"w\" or \"a\"", mode);
+  }
+
+  int fd = open(path, flags, 0644);
+  if (fd < 0) {
+    fatal("cannot open", path);
+  }
+
+  return fd;
+}
+
+/**
+ * Buffered write to a descriptor other than standard output.
+ * Standard error is not buffered.
+ */
+void jovian_write(int32_t fd, const char *chars, uint64_t length) {
+  if (fd == 2 || fd < 0 || fd >= MAX_BUFFERED_FD) {
+    writeFully(fd, chars, length);
+    return;
+  }
+
+  pthread_once(&exitOnce, registerFlush);
+  lockWrites();
+
+  WriteBuffer *buffer = &writeBuffers[fd];
+
+  if (buffer->data == NULL && (buffer->data = malloc(WRITE_BUFFER_SIZE)) == NULL) {
+    fatal("out of memory", NULL);
+  }
+
+  if (buffer->used + length > WRITE_BUFFER_SIZE) {
+    flushBuffer(fd);
+  }
+
+  if (length > WRITE_BUFFER_SIZE) {
+    writeFully(fd, chars, length);
+  } else {
+    memcpy(buffer->data + buffer->used, chars, length);
+    buffer->used += length;
+  }
+
+  unlockWrites();
+}
+
+/**
+ * Flushes the buffered writes of a descriptor and closes it.
+ */
+void jovian_close(int32_t fd) {
+  if (fd >= 0 && fd < MAX_BUFFERED_FD) {
+    lockWrites();
+    flushBuffer(fd);
+    unlockWrites();
+  }
+
+  close(fd);
+}
@@ -0,0 +1,323 @@
+/**
+ * Hash map runtime for Eva programs: an open-addressing Swiss table.
+ *
+ * Every slot has a control byte: EMPTY, DELETED, or the low 7 bits
+ * of the key hash (h2) when full. Lookups probe groups of 16 control
+ * bytes at once, matching h2 with SSE2, and compare keys only for
+ * matching bytes. The high bits of the hash (h1) choose the first
+ * group, further groups are probed triangularly.
+ *
+ * Keys are integers or strings (not copied); values are 8-byte
+ * slots which the compiled code loads and stores with their type.
+ * Integer keys are hashed by the compiled code, see hashInt.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// ---------------------------------------------------------------
+// Compiler interface.
+
+#define KEY_INT 0
+#define KEY_STRING 1
+
+typedef struct Slot {
+  uint64_t key;
+  uint64_t value;
+} Slot;
+
+typedef struct JovianMap {
+  int8_t *ctrl;
+  Slot *slots;
+  uint64_t capacity;
+  uint64_t size;
+  uint64_t growthLeft;
+  uint32_t keyKind;
+} JovianMap;
+
+/**
+ * String runtime, see string.c.
+ */
+typedef struct JovianString JovianString;
+
+int jovian_string_equal(const JovianString *a, const JovianString *b);
+int64_t jovian_string_hash(JovianString *s);
+
+/**
+ * Output runtime, see print.c.
+ */
+void jovian_flush_output(void);
+
+// ---------------------------------------------------------------
+// Control bytes.
+
+#define GROUP_WIDTH 16
+#define MIN_CAPACITY 16
+
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+
+static void fatal(const char *message) {
+  jovian_flush_output();
+  fprintf(stderr, "Fatal error: [Map]: %s\n", message);
+  exit(1);
+}
+
+/**
+ * Integer key hash, the same as emitted by JovianVM::hashMapKey.
+ */
+static inline uint64_t hashInt(uint64_t key) {
+  uint64_t h = key * 0x9e3779b97f4a7c15ull;
+  return h ^ (h >> 32);
+}
+
+static inline uint64_t hashKey(const JovianMap *map, uint64_t key) {
+  return map->keyKind == KEY_STRING ? (uint64_t)jovian_string_hash((JovianString *)key) : hashInt(key);
+}
+
+static inline uint64_t h1(uint64_t hash) { return hash >> 7; }
+static inline int8_t h2(uint64_t hash) { return hash & 0x7f; }
+
+/**
+ * Sets a control byte, and its mirror after the end, so that
+ * groups can be loaded at any position.
+ */
+static inline void setCtrl(JovianMap *map, uint64_t i, int8_t ctrl) {
+  map->ctrl[i] = ctrl;
+  map->ctrl[((i - GROUP_WIDTH) & (map->capacity - 1)) + GROUP_WIDTH] = ctrl;
+}
+
+/**
+ * Bit masks of group positions holding h2, and of empty (or deleted)
+ * positions.
+ */
+static inline unsigned matchGroup(const int8_t *group, int8_t hash2) {
+#ifdef __SSE2__
+  __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(hash2)));
+#else
+  unsigned mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; i++) {
+    mask |= (unsigned)(group[i] == hash2) << i;
+  }
+  return mask;
+#endif
+}
+
+static inline unsigned matchEmpty(const int8_t *group) { return matchGroup(group, CTRL_EMPTY); }
+
+static inline unsigned matchEmptyOrDeleted(const int8_t *group) {
+#ifdef __SSE2__
+  // Only EMPTY and DELETED have the sign bit set:
+  return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+  unsigned mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; i++) {
+    mask |= (unsigned)(group[i] < 0) << i;
+  }
+  return mask;
+#endif
+}
+
+// ---------------------------------------------------------------
+// Table.
+
+static void allocTable(JovianMap *map, uint64_t capacity) {
+  map->ctrl = malloc(capacity + GROUP_WIDTH);
+  map->slots = malloc(capacity * sizeof(Slot));
+
+  if (map->ctrl == NULL || map->slots == NULL) {
+    fatal("out of memory");
+  }
+
+  memset(map->ctrl, CTRL_EMPTY, capacity + GROUP_WIDTH);
+  map->capacity = capacity;
+  map->growthLeft = capacity - capacity / 8 - map->size;
+}
+
+/**
+ * First empty or deleted slot on the probe sequence of a hash.
+ */
+static uint64_t findFree(const JovianMap *map, uint64_t hash) {
+  uint64_t mask = map->capacity - 1;
+  uint64_t pos = h1(hash) & mask;
+
+  for (uint64_t step = GROUP_WIDTH;; step += GROUP_WIDTH) {
+    unsigned free = matchEmptyOrDeleted(map->ctrl + pos);
+    if (free != 0) {
+      return (pos + __builtin_ctz(free)) & mask;
+    }
+    pos = (pos + step) & mask;
+  }
+}
+
+/**
+ * Rehashes into a table of the given capacity, dropping deleted slots.
+ */
+static void resize(JovianMap *map, uint64_t capacity) {
+  int8_t *oldCtrl = map->ctrl;
+  Slot *oldSlots = map->slots;
+  uint64_t oldCapacity = map->capacity;
+
+  allocTable(map, capacity);
+
+  for (uint64_t i = 0; i < oldCapacity; i++) {
+    if (oldCtrl[i] >= 0) {
+      uint64_t hash = hashKey(map, oldSlots[i].key);
+      uint64_t pos = findFree(map, hash);
+      setCtrl(map, pos, h2(hash));
+      map->slots[pos] = oldSlots[i];
+    }
+  }
+
+  free(oldCtrl);
+  free(oldSlots);
+}
+
+/**
+ * Slot of a key, -1 if absent. Specialized by key kind when inlined.
+ */
+static inline int64_t find(const JovianMap *map, uint64_t key, uint64_t hash, int keyKind) {
+  uint64_t mask = map->capacity - 1;
+  uint64_t pos = h1(hash) & mask;
+  int8_t hash2 = h2(hash);
+
+  for (uint64_t step = GROUP_WIDTH;; step += GROUP_WIDTH) {
+    const int8_t *group = map->ctrl + pos;
+
+    for (unsigned match = matchGroup(group, hash2); match != 0; match &= match - 1) {
+      uint64_t i = (pos + __builtin_ctz(match)) & mask;
+      uint64_t slotKey = map->slots[i].key;
+
+      if (keyKind == KEY_INT ? slotKey == key
+                             : jovian_string_equal((JovianString *)slotKey, (JovianString *)key)) {
+        return i;
+      }
+    }
+
+    // An empty position ends the probe sequence:
+    if (matchEmpty(group) != 0) {
+      return -1;
+    }
+
+    pos = (pos + step) & mask;
+  }
+}
+
+static inline uint64_t *findValue(JovianMap *map, uint64_t key, uint64_t hash, int keyKind) {
+  int64_t i = find(map, key, hash, keyKind);
+  return i >= 0 ? &map->slots[i].value : NULL;
+}
+
+static inline uint64_t *insert(JovianMap *map, uint64_t key, uint64_t hash, int keyKind) {
+  int64_t i = find(map, key, hash, keyKind);
+
+  if (i >= 0) {
+    return &map->slots[i].value;
+  }
+
+  if (map->growthLeft == 0) {
+    // Mostly deleted slots: rehash at the same capacity.
+    resize(map, map->size * 2 < map->capacity / 2 ? map->capacity : map->capacity * 2);
+  }
+
+  uint64_t pos = findFree(map, hash);
+
+  if (map->ctrl[pos] == CTRL_EMPTY) {
+    map->growthLeft--;
+  }
+
+  setCtrl(map, pos, h2(hash));
+  map->slots[pos].key = key;
+  map->slots[pos].value = 0;
+  map->size++;
+
+  return &map->slots[pos].value;
+}
+
+static inline int removeKey(JovianMap *map, uint64_t key, uint64_t hash, int keyKind) {
+  int64_t i = find(map, key, hash, keyKind);
+
+  if (i < 0) {
+    return 0;
+  }
+
+  setCtrl(map, i, CTRL_DELETED);
+  map->size--;
+
+  return 1;
+}
+
+// ---------------------------------------------------------------
+// Runtime API.
+
+JovianMap *jovian_map_new(uint32_t keyKind) {
+  JovianMap *map = calloc(1, sizeof(JovianMap));
+  if (map == NULL) {
+    fatal("out of memory");
+  }
+
+  map->keyKind = keyKind;
+  allocTable(map, MIN_CAPACITY);
+
+  return map;
+}
+
+void jovian_map_free(JovianMap *map) {
+  free(map->ctrl);
+  free(map->slots);
+  free(map);
+}
+
+int64_t jovian_map_size(const JovianMap *map) { return map->size; }
+
+/**
+ * Value slot of a key, NULL if absent.
+ */
+uint64_t *jovian_map_find_int(JovianMap *map, uint64_t key, uint64_t hash) {
+  return findValue(map, key, hash, KEY_INT);
+}
+
+uint64_t *jovian_map_find_string(JovianMap *map, JovianString *key, uint64_t hash) {
+  return findValue(map, (uint64_t)key, hash, KEY_STRING);
+}
+
+/**
+ * Value slot of a key, inserted with a zero value if absent.
+ */
+uint64_t *jovian_map_insert_int(JovianMap *map, uint64_t key, uint64_t hash) {
+  return insert(map, key, hash, KEY_INT);
+}
+
+uint64_t *jovian_map_insert_string(JovianMap *map, JovianString *key, uint64_t hash) {
+  return insert(map, (uint64_t)key, hash, KEY_STRING);
+}
+
+/**
+ * Removes a key, returns whether it was present.
+ */
+int jovian_map_remove_int(JovianMap *map, uint64_t key, uint64_t hash) {
+  return removeKey(map, key, hash, KEY_INT);
+}
+
+int jovian_map_remove_string(JovianMap *map, JovianString *key, uint64_t hash) {
+  return removeKey(map, (uint64_t)key, hash, KEY_STRING);
+}
+
+/**
+ * Copies the keys, keySize bytes each, to an array of map->size elements.
+ */
+void jovian_map_keys(const JovianMap *map, char *keys, uint64_t keySize) {
+  for (uint64_t i = 0; i < map->capacity; i++) {
+    if (map->ctrl[i] >= 0) {
+      memcpy(keys, &map->slots[i].key, keySize);
+      keys += keySize;
+    }
+  }
+}
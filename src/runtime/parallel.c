@@ -0,0 +1,438 @@
+/**
+ * Data-parallel algorithms for Eva programs, on the work-stealing
+ * workers of task.c.
+ *
+ * (parallel-for ...) and the other forms which evaluate expressions
+ * per element are compiled into kernels over index ranges; this file
+ * splits the range recursively into tasks down to the grain size and
+ * calls the kernel once per chunk. Sorting and prefix sums of number
+ * arrays are implemented here, specialized for each element type.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ---------------------------------------------------------------
+// Compiler interface.
+
+/**
+ * Kernel: runs the body for the indices [begin, end). Captures are
+ * the variables used by the body, see JovianVM::compileKernel.
+ */
+typedef void (*Kernel)(void *captures, int64_t begin, int64_t end);
+
+/**
+ * Element types of sorted and scanned arrays.
+ */
+#define KIND_I32 0
+#define KIND_I64 1
+#define KIND_F32 2
+#define KIND_F64 3
+
+/**
+ * Task runtime, see task.c.
+ */
+typedef struct JovianTask JovianTask;
+
+JovianTask *jovian_spawn(void (*fn)(void *env, void *result), void *env);
+void jovian_join(JovianTask *task, void *result);
+int32_t jovian_worker_count(void);
+
+/**
+ * Output runtime, see print.c.
+ */
+void jovian_flush_output(void);
+
+// ---------------------------------------------------------------
+// Ranges.
+
+/**
+ * Chunks per worker of the default grain size: enough to balance
+ * uneven chunks by stealing.
+ */
+#define CHUNKS_PER_WORKER 8
+#define MAX_SPLITS 64
+
+typedef struct Range {
+  Kernel kernel;
+  void *captures;
+  int64_t begin;
+  int64_t end;
+  int64_t grain;
+} Range;
+
+static void fatal(const char *message) {
+  jovian_flush_output();
+  fprintf(stderr, "Fatal error: [Parallel]: %s\n", message);
+  exit(1);
+}
+
+static void runRange(Range range);
+
+static void rangeTask(void *env, void *result) {
+  Range range = *(Range *)env;
+  free(env);
+  runRange(range);
+}
+
+/**
+ * Spawns the upper halves until the range fits the grain, runs the
+ * rest, then joins the halves.
+ */
+static void runRange(Range range) {
+  JovianTask *halves[MAX_SPLITS];
+  int splits = 0;
+
+  while (range.end - range.begin > range.grain && splits < MAX_SPLITS) {
+    int64_t middle = range.begin + (range.end - range.begin) / 2;
+
+    Range *upper = malloc(sizeof(Range));
+    if (upper == NULL) {
+      fatal("out of memory");
+    }
+
+    *upper = range;
+    upper->begin = middle;
+    range.end = middle;
+
+    halves[splits++] = jovian_spawn(rangeTask, upper);
+  }
+
+  range.kernel(range.captures, range.begin, range.end);
+
+  uint64_t unused;
+  while (splits > 0) {
+    jovian_join(halves[--splits], &unused);
+  }
+}
+
+static void parallelFor(Kernel kernel, void *captures, int64_t begin, int64_t end, int64_t grain) {
+  if (begin >= end) {
+    return;
+  }
+
+  Range range = {kernel, captures, begin, end, grain > 0 ? grain : 1};
+  runRange(range);
+}
+
+// ---------------------------------------------------------------
+// Sorting: chunks are sorted in parallel, then sorted runs are merged
+// pairwise. Each merge is split by output position into independent
+// pieces, so all rounds are parallel.
+
+#define SORT_GRAIN 8192
+#define INSERTION_SORT_MAX 24
+
+/**
+ * Per-type sort and scan kernels.
+ */
+#define DEFINE_KERNELS(T, U, NAME)                                                                    \
+  static void insertionSort_##NAME(T *a, int64_t n) {                                                \
+    for (int64_t i = 1; i < n; i++) {                                                                 \
+      T value = a[i];                                                                                 \
+      int64_t j = i;                                                                                  \
+      for (; j > 0 && value < a[j - 1]; j--) {                                                        \
+        a[j] = a[j - 1];                                                                              \
+      }                                                                                               \
+      a[j] = value;                                                                                   \
+    }                                                                                                 \
+  }                                                                                                   \
+                                                                                                      \
+  /* Quicksort, median of three; recurses into the smaller side. */                                  \
+  static void quickSort_##NAME(T *a, int64_t n) {                                                    \
+    while (n > INSERTION_SORT_MAX) {                                                                  \
+      T x = a[0], y = a[n / 2], z = a[n - 1];                                                         \
+      T pivot = x < y ? (y < z ? y : (x < z ? z : x)) : (x < z ? x : (y < z ? z : y));                \
+                                                                                                      \
+      int64_t i = 0, j = n - 1;                                                                       \
+      for (;;) {                                                                                      \
+        while (a[i] < pivot) {                                                                        \
+          i++;                                                                                        \
+        }                                                                                             \
+        while (pivot < a[j]) {                                                                        \
+          j--;                                                                                        \
+        }                                                                                             \
+        if (i >= j) {                                                                                 \
+          break;                                                                                      \
+        }                                                                                             \
+        T swap = a[i];                                                                                \
+        a[i++] = a[j];                                                                                \
+        a[j--] = swap;                                                                                \
+      }                                                                                               \
+                                                                                                      \
+      if (j + 1 < n - j - 1) {                                                                        \
+        quickSort_##NAME(a, j + 1);                                                                   \
+        a += j + 1;                                                                                   \
+        n -= j + 1;                                                                                   \
+      } else {                                                                                        \
+        quickSort_##NAME(a + j + 1, n - j - 1);                                                       \
+        n = j + 1;                                                                                    \
+      }                                                                                               \
+    }                                                                                                 \
+    insertionSort_##NAME(a, n);                                                                       \
+  }                                                                                                   \
+                                                                                                      \
+  /* Elements of a among the first k of the merge of a and b. */                                      \
+  static int64_t coRank_##NAME(const T *a, int64_t na, const T *b, int64_t nb, int64_t k) {           \
+    int64_t low = k > nb ? k - nb : 0;                                                                \
+    int64_t high = k < na ? k : na;                                                                   \
+    while (low < high) {                                                                              \
+      int64_t i = low + (high - low) / 2;                                                             \
+      if (b[k - i - 1] < a[i]) {                                                                      \
+        high = i;                                                                                     \
+      } else {                                                                                        \
+        low = i + 1;                                                                                  \
+      }                                                                                               \
+    }                                                                                                 \
+    return low;                                                                                       \
+  }                                                                                                   \
+                                                                                                      \
+  /* Output [from, to) of the stable merge of a and b. */                                             \
+  static void mergePiece_##NAME(const T *a, int64_t na, const T *b, int64_t nb, T *out, int64_t from, \
+                                int64_t to) {                                                         \
+    int64_t i = coRank_##NAME(a, na, b, nb, from);                                                    \
+    int64_t j = from - i;                                                                             \
+    for (int64_t k = from; k < to; k++) {                                                             \
+      out[k] = j >= nb || (i < na && !(b[j] < a[i])) ? a[i++] : b[j++];                               \
+    }                                                                                                 \
+  }                                                                                                   \
+                                                                                                      \
+  static U sum_##NAME(const T *a, int64_t n) {                                                        \
+    U sum = 0;                                                                                        \
+    for (int64_t i = 0; i < n; i++) {                                                                 \
+      sum += (U)a[i];                                                                                 \
+    }                                                                                                 \
+    return sum;                                                                                       \
+  }                                                                                                   \
+                                                                                                      \
+  static void scan_##NAME(T *a, int64_t n, U offset) {                                                \
+    for (int64_t i = 0; i < n; i++) {                                                                 \
+      offset += (U)a[i];                                                                              \
+      a[i] = (T)offset;                                                                               \
+    }                                                                                                 \
+  }
+
+// Integer sums wrap, as in compiled code:
+DEFINE_KERNELS(int32_t, uint32_t, i32)
+DEFINE_KERNELS(int64_t, uint64_t, i64)
+DEFINE_KERNELS(float, float, f32)
+DEFINE_KERNELS(double, double, f64)
+
+#define DISPATCH(kind, CALL)                                                                          \
+  switch (kind) {                                                                                     \
+  case KIND_I32:                                                                                      \
+    CALL(int32_t, uint32_t, i32);                                                                     \
+    break;                                                                                            \
+  case KIND_I64:                                                                                      \
+    CALL(int64_t, uint64_t, i64);                                                                     \
+    break;                                                                                            \
+  case KIND_F32:                                                                                      \
+    CALL(float, float, f32);                                                                          \
+    break;                                                                                            \
+  case KIND_F64:                                                                                      \
+    CALL(double, double, f64);                                                                        \
+    break;                                                                                            \
+  default:                                                                                            \
+    fatal("unknown element kind");                                                                    \
+  }
+
+static int64_t elementSize(int32_t kind) { return kind == KIND_I32 || kind == KIND_F32 ? 4 : 8; }
+
+typedef struct SortPass {
+  int32_t kind;
+  char *from;
+  char *to;
+  int64_t length;
+  int64_t run;
+  int64_t piecesPerMerge;
+  int64_t pieceSize;
+} SortPass;
+
+static void sortChunks(void *captures, int64_t begin, int64_t end) {
+  SortPass *pass = captures;
+
+  for (int64_t chunk = begin; chunk < end; chunk++) {
+    int64_t start = chunk * pass->run;
+    int64_t count = start + pass->run < pass->length ? pass->run : pass->length - start;
+
+#define SORT_CHUNK(T, U, NAME) quickSort_##NAME((T *)pass->from + start, count)
+    DISPATCH(pass->kind, SORT_CHUNK)
+#undef SORT_CHUNK
+  }
+}
+
+/**
+ * Pieces of the merges of pairs of runs of one round.
+ */
+static void mergePieces(void *captures, int64_t begin, int64_t end) {
+  SortPass *pass = captures;
+
+  for (int64_t piece = begin; piece < end; piece++) {
+    int64_t start = piece / pass->piecesPerMerge * 2 * pass->run;
+    int64_t middle = start + pass->run < pass->length ? start + pass->run : pass->length;
+    int64_t stop = middle + pass->run < pass->length ? middle + pass->run : pass->length;
+
+    int64_t from = piece % pass->piecesPerMerge * pass->pieceSize;
+    int64_t to = from + pass->pieceSize < stop - start ? from + pass->pieceSize : stop - start;
+
+    if (from >= to) {
+      continue;
+    }
+
+#define MERGE_PIECE(T, U, NAME)                                                                       \
+  mergePiece_##NAME((T *)pass->from + start, middle - start, (T *)pass->from + middle, stop - middle, \
+                    (T *)pass->to + start, from, to)
+    DISPATCH(pass->kind, MERGE_PIECE)
+#undef MERGE_PIECE
+  }
+}
+
+// ---------------------------------------------------------------
+// Prefix sums: sums of chunks, a sequential scan of the sums, then
+// the chunks are scanned from their offsets.
+
+#define SCAN_GRAIN 65536
+
+typedef struct ScanPass {
+  int32_t kind;
+  char *data;
+  int64_t length;
+  int64_t chunk;
+  uint64_t *sums;
+} ScanPass;
+
+static void sumChunks(void *captures, int64_t begin, int64_t end) {
+  ScanPass *pass = captures;
+
+  for (int64_t chunk = begin; chunk < end; chunk++) {
+    int64_t start = chunk * pass->chunk;
+    int64_t count = start + pass->chunk < pass->length ? pass->chunk : pass->length - start;
+
+#define SUM_CHUNK(T, U, NAME)                                                                         \
+  {                                                                                                   \
+    U sum = sum_##NAME((T *)pass->data + start, count);                                               \
+    memcpy(&pass->sums[chunk], &sum, sizeof(U));                                                      \
+  }
+    DISPATCH(pass->kind, SUM_CHUNK)
+#undef SUM_CHUNK
+  }
+}
+
+static void scanChunks(void *captures, int64_t begin, int64_t end) {
+  ScanPass *pass = captures;
+
+  for (int64_t chunk = begin; chunk < end; chunk++) {
+    int64_t start = chunk * pass->chunk;
+    int64_t count = start + pass->chunk < pass->length ? pass->chunk : pass->length - start;
+
+#define SCAN_CHUNK(T, U, NAME)                                                                        \
+  {                                                                                                   \
+    U offset;                                                                                         \
+    memcpy(&offset, &pass->sums[chunk], sizeof(U));                                                   \
+    scan_##NAME((T *)pass->data + start, count, offset);                                              \
+  }
+    DISPATCH(pass->kind, SCAN_CHUNK)
+#undef SCAN_CHUNK
+  }
+}
+
+// ---------------------------------------------------------------
+// Runtime API.
+
+/**
+ * Default grain of a range of n indices.
+ */
+int64_t jovian_parallel_grain(int64_t n) {
+  int64_t grain = n / ((int64_t)jovian_worker_count() * CHUNKS_PER_WORKER);
+  return grain > 0 ? grain : 1;
+}
+
+/**
+ * Runs the kernel over [begin, end) in chunks of at least grain
+ * indices (the default grain if grain <= 0), and waits for all.
+ */
+void jovian_parallel_for(Kernel kernel, void *captures, int64_t begin, int64_t end, int64_t grain) {
+  parallelFor(kernel, captures, begin, end, grain > 0 ? grain : jovian_parallel_grain(end - begin));
+}
+
+/**
+ * Sorts numbers ascending. NaNs are not ordered.
+ */
+void jovian_parallel_sort(void *data, int64_t length, int32_t kind) {
+  if (length < 2) {
+    return;
+  }
+
+  int64_t chunks = (length + SORT_GRAIN - 1) / SORT_GRAIN;
+  SortPass pass = {kind, data, NULL, length, SORT_GRAIN, 0, SORT_GRAIN};
+
+  parallelFor(sortChunks, &pass, 0, chunks, 1);
+
+  if (chunks == 1) {
+    return;
+  }
+
+  char *buffer = malloc(length * elementSize(kind));
+  if (buffer == NULL) {
+    fatal("out of memory");
+  }
+  pass.to = buffer;
+
+  for (; pass.run < length; pass.run *= 2) {
+    int64_t merges = (length + 2 * pass.run - 1) / (2 * pass.run);
+    pass.piecesPerMerge = (2 * pass.run + SORT_GRAIN - 1) / SORT_GRAIN;
+
+    parallelFor(mergePieces, &pass, 0, merges * pass.piecesPerMerge, 1);
+
+    char *swap = pass.from;
+    pass.from = pass.to;
+    pass.to = swap;
+  }
+
+  if (pass.from != data) {
+    memcpy(data, pass.from, length * elementSize(kind));
+  }
+
+  free(pass.from == data ? pass.to : pass.from);
+}
+
+/**
+ * Inclusive prefix sums, in place. Floating point sums are added in
+ * a different order than sequentially.
+ */
+void jovian_prefix_sum(void *data, int64_t length, int32_t kind) {
+  int64_t chunks = (length + SCAN_GRAIN - 1) / SCAN_GRAIN;
+
+  if (chunks == 0) {
+    return;
+  }
+
+  uint64_t *sums = malloc(chunks * sizeof(uint64_t));
+  if (sums == NULL) {
+    fatal("out of memory");
+  }
+
+  ScanPass pass = {kind, data, length, SCAN_GRAIN, sums};
+
+  parallelFor(sumChunks, &pass, 0, chunks, 1);
+
+  // Exclusive scan of the chunk sums:
+#define SCAN_SUMS(T, U, NAME)                                                                         \
+  {                                                                                                   \
+    U offset = 0;                                                                                     \
+    for (int64_t chunk = 0; chunk < chunks; chunk++) {                                                \
+      U sum;                                                                                          \
+      memcpy(&sum, &sums[chunk], sizeof(U));                                                          \
+      memcpy(&sums[chunk], &offset, sizeof(U));                                                       \
+      offset += sum;                                                                                  \
+    }                                                                                                 \
+  }
+  DISPATCH(kind, SCAN_SUMS)
+#undef SCAN_SUMS
+
+  parallelFor(scanChunks, &pass, 0, chunks, 1);
+
+  free(sums);
+}
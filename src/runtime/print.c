@@ -0,0 +1,36 @@
+/**
+ * Output of Eva programs on exit and runtime errors.
+ *
+ * The compiled code buffers printf output per thread, see
+ * JovianVM::createPrintFunctions. The buffer of the exiting thread is
+ * written at exit, and runtime errors write it before their message,
+ * so output printed before an error is not lost nor reordered.
+ * Programs which never print have no buffer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// ---------------------------------------------------------------
+// Compiler interface.
+
+void jovian_print_flush(void) __attribute__((weak));
+
+// ---------------------------------------------------------------
+// Runtime API.
+
+/**
+ * Writes buffered output, called by the fatal errors of the runtime.
+ */
+void jovian_flush_output(void) {
+  if (jovian_print_flush != NULL) {
+    jovian_print_flush();
+  }
+  fflush(stdout);
+}
+
+__attribute__((constructor)) static void registerFlush(void) {
+  if (jovian_print_flush != NULL) {
+    atexit(jovian_print_flush);
+  }
+}
@@ -0,0 +1,68 @@
+/**
+ * Branch profile for Eva programs compiled with --profile-generate.
+ *
+ * Generated code counts, per (if ...), (cond ...) clause and loop,
+ * how often its condition was true and false, and how often each
+ * function was entered. At exit the counts are written to the file
+ * given to --profile-generate, or named by the JOVIAN_PROFILE
+ * environment variable, one site per line:
+ *
+ *   <site> <true count> <false count>
+ *
+ * --profile-use=<file> reads them back when rebuilding the program.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// ---------------------------------------------------------------
+// Compiler interface.
+
+/**
+ * Counted site: see JovianVM::registerProfileSites.
+ */
+typedef struct ProfileSite {
+  const char *name;
+  uint64_t *counters;
+} ProfileSite;
+
+// ---------------------------------------------------------------
+// Report.
+
+static const ProfileSite *sites;
+static uint64_t sitesCount;
+static const char *profilePath;
+
+static void report(void) {
+  const char *path = getenv("JOVIAN_PROFILE");
+  path = path != NULL ? path : profilePath;
+
+  FILE *out = fopen(path, "w");
+
+  if (out == NULL) {
+    fprintf(stderr, "Warning: [Profile]: cannot write %s\n", path);
+    return;
+  }
+
+  for (uint64_t i = 0; i < sitesCount; i++) {
+    fprintf(out, "%s %llu %llu\n", sites[i].name, (unsigned long long)sites[i].counters[0],
+            (unsigned long long)sites[i].counters[1]);
+  }
+
+  fclose(out);
+}
+
+// ---------------------------------------------------------------
+// Runtime API.
+
+/**
+ * Registers the counted sites, called at the beginning of main.
+ */
+void jovian_profile_init(const ProfileSite *table, uint64_t count, const char *path) {
+  sites = table;
+  sitesCount = count;
+  profilePath = path;
+
+  atexit(report);
+}
@@ -0,0 +1,166 @@
+/**
+ * Region (arena) allocator for (region ...) blocks of Eva programs
+ * compiled with the default malloc memory mode.
+ *
+ * Every (new ...) executed while a region is active bump-allocates
+ * from the innermost region. Leaving the region releases all of its
+ * chunks at once: they are spliced onto a thread-local chunk cache
+ * and reused by later regions.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// ---------------------------------------------------------------
+// Compiler interface.
+
+/**
+ * Active region. The compiler inlines the bump allocation over
+ * `top` and `end`, and calls jovian_region_alloc when it does not fit.
+ */
+typedef struct Region {
+  char *top;
+  char *end;
+  struct Region *parent;
+  struct Chunk *chunk;
+  struct Chunk *firstChunk;
+  size_t nextSize;
+} Region;
+
+/**
+ * Innermost active region of the thread, NULL outside of regions.
+ */
+__thread Region *jovian_region;
+
+/**
+ * Output runtime, see print.c.
+ */
+void jovian_flush_output(void);
+
+// ---------------------------------------------------------------
+// Chunks.
+
+typedef struct Chunk {
+  struct Chunk *prev;
+  char *end;
+} Chunk;
+
+#define ALIGNMENT 16
+#define MIN_CHUNK_SIZE ((size_t)64 << 10)
+#define MAX_CHUNK_SIZE ((size_t)16 << 20)
+
+/**
+ * Chunks of exited regions, most recent first.
+ */
+static __thread Chunk *chunkCache;
+
+static inline size_t align(size_t size) {
+  return (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+}
+
+static inline char *chunkData(Chunk *chunk) {
+  return (char *)chunk + align(sizeof(Chunk));
+}
+
+static void fatal(const char *message) {
+  jovian_flush_output();
+  fprintf(stderr, "Fatal error: [Region]: %s\n", message);
+  abort();
+}
+
+/**
+ * Returns a chunk with at least `size` bytes of data, reusing the
+ * most recently cached chunk if it is large enough.
+ */
+static Chunk *newChunk(size_t size) {
+  Chunk *chunk = chunkCache;
+
+  if (chunk != NULL && (size_t)(chunk->end - chunkData(chunk)) >= size) {
+    chunkCache = chunk->prev;
+  } else {
+    size_t total = align(sizeof(Chunk)) + size;
+    chunk = malloc(total);
+    if (chunk == NULL) {
+      fatal("out of memory");
+    }
+    chunk->end = (char *)chunk + total;
+  }
+
+  chunk->prev = NULL;
+  return chunk;
+}
+
+// ---------------------------------------------------------------
+// Runtime API.
+
+/**
+ * Enters a new innermost region.
+ */
+void jovian_region_enter(void) {
+  Chunk *chunk = newChunk(align(sizeof(Region)) + MIN_CHUNK_SIZE);
+
+  // The region header lives in its first chunk:
+  Region *region = (Region *)chunkData(chunk);
+  region->top = (char *)region + align(sizeof(Region));
+  region->end = chunk->end;
+  region->parent = jovian_region;
+  region->chunk = region->firstChunk = chunk;
+  region->nextSize = MIN_CHUNK_SIZE * 2;
+
+  jovian_region = region;
+}
+
+/**
+ * Leaves the innermost region, freeing all of its objects in O(1).
+ */
+void jovian_region_exit(void) {
+  Region *region = jovian_region;
+
+  if (region == NULL) {
+    fatal("no active region");
+  }
+
+  jovian_region = region->parent;
+
+  region->firstChunk->prev = chunkCache;
+  chunkCache = region->chunk;
+}
+
+/**
+ * Slow path of the inline bump allocation: continues in a new chunk.
+ */
+void *jovian_region_alloc(uint64_t size) {
+  Region *region = jovian_region;
+  size = align(size);
+
+  size_t chunkSize = size > region->nextSize ? size : region->nextSize;
+  if (region->nextSize < MAX_CHUNK_SIZE) {
+    region->nextSize *= 2;
+  }
+
+  Chunk *chunk = newChunk(chunkSize);
+  chunk->prev = region->chunk;
+  region->chunk = chunk;
+
+  char *obj = chunkData(chunk);
+  region->top = obj + size;
+  region->end = chunk->end;
+
+  return obj;
+}
+
+/**
+ * Whether an object belongs to an active region; (delete obj)
+ * ignores such objects.
+ */
+int jovian_region_owns(void *obj) {
+  for (Region *region = jovian_region; region != NULL; region = region->parent) {
+    for (Chunk *chunk = region->chunk; chunk != NULL; chunk = chunk->prev) {
+      if ((char *)obj >= (char *)chunk && (char *)obj < chunk->end) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
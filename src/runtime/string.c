@@ -0,0 +1,405 @@
+/**
+ * String runtime for Eva programs.
+ *
+ * Strings are immutable. Heap strings are length-prefixed objects
+ * with a cached hash and NUL-terminated characters; literals are
+ * static objects of the same layout emitted by the compiler.
+ *
+ * Strings of up to SMALL_STRING_MAX bytes are not allocated: they
+ * are stored in the pointer itself, tagged by the lowest bit:
+ *
+ *   byte 0: length << 1 | 1, bytes 1-6: characters, byte 7: 0
+ *
+ * Every string of up to SMALL_STRING_MAX bytes is small, so small
+ * strings are equal exactly when their words are.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// ---------------------------------------------------------------
+// Compiler interface.
+
+/**
+ * String object: see JovianVM::getStringType.
+ */
+typedef struct JovianString {
+  uint64_t length;
+  uint64_t hash;
+  uint32_t flags;
+  char chars[];
+} JovianString;
+
+#define STRING_STATIC 1
+#define SMALL_STRING_MAX 6
+
+/**
+ * String builder: see JovianVM::getStringBuilderType.
+ */
+typedef struct JovianStringBuilder {
+  char *data;
+  uint64_t length;
+  uint64_t capacity;
+} JovianStringBuilder;
+
+/**
+ * Output runtime, see print.c.
+ */
+void jovian_flush_output(void);
+
+// ---------------------------------------------------------------
+// Representation.
+
+static void fatal(const char *message) {
+  jovian_flush_output();
+  fprintf(stderr, "Fatal error: [String]: %s\n", message);
+  exit(1);
+}
+
+static inline int isSmall(const JovianString *s) { return ((uintptr_t)s & 1) != 0; }
+
+/**
+ * Characters and length of a string. Small strings are decoded
+ * into the caller's word.
+ */
+static inline const char *stringData(const JovianString *s, uintptr_t *word, uint64_t *length) {
+  if (isSmall(s)) {
+    *word = (uintptr_t)s;
+    *length = (*word & 0xff) >> 1;
+    return (const char *)word + 1;
+  }
+  *length = s->length;
+  return s->chars;
+}
+
+static JovianString *newString(const char *chars, uint64_t length) {
+  if (length <= SMALL_STRING_MAX) {
+    uintptr_t word = 0;
+    memcpy((char *)&word + 1, chars, length);
+    return (JovianString *)(word | length << 1 | 1);
+  }
+
+  JovianString *s = malloc(sizeof(JovianString) + length + 1);
+  if (s == NULL) {
+    fatal("out of memory");
+  }
+
+  s->length = length;
+  s->hash = 0;
+  s->flags = 0;
+  memcpy(s->chars, chars, length);
+  s->chars[length] = '\0';
+
+  return s;
+}
+
+// ---------------------------------------------------------------
+// SIMD primitives, with scalar fallbacks.
+
+static int bytesEqual(const char *a, const char *b, uint64_t length) {
+  uint64_t i = 0;
+
+#ifdef __SSE2__
+  for (; i + 16 <= length; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xffff) {
+      return 0;
+    }
+  }
+#endif
+
+  return memcmp(a + i, b + i, length - i) == 0;
+}
+
+/**
+ * Substring search: candidate positions are those where both the
+ * first and the last byte of the needle match, 16 at a time.
+ */
+static int64_t findBytes(const char *haystack, uint64_t length, const char *needle, uint64_t needleLength) {
+  if (needleLength == 0) {
+    return 0;
+  }
+  if (needleLength > length) {
+    return -1;
+  }
+  if (needleLength == 1) {
+    const char *found = memchr(haystack, needle[0], length);
+    return found != NULL ? found - haystack : -1;
+  }
+
+  uint64_t last = length - needleLength;
+  uint64_t i = 0;
+
+#ifdef __SSE2__
+  __m128i first = _mm_set1_epi8(needle[0]);
+  __m128i final = _mm_set1_epi8(needle[needleLength - 1]);
+
+  for (; i + 16 <= last + 1; i += 16) {
+    __m128i blockFirst = _mm_loadu_si128((const __m128i *)(haystack + i));
+    __m128i blockFinal = _mm_loadu_si128((const __m128i *)(haystack + i + needleLength - 1));
+
+    unsigned mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(first, blockFirst), _mm_cmpeq_epi8(final, blockFinal)));
+
+    while (mask != 0) {
+      unsigned bit = __builtin_ctz(mask);
+      if (memcmp(haystack + i + bit + 1, needle + 1, needleLength - 2) == 0) {
+        return i + bit;
+      }
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  for (; i <= last; i++) {
+    if (haystack[i] == needle[0] && memcmp(haystack + i + 1, needle + 1, needleLength - 1) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+#define HASH_PRIME_1 0x9e3779b185ebca87ull
+#define HASH_PRIME_2 0xc2b2ae3d27d4eb4full
+
+static inline uint64_t mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= HASH_PRIME_2;
+  h ^= h >> 29;
+  h *= HASH_PRIME_1;
+  h ^= h >> 32;
+  return h;
+}
+
+/**
+ * Hashes 16-byte blocks into two 64-bit lanes: each lane adds the
+ * product of the low and high halves of its (keyed) data, as XXH3
+ * does, then the lanes and the length are mixed.
+ */
+static uint64_t hashBytes(const char *chars, uint64_t length) {
+  uint64_t acc[2] = {HASH_PRIME_1, HASH_PRIME_2};
+  uint64_t i = 0;
+
+  for (; i < length; i += 16) {
+    uint64_t block[2] = {0, 0};
+    memcpy(block, chars + i, length - i < 16 ? length - i : 16);
+
+#ifdef __SSE2__
+    __m128i data = _mm_loadu_si128((const __m128i *)block);
+    __m128i keyed = _mm_xor_si128(data, _mm_set_epi64x(HASH_PRIME_2, HASH_PRIME_1));
+    __m128i high = _mm_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1));
+    __m128i sum = _mm_add_epi64(_mm_loadu_si128((const __m128i *)acc),
+                                _mm_add_epi64(_mm_mul_epu32(keyed, high), data));
+    _mm_storeu_si128((__m128i *)acc, sum);
+#else
+    uint64_t keys[2] = {HASH_PRIME_1, HASH_PRIME_2};
+    for (int lane = 0; lane < 2; lane++) {
+      uint64_t keyed = block[lane] ^ keys[lane];
+      acc[lane] += (keyed & 0xffffffff) * (keyed >> 32) + block[lane];
+    }
+#endif
+  }
+
+  return mix(acc[0] ^ mix(acc[1] + length));
+}
+
+// ---------------------------------------------------------------
+// Runtime API.
+
+/**
+ * String of a copy of length characters.
+ */
+JovianString *jovian_string_new(const char *chars, uint64_t length) { return newString(chars, length); }
+
+/**
+ * Whether two strings have the same characters.
+ */
+int jovian_string_equal(const JovianString *a, const JovianString *b) {
+  if (a == b) {
+    return 1;
+  }
+  if (isSmall(a) || isSmall(b)) {
+    return 0;
+  }
+  if (a->length != b->length || (a->hash != 0 && b->hash != 0 && a->hash != b->hash)) {
+    return 0;
+  }
+  return bytesEqual(a->chars, b->chars, a->length);
+}
+
+/**
+ * Index of the first occurrence of needle in s, -1 if none.
+ */
+int64_t jovian_string_find(const JovianString *s, const JovianString *needle) {
+  uintptr_t word, needleWord;
+  uint64_t length, needleLength;
+
+  const char *chars = stringData(s, &word, &length);
+  const char *needleChars = stringData(needle, &needleWord, &needleLength);
+
+  return findBytes(chars, length, needleChars, needleLength);
+}
+
+/**
+ * Hash of the characters, cached in heap strings. Never 0.
+ */
+int64_t jovian_string_hash(JovianString *s) {
+  if (!isSmall(s) && s->hash != 0) {
+    return s->hash;
+  }
+
+  uintptr_t word;
+  uint64_t length;
+  const char *chars = stringData(s, &word, &length);
+
+  uint64_t hash = hashBytes(chars, length);
+  hash = hash != 0 ? hash : 1;
+
+  // Racing threads store the same value:
+  if (!isSmall(s)) {
+    __atomic_store_n(&s->hash, hash, __ATOMIC_RELAXED);
+  }
+
+  return hash;
+}
+
+JovianString *jovian_string_concat(const JovianString *a, const JovianString *b) {
+  uintptr_t wordA, wordB;
+  uint64_t lengthA, lengthB;
+
+  const char *charsA = stringData(a, &wordA, &lengthA);
+  const char *charsB = stringData(b, &wordB, &lengthB);
+
+  char small[SMALL_STRING_MAX];
+  char *chars = lengthA + lengthB <= SMALL_STRING_MAX ? small : malloc(lengthA + lengthB);
+
+  memcpy(chars, charsA, lengthA);
+  memcpy(chars + lengthA, charsB, lengthB);
+
+  JovianString *s = newString(chars, lengthA + lengthB);
+
+  if (chars != small) {
+    free(chars);
+  }
+
+  return s;
+}
+
+/**
+ * Substring of count bytes from start.
+ */
+JovianString *jovian_string_sub(const JovianString *s, int64_t start, int64_t count) {
+  uintptr_t word;
+  uint64_t length;
+  const char *chars = stringData(s, &word, &length);
+
+  if (start < 0 || count < 0 || (uint64_t)start + count > length) {
+    fatal("substring out of bounds");
+  }
+
+  return newString(chars + start, count);
+}
+
+/**
+ * Byte at an index.
+ */
+int32_t jovian_string_char_at(const JovianString *s, int64_t index) {
+  uintptr_t word;
+  uint64_t length;
+  const char *chars = stringData(s, &word, &length);
+
+  if (index < 0 || (uint64_t)index >= length) {
+    fatal("index out of bounds");
+  }
+
+  return (unsigned char)chars[index];
+}
+
+/**
+ * Frees a heap string; small and static strings are ignored.
+ */
+void jovian_string_free(JovianString *s) {
+  if (!isSmall(s) && !(s->flags & STRING_STATIC)) {
+    free(s);
+  }
+}
+
+// ---------------------------------------------------------------
+// String builder.
+
+JovianStringBuilder *jovian_builder_new(void) {
+  JovianStringBuilder *builder = calloc(1, sizeof(JovianStringBuilder));
+  if (builder == NULL) {
+    fatal("out of memory");
+  }
+  return builder;
+}
+
+static void reserve(JovianStringBuilder *builder, uint64_t length) {
+  if (builder->length + length <= builder->capacity) {
+    return;
+  }
+
+  uint64_t capacity = builder->capacity < 16 ? 16 : builder->capacity * 2;
+  while (capacity < builder->length + length) {
+    capacity *= 2;
+  }
+
+  builder->data = realloc(builder->data, capacity);
+  if (builder->data == NULL) {
+    fatal("out of memory");
+  }
+  builder->capacity = capacity;
+}
+
+void jovian_builder_append(JovianStringBuilder *builder, const JovianString *s) {
+  uintptr_t word;
+  uint64_t length;
+  const char *chars = stringData(s, &word, &length);
+
+  reserve(builder, length);
+  memcpy(builder->data + builder->length, chars, length);
+  builder->length += length;
+}
+
+void jovian_builder_append_int(JovianStringBuilder *builder, int64_t value) {
+  char digits[20];
+  int pos = sizeof(digits);
+
+  // Unsigned magnitude, also of INT64_MIN:
+  uint64_t rest = value < 0 ? -(uint64_t)value : (uint64_t)value;
+
+  do {
+    digits[--pos] = '0' + rest % 10;
+    rest /= 10;
+  } while (rest != 0);
+
+  reserve(builder, sizeof(digits) - pos + 1);
+
+  if (value < 0) {
+    builder->data[builder->length++] = '-';
+  }
+
+  memcpy(builder->data + builder->length, digits + pos, sizeof(digits) - pos);
+  builder->length += sizeof(digits) - pos;
+}
+
+/**
+ * String of the appended characters; the builder stays usable.
+ */
+JovianString *jovian_builder_build(const JovianStringBuilder *builder) {
+  return newString(builder->data, builder->length);
+}
+
+void jovian_builder_free(JovianStringBuilder *builder) {
+  free(builder->data);
+  free(builder);
+}
@@ -0,0 +1,338 @@
+/**
+ * Work-stealing task runtime for (spawn ...) and (join ...).
+ *
+ * Each worker thread owns a Chase-Lev deque: it pushes and takes
+ * tasks at the bottom, other workers steal from the top, all without
+ * locks. The thread which spawns the first task becomes worker 0;
+ * JOVIAN_WORKERS (default: the number of cores) workers run in total.
+ * Joining workers run other tasks until the joined one is done; idle
+ * workers sleep until a task is spawned.
+ *
+ * Chase-Lev with C11 atomics as in "Correct and Efficient
+ * Work-Stealing for Weak Memory Models" (Le et al., 2013).
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// ---------------------------------------------------------------
+// Compiler interface.
+
+/**
+ * Task: an outlined (spawn ...) expression, see JovianVM::compileTask.
+ * The task function stores its value (up to 8 bytes) to `result`.
+ */
+typedef struct JovianTask {
+  void (*fn)(void *env, void *result);
+  void *env;
+  uint64_t result;
+  atomic_int done;
+} JovianTask;
+
+/**
+ * Output runtime, see print.c.
+ */
+void jovian_flush_output(void);
+
+// ---------------------------------------------------------------
+// Deques.
+
+#define MIN_DEQUE_SIZE 64
+#define CACHE_LINE 64
+
+typedef struct Buffer {
+  int64_t size;
+  _Atomic(JovianTask *) slots[];
+} Buffer;
+
+typedef struct Deque {
+  atomic_int_fast64_t top;
+  char topPadding[CACHE_LINE - sizeof(atomic_int_fast64_t)];
+  atomic_int_fast64_t bottom;
+  char bottomPadding[CACHE_LINE - sizeof(atomic_int_fast64_t)];
+  _Atomic(Buffer *) buffer;
+} __attribute__((aligned(CACHE_LINE))) Deque;
+
+static void fatal(const char *message) {
+  jovian_flush_output();
+  fprintf(stderr, "Fatal error: [Task]: %s\n", message);
+  exit(1);
+}
+
+static Buffer *newBuffer(int64_t size) {
+  Buffer *buffer = malloc(sizeof(Buffer) + size * sizeof(JovianTask *));
+  if (buffer == NULL) {
+    fatal("out of memory");
+  }
+  buffer->size = size;
+  return buffer;
+}
+
+static inline JovianTask *getSlot(Buffer *buffer, int64_t i) {
+  return atomic_load_explicit(&buffer->slots[i & (buffer->size - 1)], memory_order_relaxed);
+}
+
+static inline void setSlot(Buffer *buffer, int64_t i, JovianTask *task) {
+  atomic_store_explicit(&buffer->slots[i & (buffer->size - 1)], task, memory_order_relaxed);
+}
+
+/**
+ * Doubles the buffer. The old one is not freed: thieves may still
+ * be reading from it.
+ */
+static Buffer *grow(Deque *deque, Buffer *buffer, int64_t top, int64_t bottom) {
+  Buffer *grown = newBuffer(buffer->size * 2);
+
+  for (int64_t i = top; i < bottom; i++) {
+    setSlot(grown, i, getSlot(buffer, i));
+  }
+
+  atomic_store_explicit(&deque->buffer, grown, memory_order_release);
+  return grown;
+}
+
+/**
+ * Owner: pushes a task at the bottom.
+ */
+static void push(Deque *deque, JovianTask *task) {
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  Buffer *buffer = atomic_load_explicit(&deque->buffer, memory_order_relaxed);
+
+  if (bottom - top > buffer->size - 1) {
+    buffer = grow(deque, buffer, top, bottom);
+  }
+
+  setSlot(buffer, bottom, task);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+/**
+ * Owner: takes the most recently pushed task, NULL if empty.
+ */
+static JovianTask *take(Deque *deque) {
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  Buffer *buffer = atomic_load_explicit(&deque->buffer, memory_order_relaxed);
+
+  atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+  JovianTask *task = NULL;
+
+  if (top <= bottom) {
+    task = getSlot(buffer, bottom);
+
+    // Last task: race against thieves.
+    if (top == bottom) {
+      if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                   memory_order_relaxed)) {
+        task = NULL;
+      }
+      atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+  } else {
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+  }
+
+  return task;
+}
+
+/**
+ * Thief: steals the oldest task, NULL if empty or lost a race.
+ */
+static JovianTask *steal(Deque *deque) {
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+  if (top >= bottom) {
+    return NULL;
+  }
+
+  Buffer *buffer = atomic_load_explicit(&deque->buffer, memory_order_consume);
+  JovianTask *task = getSlot(buffer, top);
+
+  if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                               memory_order_relaxed)) {
+    return NULL;
+  }
+
+  return task;
+}
+
+// ---------------------------------------------------------------
+// Workers.
+
+#define STEAL_ROUNDS 64
+
+static Deque *deques;
+static int workerCount;
+
+static __thread int workerIndex = -1;
+static __thread uint64_t randomState;
+
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * Idle workers sleep while no task is queued.
+ */
+static pthread_mutex_t sleepLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sleepCond = PTHREAD_COND_INITIALIZER;
+static atomic_int sleepers;
+static atomic_int_fast64_t queued;
+
+static inline uint64_t nextRandom(void) {
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 7;
+  randomState ^= randomState << 17;
+  return randomState;
+}
+
+/**
+ * A task of the own deque, or one stolen from a random other worker.
+ */
+static JovianTask *findTask(void) {
+  JovianTask *task = take(&deques[workerIndex]);
+
+  for (int round = 0; task == NULL && round < STEAL_ROUNDS && workerCount > 1; round++) {
+    int victim = nextRandom() % workerCount;
+    if (victim != workerIndex) {
+      task = steal(&deques[victim]);
+    }
+  }
+
+  if (task != NULL) {
+    atomic_fetch_sub(&queued, 1);
+  }
+
+  return task;
+}
+
+static void run(JovianTask *task) {
+  task->fn(task->env, &task->result);
+  atomic_store_explicit(&task->done, 1, memory_order_release);
+}
+
+static void *workerMain(void *arg) {
+  workerIndex = (int)(intptr_t)arg;
+  randomState = 0x9e3779b97f4a7c15ull * (workerIndex + 1);
+
+  for (;;) {
+    JovianTask *task = findTask();
+
+    if (task != NULL) {
+      run(task);
+      continue;
+    }
+
+    pthread_mutex_lock(&sleepLock);
+    atomic_fetch_add(&sleepers, 1);
+    while (atomic_load(&queued) == 0) {
+      pthread_cond_wait(&sleepCond, &sleepLock);
+    }
+    atomic_fetch_sub(&sleepers, 1);
+    pthread_mutex_unlock(&sleepLock);
+  }
+
+  return NULL;
+}
+
+static void init(void) {
+  const char *workers = getenv("JOVIAN_WORKERS");
+  workerCount = workers != NULL ? atoi(workers) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  workerCount = workerCount > 0 ? workerCount : 1;
+
+  if (posix_memalign((void **)&deques, CACHE_LINE, workerCount * sizeof(Deque)) != 0) {
+    fatal("out of memory");
+  }
+
+  for (int i = 0; i < workerCount; i++) {
+    atomic_init(&deques[i].top, 0);
+    atomic_init(&deques[i].bottom, 0);
+    atomic_init(&deques[i].buffer, newBuffer(MIN_DEQUE_SIZE));
+  }
+
+  // The initializing thread is worker 0:
+  workerIndex = 0;
+  randomState = 0x9e3779b97f4a7c15ull;
+
+  for (int i = 1; i < workerCount; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, workerMain, (void *)(intptr_t)i) != 0) {
+      fatal("cannot create worker thread");
+    }
+    pthread_detach(thread);
+  }
+}
+
+// ---------------------------------------------------------------
+// Runtime API.
+
+/**
+ * Queues a task on the deque of the calling worker. The task
+ * function takes ownership of env.
+ */
+JovianTask *jovian_spawn(void (*fn)(void *env, void *result), void *env) {
+  pthread_once(&initOnce, init);
+
+  if (workerIndex < 0) {
+    fatal("spawn from a thread which is not a worker");
+  }
+
+  JovianTask *task = malloc(sizeof(JovianTask));
+  if (task == NULL) {
+    fatal("out of memory");
+  }
+
+  task->fn = fn;
+  task->env = env;
+  task->result = 0;
+  atomic_init(&task->done, 0);
+
+  push(&deques[workerIndex], task);
+  atomic_fetch_add(&queued, 1);
+
+  if (atomic_load(&sleepers) > 0) {
+    pthread_mutex_lock(&sleepLock);
+    pthread_cond_signal(&sleepCond);
+    pthread_mutex_unlock(&sleepLock);
+  }
+
+  return task;
+}
+
+/**
+ * Number of worker threads, see JOVIAN_WORKERS.
+ */
+int32_t jovian_worker_count(void) {
+  pthread_once(&initOnce, init);
+  return workerCount;
+}
+
+/**
+ * Waits for a task, running other tasks meanwhile, copies its
+ * value to `result` and frees it.
+ */
+void jovian_join(JovianTask *task, void *result) {
+  for (int spins = 0; !atomic_load_explicit(&task->done, memory_order_acquire);) {
+    JovianTask *other = workerIndex >= 0 ? findTask() : NULL;
+
+    if (other != NULL) {
+      run(other);
+      spins = 0;
+    } else if (++spins > STEAL_ROUNDS) {
+      sched_yield();
+    }
+  }
+
+  memcpy(result, &task->result, sizeof(task->result));
+  free(task);
+}
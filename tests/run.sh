@@ -0,0 +1,129 @@
+#!/bin/bash
+# Runs the test programs: each tests/<name>.eva is compiled with the
+# runtime (src/runtime), executed, and its output compared with
+# tests/<name>.out.
+#
+#   ./compile-run.sh            # builds ./jovian-vm
+#   ./tests/run.sh [name...]
+#
+# Options of jovian-vm are given in a first line comment of the
+# program:
+#
+#   // vm: --memory=gc
+#
+# A program compiled with --profile-generate runs twice: with the
+# counters, then rebuilt with --profile-use on the written profile.
+# Both runs must print the expected output.
+#
+# A program which must be rejected by the compiler gives the error
+# in a comment instead of an output file:
+#
+#   // error: object escapes its region
+#
+# A program which stops with a runtime error gives its exit code,
+# the error is part of the expected output:
+#
+#   // exit: 1
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+vm=${JOVIAN_VM:-$root/jovian-vm}
+cc=${CC:-cc}
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# Compiles <program> with [options...] to $work/out:
+build() {
+  local program=$1
+  shift
+
+  (cd "$work" && "$vm" "$@" -f "$program" > /dev/null) &&
+  # opt lowers generators and async functions (coroutine passes):
+  opt-14 -O2 "$work/out.ll" -o "$work/out.bc" &&
+  llc-14 -O2 -relocation-model=pic -filetype=obj "$work/out.bc" -o "$work/out.o" &&
+  $cc "$work/out.o" "$root"/src/runtime/*.c -o "$work/out" -lpthread -lm
+}
+
+# Runs $work/out, in $work and with an empty standard input, and
+# compares its exit code and output with <expected>:
+check() {
+  local name=$1 expected=$2
+
+  (cd "$work" && ./out < /dev/null > "$work/actual" 2>&1)
+  local status=$?
+
+  if [ $status -ne "$exit" ]; then
+    echo "FAIL $name: exit code $status"
+    cat "$work/actual"
+    return 1
+  fi
+
+  if ! diff -u "$expected" "$work/actual"; then
+    echo "FAIL $name: unexpected output"
+    return 1
+  fi
+}
+
+names=("$@")
+
+if [ ${#names[@]} -eq 0 ]; then
+  for program in "$root"/tests/*.eva; do
+    names+=("$(basename "$program" .eva)")
+  done
+fi
+
+failed=0
+
+for name in "${names[@]}"; do
+  program=$root/tests/$name.eva
+  expected=$root/tests/$name.out
+  options=$(sed -n '1s|^// vm:||p' "$program")
+  error=$(sed -n 's|^// error: ||p' "$program")
+  exit=$(sed -n 's|^// exit: ||p' "$program")
+  exit=${exit:-0}
+
+  rm -f "$work"/*
+
+  if [ -n "$error" ]; then
+    if build "$program" $options 2> "$work/errors"; then
+      echo "FAIL $name: compiled, expected: $error"
+      failed=$((failed + 1))
+    elif ! grep -qF "$error" "$work/errors"; then
+      echo "FAIL $name: expected: $error"
+      cat "$work/errors"
+      failed=$((failed + 1))
+    else
+      echo "ok   $name"
+    fi
+    continue
+  fi
+
+  if ! build "$program" $options; then
+    echo "FAIL $name: compilation"
+    failed=$((failed + 1))
+    continue
+  fi
+
+  if ! check "$name" "$expected"; then
+    failed=$((failed + 1))
+    continue
+  fi
+
+  if [[ " $options " == *" --profile-generate "* ]]; then
+    options=${options/--profile-generate/--profile-use=jovian.profile}
+
+    if ! build "$program" $options || ! check "$name (profile-use)" "$expected"; then
+      failed=$((failed + 1))
+      continue
+    fi
+  fi
+
+  echo "ok   $name"
+done
+
+if [ $failed -ne 0 ]; then
+  echo "$failed of ${#names[@]} test(s) failed"
+  exit 1
+fi
+
+echo "all ${#names[@]} test(s) passed"